@@ -0,0 +1,54 @@
+/** \ingroup Utils
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Strict bulk base64 encoding and decoding
+ * @section DESCRIPTION
+ *
+ * Provides base64 encoding and decoding that validates its input, reporting
+ * the position of the first invalid character, together with functions for
+ * converting newline-separated lists of keys to and from contiguous arrays.
+ *
+ * Where the processor supports it, blocks of input are converted using SSSE3
+ * or AVX2 instructions, with the remainder handled by a portable scalar
+ * implementation.
+ *
+ */
+
+/** \addtogroup Utils
+ *  @{
+ */
+
+#ifndef __BASE64_H
+#define __BASE64_H
+
+// Includes
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Defines
+
+// Structures
+
+// Function prototypes
+
+size_t base64_encode(unsigned char const * input, size_t input_size, char * output);
+bool base64_decode(char const * input, size_t input_size, unsigned char * output, size_t * output_size, size_t * error_pos);
+
+size_t base64_key_list_size(size_t key_size, size_t count);
+size_t base64_encode_key_list(unsigned char const * keys, size_t key_size, size_t count, char * output);
+bool base64_decode_key_list(char const * input, size_t input_size, size_t key_size, unsigned char * keys, size_t capacity, size_t * count, size_t * error_pos);
+
+// Function definitions
+
+#endif // __BASE64_H
+
+/** @} addtogroup Utils */
+
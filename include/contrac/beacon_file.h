@@ -0,0 +1,85 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief A persistent beacon store that can be memory mapped
+ * @section DESCRIPTION
+ *
+ * This class provides a versioned on-disk format for captured beacons that
+ * can be memory mapped and used directly, without being deserialised. The
+ * beacons are written from a \ref BeaconStore using
+ * \ref beacon_file_write(), and opened using \ref beacon_file_open().
+ *
+ * The file starts with a header holding the format version, the range of days
+ * covered and an index giving the position of each day's beacons. The beacons
+ * themselves follow as fixed-size \ref BeaconRecord entries, grouped by day
+ * and aligned to a page boundary. Opening a file therefore only reads the
+ * header, irrespective of the number of beacons it contains.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __BEACON_FILE_H
+#define __BEACON_FILE_H
+
+// Includes
+
+#include "contrac/contrac.h"
+#include "contrac/beacon_store.h"
+#include "contrac/dtk_list.h"
+#include "contrac/match.h"
+
+// Defines
+
+/**
+ * The version of the file format written by this library
+ *
+ * Version 2 files hold each day's records sorted by RPI. Version 1 files,
+ * with the records in capture order, can still be read.
+ */
+#define BEACON_FILE_VERSION (2)
+
+/**
+ * Align the records for huge pages when writing, and request huge pages when
+ * mapping the file
+ */
+#define BEACON_FILE_HUGE_PAGES (1 << 0)
+
+// Structures
+
+/**
+ * An opaque structure that represents an opened beacon file.
+ *
+ * The internal structure can be found in beacon_file.c
+ */
+typedef struct _BeaconFile BeaconFile;
+
+// Function prototypes
+
+bool beacon_file_write(BeaconStore const * store, char const * path, unsigned int flags);
+
+BeaconFile * beacon_file_open(char const * path, unsigned int flags);
+void beacon_file_close(BeaconFile * data);
+
+size_t beacon_file_count(BeaconFile const * data);
+size_t beacon_file_get_day_count(BeaconFile const * data);
+bool beacon_file_get_coverage(BeaconFile const * data, uint32_t * first_day_number, uint32_t * last_day_number);
+BeaconRecord const * beacon_file_get_day(BeaconFile const * data, uint32_t day_number, size_t * count);
+
+void match_list_find_matches_file(MatchList * data, BeaconFile const * beacons, DtkList * diagnosis_keys);
+
+// Function definitions
+
+#endif // __BEACON_FILE_H
+
+/** @} addtogroup Containers*/
+
@@ -0,0 +1,86 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Concurrent ingestion of beacons from multiple producer threads
+ * @section DESCRIPTION
+ *
+ * This class allows several threads to capture beacons into a single
+ * \ref BeaconStore at the same time as it's being matched against.
+ *
+ * Each producer thread has its own lock-free staging queue, so producers never
+ * contend with each other or wait on a lock. The queues are drained into the
+ * store in batches, either by calling \ref beacon_ingest_drain() or by a
+ * background thread started using \ref beacon_ingest_start(). Readers lock
+ * the store for reading, which only ever holds up the drain; producers carry
+ * on filling their queues in the meantime. The matcher only holds the lock
+ * for long enough to take a snapshot of the store, so a long running match
+ * doesn't hold up the drain either.
+ *
+ * If a producer's queue is full the beacon is dropped rather than blocking
+ * the producer, and the drop is counted.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __BEACON_INGEST_H
+#define __BEACON_INGEST_H
+
+// Includes
+
+#include "contrac/contrac.h"
+#include "contrac/beacon_store.h"
+#include "contrac/dtk_list.h"
+#include "contrac/match.h"
+
+// Defines
+
+/**
+ * The default capacity of each producer's staging queue
+ */
+#define BEACON_INGEST_QUEUE_CAPACITY (4096)
+
+// Structures
+
+/**
+ * An opaque structure that represents the ingestion state.
+ *
+ * The internal structure can be found in beacon_ingest.c
+ */
+typedef struct _BeaconIngest BeaconIngest;
+
+// Function prototypes
+
+BeaconIngest * beacon_ingest_new(BeaconStore * store, size_t producers, size_t queue_capacity);
+void beacon_ingest_delete(BeaconIngest * data);
+
+bool beacon_ingest_add_beacon(BeaconIngest * data, size_t producer, uint32_t day_number, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+size_t beacon_ingest_drain(BeaconIngest * data);
+
+bool beacon_ingest_start(BeaconIngest * data);
+void beacon_ingest_stop(BeaconIngest * data);
+
+BeaconStore const * beacon_ingest_lock_store(BeaconIngest * data);
+void beacon_ingest_unlock_store(BeaconIngest * data);
+BeaconSnapshot * beacon_ingest_snapshot(BeaconIngest * data);
+
+size_t beacon_ingest_get_producer_count(BeaconIngest const * data);
+uint64_t beacon_ingest_get_dropped(BeaconIngest const * data);
+
+void match_list_find_matches_ingest(MatchList * data, BeaconIngest * beacons, DtkList * diagnosis_keys);
+
+// Function definitions
+
+#endif // __BEACON_INGEST_H
+
+/** @} addtogroup Containers*/
+
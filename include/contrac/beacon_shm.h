@@ -0,0 +1,84 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief A beacon store shared between processes
+ * @section DESCRIPTION
+ *
+ * This class provides a beacon store held in a POSIX shared memory object,
+ * so that beacons captured by one process can be matched by another without
+ * being serialised or copied between them.
+ *
+ * A single writer process creates the store using \ref beacon_shm_create()
+ * and adds beacons to it. The writer chooses the permissions of the store, so
+ * readers can run as a separate, less privileged user. Any number of reader processes open it using
+ * \ref beacon_shm_open() and match against the live beacons.
+ *
+ * The layout follows that of a \ref BeaconFile: a header, an index with an
+ * entry for each day, and page-aligned \ref BeaconRecord entries. Since the
+ * store is updated in place, each day has a fixed capacity of records and the
+ * index entries are native-endian values updated atomically. Each index entry
+ * also carries a sequence number that changes whenever the day's slot is
+ * reused, which readers use to detect when a day has been expired under
+ * them.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __BEACON_SHM_H
+#define __BEACON_SHM_H
+
+// Includes
+
+#include <sys/types.h>
+
+#include "contrac/contrac.h"
+#include "contrac/beacon_store.h"
+#include "contrac/dtk_list.h"
+#include "contrac/match.h"
+
+// Defines
+
+/**
+ * The version of the shared memory layout used by this library
+ */
+#define BEACON_SHM_VERSION (1)
+
+// Structures
+
+/**
+ * An opaque structure that represents a mapped shared memory store.
+ *
+ * The internal structure can be found in beacon_shm.c
+ */
+typedef struct _BeaconShm BeaconShm;
+
+// Function prototypes
+
+BeaconShm * beacon_shm_create(char const * name, size_t retention_days, size_t day_capacity, mode_t mode);
+BeaconShm * beacon_shm_open(char const * name);
+void beacon_shm_delete(BeaconShm * data);
+
+bool beacon_shm_add_beacon(BeaconShm * data, uint32_t day_number, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+
+size_t beacon_shm_count(BeaconShm const * data);
+size_t beacon_shm_get_day_capacity(BeaconShm const * data);
+BeaconRecord const * beacon_shm_get_day(BeaconShm const * data, uint32_t day_number, size_t * count);
+
+bool match_list_find_matches_shm(MatchList * data, BeaconShm const * beacons, DtkList * diagnosis_keys);
+
+// Function definitions
+
+#endif // __BEACON_SHM_H
+
+/** @} addtogroup Containers*/
+
@@ -0,0 +1,119 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Stores captured beacons for a retention window of days
+ * @section DESCRIPTION
+ *
+ * This class stores captured beacons partitioned by the day they were
+ * captured on. Each day is held as a contiguous segment of fixed-size records
+ * in a ring, with one slot for each day of the retention window. When a
+ * beacon is added for a new day, the segments for any days that have fallen
+ * out of the window are reused, so expiring a day is O(1) rather than
+ * requiring the whole store to be rebuilt.
+ *
+ * The \ref match_list_find_matches_store() function only checks each
+ * diagnosis key against the segment for the day it was captured on, which
+ * avoids generating RPIs for days with no beacons. Unlike matching against an
+ * \ref RpiList, a beacon recorded under the wrong day, for example because the
+ * capturing device's clock was skewed around midnight, won't be matched.
+ *
+ * Limits can be set on the number of beacons stored for each day and each
+ * time interval, so that the store's memory use and matching time stay
+ * bounded when large numbers of beacons are broadcast nearby.
+ *
+ * A \ref BeaconSnapshot captures the contents of the store at a point in time
+ * without copying the beacons, so matching can run against it while capture
+ * continues.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __BEACON_STORE_H
+#define __BEACON_STORE_H
+
+// Includes
+
+#include "contrac/contrac.h"
+#include "contrac/rpi.h"
+#include "contrac/rpi_list.h"
+#include "contrac/dtk_list.h"
+#include "contrac/match.h"
+
+// Defines
+
+/**
+ * The default number of days beacons are retained for
+ */
+#define BEACON_STORE_RETENTION_DAYS (14)
+
+/**
+ * The maximum number of days beacons can be retained for
+ */
+#define BEACON_STORE_RETENTION_DAYS_MAX (64)
+
+// Structures
+
+/**
+ * An opaque structure that represents the store.
+ *
+ * The internal structure can be found in beacon_store.c
+ */
+typedef struct _BeaconStore BeaconStore;
+
+/**
+ * An opaque structure that represents a snapshot of a store.
+ *
+ * The internal structure can be found in beacon_store.c
+ */
+typedef struct _BeaconSnapshot BeaconSnapshot;
+
+/**
+ * @brief A single captured beacon
+ *
+ * Beacons for a day are stored contiguously as an array of these records.
+ */
+typedef struct _BeaconRecord {
+	unsigned char rpi[RPI_SIZE];
+	uint8_t time_interval_number;
+} BeaconRecord;
+
+// Function prototypes
+
+BeaconStore * beacon_store_new(size_t retention_days);
+void beacon_store_delete(BeaconStore * data);
+
+bool beacon_store_add_beacon(BeaconStore * data, uint32_t day_number, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+bool beacon_store_add_list(BeaconStore * data, uint32_t day_number, RpiList const * beacons);
+void beacon_store_expire(BeaconStore * data, uint32_t oldest_day_number);
+void beacon_store_set_limits(BeaconStore * data, size_t interval_limit, size_t day_limit);
+uint64_t beacon_store_get_rejected(BeaconStore const * data);
+
+size_t beacon_store_get_retention_days(BeaconStore const * data);
+bool beacon_store_get_newest_day(BeaconStore const * data, uint32_t * day_number);
+size_t beacon_store_count(BeaconStore const * data);
+BeaconRecord const * beacon_store_get_day(BeaconStore const * data, uint32_t day_number, size_t * count);
+
+BeaconSnapshot * beacon_store_snapshot(BeaconStore const * data);
+void beacon_snapshot_delete(BeaconSnapshot * data);
+size_t beacon_snapshot_count(BeaconSnapshot const * data);
+BeaconRecord const * beacon_snapshot_get_day(BeaconSnapshot const * data, uint32_t day_number, size_t * count);
+
+void match_list_find_matches_store(MatchList * data, BeaconStore const * beacons, DtkList * diagnosis_keys);
+void match_list_find_matches_snapshot(MatchList * data, BeaconSnapshot const * beacons, DtkList * diagnosis_keys);
+
+// Function definitions
+
+#endif // __BEACON_STORE_H
+
+/** @} addtogroup Containers*/
+
@@ -0,0 +1,78 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief A crash-safe append-only log of captured beacons
+ * @section DESCRIPTION
+ *
+ * This class provides a durable write path for captured beacons. Each
+ * sighting is appended to the log as a fixed-size record protected by a
+ * CRC-32 checksum.
+ *
+ * Records are collected in memory and written out in batches, with a single
+ * fsync for each batch (group commit). The batch size controls the trade-off
+ * between throughput and durability: on power loss at most one batch of
+ * sightings is lost.
+ *
+ * When a log is opened, its records are replayed sequentially into an
+ * \ref RpiList, a \ref BeaconStore or both, to rebuild the in-memory state.
+ * Replay stops at the first torn or corrupted record, and the log is
+ * truncated at that point so new records follow on from the last good one.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __CAPTURE_LOG_H
+#define __CAPTURE_LOG_H
+
+// Includes
+
+#include <time.h>
+
+#include "contrac/contrac.h"
+#include "contrac/rpi_list.h"
+#include "contrac/beacon_store.h"
+
+// Defines
+
+/**
+ * The default number of records written for each fsync
+ */
+#define CAPTURE_LOG_SYNC_BATCH (1024)
+
+// Structures
+
+/**
+ * An opaque structure that represents an opened capture log.
+ *
+ * The internal structure can be found in capture_log.c
+ */
+typedef struct _CaptureLog CaptureLog;
+
+// Function prototypes
+
+CaptureLog * capture_log_open(char const * path, RpiList * beacons, BeaconStore * store);
+bool capture_log_close(CaptureLog * data);
+
+bool capture_log_append(CaptureLog * data, uint32_t day_number, unsigned char const * rpi_bytes, uint8_t time_interval_number, time_t seen, int8_t rssi);
+bool capture_log_flush(CaptureLog * data);
+
+bool capture_log_set_sync_batch(CaptureLog * data, size_t records);
+size_t capture_log_get_sync_batch(CaptureLog const * data);
+size_t capture_log_get_recovered(CaptureLog const * data);
+
+// Function definitions
+
+#endif // __CAPTURE_LOG_H
+
+/** @} addtogroup Containers*/
+
@@ -18,6 +18,16 @@
  * 3. Generating a Rolling Proximity Identifier based on the current time
  *    interval number.
  *
+ * The RPIs for every time interval of the current day are generated together
+ * with the DTK, so moving to a new time interval is a table lookup. The next
+ * day's DTK and RPIs are generated ahead of midnight, so moving to a new day
+ * is too. Optionally the table also holds a ready-to-send BLE advertising
+ * payload for each RPI.
+ *
+ * The current RPI, time interval number and day number are also published
+ * for other threads, such as a BLE advertising callback, to read without
+ * locking using \ref contrac_get_identity().
+ *
  * Values can be extracted and set in binary or base64 format.
  *
  */
@@ -33,6 +43,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
 // Defines
 
@@ -48,6 +59,11 @@
  */
 #define TK_SIZE_BASE64 (44)
 
+/**
+ * The size in bytes of a BLE advertising payload containing an RPI
+ */
+#define CONTRAC_PAYLOAD_SIZE (27)
+
 // Structures
 
 /**
@@ -57,6 +73,17 @@
  */
 typedef struct _Contrac Contrac;
 
+/**
+ * @brief A consistent copy of the current identity
+ *
+ * Filled out by \ref contrac_get_identity().
+ */
+typedef struct _ContracIdentity {
+	unsigned char rpi[16];
+	uint8_t time_interval_number;
+	uint32_t day_number;
+} ContracIdentity;
+
 // Function prototypes
 
 Contrac * contrac_new();
@@ -78,10 +105,19 @@ bool contrac_set_tracing_key_base64(Contrac * data, char const * tracing_key);
 
 unsigned char const * contrac_get_daily_key(Contrac const * data);
 void contrac_get_daily_key_base64(Contrac const * data, char * base64);
+bool contrac_generate_daily_keys(Contrac const * data, uint32_t day_number, size_t count, unsigned char * dtk_bytes);
 
 unsigned char const * contrac_get_proximity_id(Contrac const * data);
 void contrac_get_proximity_id_base64(Contrac const * data, char * base64);
 
+bool contrac_prepare_next_day(Contrac * data);
+unsigned char const * contrac_get_schedule(Contrac const * data);
+void contrac_set_advertising_payloads(Contrac * data, bool enabled);
+unsigned char const * contrac_get_advertising_payload(Contrac const * data);
+
+bool contrac_get_identity(Contrac const * data, ContracIdentity * identity);
+time_t contrac_get_next_rollover(Contrac * data);
+
 // Function definitions
 
 #endif // __CONTRAC_H
@@ -0,0 +1,70 @@
+/** \ingroup Utils
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Per-thread cached HMAC, HKDF and AES operations
+ * @section DESCRIPTION
+ *
+ * Provides the HMAC-SHA256, HKDF-SHA256 and AES-128 operations used to
+ * derive DTKs and RPIs, using contexts that are created once for each thread
+ * and then reused. This avoids looking up the algorithms and allocating new contexts
+ * for every key derived, which on OpenSSL 3 involves locking that serialises
+ * threads deriving keys in parallel.
+ *
+ * The contexts are created the first time a thread uses them and freed when
+ * the thread exits.
+ *
+ */
+
+/** \addtogroup Utils
+ *  @{
+ */
+
+#ifndef __CRYPTO_CONTEXT_H
+#define __CRYPTO_CONTEXT_H
+
+// Includes
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Defines
+
+/**
+ * The size in bytes of an HMAC-SHA256 output
+ */
+#define CRYPTO_HMAC_SIZE (32)
+
+/**
+ * The size in bytes of an AES-128 key
+ */
+#define CRYPTO_AES_KEY_SIZE (16)
+
+/**
+ * The size in bytes of an AES block
+ */
+#define CRYPTO_AES_BLOCK_SIZE (16)
+
+// Structures
+
+// Function prototypes
+
+bool crypto_hmac_sha256(unsigned char const * key, size_t key_size, unsigned char const * input, size_t input_size, unsigned char * output, size_t output_size);
+bool crypto_hmac_sha256_multi(unsigned char const * key, size_t key_size, unsigned char const * const * inputs, size_t const * input_sizes, size_t count, unsigned char * outputs, size_t output_size);
+bool crypto_hkdf_sha256(unsigned char const * key, size_t key_size, unsigned char const * info, size_t info_size, unsigned char * output, size_t output_size);
+bool crypto_aes128_ecb_encrypt(unsigned char const * key, unsigned char const * input, unsigned char * output, size_t size);
+bool crypto_aes128_ctr(unsigned char const * key, unsigned char const * iv, unsigned char const * input, unsigned char * output, size_t size);
+void crypto_context_clear();
+
+// Function definitions
+
+#endif // __CRYPTO_CONTEXT_H
+
+/** @} addtogroup Utils */
+
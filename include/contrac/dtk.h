@@ -56,6 +56,7 @@ Dtk * dtk_new();
 void dtk_delete(Dtk * data);
 
 bool dtk_generate_daily_key(Dtk * data, Contrac const * contrac, uint32_t day_number);
+bool dtk_generate_daily_keys(Contrac const * contrac, uint32_t day_number, size_t count, unsigned char * dtk_bytes);
 unsigned char const * dtk_get_daily_key(Dtk const * data);
 uint32_t dtk_get_day_number(Dtk const * data);
 void dtk_assign(Dtk * data, unsigned char const * dtk_bytes, uint32_t day_number);
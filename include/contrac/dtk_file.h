@@ -0,0 +1,81 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief A batch of diagnosis keys that can be memory mapped
+ * @section DESCRIPTION
+ *
+ * This class provides a versioned on-disk format for batches of diagnosis
+ * keys that can be memory mapped and used directly, without being parsed.
+ * Batches are written from a \ref DtkList using \ref dtk_file_write(), and
+ * opened using \ref dtk_file_open().
+ *
+ * The file starts with a header and an index giving the position of each
+ * day's keys. The keys themselves follow, stored contiguously and grouped by
+ * day, aligned so they can be loaded directly into vector registers. Opening
+ * a file only reads the header and index, and matching only touches the keys
+ * for days on which beacons were captured.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __DTK_FILE_H
+#define __DTK_FILE_H
+
+// Includes
+
+#include "contrac/contrac.h"
+#include "contrac/beacon_store.h"
+#include "contrac/dtk_list.h"
+#include "contrac/match.h"
+
+// Defines
+
+/**
+ * The version of the file format written by this library
+ */
+#define DTK_FILE_VERSION (1)
+
+/**
+ * Verify the checksum of each day's keys when they're used
+ */
+#define DTK_FILE_VERIFY (1 << 0)
+
+// Structures
+
+/**
+ * An opaque structure that represents an opened batch file.
+ *
+ * The internal structure can be found in dtk_file.c
+ */
+typedef struct _DtkFile DtkFile;
+
+// Function prototypes
+
+bool dtk_file_write(DtkList const * diagnosis_keys, char const * path);
+
+DtkFile * dtk_file_open(char const * path, unsigned int flags);
+void dtk_file_close(DtkFile * data);
+
+size_t dtk_file_count(DtkFile const * data);
+size_t dtk_file_get_day_count(DtkFile const * data);
+bool dtk_file_get_coverage(DtkFile const * data, uint32_t * first_day_number, uint32_t * last_day_number);
+unsigned char const * dtk_file_get_day(DtkFile const * data, uint32_t day_number, size_t * count);
+
+void match_list_find_matches_dtk_file(MatchList * data, BeaconStore const * beacons, DtkFile const * diagnosis_keys);
+
+// Function definitions
+
+#endif // __DTK_FILE_H
+
+/** @} addtogroup Containers*/
+
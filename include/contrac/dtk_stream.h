@@ -0,0 +1,96 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Reads diagnosis keys from a byte stream
+ * @section DESCRIPTION
+ *
+ * This class allows diagnosis keys to be read one at a time from a file
+ * descriptor, a memory buffer or a callback, without first building a
+ * \ref DtkList. Input is read in fixed-size chunks, so the memory used is
+ * independent of the size of the input.
+ *
+ * The stream is a sequence of records of DTK_STREAM_RECORD_SIZE (20) bytes,
+ * each containing the DTK_SIZE (16) byte diagnosis key followed by its day
+ * number as a 32-bit big-endian integer. Records can be produced using
+ * \ref dtk_stream_encode_record().
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __DTK_STREAM_H
+#define __DTK_STREAM_H
+
+// Includes
+
+#include <sys/types.h>
+
+#include "contrac/contrac.h"
+#include "contrac/dtk.h"
+
+// Defines
+
+/**
+ * The size in bytes of a single diagnosis key record in a stream.
+ *
+ */
+#define DTK_STREAM_RECORD_SIZE (DTK_SIZE + 4)
+
+/**
+ * The default number of bytes read from the input at a time.
+ *
+ */
+#define DTK_STREAM_CHUNK_SIZE (DTK_STREAM_RECORD_SIZE * 1024)
+
+// Structures
+
+/**
+ * An opaque structure that represents the stream.
+ *
+ * The internal structure can be found in dtk_stream.c
+ */
+typedef struct _DtkStream DtkStream;
+
+/**
+ * A callback used to read raw bytes into the stream.
+ *
+ * The callback should behave like read(), filling the buffer with up to size
+ * bytes and returning the number of bytes written.
+ *
+ * @param user_data The user data pointer provided when creating the stream.
+ * @param buffer The buffer to write the bytes into.
+ * @param size The maximum number of bytes to write.
+ * @return The number of bytes written, zero at the end of the input, or a
+ *         negative value on error.
+ */
+typedef ssize_t (*DtkStreamRead)(void * user_data, unsigned char * buffer, size_t size);
+
+// Function prototypes
+
+DtkStream * dtk_stream_new_fd(int fd, size_t chunk_size);
+DtkStream * dtk_stream_new_memory(unsigned char const * buffer, size_t size);
+DtkStream * dtk_stream_new_reader(DtkStreamRead read, void * user_data, size_t chunk_size);
+void dtk_stream_delete(DtkStream * data);
+
+bool dtk_stream_read(DtkStream * data, unsigned char * dtk_bytes, uint32_t * day_number);
+bool dtk_stream_get_error(DtkStream const * data);
+size_t dtk_stream_get_count(DtkStream const * data);
+
+bool dtk_stream_source(void * user_data, unsigned char * dtk_bytes, uint32_t * day_number);
+void dtk_stream_encode_record(unsigned char * record, unsigned char const * dtk_bytes, uint32_t day_number);
+
+// Function definitions
+
+#endif // __DTK_STREAM_H
+
+/** @} addtogroup Containers*/
+
@@ -0,0 +1,91 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Reads diagnosis keys from Exposure Notification export files
+ * @section DESCRIPTION
+ *
+ * This class reads the temporary exposure keys from the binary export files
+ * published by Exposure Notification diagnosis servers, one key at a time.
+ * The keys can be added to a \ref DtkList or fed directly into
+ * \ref match_list_find_matches_pipelined().
+ *
+ * Files can be memory mapped and parsed in place, or read in fixed-size
+ * chunks from a file descriptor or callback, so the memory used is
+ * independent of the size of the file.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __EXPORT_READER_H
+#define __EXPORT_READER_H
+
+// Includes
+
+#include <sys/types.h>
+
+#include "contrac/contrac.h"
+#include "contrac/dtk.h"
+#include "contrac/dtk_list.h"
+#include "contrac/dtk_stream.h"
+
+// Defines
+
+/**
+ * The header at the start of every export file.
+ *
+ */
+#define EXPORT_READER_HEADER "EK Export v1    "
+
+/**
+ * The size in bytes of the header at the start of every export file.
+ *
+ */
+#define EXPORT_READER_HEADER_SIZE (16)
+
+/**
+ * The default number of bytes read from the input at a time.
+ *
+ */
+#define EXPORT_READER_CHUNK_SIZE (64 * 1024)
+
+// Structures
+
+/**
+ * An opaque structure that represents the reader.
+ *
+ * The internal structure can be found in export_reader.c
+ */
+typedef struct _ExportReader ExportReader;
+
+// Function prototypes
+
+ExportReader * export_reader_open(char const * path);
+ExportReader * export_reader_new_fd(int fd, size_t chunk_size);
+ExportReader * export_reader_new_memory(unsigned char const * buffer, size_t size);
+ExportReader * export_reader_new_reader(DtkStreamRead read, void * user_data, size_t chunk_size);
+void export_reader_delete(ExportReader * data);
+
+bool export_reader_read(ExportReader * data, unsigned char * dtk_bytes, uint32_t * day_number);
+uint32_t export_reader_get_rolling_period(ExportReader const * data);
+bool export_reader_get_error(ExportReader const * data);
+size_t export_reader_get_count(ExportReader const * data);
+
+bool export_reader_source(void * user_data, unsigned char * dtk_bytes, uint32_t * day_number);
+bool export_reader_add_to_list(ExportReader * data, DtkList * diagnosis_keys);
+
+// Function definitions
+
+#endif // __EXPORT_READER_H
+
+/** @} addtogroup Containers*/
+
@@ -31,11 +31,31 @@
 
 #include "contrac/contrac.h"
 #include "contrac/dtk.h"
+#include "contrac/rpi_list.h"
+#include "contrac/dtk_list.h"
+#include "contrac/dtk_stream.h"
+#include "contrac/rpi.h"
 
 // Defines
 
 // Structures
 
+/**
+ * The order in which diagnosis keys are processed when searching for matches.
+ *
+ * MATCH_ORDER_DOWNLOAD processes the DTKs in the order they appear in the
+ * list, which is usually the order they were downloaded in.
+ *
+ * MATCH_ORDER_NEWEST_FIRST processes the DTKs with the most recent day number
+ * first. Matches for recent days are the most actionable, so this minimises
+ * the time until the first relevant match is reported. DTKs with the same day
+ * number are processed in download order.
+ */
+typedef enum _MatchOrder {
+	MATCH_ORDER_DOWNLOAD,
+	MATCH_ORDER_NEWEST_FIRST,
+} MatchOrder;
+
 /**
  * An opaque structure that represents the head of the list.
  * 
@@ -50,6 +70,17 @@ typedef struct _MatchList MatchList;
  */
 typedef struct _MatchListItem MatchListItem;
 
+/**
+ * A callback that's triggered each time a match is added to the list.
+ *
+ * This allows matches to be reported incrementally while the search is still
+ * in progress. The match item remains owned by the list.
+ *
+ * @param match The match that has just been added to the list.
+ * @param user_data The user data pointer provided when setting the callback.
+ */
+typedef void (*MatchCallback)(MatchListItem const * match, void * user_data);
+
 // Function prototypes
 
 MatchList * match_list_new();
@@ -60,11 +91,25 @@ size_t match_list_count(MatchList * data);
 
 uint32_t match_list_get_day_number(MatchListItem const * data);
 uint8_t match_list_get_time_interval_number(MatchListItem const * data);
+unsigned char const * match_list_get_metadata(MatchListItem const * data);
+RpiEncoding match_list_get_variant(MatchListItem const * data);
 
 MatchListItem const * match_list_first(MatchList const * data);
 MatchListItem const * match_list_next(MatchListItem const * data);
 
+void match_list_set_order(MatchList * data, MatchOrder order);
+MatchOrder match_list_get_order(MatchList const * data);
+void match_list_set_callback(MatchList * data, MatchCallback callback, void * user_data);
+void match_list_set_memory_budget(MatchList * data, size_t memory_budget);
+size_t match_list_get_memory_budget(MatchList const * data);
+void match_list_set_spill_directory(MatchList * data, char const * directory);
+void match_list_set_rpi_scheme(MatchList * data, RpiScheme scheme);
+RpiScheme match_list_get_rpi_scheme(MatchList const * data);
+void match_list_add_rpi_variant(MatchList * data, RpiEncoding variant);
+void match_list_clear_rpi_variants(MatchList * data);
+
 void match_list_find_matches(MatchList * data, RpiList * beacons, DtkList * diagnosis_keys);
+bool match_stream(MatchList * data, RpiList * beacons, DtkStream * diagnosis_keys);
 
 // Function definitions
 
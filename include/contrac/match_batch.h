@@ -0,0 +1,71 @@
+/** \ingroup Matching
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Matches the beacons from many devices in a single pass
+ * @section DESCRIPTION
+ *
+ * This class allows the beacons captured by many different devices (tenants)
+ * to be matched against the same diagnosis keys at once. The RPIs for each
+ * diagnosis key are generated only once and looked up in a combined index of
+ * all the tenants' beacons, so the cost of deriving the RPIs is shared between
+ * all of the tenants rather than paid once per device.
+ *
+ * The matches are returned partitioned by tenant, with a separate
+ * \ref MatchList for each. They carry the same encodings and decrypted
+ * metadata as matching each tenant's beacons separately.
+ *
+ */
+
+/** \addtogroup Matching
+ *  @{
+ */
+
+#ifndef __MATCH_BATCH_H
+#define __MATCH_BATCH_H
+
+// Includes
+
+#include "contrac/contrac.h"
+#include "contrac/rpi_list.h"
+#include "contrac/dtk_list.h"
+#include "contrac/match.h"
+
+// Defines
+
+// Structures
+
+/**
+ * An opaque structure that represents a batch of tenants.
+ *
+ * The internal structure can be found in match_batch.c
+ */
+typedef struct _MatchBatch MatchBatch;
+
+// Function prototypes
+
+MatchBatch * match_batch_new();
+void match_batch_delete(MatchBatch * data);
+
+void match_batch_add_tenant(MatchBatch * data, uint32_t tenant_id, RpiList const * beacons);
+void match_batch_set_rpi_scheme(MatchBatch * data, RpiScheme scheme);
+void match_batch_add_rpi_variant(MatchBatch * data, RpiEncoding variant);
+size_t match_batch_get_tenant_count(MatchBatch const * data);
+uint32_t match_batch_get_tenant_id(MatchBatch const * data, size_t position);
+
+void match_batch_find_matches(MatchBatch * data, DtkList * diagnosis_keys);
+MatchList * match_batch_get_matches(MatchBatch const * data, uint32_t tenant_id);
+MatchList * match_batch_get_matches_at(MatchBatch const * data, size_t position);
+
+// Function definitions
+
+#endif // __MATCH_BATCH_H
+
+/** @} addtogroup Matching*/
+
@@ -0,0 +1,75 @@
+/** \ingroup Matching
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Pipelined matching of diagnosis keys against collected RPIs
+ * @section DESCRIPTION
+ *
+ * This provides an alternative to \ref match_list_find_matches() that doesn't
+ * need the full list of diagnosis keys to be available before matching starts.
+ *
+ * Matching is split into three concurrent stages: reading the diagnosis keys
+ * from a source, deriving the RPIs from each key, and looking the RPIs up in an
+ * index of the beacons. The stages are joined by bounded lock-free queues, so
+ * reading and parsing overlap with the HMAC computation and the memory used is
+ * bounded by the queue depth rather than the number of keys.
+ *
+ */
+
+/** \addtogroup Matching
+ *  @{
+ */
+
+#ifndef __MATCH_PIPELINE_H
+#define __MATCH_PIPELINE_H
+
+// Includes
+
+#include "contrac/contrac.h"
+#include "contrac/dtk.h"
+#include "contrac/rpi_list.h"
+#include "contrac/dtk_list.h"
+#include "contrac/match.h"
+
+// Defines
+
+/**
+ * The default number of items each queue in the pipeline can hold.
+ *
+ */
+#define MATCH_PIPELINE_QUEUE_DEPTH (64)
+
+// Structures
+
+/**
+ * A callback used to read diagnosis keys into the pipeline.
+ *
+ * Each call should write the next DTK_SIZE (16) byte diagnosis key into the
+ * dtk_bytes buffer and its day number into day_number. The callback is called
+ * from a separate thread, so may block while reading or parsing input.
+ *
+ * @param user_data The user data pointer provided to the pipeline.
+ * @param dtk_bytes A buffer of DTK_SIZE bytes to store the key in.
+ * @param day_number Returns the day number associated with the key.
+ * @return true if a key was returned, false if there are no more keys.
+ */
+typedef bool (*DiagnosisSource)(void * user_data, unsigned char * dtk_bytes, uint32_t * day_number);
+
+// Function prototypes
+
+void match_list_find_matches_pipelined(MatchList * data, RpiList * beacons, DiagnosisSource source, void * user_data, size_t queue_depth, size_t derive_threads);
+
+bool match_pipeline_dtk_list_source(void * user_data, unsigned char * dtk_bytes, uint32_t * day_number);
+
+// Function definitions
+
+#endif // __MATCH_PIPELINE_H
+
+/** @} addtogroup Matching*/
+
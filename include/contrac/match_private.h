@@ -0,0 +1,83 @@
+/** \ingroup Matching
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Private header for the matching functionality
+ * @section DESCRIPTION
+ *
+ * This provides access to private functionality in the \ref MatchList class,
+ * allowing the other matching strategies to add matches to a list.
+ *
+ */
+
+/** \addtogroup Matching
+ *  @{
+ */
+
+#ifndef __MATCH_PRIVATE_H
+#define __MATCH_PRIVATE_H
+
+// Includes
+
+#include "contrac/match.h"
+#include "contrac/beacon_store.h"
+
+// Defines
+
+/**
+ * The size of the buffer needed to hold the RPIs generated for a diagnosis
+ * key, for all of the variants that can be registered.
+ */
+#define MATCH_GENERATED_SIZE (RPI_ENCODING_COUNT * RPI_INTERVAL_MAX * RPI_SIZE)
+
+// Structures
+
+/**
+ * @brief A contiguous block of beacons captured on a single day
+ *
+ * If sorted is set, the records are in the order given by
+ * \ref match_record_compare() and are searched in place rather than indexed.
+ */
+typedef struct _MatchSegment {
+	uint32_t day_number;
+	BeaconRecord const * records;
+	size_t count;
+	bool sorted;
+} MatchSegment;
+
+/**
+ * @brief The metadata key for a diagnosis key, derived when first needed
+ */
+typedef struct _MatchMetadataKey {
+	Dtk const * dtk;
+	bool derived;
+	bool valid;
+	unsigned char aemk[RPI_METADATA_KEY_SIZE];
+} MatchMetadataKey;
+
+// Function prototypes
+
+void match_list_append_match(MatchList * data, uint32_t day_number, uint8_t time_interval_number);
+void match_metadata_key_init(MatchMetadataKey * key, Dtk const * dtk);
+void match_metadata_key_clear(MatchMetadataKey * key);
+void match_list_append_beacon_match(MatchList * data, MatchMetadataKey * key, uint32_t day_number, uint8_t time_interval_number, RpiEncoding variant, RpiListItem const * beacon);
+void match_list_copy_rpi_settings(MatchList * data, MatchList const * source);
+size_t match_list_get_rpi_variants(MatchList const * data, RpiEncoding * variants);
+size_t match_list_generate_rpis(MatchList const * data, Dtk const * diagnosis_key, unsigned char * generated, RpiEncoding * variants);
+bool match_list_find_matches_external(MatchList * data, RpiList * beacons, DtkList * diagnosis_keys, size_t memory_budget, char const * directory);
+int match_record_compare(void const * left, void const * right);
+void match_list_find_matches_segments(MatchList * data, MatchSegment const * segments, size_t count, DtkList * diagnosis_keys);
+void match_list_find_matches_segment_keys(MatchList * data, MatchSegment const * segment, unsigned char const * dtk_bytes, size_t count);
+
+// Function definitions
+
+#endif // __MATCH_PRIVATE_H
+
+/** @} addtogroup Matching */
+
@@ -0,0 +1,98 @@
+/** \ingroup Matching
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Sharded matching across multiple workers
+ * @section DESCRIPTION
+ *
+ * This allows a large match job to be split between several workers. The
+ * beacons are sharded between the workers by RPI prefix, while every worker
+ * receives all of the diagnosis keys. Each worker finds the matches for its
+ * own shard and the coordinator merges the results into a single
+ * \ref MatchList.
+ *
+ * The coordinator and workers communicate through a \ref MatchTransport, which
+ * abstracts the channel used to carry the messages. A transport based on Unix
+ * domain sockets is provided and used by
+ * \ref match_list_find_matches_sharded() to run the workers as local
+ * threads. The workers can be run in separate processes or on other machines
+ * by calling \ref match_shard_coordinate() and \ref match_shard_serve()
+ * directly, with any suitable transport.
+ *
+ */
+
+/** \addtogroup Matching
+ *  @{
+ */
+
+#ifndef __MATCH_SHARD_H
+#define __MATCH_SHARD_H
+
+// Includes
+
+#include "contrac/contrac.h"
+#include "contrac/rpi_list.h"
+#include "contrac/dtk_list.h"
+#include "contrac/match.h"
+
+// Defines
+
+// Structures
+
+/**
+ * A callback used to send bytes over a transport channel.
+ *
+ * Must send the whole buffer before returning.
+ *
+ * @param channel The channel to send on.
+ * @param buffer The bytes to send.
+ * @param size The number of bytes to send.
+ * @return true if all of the bytes were sent, false otherwise.
+ */
+typedef bool (*MatchTransportSend)(void * channel, void const * buffer, size_t size);
+
+/**
+ * A callback used to receive bytes from a transport channel.
+ *
+ * Must fill the whole buffer before returning.
+ *
+ * @param channel The channel to receive from.
+ * @param buffer The buffer to fill.
+ * @param size The number of bytes to receive.
+ * @return true if all of the bytes were received, false otherwise.
+ */
+typedef bool (*MatchTransportReceive)(void * channel, void * buffer, size_t size);
+
+/**
+ * @brief The functions used to communicate between coordinator and workers.
+ *
+ * A channel is an opaque pointer representing one end of a connection between
+ * the coordinator and a single worker. The transport is used to send and
+ * receive bytes over it in order.
+ */
+typedef struct _MatchTransport {
+	MatchTransportSend send;
+	MatchTransportReceive receive;
+} MatchTransport;
+
+// Function prototypes
+
+bool match_list_find_matches_sharded(MatchList * data, RpiList * beacons, DtkList * diagnosis_keys, size_t shards);
+
+bool match_shard_coordinate(MatchList * data, RpiList * beacons, DtkList * diagnosis_keys, MatchTransport const * transport, void ** channels, size_t shards);
+bool match_shard_serve(MatchTransport const * transport, void * channel);
+
+MatchTransport const * match_transport_socket();
+
+// Function definitions
+
+#endif // __MATCH_SHARD_H
+
+/** @} addtogroup Matching*/
+
@@ -0,0 +1,62 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Bounded lock-free single-producer single-consumer queue
+ * @section DESCRIPTION
+ *
+ * This class provides a fixed capacity queue of fixed size elements that can
+ * be safely used by exactly one producer thread and one consumer thread at the
+ * same time without locking. It's used to join the stages of the matching
+ * pipeline, where the bounded capacity limits the amount of memory in flight.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __QUEUE_H
+#define __QUEUE_H
+
+// Includes
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Defines
+
+// Structures
+
+/**
+ * An opaque structure that represents the queue.
+ *
+ * The internal structure can be found in queue.c
+ */
+typedef struct _Queue Queue;
+
+// Function prototypes
+
+Queue * queue_new(size_t element_size, size_t capacity);
+void queue_delete(Queue * data);
+
+bool queue_push(Queue * data, void const * element);
+bool queue_pop(Queue * data, void * element);
+void queue_push_wait(Queue * data, void const * element);
+bool queue_pop_wait(Queue * data, void * element);
+
+void queue_close(Queue * data);
+size_t queue_get_capacity(Queue const * data);
+
+// Function definitions
+
+#endif // __QUEUE_H
+
+/** @} addtogroup Containers*/
+
@@ -0,0 +1,75 @@
+/** \ingroup KeyGeneration
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Updates the keys at each time interval boundary
+ * @section DESCRIPTION
+ *
+ * This class runs a background thread that sleeps until the current Rolling
+ * Proximity Identifier expires, then updates the keys and calls a callback.
+ * This avoids having to poll \ref contrac_update_current_time() to find out
+ * whether a new time interval has started.
+ *
+ * While the scheduler is running its thread is the only one that should
+ * update the keys. Other threads can read the current identity using
+ * \ref contrac_get_identity().
+ *
+ */
+
+/** \addtogroup KeyGeneration
+ *  @{
+ */
+
+#ifndef __ROLLOVER_SCHEDULER_H
+#define __ROLLOVER_SCHEDULER_H
+
+// Includes
+
+#include "contrac/contrac.h"
+
+// Defines
+
+// Structures
+
+/**
+ * An opaque structure that represents the scheduler.
+ *
+ * The internal structure can be found in rollover_scheduler.c
+ */
+typedef struct _RolloverScheduler RolloverScheduler;
+
+/**
+ * A callback that's triggered each time the keys are updated at a time
+ * interval boundary.
+ *
+ * The callback is called on the scheduler's thread.
+ *
+ * @param contrac The context object that was updated.
+ * @param new_day true if the day number changed, false if only the time
+ *        interval number did.
+ * @param user_data The user data pointer passed in when the scheduler was
+ *        created.
+ */
+typedef void (*RolloverCallback)(Contrac * contrac, bool new_day, void * user_data);
+
+// Function prototypes
+
+RolloverScheduler * rollover_scheduler_new(Contrac * contrac, RolloverCallback callback, void * user_data);
+void rollover_scheduler_delete(RolloverScheduler * data);
+
+bool rollover_scheduler_start(RolloverScheduler * data);
+void rollover_scheduler_stop(RolloverScheduler * data);
+bool rollover_scheduler_get_running(RolloverScheduler const * data);
+
+// Function definitions
+
+#endif // __ROLLOVER_SCHEDULER_H
+
+/** @} addtogroup KeyGeneration */
+
@@ -52,8 +52,71 @@
  */
 #define RPI_INTERVAL_MAX (144)
 
+/**
+ * The size in bytes of the Associated Encrypted Metadata broadcast alongside
+ * an RPI under the AES scheme.
+ *
+ */
+#define RPI_METADATA_SIZE (4)
+
+/**
+ * The size in bytes of the key used to decrypt the Associated Encrypted
+ * Metadata.
+ *
+ */
+#define RPI_METADATA_KEY_SIZE (16)
+
 // Structures
 
+/**
+ * The scheme used to generate RPIs from a daily key.
+ *
+ * RPI_SCHEME_HMAC is the scheme from version 1.1 of the Contact Tracing
+ * Cryptography Specification, with each RPI generated using HMAC-SHA256:
+ *
+ *     RPI_{i, j} <- Truncate(HMAC(dtk_i, (UTF8("CT-RPI") || TIN_j)), 16)
+ *
+ * RPI_SCHEME_AES is the scheme from version 1.2 of the Exposure Notification
+ * Cryptography Specification. A key is derived once for each day and then
+ * each RPI is a single AES-128 block encryption:
+ *
+ *     RPIK_i <- HKDF(dtk_i, NULL, UTF8("EN-RPIK"), 16)
+ *     RPI_{i, j} <- AES128(RPIK_i, UTF8("EN-RPI") || 0x000000000000 || ENIN_j)
+ *
+ * where ENIN_j is the interval number counted from the Unix epoch, encoded
+ * as a 32 bit little-endian integer.
+ */
+typedef enum _RpiScheme {
+	RPI_SCHEME_HMAC,
+	RPI_SCHEME_AES,
+} RpiScheme;
+
+/**
+ * The way the info is encoded when generating an RPI using RPI_SCHEME_HMAC.
+ *
+ * The specification doesn't make clear whether the prefix and time interval
+ * number are concatenated as strings or as bytes, so implementations differ.
+ *
+ * RPI_ENCODING_BINARY includes the null terminator of the prefix, followed by
+ * the time interval number as a single byte. This is the encoding used by
+ * default.
+ *
+ * RPI_ENCODING_BINARY_UNTERMINATED is the prefix without its null terminator,
+ * followed by the time interval number as a single byte.
+ *
+ * RPI_ENCODING_STRING is the prefix without its null terminator, followed by
+ * the time interval number written as a decimal string.
+ *
+ * RPI_ENCODING_COUNT is the number of encodings, rather than an encoding.
+ */
+typedef enum _RpiEncoding {
+	RPI_ENCODING_BINARY,
+	RPI_ENCODING_BINARY_UNTERMINATED,
+	RPI_ENCODING_STRING,
+
+	RPI_ENCODING_COUNT
+} RpiEncoding;
+
 /**
  * An opaque structure for representing a DTK.
  *
@@ -67,6 +130,12 @@ Rpi * rpi_new();
 void rpi_delete(Rpi * data);
 
 bool rpi_generate_proximity_id(Rpi * data, Dtk const * dtk, uint8_t time_interval_number);
+bool rpi_generate_proximity_ids(Dtk const * dtk, unsigned char * rpi_bytes);
+bool rpi_generate_proximity_id_scheme(Rpi * data, Dtk const * dtk, uint8_t time_interval_number, RpiScheme scheme);
+bool rpi_generate_proximity_ids_scheme(Dtk const * dtk, RpiScheme scheme, unsigned char * rpi_bytes);
+bool rpi_generate_proximity_ids_variants(Dtk const * dtk, RpiEncoding const * encodings, size_t count, unsigned char * rpi_bytes);
+bool rpi_generate_metadata_key(Dtk const * dtk, unsigned char * aemk);
+bool rpi_decrypt_metadata(unsigned char const * aemk, unsigned char const * rpi_bytes, unsigned char const * encrypted, unsigned char * metadata);
 unsigned char const * rpi_get_proximity_id(Rpi const * data);
 uint8_t rpi_get_time_interval_number(Rpi const * data);
 void rpi_assign(Rpi * data, unsigned char const * rpi_bytes, uint8_t time_interval_number);
@@ -0,0 +1,73 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Provides a hash index of RPIs
+ * @section DESCRIPTION
+ *
+ * This class allows RPIs captured over Bluetooth to be looked up by value in
+ * constant time. Generated RPIs can then be checked against the full set of
+ * beacons with a single lookup, rather than by comparing against each beacon
+ * in turn.
+ *
+ * Each entry stores a tag alongside the RPI and time interval number, which
+ * the caller can use to associate the entry with other data.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+#ifndef __RPI_INDEX_H
+#define __RPI_INDEX_H
+
+// Includes
+
+#include "contrac/contrac.h"
+#include "contrac/rpi.h"
+#include "contrac/rpi_list.h"
+
+// Defines
+
+// Structures
+
+/**
+ * An opaque structure that represents the index.
+ *
+ * The internal structure can be found in rpi_index.c
+ */
+typedef struct _RpiIndex RpiIndex;
+
+/**
+ * A callback that's triggered for each entry found by \ref rpi_index_find().
+ *
+ * @param tag The tag that was stored with the entry.
+ * @param user_data The user data pointer passed in to the lookup.
+ */
+typedef void (*RpiIndexVisit)(uint32_t tag, void * user_data);
+
+// Function prototypes
+
+RpiIndex * rpi_index_new(size_t capacity);
+void rpi_index_delete(RpiIndex * data);
+
+void rpi_index_add(RpiIndex * data, unsigned char const * rpi_bytes, uint8_t time_interval_number, uint32_t tag);
+void rpi_index_add_list(RpiIndex * data, RpiList const * beacons);
+size_t rpi_index_count(RpiIndex const * data);
+size_t rpi_index_memory_estimate(size_t count);
+
+size_t rpi_index_find(RpiIndex const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number, RpiIndexVisit visit, void * user_data);
+
+// Function definitions
+
+#endif // __RPI_INDEX_H
+
+/** @} addtogroup Containers*/
+
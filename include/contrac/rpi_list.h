@@ -16,6 +16,10 @@
  * captured over Bluetooth. Combined with the \ref DtkList class the two can
  * be easily stored and passed into the \ref match_list_find_matches() function.
  *
+ * Limits can be set on the number of distinct RPIs held for each time
+ * interval and in total, so that a device broadcasting large numbers of RPIs
+ * can't exhaust memory or make matching arbitrarily slow.
+ *
  */
 
 /** \addtogroup Containers
@@ -27,13 +31,37 @@
 
 // Includes
 
+#include <time.h>
+
 #include "contrac/contrac.h"
 #include "contrac/rpi.h"
 
 // Defines
 
+/**
+ * The signal strength recorded when a beacon is added without one.
+ */
+#define RPI_LIST_RSSI_UNKNOWN (INT8_MIN)
+
 // Structures
 
+/**
+ * What happens when an RPI is added to a list that has reached its limits.
+ *
+ * RPI_LIST_EVICTION_REJECT keeps the RPIs already in the list and rejects the
+ * new one.
+ *
+ * RPI_LIST_EVICTION_SPARSE makes room by removing the earliest added RPI that
+ * has only been seen once, rejecting the new RPI if there's no such RPI to
+ * remove. Genuine contacts are seen repeatedly, so they survive a flood of
+ * one-off RPIs, while recent one-off RPIs are kept in preference to older
+ * ones.
+ */
+typedef enum _RpiListEviction {
+	RPI_LIST_EVICTION_REJECT,
+	RPI_LIST_EVICTION_SPARSE,
+} RpiListEviction;
+
 /**
  * An opaque structure that represents the head of the list.
  * 
@@ -54,11 +82,26 @@ RpiList * rpi_list_new();
 void rpi_list_delete(RpiList * data);
 
 void rpi_list_append(RpiList * data, Rpi * rpi);
-void rpi_list_add_beacon(RpiList * data, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+bool rpi_list_add_beacon(RpiList * data, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+bool rpi_list_add_sighting(RpiList * data, unsigned char const * rpi_bytes, uint8_t time_interval_number, time_t seen, int8_t rssi);
+bool rpi_list_add_sighting_metadata(RpiList * data, unsigned char const * rpi_bytes, uint8_t time_interval_number, time_t seen, int8_t rssi, unsigned char const * metadata);
+size_t rpi_list_count(RpiList const * data);
+
+void rpi_list_set_limits(RpiList * data, size_t interval_limit, size_t total_limit);
+void rpi_list_set_eviction(RpiList * data, RpiListEviction eviction);
+uint64_t rpi_list_get_rejected(RpiList const * data);
+uint64_t rpi_list_get_evicted(RpiList const * data);
 
 RpiListItem const * rpi_list_first(RpiList const * data);
 RpiListItem const * rpi_list_next(RpiListItem const * data);
 Rpi const * rpi_list_get_rpi(RpiListItem const * data);
+uint32_t rpi_list_get_sighting_count(RpiListItem const * data);
+time_t rpi_list_get_first_seen(RpiListItem const * data);
+time_t rpi_list_get_last_seen(RpiListItem const * data);
+int8_t rpi_list_get_rssi_min(RpiListItem const * data);
+int8_t rpi_list_get_rssi_max(RpiListItem const * data);
+unsigned char const * rpi_list_get_metadata(RpiListItem const * data);
+RpiListItem const * rpi_list_find(RpiList const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number);
 
 // Function definitions
 
@@ -15,6 +15,7 @@
  *
  * base64 encoding and decoding functionality.
  * Time conversion: from epoch to day numbers and time interval numbers.
+ * Keyed hashing, for hash tables that hold data chosen by an attacker.
  *
  */
 
@@ -27,6 +28,8 @@
 
 // Includes
 
+#include <stdio.h>
+#include <stdbool.h>
 #include <time.h>
 
 // Defines
@@ -41,6 +44,11 @@
 		__typeof__ (b) _b = (b); \
 		_a < _b ? _a : _b; })
 
+/**
+ * The size of the secret key used by \ref siphash_13()
+ */
+#define HASH_KEY_SIZE (16)
+
 // Structures
 
 // Function prototypes
@@ -52,6 +60,19 @@ void base64_decode_base64_to_binary(unsigned char const *input, size_t input_siz
 
 uint32_t epoch_to_day_number(time_t epoch);
 uint8_t epoch_to_time_interval_number(time_t epoch);
+time_t epoch_to_next_rollover(time_t epoch);
+
+uint32_t crc32_update(uint32_t crc, unsigned char const * buffer, size_t size);
+void big_endian_encode_u32(unsigned char * buffer, uint32_t value);
+void big_endian_encode_u64(unsigned char * buffer, uint64_t value);
+uint32_t big_endian_decode_u32(unsigned char const * buffer);
+uint64_t big_endian_decode_u64(unsigned char const * buffer);
+
+void hash_key_generate(unsigned char * key);
+uint64_t siphash_13(unsigned char const * key, unsigned char const * buffer, size_t size);
+
+FILE * file_create_temp(char const * path, char ** temp_path);
+bool file_sync_directory(char const * path);
 
 // Function definitions
 
@@ -0,0 +1,725 @@
+/** \ingroup Utils
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Strict bulk base64 encoding and decoding
+ * @section DESCRIPTION
+ *
+ * Provides base64 encoding and decoding that validates its input, reporting
+ * the position of the first invalid character, together with functions for
+ * converting newline-separated lists of keys to and from contiguous arrays.
+ *
+ * On x86 processors blocks of input are converted using SSSE3 or AVX2
+ * instructions, selected at runtime depending on what the processor
+ * supports. The decoder translates and validates 16 or 32 characters at a
+ * time using nibble lookup tables. If a block contains anything other than
+ * base64 characters, including padding, it's left to the scalar
+ * implementation, which then handles the padding or finds the exact position
+ * of the error. The encoder works in the same way on blocks of 12 or 24
+ * bytes.
+ *
+ * The scalar implementation handles the remainder and is used on its own on
+ * other processors. Both produce identical results.
+ *
+ * Key lists hold a short key on each line, usually ending in padding, which
+ * is too short for the vector decoder to be of much use line by line. Runs of
+ * well-formed lines are therefore decoded in batches: the complete groups of
+ * several lines are gathered together and decoded in one go, leaving only
+ * the final padded group of each line for the scalar decoder.
+ *
+ */
+
+/** \addtogroup Utils
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "contrac/utils.h"
+
+#include "contrac/base64.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+// Defines
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/**
+ * Used internally.
+ *
+ * Defined if the SSSE3 and AVX2 implementations are available.
+ */
+#define BASE64_SIMD_X86
+#endif
+
+/**
+ * Used internally.
+ *
+ * The character used to pad the end of the encoded data.
+ */
+#define BASE64_PAD '='
+
+/**
+ * Used internally.
+ *
+ * The maximum number of characters gathered from a batch of key list lines.
+ */
+#define BASE64_BATCH_CHARS (256)
+
+// Structures
+
+// Function prototypes
+
+#ifdef BASE64_SIMD_X86
+static bool base64_decode_block_ssse3(char const * input, unsigned char * output);
+static bool base64_decode_block_avx2(char const * input, unsigned char * output);
+static void base64_encode_block_ssse3(unsigned char const * input, char * output);
+static void base64_encode_block_avx2(unsigned char const * input, char * output);
+#endif
+static size_t base64_decode_key_batch(char const * input, size_t input_size, size_t key_size, unsigned char * keys, size_t capacity, size_t * consumed);
+
+// Function definitions
+
+/**
+ * Used internally.
+ *
+ * The base64 alphabet, indexed by 6-bit value.
+ */
+static char const base64_encode_table[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Used internally.
+ *
+ * The 6-bit value of each character, or -1 if it's not part of the base64
+ * alphabet.
+ */
+static int8_t const base64_decode_table[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#ifdef BASE64_SIMD_X86
+/**
+ * Decodes 16 base64 characters into 12 bytes using SSSE3.
+ *
+ * For internal use. Each character is classified using lookup tables indexed
+ * by its high and low nibbles, which flag any character outside the base64
+ * alphabet, and then offset to give its 6-bit value. The values are then
+ * packed together using multiply-add instructions.
+ *
+ * Nothing is written if any of the characters is invalid, including padding.
+ *
+ * @param input The 16 characters to decode.
+ * @param output A buffer of at least 12 bytes to store the result in.
+ * @return true if all of the characters were valid, false otherwise.
+ */
+__attribute__((target("ssse3")))
+static bool base64_decode_block_ssse3(char const * input, unsigned char * output) {
+	__m128i in;
+	__m128i hi_nibbles;
+	__m128i lo_nibbles;
+	__m128i lo;
+	__m128i hi;
+	__m128i roll;
+	__m128i mask_2f;
+	unsigned char block[16];
+	bool result;
+
+	in = _mm_loadu_si128((__m128i const *)input);
+	mask_2f = _mm_set1_epi8(0x2f);
+
+	hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+	lo_nibbles = _mm_and_si128(in, mask_2f);
+	lo = _mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), lo_nibbles);
+	hi = _mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hi_nibbles);
+
+	// Any character with a bit set in both tables is invalid
+	result = (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) == 0xffff);
+
+	if (result) {
+		roll = _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0), _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm_add_epi8(in, roll);
+
+		// Pack each group of four 6-bit values into three bytes
+		in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+		in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+		in = _mm_shuffle_epi8(in, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+		_mm_storeu_si128((__m128i *)block, in);
+		memcpy(output, block, 12);
+	}
+
+	return result;
+}
+
+/**
+ * Decodes 32 base64 characters into 24 bytes using AVX2.
+ *
+ * For internal use. This works in the same way as
+ * \ref base64_decode_block_ssse3(), on two blocks of 16 characters at once.
+ *
+ * Nothing is written if any of the characters is invalid, including padding.
+ *
+ * @param input The 32 characters to decode.
+ * @param output A buffer of at least 24 bytes to store the result in.
+ * @return true if all of the characters were valid, false otherwise.
+ */
+__attribute__((target("avx2")))
+static bool base64_decode_block_avx2(char const * input, unsigned char * output) {
+	__m256i in;
+	__m256i hi_nibbles;
+	__m256i lo_nibbles;
+	__m256i lo;
+	__m256i hi;
+	__m256i roll;
+	__m256i mask_2f;
+	unsigned char block[32];
+	bool result;
+
+	in = _mm256_loadu_si256((__m256i const *)input);
+	mask_2f = _mm256_set1_epi8(0x2f);
+
+	hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+	lo_nibbles = _mm256_and_si256(in, mask_2f);
+	lo = _mm256_shuffle_epi8(_mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), lo_nibbles);
+	hi = _mm256_shuffle_epi8(_mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hi_nibbles);
+
+	// Any character with a bit set in both tables is invalid
+	result = _mm256_testz_si256(lo, hi);
+
+	if (result) {
+		roll = _mm256_shuffle_epi8(_mm256_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0), _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+
+		// Pack each group of four 6-bit values into three bytes, then move the
+		// twelve bytes from each lane together
+		in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+		in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+
+		_mm256_storeu_si256((__m256i *)block, in);
+		memcpy(output, block, 24);
+	}
+
+	return result;
+}
+
+/**
+ * Encodes 12 bytes into 16 base64 characters using SSSE3.
+ *
+ * For internal use. The bytes are spread so that each 6-bit value is in its
+ * own byte using shuffles and multiplies, and each value is then offset into
+ * the base64 alphabet using a lookup table indexed by its range.
+ *
+ * Reads 16 bytes from the input, although only the first 12 are used.
+ *
+ * @param input The bytes to encode, with at least 16 bytes readable.
+ * @param output A buffer of at least 16 characters to store the result in.
+ */
+__attribute__((target("ssse3")))
+static void base64_encode_block_ssse3(unsigned char const * input, char * output) {
+	__m128i in;
+	__m128i indices;
+	__m128i offsets;
+
+	in = _mm_loadu_si128((__m128i const *)input);
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+	indices = _mm_or_si128(
+		_mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040)),
+		_mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010)));
+
+	// Select the offset for each range: A-Z, a-z, 0-9, + and /
+	offsets = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	offsets = _mm_or_si128(offsets, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+	offsets = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), offsets);
+
+	_mm_storeu_si128((__m128i *)output, _mm_add_epi8(indices, offsets));
+}
+
+/**
+ * Encodes 24 bytes into 32 base64 characters using AVX2.
+ *
+ * For internal use. This works in the same way as
+ * \ref base64_encode_block_ssse3(), with the two groups of 12 bytes loaded
+ * into separate lanes.
+ *
+ * Reads 28 bytes from the input, although only the first 24 are used.
+ *
+ * @param input The bytes to encode, with at least 28 bytes readable.
+ * @param output A buffer of at least 32 characters to store the result in.
+ */
+__attribute__((target("avx2")))
+static void base64_encode_block_avx2(unsigned char const * input, char * output) {
+	__m256i in;
+	__m256i indices;
+	__m256i offsets;
+
+	in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *)input)), _mm_loadu_si128((__m128i const *)(input + 12)), 1);
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+	indices = _mm256_or_si256(
+		_mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040)),
+		_mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010)));
+
+	// Select the offset for each range: A-Z, a-z, 0-9, + and /
+	offsets = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+	offsets = _mm256_or_si256(offsets, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+	offsets = _mm256_shuffle_epi8(_mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), offsets);
+
+	_mm256_storeu_si256((__m256i *)output, _mm256_add_epi8(indices, offsets));
+}
+#endif
+
+/**
+ * Encodes binary data into a base64 string.
+ *
+ * The output buffer must have space for at least
+ * base64_encode_size(input_size) characters, which includes the null
+ * terminator that's added to the end of the string.
+ *
+ * @param input The binary data to encode.
+ * @param input_size The number of bytes to encode.
+ * @param output A buffer to store the null terminated result in.
+ * @return The length of the encoded string, not including the terminator.
+ */
+size_t base64_encode(unsigned char const * input, size_t input_size, char * output) {
+	size_t pos;
+	size_t written;
+	uint32_t value;
+
+	pos = 0;
+	written = 0;
+
+#ifdef BASE64_SIMD_X86
+	if (__builtin_cpu_supports("avx2")) {
+		while (pos + 28 <= input_size) {
+			base64_encode_block_avx2(input + pos, output + written);
+			pos += 24;
+			written += 32;
+		}
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		while (pos + 16 <= input_size) {
+			base64_encode_block_ssse3(input + pos, output + written);
+			pos += 12;
+			written += 16;
+		}
+	}
+#endif
+
+	while (pos + 3 <= input_size) {
+		value = (input[pos] << 16) | (input[pos + 1] << 8) | input[pos + 2];
+		output[written] = base64_encode_table[(value >> 18) & 0x3f];
+		output[written + 1] = base64_encode_table[(value >> 12) & 0x3f];
+		output[written + 2] = base64_encode_table[(value >> 6) & 0x3f];
+		output[written + 3] = base64_encode_table[value & 0x3f];
+		pos += 3;
+		written += 4;
+	}
+
+	// Any remaining one or two bytes are padded
+	if (pos < input_size) {
+		value = input[pos] << 16;
+		if (pos + 1 < input_size) {
+			value |= input[pos + 1] << 8;
+		}
+		output[written] = base64_encode_table[(value >> 18) & 0x3f];
+		output[written + 1] = base64_encode_table[(value >> 12) & 0x3f];
+		output[written + 2] = (pos + 1 < input_size) ? base64_encode_table[(value >> 6) & 0x3f] : BASE64_PAD;
+		output[written + 3] = BASE64_PAD;
+		written += 4;
+	}
+
+	output[written] = '\0';
+
+	return written;
+}
+
+/**
+ * Decodes a base64 string into binary data, validating it strictly.
+ *
+ * The input length must be a multiple of four and may contain only characters
+ * from the base64 alphabet, with one or two padding characters allowed only
+ * at the very end. Whitespace isn't skipped. Any bits left over in the final
+ * character before the padding must be zero, so that each value has only one
+ * valid encoding.
+ *
+ * On entry output_size should be set to the size of the output buffer. On
+ * exit it's set to the number of bytes written. If the input is invalid, or
+ * the output buffer isn't large enough, the output may be partially written,
+ * and error_pos is set to the position in the input of the first character
+ * that couldn't be decoded. For input that ends part way through a group of
+ * four characters, this is the input size.
+ *
+ * @param input The base64 characters to decode. These don't need to be null
+ *        terminated.
+ * @param input_size The number of characters to decode.
+ * @param output A buffer to store the result in.
+ * @param output_size The size of the output buffer, which is updated to the
+ *        number of bytes written.
+ * @param error_pos Set to the position of the first invalid character if
+ *        decoding fails. May be NULL.
+ * @return true if the input was decoded successfully, false otherwise.
+ */
+bool base64_decode(char const * input, size_t input_size, unsigned char * output, size_t * output_size, size_t * error_pos) {
+	unsigned char const * characters;
+	size_t capacity;
+	size_t pos;
+	size_t written;
+	size_t error;
+	size_t padding;
+	size_t index;
+	uint32_t value;
+	int8_t sextet;
+	bool result;
+
+	characters = (unsigned char const *)input;
+	capacity = *output_size;
+	pos = 0;
+	written = 0;
+	error = 0;
+	result = true;
+
+#ifdef BASE64_SIMD_X86
+	// Blocks containing padding or errors are left for the scalar loop
+	if (__builtin_cpu_supports("avx2")) {
+		while ((pos + 32 <= input_size) && (written + 24 <= capacity) && base64_decode_block_avx2(input + pos, output + written)) {
+			pos += 32;
+			written += 24;
+		}
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		while ((pos + 16 <= input_size) && (written + 12 <= capacity) && base64_decode_block_ssse3(input + pos, output + written)) {
+			pos += 16;
+			written += 12;
+		}
+	}
+#endif
+
+	while (result && (pos < input_size)) {
+		if (pos + 4 > input_size) {
+			// The input ends part way through a group
+			error = input_size;
+			result = false;
+		}
+		else {
+			// Padding is only allowed in the last group
+			padding = 0;
+			if ((pos + 4 == input_size) && (characters[pos + 3] == BASE64_PAD)) {
+				padding = (characters[pos + 2] == BASE64_PAD) ? 2 : 1;
+			}
+
+			value = 0;
+			for (index = 0; result && (index < 4 - padding); ++index) {
+				sextet = base64_decode_table[characters[pos + index]];
+				if (sextet < 0) {
+					error = pos + index;
+					result = false;
+				}
+				value = (value << 6) | (sextet & 0x3f);
+			}
+
+			// Reject non-canonical encodings with unused bits set
+			if (result && ((value & ((1u << (2 * padding)) - 1)) != 0)) {
+				error = pos + 3 - padding;
+				result = false;
+			}
+			value <<= 6 * padding;
+
+			if (result && (written + 3 - padding > capacity)) {
+				error = pos;
+				result = false;
+			}
+
+			if (result) {
+				output[written] = (value >> 16) & 0xff;
+				if (padding < 2) {
+					output[written + 1] = (value >> 8) & 0xff;
+				}
+				if (padding < 1) {
+					output[written + 2] = value & 0xff;
+				}
+				written += 3 - padding;
+				pos += 4;
+			}
+		}
+	}
+
+	*output_size = written;
+	if ((!result) && (error_pos != NULL)) {
+		*error_pos = error;
+	}
+
+	return result;
+}
+
+/**
+ * Returns the buffer size needed to encode a list of keys.
+ *
+ * This is the size needed by \ref base64_encode_key_list(), including the
+ * newline after each key and the null terminator.
+ *
+ * @param key_size The size of each key in bytes.
+ * @param count The number of keys.
+ * @return The buffer size needed to store the encoded list.
+ */
+size_t base64_key_list_size(size_t key_size, size_t count) {
+	// The null terminator of each encoded key is replaced by a newline
+	return (count * base64_encode_size(key_size)) + 1;
+}
+
+/**
+ * Encodes a contiguous array of keys as a newline-separated list of base64
+ * strings.
+ *
+ * Each key is written on its own line, with every line terminated by a
+ * newline. The result is null terminated. The output buffer must be at least
+ * base64_key_list_size(key_size, count) bytes long.
+ *
+ * @param keys The keys to encode, each key_size bytes long, one after the
+ *        other.
+ * @param key_size The size of each key in bytes.
+ * @param count The number of keys to encode.
+ * @param output A buffer to store the result in.
+ * @return The length of the encoded list, not including the terminator.
+ */
+size_t base64_encode_key_list(unsigned char const * keys, size_t key_size, size_t count, char * output) {
+	size_t key;
+	size_t written;
+
+	written = 0;
+	for (key = 0; key < count; ++key) {
+		written += base64_encode(keys + (key * key_size), key_size, output + written);
+		output[written] = '\n';
+		written++;
+	}
+	output[written] = '\0';
+
+	return written;
+}
+
+/**
+ * Decodes a batch of key list lines that all have the expected length.
+ *
+ * For internal use. The complete groups of four characters from each line
+ * are gathered together and decoded in a single call, so that the vector
+ * decoder runs across line boundaries. The final group of each line, which
+ * holds the padding, is then decoded separately.
+ *
+ * Either the whole batch is decoded or nothing is. Lines that aren't exactly
+ * the encoded length of a key followed by a newline end the batch, and if
+ * there are fewer than two lines, or any of them fails to decode, zero is
+ * returned so the caller can decode the lines one at a time and find the
+ * exact position of the error. Padding in the last gathered group decodes to
+ * fewer bytes than expected, so it fails the batch too.
+ *
+ * @param input The list to decode from.
+ * @param input_size The number of characters in the list.
+ * @param key_size The size of each key in bytes.
+ * @param keys A buffer to store the keys in.
+ * @param capacity The maximum number of keys the buffer can hold.
+ * @param consumed Set to the number of characters decoded.
+ * @return The number of keys decoded.
+ */
+static size_t base64_decode_key_batch(char const * input, size_t input_size, size_t key_size, unsigned char * keys, size_t capacity, size_t * consumed) {
+	char characters[BASE64_BATCH_CHARS];
+	unsigned char bytes[(BASE64_BATCH_CHARS / 4) * 3];
+	size_t offsets[BASE64_BATCH_CHARS / 4];
+	size_t encoded;
+	size_t full_chars;
+	size_t full_bytes;
+	size_t lines_max;
+	size_t lines;
+	size_t line;
+	size_t end;
+	size_t pos;
+	size_t size;
+	bool result;
+
+	encoded = base64_encode_size(key_size) - 1;
+	full_chars = (key_size / 3) * 4;
+	full_bytes = (key_size / 3) * 3;
+	lines_max = (full_chars > 0) ? MIN(capacity, BASE64_BATCH_CHARS / full_chars) : 0;
+
+	pos = 0;
+	lines = 0;
+	result = true;
+	while (result && (lines < lines_max)) {
+		end = pos + encoded;
+		if ((end < input_size) && (input[end] == '\r')) {
+			end++;
+		}
+		result = (end < input_size) && (input[end] == '\n');
+		if (result) {
+			offsets[lines] = pos;
+			memcpy(characters + (lines * full_chars), input + pos, full_chars);
+			pos = end + 1;
+			lines++;
+		}
+	}
+
+	result = (lines >= 2);
+	if (result) {
+		size = lines * full_bytes;
+		result = base64_decode(characters, lines * full_chars, bytes, &size, NULL) && (size == lines * full_bytes);
+	}
+
+	for (line = 0; result && (line < lines); ++line) {
+		memcpy(keys + (line * key_size), bytes + (line * full_bytes), full_bytes);
+		if (encoded > full_chars) {
+			size = key_size - full_bytes;
+			result = base64_decode(input + offsets[line] + full_chars, encoded - full_chars, keys + (line * key_size) + full_bytes, &size, NULL) && (size == key_size - full_bytes);
+		}
+	}
+
+	if (!result) {
+		lines = 0;
+		pos = 0;
+	}
+	*consumed = pos;
+
+	return lines;
+}
+
+/**
+ * Decodes a newline-separated list of base64 keys into a contiguous array.
+ *
+ * Each non-empty line must hold exactly one key encoded in base64, decoding
+ * to exactly key_size bytes, as validated by \ref base64_decode(). Lines may
+ * end with either "\n" or "\r\n" and empty lines are skipped, so the list may
+ * or may not end with a newline. Runs of lines holding a single key each are
+ * decoded in batches, to make better use of the vector decoder.
+ *
+ * The keys are written one after the other to the keys buffer, which has
+ * space for capacity keys. Decoding stops at the first invalid line, with
+ * count set to the number of keys successfully decoded before it and
+ * error_pos set to the position in the input of the first character that
+ * couldn't be decoded. For a line that's too short this is the end of the
+ * line, and if there are more keys than will fit in the buffer it's the start
+ * of the first key that doesn't fit.
+ *
+ * @param input The list to decode. This doesn't need to be null terminated.
+ * @param input_size The number of characters in the list.
+ * @param key_size The size of each key in bytes.
+ * @param keys A buffer to store the keys in.
+ * @param capacity The maximum number of keys the buffer can hold.
+ * @param count Set to the number of keys decoded.
+ * @param error_pos Set to the position of the first invalid character if
+ *        decoding fails. May be NULL.
+ * @return true if the whole list was decoded successfully, false otherwise.
+ */
+bool base64_decode_key_list(char const * input, size_t input_size, size_t key_size, unsigned char * keys, size_t capacity, size_t * count, size_t * error_pos) {
+	char const * newline;
+	size_t pos;
+	size_t line_end;
+	size_t next;
+	size_t length;
+	size_t decoded;
+	size_t batch;
+	size_t size;
+	size_t error;
+	bool result;
+
+	pos = 0;
+	decoded = 0;
+	error = 0;
+	result = true;
+
+	while (result && (pos < input_size)) {
+		batch = base64_decode_key_batch(input + pos, input_size - pos, key_size, keys + (decoded * key_size), capacity - decoded, &next);
+		if (batch > 0) {
+			decoded += batch;
+			pos += next;
+		}
+		else {
+			newline = memchr(input + pos, '\n', input_size - pos);
+			if (newline != NULL) {
+				line_end = newline - input;
+				next = line_end + 1;
+			}
+			else {
+				line_end = input_size;
+				next = input_size;
+			}
+
+			length = line_end - pos;
+			if ((length > 0) && (input[line_end - 1] == '\r')) {
+				length--;
+			}
+
+			if (length > 0) {
+				if (decoded >= capacity) {
+					error = pos;
+					result = false;
+				}
+				else {
+					size = key_size;
+					result = base64_decode(input + pos, length, keys + (decoded * key_size), &size, &error);
+					if (!result) {
+						error += pos;
+					}
+					else if (size != key_size) {
+						error = pos + length;
+						result = false;
+					}
+					else {
+						decoded++;
+					}
+				}
+			}
+
+			pos = next;
+		}
+	}
+
+	*count = decoded;
+	if ((!result) && (error_pos != NULL)) {
+		*error_pos = error;
+	}
+
+	return result;
+}
+
+/** @} addtogroup Utils */
+
@@ -0,0 +1,497 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief A persistent beacon store that can be memory mapped
+ * @section DESCRIPTION
+ *
+ * This class provides a versioned on-disk format for captured beacons that
+ * can be memory mapped and used directly, without being deserialised. The
+ * beacons are written from a \ref BeaconStore using
+ * \ref beacon_file_write(), and opened using \ref beacon_file_open().
+ *
+ * The file starts with a header holding the format version, the range of days
+ * covered and an index giving the position of each day's beacons. The beacons
+ * themselves follow as fixed-size \ref BeaconRecord entries, grouped by day
+ * and aligned to a page boundary. Opening a file therefore only reads the
+ * header, irrespective of the number of beacons it contains.
+ *
+ * Each day's records are sorted by RPI and time interval number, so the
+ * matcher can binary search them in the mapping without building an index.
+ *
+ * All integers in the header and index are stored big-endian.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/match_private.h"
+
+#include "contrac/beacon_file.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The bytes identifying a beacon file.
+ */
+#define BEACON_FILE_MAGIC "CTBEACON"
+
+/**
+ * Used internally.
+ *
+ * The size of the fixed part of the header.
+ */
+#define BEACON_FILE_HEADER_SIZE (64)
+
+/**
+ * Used internally.
+ *
+ * The size of each day's entry in the index: day number, record count and
+ * the position of the day's first record.
+ */
+#define BEACON_FILE_INDEX_ENTRY_SIZE (16)
+
+/**
+ * Used internally.
+ *
+ * The alignment of the records when huge pages aren't requested.
+ */
+#define BEACON_FILE_PAGE_SIZE (4096)
+
+/**
+ * Used internally.
+ *
+ * The alignment of the records when huge pages are requested.
+ */
+#define BEACON_FILE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Structures
+
+/**
+ * @brief An opened beacon file
+ *
+ * This is an opaque structure that represents a mapped beacon file. The
+ * header values are decoded when the file is opened; the records are used in
+ * place.
+ *
+ * The structure typedef is in beacon_file.h
+ */
+struct _BeaconFile {
+	unsigned char * base;
+	size_t size;
+
+	uint32_t flags;
+	uint32_t day_count;
+	uint64_t records_offset;
+	uint64_t count;
+	uint32_t first_day;
+	uint32_t last_day;
+};
+
+// Function prototypes
+
+static bool beacon_file_parse(BeaconFile * data);
+static BeaconRecord const * beacon_file_get_entry(BeaconFile const * data, uint32_t entry, uint32_t * day_number, size_t * count);
+
+// Function definitions
+
+/**
+ * Writes the beacons held in a store out to a file.
+ *
+ * The file is written to a uniquely named temporary file alongside the
+ * destination, synced and then renamed into place, so a reader will never
+ * see a partially written file. The directory is then synced so the new file
+ * survives a crash.
+ *
+ * @param store The beacons to write.
+ * @param path The file to write to.
+ * @param flags BEACON_FILE_HUGE_PAGES to align the records for huge pages.
+ * @return true if the file was written successfully, false otherwise.
+ */
+bool beacon_file_write(BeaconStore const * store, char const * path, unsigned int flags) {
+	unsigned char * header;
+	unsigned char * entry;
+	BeaconRecord const * records;
+	BeaconRecord * sorted;
+	size_t count;
+	size_t alignment;
+	size_t records_offset;
+	uint64_t total;
+	uint32_t day_count;
+	uint32_t newest_day;
+	uint32_t first_day;
+	uint32_t span;
+	uint32_t offset;
+	uint32_t day;
+	char * temp_path;
+	FILE * file;
+	bool result;
+
+	// Find the days to write. Counting from the first day avoids overflow
+	// when the newest day is the last representable day
+	day_count = 0;
+	first_day = 0;
+	span = 0;
+	if (beacon_store_get_newest_day(store, &newest_day)) {
+		first_day = newest_day - MIN((uint32_t)beacon_store_get_retention_days(store) - 1, newest_day);
+		span = newest_day - first_day;
+		for (offset = 0; offset <= span; ++offset) {
+			if (beacon_store_get_day(store, first_day + offset, &count) != NULL) {
+				day_count++;
+			}
+		}
+	}
+
+	alignment = (flags & BEACON_FILE_HUGE_PAGES) ? BEACON_FILE_HUGE_PAGE_SIZE : BEACON_FILE_PAGE_SIZE;
+	records_offset = BEACON_FILE_HEADER_SIZE + (day_count * BEACON_FILE_INDEX_ENTRY_SIZE);
+	records_offset = ((records_offset + alignment - 1) / alignment) * alignment;
+
+	// Build the header and index
+	header = calloc(records_offset, 1);
+	entry = header + BEACON_FILE_HEADER_SIZE;
+	total = 0;
+	if (day_count > 0) {
+		for (offset = 0; offset <= span; ++offset) {
+			day = first_day + offset;
+			if (beacon_store_get_day(store, day, &count) != NULL) {
+				if (total == 0) {
+					big_endian_encode_u32(header + 40, day);
+				}
+				big_endian_encode_u32(header + 44, day);
+				big_endian_encode_u32(entry, day);
+				big_endian_encode_u32(entry + 4, (uint32_t)count);
+				big_endian_encode_u64(entry + 8, total);
+				entry += BEACON_FILE_INDEX_ENTRY_SIZE;
+				total += count;
+			}
+		}
+	}
+
+	memcpy(header, BEACON_FILE_MAGIC, 8);
+	big_endian_encode_u32(header + 8, BEACON_FILE_VERSION);
+	big_endian_encode_u32(header + 12, sizeof(BeaconRecord));
+	big_endian_encode_u32(header + 16, day_count);
+	big_endian_encode_u32(header + 20, flags & BEACON_FILE_HUGE_PAGES);
+	big_endian_encode_u64(header + 24, records_offset);
+	big_endian_encode_u64(header + 32, total);
+
+	// Write the file, with each day's records sorted
+	file = file_create_temp(path, &temp_path);
+	result = (file != NULL);
+	if (result) {
+		result = (fwrite(header, records_offset, 1, file) == 1);
+		if (day_count > 0) {
+			for (offset = 0; result && (offset <= span); ++offset) {
+				records = beacon_store_get_day(store, first_day + offset, &count);
+				if (records != NULL) {
+					sorted = malloc(sizeof(BeaconRecord) * count);
+					result = (sorted != NULL);
+					if (result) {
+						memcpy(sorted, records, sizeof(BeaconRecord) * count);
+						qsort(sorted, count, sizeof(BeaconRecord), match_record_compare);
+						result = (fwrite(sorted, sizeof(BeaconRecord), count, file) == count);
+						free(sorted);
+					}
+				}
+			}
+		}
+
+		result = result && (fflush(file) == 0) && (fsync(fileno(file)) == 0);
+		result = (fclose(file) == 0) && result;
+
+		if (result) {
+			result = (rename(temp_path, path) == 0);
+		}
+		if (result) {
+			result = file_sync_directory(path);
+		}
+		else {
+			unlink(temp_path);
+		}
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error writing beacon file: %s\n", path);
+	}
+
+	free(temp_path);
+	free(header);
+
+	return result;
+}
+
+/**
+ * Decodes and validates the header of a mapped file.
+ *
+ * For internal use. Checks that the index and records all lie within the
+ * mapping, so they can be used without further bounds checks.
+ *
+ * @param data The file to parse, with the base and size already set.
+ * @return true if the file is a valid beacon file, false otherwise.
+ */
+static bool beacon_file_parse(BeaconFile * data) {
+	unsigned char const * entry;
+	uint32_t pos;
+	bool result;
+
+	uint64_t first;
+	uint64_t count;
+
+	result = (data->size >= BEACON_FILE_HEADER_SIZE) && (memcmp(data->base, BEACON_FILE_MAGIC, 8) == 0);
+	if (result) {
+		if (big_endian_decode_u32(data->base + 8) != BEACON_FILE_VERSION) {
+			LOG(LOG_ERR, "Unsupported beacon file version\n");
+			result = false;
+		}
+	}
+
+	if (result) {
+		data->day_count = big_endian_decode_u32(data->base + 16);
+		data->flags = big_endian_decode_u32(data->base + 20);
+		data->records_offset = big_endian_decode_u64(data->base + 24);
+		data->count = big_endian_decode_u64(data->base + 32);
+		data->first_day = big_endian_decode_u32(data->base + 40);
+		data->last_day = big_endian_decode_u32(data->base + 44);
+
+		result = (big_endian_decode_u32(data->base + 12) == sizeof(BeaconRecord))
+			&& (data->records_offset >= BEACON_FILE_HEADER_SIZE + ((uint64_t)data->day_count * BEACON_FILE_INDEX_ENTRY_SIZE))
+			&& (data->records_offset <= data->size)
+			&& (data->count <= (data->size - data->records_offset) / sizeof(BeaconRecord));
+	}
+
+	// Written so that a crafted offset can't wrap around
+	entry = data->base + BEACON_FILE_HEADER_SIZE;
+	for (pos = 0; result && (pos < data->day_count); ++pos) {
+		first = big_endian_decode_u64(entry + 8);
+		count = big_endian_decode_u32(entry + 4);
+		result = (first <= data->count) && (count <= data->count - first);
+		entry += BEACON_FILE_INDEX_ENTRY_SIZE;
+	}
+
+	return result;
+}
+
+/**
+ * Opens a beacon file and maps it into memory.
+ *
+ * Only the header is read; the records are paged in as they're used.
+ *
+ * @param path The file to open.
+ * @param flags BEACON_FILE_HUGE_PAGES to request huge pages for the mapping.
+ *        This is a hint that's ignored if huge pages aren't available.
+ * @return The opened file, or NULL if it couldn't be opened or isn't valid.
+ */
+BeaconFile * beacon_file_open(char const * path, unsigned int flags) {
+	BeaconFile * data;
+	struct stat status;
+	void * base;
+	int fd;
+	bool result;
+
+	data = NULL;
+	base = MAP_FAILED;
+
+	fd = open(path, O_RDONLY);
+	result = (fd >= 0) && (fstat(fd, &status) == 0) && (status.st_size > 0);
+
+	if (result) {
+#ifdef MAP_HUGETLB
+		if (flags & BEACON_FILE_HUGE_PAGES) {
+			// Only succeeds for files on a hugetlbfs filesystem
+			base = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED | MAP_HUGETLB, fd, 0);
+		}
+#endif
+		if (base == MAP_FAILED) {
+			base = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		result = (base != MAP_FAILED);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (result) {
+		data = calloc(sizeof(BeaconFile), 1);
+		data->base = base;
+		data->size = status.st_size;
+		result = beacon_file_parse(data);
+	}
+
+	if (result) {
+#ifdef MADV_HUGEPAGE
+		if ((flags & BEACON_FILE_HUGE_PAGES) && (data->flags & BEACON_FILE_HUGE_PAGES)) {
+			madvise(data->base, data->size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+	else {
+		LOG(LOG_ERR, "Error opening beacon file: %s\n", path);
+		beacon_file_close(data);
+		data = NULL;
+	}
+
+	return data;
+}
+
+/**
+ * Unmaps and closes a beacon file.
+ *
+ * Any records returned from the file are no longer valid after this call.
+ *
+ * @param data The instance to free.
+ */
+void beacon_file_close(BeaconFile * data) {
+	if (data) {
+		munmap(data->base, data->size);
+
+		free(data);
+	}
+}
+
+/**
+ * Returns the number of beacons in the file.
+ *
+ * @param data The file to operate on.
+ * @return The total number of beacons across all days.
+ */
+size_t beacon_file_count(BeaconFile const * data) {
+	return data->count;
+}
+
+/**
+ * Returns the number of days in the file's index.
+ *
+ * Only days with beacons are included in the index.
+ *
+ * @param data The file to operate on.
+ * @return The number of days with beacons.
+ */
+size_t beacon_file_get_day_count(BeaconFile const * data) {
+	return data->day_count;
+}
+
+/**
+ * Returns the range of days covered by the file.
+ *
+ * @param data The file to operate on.
+ * @param first_day_number Returns the oldest day with beacons.
+ * @param last_day_number Returns the newest day with beacons.
+ * @return true if the file contains any beacons, false otherwise.
+ */
+bool beacon_file_get_coverage(BeaconFile const * data, uint32_t * first_day_number, uint32_t * last_day_number) {
+	if (data->day_count > 0) {
+		*first_day_number = data->first_day;
+		*last_day_number = data->last_day;
+	}
+
+	return (data->day_count > 0);
+}
+
+/**
+ * Returns the records for an entry in the day index.
+ *
+ * For internal use.
+ *
+ * @param data The file to operate on.
+ * @param entry The position in the index, less than the day count.
+ * @param day_number Returns the day of the entry.
+ * @param count Returns the number of records for the day.
+ * @return The records for the day, within the mapping.
+ */
+static BeaconRecord const * beacon_file_get_entry(BeaconFile const * data, uint32_t entry, uint32_t * day_number, size_t * count) {
+	unsigned char const * index;
+
+	index = data->base + BEACON_FILE_HEADER_SIZE + (entry * BEACON_FILE_INDEX_ENTRY_SIZE);
+	*day_number = big_endian_decode_u32(index);
+	*count = big_endian_decode_u32(index + 4);
+
+	return (BeaconRecord const *)(data->base + data->records_offset) + big_endian_decode_u64(index + 8);
+}
+
+/**
+ * Returns the beacons captured on a given day.
+ *
+ * The records are returned directly from the mapped file and remain valid
+ * until the file is closed. They're sorted by RPI and time interval number.
+ *
+ * @param data The file to operate on.
+ * @param day_number The day to return the beacons for.
+ * @param count Returns the number of records in the array.
+ * @return The beacons for the day, or NULL if there are none.
+ */
+BeaconRecord const * beacon_file_get_day(BeaconFile const * data, uint32_t day_number, size_t * count) {
+	BeaconRecord const * records;
+	uint32_t entry;
+	uint32_t day;
+
+	records = NULL;
+	*count = 0;
+	for (entry = 0; (records == NULL) && (entry < data->day_count); ++entry) {
+		records = beacon_file_get_entry(data, entry, &day, count);
+		if (day != day_number) {
+			records = NULL;
+			*count = 0;
+		}
+	}
+
+	return records;
+}
+
+/**
+ * Returns a list of matches found between the beacons in a file and
+ * diagnoses.
+ *
+ * The records are searched directly in the mapping, with no index built and
+ * nothing copied. Each diagnosis key is only checked against the beacons
+ * captured on its own day, as for \ref match_list_find_matches_store().
+ *
+ * The match list isn't cleared by this call and so any new values will be
+ * appended to it.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons The opened beacon file.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ */
+void match_list_find_matches_file(MatchList * data, BeaconFile const * beacons, DtkList * diagnosis_keys) {
+	MatchSegment * segments;
+	uint32_t entry;
+
+	segments = malloc(sizeof(MatchSegment) * MAX(beacons->day_count, 1));
+	for (entry = 0; entry < beacons->day_count; ++entry) {
+		segments[entry].records = beacon_file_get_entry(beacons, entry, &segments[entry].day_number, &segments[entry].count);
+		segments[entry].sorted = true;
+	}
+
+	match_list_find_matches_segments(data, segments, beacons->day_count, diagnosis_keys);
+
+	free(segments);
+}
+
+/** @} addtogroup Containers*/
+
@@ -0,0 +1,460 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Concurrent ingestion of beacons from multiple producer threads
+ * @section DESCRIPTION
+ *
+ * This class allows several threads to capture beacons into a single
+ * \ref BeaconStore at the same time as it's being matched against.
+ *
+ * Each producer thread has its own lock-free staging queue, so producers never
+ * contend with each other or wait on a lock. The queues are drained into the
+ * store in batches, either by calling \ref beacon_ingest_drain() or by a
+ * background thread started using \ref beacon_ingest_start(). Readers lock
+ * the store for reading, which only ever holds up the drain; producers carry
+ * on filling their queues in the meantime. The matcher only holds the lock
+ * for long enough to take a snapshot of the store, so a long running match
+ * doesn't hold up the drain either.
+ *
+ * If a producer's queue is full the beacon is dropped rather than blocking
+ * the producer, and the drop is counted.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/queue.h"
+
+#include "contrac/beacon_ingest.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The maximum number of beacons moved from a queue into the store while
+ * holding the store lock.
+ */
+#define BEACON_INGEST_BATCH (256)
+
+/**
+ * Used internally.
+ *
+ * How long the background drain thread sleeps for when all of the queues are
+ * empty, in nanoseconds.
+ */
+#define BEACON_INGEST_IDLE_NS (1000000)
+
+/**
+ * Used internally.
+ *
+ * The size of a cache line. Each producer's state is kept on its own cache
+ * line to avoid false sharing between producer threads.
+ */
+#define BEACON_INGEST_CACHE_LINE (64)
+
+// Structures
+
+/**
+ * @brief A beacon waiting in a staging queue
+ */
+typedef struct _BeaconIngestItem {
+	uint32_t day_number;
+	BeaconRecord record;
+} BeaconIngestItem;
+
+/**
+ * @brief The state owned by a single producer thread
+ *
+ * The dropped count is only written by the producer.
+ */
+typedef struct _BeaconIngestProducer {
+	Queue * queue __attribute__ ((aligned (BEACON_INGEST_CACHE_LINE)));
+	uint64_t dropped;
+} BeaconIngestProducer;
+
+/**
+ * @brief The ingestion state
+ *
+ * This is an opaque structure that represents the ingestion state. The store
+ * lock is held for writing while a batch is added to the store, and for
+ * reading while the store is being matched against. The drain lock ensures
+ * only one thread drains the queues at a time, since each queue only supports
+ * a single consumer.
+ *
+ * The structure typedef is in beacon_ingest.h
+ */
+struct _BeaconIngest {
+	BeaconStore * store;
+	size_t producer_count;
+	BeaconIngestProducer * producers;
+
+	pthread_rwlock_t store_lock;
+	pthread_mutex_t drain_lock;
+
+	pthread_t thread;
+	bool running;
+};
+
+// Function prototypes
+
+static void * beacon_ingest_thread(void * user_data);
+
+// Function definitions
+
+/**
+ * Creates a new instance of the class.
+ *
+ * The store remains owned by the caller, but once passed in should only be
+ * accessed through \ref beacon_ingest_lock_store() until the ingestion state
+ * is deleted.
+ *
+ * @param store The store to add the beacons to.
+ * @param producers The number of producer threads, each with its own queue.
+ * @param queue_capacity The capacity of each queue, or zero to use
+ *        BEACON_INGEST_QUEUE_CAPACITY.
+ * @return The newly created object, or NULL if it couldn't be allocated.
+ */
+BeaconIngest * beacon_ingest_new(BeaconStore * store, size_t producers, size_t queue_capacity) {
+	BeaconIngest * data;
+	size_t producer;
+	void * memory;
+	bool result;
+
+	data = calloc(sizeof(BeaconIngest), 1);
+	data->store = store;
+	data->producer_count = MAX(producers, 1);
+	queue_capacity = (queue_capacity > 0) ? queue_capacity : BEACON_INGEST_QUEUE_CAPACITY;
+
+	// Each producer starts on a cache line boundary, so the array must be
+	// allocated on one too
+	result = (posix_memalign(&memory, BEACON_INGEST_CACHE_LINE, sizeof(BeaconIngestProducer) * data->producer_count) == 0);
+	if (result) {
+		data->producers = (BeaconIngestProducer *)memory;
+		memset(data->producers, 0, sizeof(BeaconIngestProducer) * data->producer_count);
+		for (producer = 0; producer < data->producer_count; ++producer) {
+			data->producers[producer].queue = queue_new(sizeof(BeaconIngestItem), queue_capacity);
+			result = result && (data->producers[producer].queue != NULL);
+		}
+	}
+
+	if (result) {
+		pthread_rwlock_init(&data->store_lock, NULL);
+		pthread_mutex_init(&data->drain_lock, NULL);
+	}
+	else {
+		LOG(LOG_ERR, "Error allocating beacon ingestion queues\n");
+		if (data->producers) {
+			for (producer = 0; producer < data->producer_count; ++producer) {
+				queue_delete(data->producers[producer].queue);
+			}
+			free(data->producers);
+		}
+		free(data);
+		data = NULL;
+	}
+
+	return data;
+}
+
+/**
+ * Deletes an instance of the class, freeing up the memory allocated to it.
+ *
+ * Stops the background drain thread if it's running. Any beacons still in
+ * the queues are drained into the store first. The store itself isn't
+ * deleted.
+ *
+ * @param data The instance to free.
+ */
+void beacon_ingest_delete(BeaconIngest * data) {
+	size_t producer;
+
+	if (data) {
+		beacon_ingest_stop(data);
+		beacon_ingest_drain(data);
+
+		for (producer = 0; producer < data->producer_count; ++producer) {
+			queue_delete(data->producers[producer].queue);
+		}
+		free(data->producers);
+
+		pthread_rwlock_destroy(&data->store_lock);
+		pthread_mutex_destroy(&data->drain_lock);
+
+		free(data);
+	}
+}
+
+/**
+ * Adds a captured beacon to a producer's staging queue.
+ *
+ * This never blocks. Each producer index must only be used by a single
+ * thread, but different producers can add beacons concurrently with each
+ * other, with draining and with matching.
+ *
+ * The beacon becomes visible to readers once it's been drained into the
+ * store.
+ *
+ * @param data The ingestion state to add to.
+ * @param producer The index of the calling producer, less than the producer
+ *        count.
+ * @param day_number The day the beacon was captured on.
+ * @param rpi_bytes The RPI value to add, RPI_SIZE bytes in binary format.
+ * @param time_interval_number The time interval number the beacon was
+ *        captured in.
+ * @return true if the beacon was queued, false if the queue was full and the
+ *         beacon was dropped.
+ */
+bool beacon_ingest_add_beacon(BeaconIngest * data, size_t producer, uint32_t day_number, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	BeaconIngestProducer * state;
+	BeaconIngestItem item;
+	bool result;
+
+	state = &data->producers[producer];
+	item.day_number = day_number;
+	memcpy(item.record.rpi, rpi_bytes, RPI_SIZE);
+	item.record.time_interval_number = time_interval_number;
+
+	result = queue_push(state->queue, &item);
+	if (!result) {
+		__atomic_store_n(&state->dropped, state->dropped + 1, __ATOMIC_RELAXED);
+	}
+
+	return result;
+}
+
+/**
+ * Moves the beacons waiting in the staging queues into the store.
+ *
+ * Beacons are taken from each queue in turn, a batch at a time, with the
+ * store locked for writing only while each batch is added. At most one
+ * queue's capacity is taken from each queue, so this returns even if the
+ * producers keep adding beacons.
+ *
+ * Safe to call from any thread, but only one drain runs at a time.
+ *
+ * @param data The ingestion state to drain.
+ * @return The number of beacons moved into the store.
+ */
+size_t beacon_ingest_drain(BeaconIngest * data) {
+	BeaconIngestItem * batch;
+	size_t producer;
+	size_t count;
+	size_t limit;
+	size_t pos;
+	size_t total;
+	bool more;
+
+	batch = malloc(sizeof(BeaconIngestItem) * BEACON_INGEST_BATCH);
+	total = 0;
+
+	pthread_mutex_lock(&data->drain_lock);
+	for (producer = 0; producer < data->producer_count; ++producer) {
+		limit = queue_get_capacity(data->producers[producer].queue);
+		more = true;
+		while (more && (limit > 0)) {
+			count = 0;
+			while (more && (count < MIN(limit, BEACON_INGEST_BATCH))) {
+				more = queue_pop(data->producers[producer].queue, &batch[count]);
+				if (more) {
+					count++;
+				}
+			}
+			limit -= MIN(limit, BEACON_INGEST_BATCH);
+
+			if (count > 0) {
+				pthread_rwlock_wrlock(&data->store_lock);
+				for (pos = 0; pos < count; ++pos) {
+					beacon_store_add_beacon(data->store, batch[pos].day_number, batch[pos].record.rpi, batch[pos].record.time_interval_number);
+				}
+				pthread_rwlock_unlock(&data->store_lock);
+				total += count;
+			}
+		}
+	}
+	pthread_mutex_unlock(&data->drain_lock);
+
+	// Clear the data for security
+	memset(batch, 0, sizeof(BeaconIngestItem) * BEACON_INGEST_BATCH);
+	free(batch);
+
+	return total;
+}
+
+/**
+ * The background drain thread.
+ *
+ * For internal use. Drains the queues continuously until stopped, sleeping
+ * briefly whenever they're all empty.
+ *
+ * @param user_data The BeaconIngest state.
+ * @return NULL.
+ */
+static void * beacon_ingest_thread(void * user_data) {
+	BeaconIngest * data = (BeaconIngest *)user_data;
+	struct timespec idle;
+
+	idle.tv_sec = 0;
+	idle.tv_nsec = BEACON_INGEST_IDLE_NS;
+
+	while (__atomic_load_n(&data->running, __ATOMIC_ACQUIRE)) {
+		if (beacon_ingest_drain(data) == 0) {
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts a background thread that drains the queues into the store.
+ *
+ * @param data The ingestion state to drain.
+ * @return true if the thread is running, false if it couldn't be started.
+ */
+bool beacon_ingest_start(BeaconIngest * data) {
+	bool result;
+
+	result = true;
+	if (!data->running) {
+		__atomic_store_n(&data->running, true, __ATOMIC_RELEASE);
+		result = (pthread_create(&data->thread, NULL, beacon_ingest_thread, data) == 0);
+		if (!result) {
+			__atomic_store_n(&data->running, false, __ATOMIC_RELEASE);
+			LOG(LOG_ERR, "Error starting beacon ingest thread\n");
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Stops the background drain thread, waiting for it to finish.
+ *
+ * Beacons may remain in the queues afterwards; call
+ * \ref beacon_ingest_drain() to move them into the store.
+ *
+ * @param data The ingestion state to operate on.
+ */
+void beacon_ingest_stop(BeaconIngest * data) {
+	if (data->running) {
+		__atomic_store_n(&data->running, false, __ATOMIC_RELEASE);
+		pthread_join(data->thread, NULL);
+	}
+}
+
+/**
+ * Locks the store for reading and returns it.
+ *
+ * While the lock is held the store won't change, but beacons can still be
+ * added to the queues. Multiple readers can hold the lock at once. Must be
+ * followed by a call to \ref beacon_ingest_unlock_store().
+ *
+ * @param data The ingestion state to operate on.
+ * @return The store, which can be read until it's unlocked.
+ */
+BeaconStore const * beacon_ingest_lock_store(BeaconIngest * data) {
+	pthread_rwlock_rdlock(&data->store_lock);
+
+	return data->store;
+}
+
+/**
+ * Releases the read lock taken by \ref beacon_ingest_lock_store().
+ *
+ * @param data The ingestion state to operate on.
+ */
+void beacon_ingest_unlock_store(BeaconIngest * data) {
+	pthread_rwlock_unlock(&data->store_lock);
+}
+
+/**
+ * Returns the number of producers.
+ *
+ * @param data The ingestion state to operate on.
+ * @return The number of producer queues.
+ */
+size_t beacon_ingest_get_producer_count(BeaconIngest const * data) {
+	return data->producer_count;
+}
+
+/**
+ * Returns the number of beacons dropped because a queue was full.
+ *
+ * @param data The ingestion state to operate on.
+ * @return The total number of dropped beacons across all producers.
+ */
+uint64_t beacon_ingest_get_dropped(BeaconIngest const * data) {
+	uint64_t dropped;
+	size_t producer;
+
+	dropped = 0;
+	for (producer = 0; producer < data->producer_count; ++producer) {
+		dropped += __atomic_load_n(&data->producers[producer].dropped, __ATOMIC_RELAXED);
+	}
+
+	return dropped;
+}
+
+/**
+ * Takes a point-in-time snapshot of the ingested beacons.
+ *
+ * The store is only locked for as long as it takes to take the snapshot,
+ * which is O(1) in the number of beacons. Beacons can continue to be added
+ * and drained while the snapshot is in use.
+ *
+ * @param data The ingestion state to operate on.
+ * @return The newly created snapshot, to be freed using
+ *         \ref beacon_snapshot_delete().
+ */
+BeaconSnapshot * beacon_ingest_snapshot(BeaconIngest * data) {
+	BeaconSnapshot * snapshot;
+
+	pthread_rwlock_rdlock(&data->store_lock);
+	snapshot = beacon_store_snapshot(data->store);
+	pthread_rwlock_unlock(&data->store_lock);
+
+	return snapshot;
+}
+
+/**
+ * Returns a list of matches found between the ingested beacons and diagnoses.
+ *
+ * The matches are found against a snapshot of the beacons drained so far, so
+ * beacons can continue to be added and drained while this runs.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons The ingestion state holding the beacons.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ */
+void match_list_find_matches_ingest(MatchList * data, BeaconIngest * beacons, DtkList * diagnosis_keys) {
+	BeaconSnapshot * snapshot;
+
+	snapshot = beacon_ingest_snapshot(beacons);
+	match_list_find_matches_snapshot(data, snapshot, diagnosis_keys);
+	beacon_snapshot_delete(snapshot);
+}
+
+/** @} addtogroup Containers*/
+
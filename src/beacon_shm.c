@@ -0,0 +1,566 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief A beacon store shared between processes
+ * @section DESCRIPTION
+ *
+ * This class provides a beacon store held in a POSIX shared memory object,
+ * so that beacons captured by one process can be matched by another without
+ * being serialised or copied between them.
+ *
+ * A single writer process creates the store using \ref beacon_shm_create()
+ * and adds beacons to it. Any number of reader processes open it using
+ * \ref beacon_shm_open() and match against the live beacons.
+ *
+ * The layout follows that of a \ref BeaconFile: a header, an index with an
+ * entry for each day, and page-aligned \ref BeaconRecord entries. Since the
+ * store is updated in place, each day has a fixed capacity of records and the
+ * index entries are native-endian values updated atomically. Each index entry
+ * also carries a sequence number that changes whenever the day's slot is
+ * reused, which readers use to detect when a day has been expired under
+ * them.
+ *
+ * Beacons are only ever appended to a day, with the record written before
+ * the day's count is increased, so readers can use the records up to the
+ * count without locking. When the retention window moves forwards the writer
+ * reuses the slot of the oldest day, incrementing the sequence number to an
+ * odd value while it does so and to the next even value afterwards.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/match_private.h"
+
+#include "contrac/beacon_shm.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The bytes identifying a shared memory beacon store.
+ */
+#define BEACON_SHM_MAGIC "CTBEASHM"
+
+/**
+ * Used internally.
+ *
+ * The alignment of the records.
+ */
+#define BEACON_SHM_PAGE_SIZE (4096)
+
+/**
+ * Used internally.
+ *
+ * The number of times matching is attempted if days keep being expired while
+ * the matches are found.
+ */
+#define BEACON_SHM_RETRIES (3)
+
+// Structures
+
+/**
+ * @brief The header at the start of the shared memory
+ *
+ * Matches the size and field order of the header of a \ref BeaconFile.
+ */
+typedef struct _BeaconShmHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t day_count;
+	uint32_t flags;
+	uint64_t records_offset;
+	uint64_t day_capacity;
+	uint32_t newest_day;
+	uint32_t populated;
+	unsigned char reserved[16];
+} BeaconShmHeader;
+
+/**
+ * @brief An entry in the day index
+ *
+ * The records for the entry at position n start at record n multiplied by the
+ * day capacity.
+ */
+typedef struct _BeaconShmEntry {
+	uint32_t sequence;
+	uint32_t day_number;
+	uint64_t count;
+} BeaconShmEntry;
+
+/**
+ * @brief A mapped shared memory store
+ *
+ * This is an opaque structure that represents the mapping, from either the
+ * writer's or a reader's side.
+ *
+ * The structure typedef is in beacon_shm.h
+ */
+struct _BeaconShm {
+	unsigned char * base;
+	size_t size;
+	char * name;
+	bool writer;
+
+	BeaconShmHeader * header;
+	BeaconShmEntry * entries;
+	BeaconRecord * records;
+};
+
+// Function prototypes
+
+static void beacon_shm_layout(BeaconShm * data);
+static bool beacon_shm_in_window(BeaconShm const * data, uint32_t day_number);
+static void beacon_shm_reset_entry(BeaconShmEntry * entry, uint32_t day_number);
+
+// Function definitions
+
+/**
+ * Sets up the pointers into the mapping.
+ *
+ * For internal use.
+ *
+ * @param data The mapping, with the base and header already valid.
+ */
+static void beacon_shm_layout(BeaconShm * data) {
+	data->header = (BeaconShmHeader *)data->base;
+	data->entries = (BeaconShmEntry *)(data->base + sizeof(BeaconShmHeader));
+	data->records = (BeaconRecord *)(data->base + data->header->records_offset);
+}
+
+/**
+ * Creates a new shared memory store.
+ *
+ * Any existing shared memory object with the same name is unlinked and a new
+ * one created in its place, so readers that still have the old object mapped
+ * carry on using it undisturbed. The object is removed again when the writer
+ * deletes the store, although readers with it open can carry on using it.
+ *
+ * The permissions are applied irrespective of the umask. To allow readers
+ * running as a different user to match against the store, give them a group
+ * shared with the writer and use a mode such as 0640.
+ *
+ * @param name The name of the shared memory object, starting with a slash.
+ * @param retention_days The number of days to retain beacons for, or zero to
+ *        use BEACON_STORE_RETENTION_DAYS.
+ * @param day_capacity The maximum number of beacons that can be stored for
+ *        each day.
+ * @param mode The permissions to give the shared memory object.
+ * @return The newly created store, or NULL if it couldn't be created.
+ */
+BeaconShm * beacon_shm_create(char const * name, size_t retention_days, size_t day_capacity, mode_t mode) {
+	BeaconShm * data;
+	BeaconShmHeader * header;
+	size_t records_offset;
+	void * base;
+	int fd;
+	bool result;
+
+	data = NULL;
+	retention_days = (retention_days > 0) ? MIN(retention_days, BEACON_STORE_RETENTION_DAYS_MAX) : BEACON_STORE_RETENTION_DAYS;
+	day_capacity = MAX(day_capacity, 1);
+	records_offset = sizeof(BeaconShmHeader) + (sizeof(BeaconShmEntry) * retention_days);
+	records_offset = ((records_offset + BEACON_SHM_PAGE_SIZE - 1) / BEACON_SHM_PAGE_SIZE) * BEACON_SHM_PAGE_SIZE;
+
+	// Truncating an object that's already mapped would pull the memory out
+	// from under its readers, so a fresh object is always created
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+	result = (fd >= 0) && (fchmod(fd, mode) == 0);
+	if (result) {
+		data = calloc(sizeof(BeaconShm), 1);
+		data->size = records_offset + (sizeof(BeaconRecord) * retention_days * day_capacity);
+		result = (ftruncate(fd, data->size) == 0);
+	}
+
+	if (result) {
+		base = mmap(NULL, data->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		result = (base != MAP_FAILED);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (result) {
+		data->base = base;
+		data->name = strdup(name);
+		data->writer = true;
+
+		// The new object is zero filled, so only the header needs setting
+		header = (BeaconShmHeader *)data->base;
+		header->version = BEACON_SHM_VERSION;
+		header->record_size = sizeof(BeaconRecord);
+		header->day_count = retention_days;
+		header->records_offset = records_offset;
+		header->day_capacity = day_capacity;
+		beacon_shm_layout(data);
+
+		// Readers check the magic last
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(header->magic, BEACON_SHM_MAGIC, 8);
+	}
+	else {
+		LOG(LOG_ERR, "Error creating shared memory beacon store: %s\n", name);
+		if (fd >= 0) {
+			shm_unlink(name);
+		}
+		free(data);
+		data = NULL;
+	}
+
+	return data;
+}
+
+/**
+ * Opens an existing shared memory store for reading.
+ *
+ * @param name The name of the shared memory object, as passed to
+ *        \ref beacon_shm_create().
+ * @return The opened store, or NULL if it couldn't be opened or isn't valid.
+ */
+BeaconShm * beacon_shm_open(char const * name) {
+	BeaconShm * data;
+	BeaconShmHeader const * header;
+	struct stat status;
+	void * base;
+	int fd;
+	bool result;
+
+	data = NULL;
+	base = MAP_FAILED;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	result = (fd >= 0) && (fstat(fd, &status) == 0) && (status.st_size >= BEACON_SHM_PAGE_SIZE);
+	if (result) {
+		base = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		result = (base != MAP_FAILED);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (result) {
+		header = (BeaconShmHeader const *)base;
+		result = (memcmp(header->magic, BEACON_SHM_MAGIC, 8) == 0);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		result = result
+			&& (header->version == BEACON_SHM_VERSION)
+			&& (header->record_size == sizeof(BeaconRecord))
+			&& (header->day_count > 0)
+			&& (header->day_count <= BEACON_STORE_RETENTION_DAYS_MAX)
+			&& (header->records_offset >= sizeof(BeaconShmHeader) + (sizeof(BeaconShmEntry) * header->day_count))
+			&& (header->records_offset <= (uint64_t)status.st_size)
+			&& (header->day_capacity <= ((uint64_t)status.st_size - header->records_offset) / (sizeof(BeaconRecord) * header->day_count));
+	}
+
+	if (result) {
+		data = calloc(sizeof(BeaconShm), 1);
+		data->base = base;
+		data->size = status.st_size;
+		beacon_shm_layout(data);
+	}
+	else {
+		LOG(LOG_ERR, "Error opening shared memory beacon store: %s\n", name);
+		if (base != MAP_FAILED) {
+			munmap(base, status.st_size);
+		}
+	}
+
+	return data;
+}
+
+/**
+ * Unmaps the store, freeing up the memory allocated to it.
+ *
+ * If called by the writer, the shared memory object is also removed.
+ *
+ * @param data The instance to free.
+ */
+void beacon_shm_delete(BeaconShm * data) {
+	if (data) {
+		munmap(data->base, data->size);
+		if (data->writer) {
+			shm_unlink(data->name);
+		}
+
+		free(data->name);
+		free(data);
+	}
+}
+
+/**
+ * Checks whether a day falls within the retention window.
+ *
+ * For internal use.
+ *
+ * @param data The store to check against.
+ * @param day_number The day to check.
+ * @return true if beacons for the day can be held in the store.
+ */
+static bool beacon_shm_in_window(BeaconShm const * data, uint32_t day_number) {
+	uint32_t newest_day;
+	bool populated;
+
+	populated = __atomic_load_n(&data->header->populated, __ATOMIC_ACQUIRE);
+	newest_day = __atomic_load_n(&data->header->newest_day, __ATOMIC_ACQUIRE);
+
+	return populated && (day_number <= newest_day) && ((newest_day - day_number) < data->header->day_count);
+}
+
+/**
+ * Empties an index entry so its slot can be reused for a different day.
+ *
+ * For internal use by the writer. The sequence number is odd while the entry
+ * is being changed.
+ *
+ * @param entry The entry to reset.
+ * @param day_number The day the entry will now hold.
+ */
+static void beacon_shm_reset_entry(BeaconShmEntry * entry, uint32_t day_number) {
+	uint32_t sequence;
+
+	sequence = entry->sequence;
+	__atomic_store_n(&entry->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&entry->count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->day_number, day_number, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds a captured beacon to the store.
+ *
+ * Must only be called by the writer. The retention window moves forwards in
+ * the same way as for \ref beacon_store_add_beacon().
+ *
+ * @param data The store to add to.
+ * @param day_number The day the beacon was captured on.
+ * @param rpi_bytes The RPI value to add, RPI_SIZE bytes in binary format.
+ * @param time_interval_number The time interval number the beacon was
+ *        captured in.
+ * @return true if the beacon was added, false if it was too old or the day
+ *         is full.
+ */
+bool beacon_shm_add_beacon(BeaconShm * data, uint32_t day_number, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	BeaconShmHeader * header;
+	BeaconShmEntry * entry;
+	BeaconRecord * record;
+	size_t steps;
+	size_t step;
+	uint32_t day;
+	bool result;
+
+	header = data->header;
+	result = data->writer;
+
+	if (result && !header->populated) {
+		__atomic_store_n(&header->newest_day, day_number, __ATOMIC_RELEASE);
+		__atomic_store_n(&header->populated, 1, __ATOMIC_RELEASE);
+	}
+	else if (result && (day_number > header->newest_day)) {
+		// Counting back from the new day avoids overflow at the end of the
+		// range
+		steps = MIN(day_number - header->newest_day, header->day_count);
+		for (step = 0; step < steps; ++step) {
+			day = day_number - step;
+			beacon_shm_reset_entry(&data->entries[day % header->day_count], day);
+		}
+		__atomic_store_n(&header->newest_day, day_number, __ATOMIC_RELEASE);
+	}
+
+	result = result && beacon_shm_in_window(data, day_number);
+	if (result) {
+		entry = &data->entries[day_number % header->day_count];
+		if (entry->day_number != day_number) {
+			beacon_shm_reset_entry(entry, day_number);
+		}
+
+		result = (entry->count < header->day_capacity);
+		if (result) {
+			record = &data->records[((day_number % header->day_count) * header->day_capacity) + entry->count];
+			memcpy(record->rpi, rpi_bytes, RPI_SIZE);
+			record->time_interval_number = time_interval_number;
+			__atomic_store_n(&entry->count, entry->count + 1, __ATOMIC_RELEASE);
+		}
+		else {
+			LOG(LOG_WARNING, "Shared memory beacon store is full for day %u\n", day_number);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Returns the number of beacons in the store.
+ *
+ * @param data The store to operate on.
+ * @return The total number of beacons across all retained days.
+ */
+size_t beacon_shm_count(BeaconShm const * data) {
+	BeaconShmEntry const * entry;
+	size_t count;
+	size_t slot;
+
+	count = 0;
+	for (slot = 0; slot < data->header->day_count; ++slot) {
+		entry = &data->entries[slot];
+		if (beacon_shm_in_window(data, __atomic_load_n(&entry->day_number, __ATOMIC_RELAXED))) {
+			count += __atomic_load_n(&entry->count, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Returns the maximum number of beacons that can be stored for each day.
+ *
+ * @param data The store to operate on.
+ * @return The capacity of each day.
+ */
+size_t beacon_shm_get_day_capacity(BeaconShm const * data) {
+	return data->header->day_capacity;
+}
+
+/**
+ * Returns the beacons captured on a given day.
+ *
+ * The records are returned directly from the shared memory. The writer may
+ * append more beacons to the day afterwards, but the records returned won't
+ * change until the day falls out of the retention window.
+ *
+ * @param data The store to operate on.
+ * @param day_number The day to return the beacons for.
+ * @param count Returns the number of records in the array.
+ * @return The beacons for the day, or NULL if there are none.
+ */
+BeaconRecord const * beacon_shm_get_day(BeaconShm const * data, uint32_t day_number, size_t * count) {
+	BeaconShmEntry const * entry;
+	BeaconRecord const * records;
+	uint32_t sequence;
+
+	records = NULL;
+	*count = 0;
+	if (beacon_shm_in_window(data, day_number)) {
+		entry = &data->entries[day_number % data->header->day_count];
+		sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+		if (((sequence & 1) == 0) && (__atomic_load_n(&entry->day_number, __ATOMIC_RELAXED) == day_number)) {
+			*count = __atomic_load_n(&entry->count, __ATOMIC_ACQUIRE);
+			records = (*count > 0) ? &data->records[(day_number % data->header->day_count) * data->header->day_capacity] : NULL;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != sequence) {
+			records = NULL;
+			*count = 0;
+		}
+	}
+
+	return records;
+}
+
+/**
+ * Returns a list of matches found between the shared beacons and diagnoses.
+ *
+ * The beacons are used directly from the shared memory while the writer
+ * continues to add more. Each diagnosis key is only checked against the
+ * beacons captured on its own day, as for \ref match_list_find_matches_store().
+ *
+ * If a day is expired by the writer while its beacons are being checked, the
+ * matches are discarded and found again. If this keeps happening, no matches
+ * are added and false is returned.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons The opened shared memory store.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ * @return true if the matches were found from a consistent view of the
+ *         beacons, false otherwise.
+ */
+bool match_list_find_matches_shm(MatchList * data, BeaconShm const * beacons, DtkList * diagnosis_keys) {
+	MatchSegment segments[BEACON_STORE_RETENTION_DAYS_MAX];
+	uint32_t sequences[BEACON_STORE_RETENTION_DAYS_MAX];
+	BeaconShmEntry const * entry;
+	MatchList * found;
+	MatchListItem const * match;
+	size_t day_count;
+	size_t count;
+	size_t slot;
+	int attempt;
+	bool consistent;
+
+	consistent = false;
+	day_count = beacons->header->day_count;
+	for (attempt = 0; (!consistent) && (attempt < BEACON_SHM_RETRIES); ++attempt) {
+		// Take a view of the days currently held
+		consistent = true;
+		count = 0;
+		for (slot = 0; slot < day_count; ++slot) {
+			entry = &beacons->entries[slot];
+			sequences[slot] = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+			consistent = consistent && ((sequences[slot] & 1) == 0);
+			segments[count].day_number = __atomic_load_n(&entry->day_number, __ATOMIC_RELAXED);
+			segments[count].count = __atomic_load_n(&entry->count, __ATOMIC_ACQUIRE);
+			segments[count].records = &beacons->records[slot * beacons->header->day_capacity];
+			segments[count].sorted = false;
+			if ((segments[count].count > 0) && beacon_shm_in_window(beacons, segments[count].day_number)) {
+				count++;
+			}
+		}
+
+		found = match_list_new();
+		match_list_copy_rpi_settings(found, data);
+		if (consistent) {
+			match_list_find_matches_segments(found, segments, count, diagnosis_keys);
+
+			// Check no day was expired while its beacons were being used
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			for (slot = 0; consistent && (slot < day_count); ++slot) {
+				consistent = (__atomic_load_n(&beacons->entries[slot].sequence, __ATOMIC_RELAXED) == sequences[slot]);
+			}
+		}
+
+		if (consistent) {
+			match = match_list_first(found);
+			while (match != NULL) {
+				match_list_append_beacon_match(data, NULL, match_list_get_day_number(match), match_list_get_time_interval_number(match), match_list_get_variant(match), NULL);
+				match = match_list_next(match);
+			}
+		}
+		match_list_delete(found);
+	}
+
+	if (!consistent) {
+		LOG(LOG_WARNING, "Shared memory beacon store changed during matching\n");
+	}
+
+	return consistent;
+}
+
+/** @} addtogroup Containers*/
+
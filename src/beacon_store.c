@@ -0,0 +1,623 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Stores captured beacons for a retention window of days
+ * @section DESCRIPTION
+ *
+ * This class stores captured beacons partitioned by the day they were
+ * captured on. Each day is held as a contiguous segment of fixed-size records
+ * in a ring, with one slot for each day of the retention window. When a
+ * beacon is added for a new day, the segments for any days that have fallen
+ * out of the window are reused, so expiring a day is O(1) rather than
+ * requiring the whole store to be rebuilt.
+ *
+ * The \ref match_list_find_matches_store() function only checks each
+ * diagnosis key against the segment for the day it was captured on, which
+ * avoids generating RPIs for days with no beacons. Unlike matching against an
+ * \ref RpiList, a beacon recorded under the wrong day, for example because the
+ * capturing device's clock was skewed around midnight, won't be matched.
+ *
+ * A point-in-time snapshot of the store can be taken using
+ * \ref beacon_store_snapshot(). The records for each day are held in a
+ * reference counted buffer that's only ever appended to, and a snapshot just
+ * takes a reference to each day's buffer along with its current length. New
+ * beacons are appended beyond the end seen by the snapshot. If a shared
+ * buffer needs to grow, or a shared segment is expired, the store moves on to
+ * a new buffer and leaves the old one to the snapshot. Taking a snapshot is
+ * therefore O(1) in the number of beacons and never copies the beacon data.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/match_private.h"
+
+#include "contrac/beacon_store.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The initial number of records allocated for a day's segment.
+ */
+#define BEACON_STORE_SEGMENT_INITIAL (64)
+
+// Structures
+
+/**
+ * @brief A reference counted buffer of records
+ *
+ * Records are only ever appended to a buffer, so a holder of a reference can
+ * safely read the records that existed when it took the reference while more
+ * are added.
+ */
+typedef struct _BeaconStoreBuffer {
+	size_t references;
+	size_t allocated;
+	BeaconRecord records[];
+} BeaconStoreBuffer;
+
+/**
+ * @brief The beacons captured on a single day
+ *
+ * The records are held contiguously. A segment is only valid for the day
+ * stored in it; once the day falls out of the retention window the segment is
+ * reused, keeping its buffer if no snapshot refers to it.
+ */
+typedef struct _BeaconStoreSegment {
+	uint32_t day_number;
+	size_t count;
+	BeaconStoreBuffer * buffer;
+	uint32_t interval_counts[UINT8_MAX + 1];
+} BeaconStoreSegment;
+
+/**
+ * @brief A store of captured beacons
+ *
+ * This is an opaque structure that represents the store. The segment for a
+ * day is held in the slot given by the day number modulo the retention
+ * period.
+ *
+ * The structure typedef is in beacon_store.h
+ */
+struct _BeaconStore {
+	size_t retention_days;
+	BeaconStoreSegment * segments;
+
+	bool populated;
+	uint32_t newest_day;
+	size_t count;
+
+	size_t interval_limit;
+	size_t day_limit;
+	uint64_t rejected;
+};
+
+/**
+ * @brief A point-in-time snapshot of a store
+ *
+ * This is an opaque structure that holds a reference to the buffer of each
+ * day that had beacons when the snapshot was taken.
+ *
+ * The structure typedef is in beacon_store.h
+ */
+struct _BeaconSnapshot {
+	size_t day_count;
+	size_t count;
+	uint32_t day_numbers[BEACON_STORE_RETENTION_DAYS_MAX];
+	size_t counts[BEACON_STORE_RETENTION_DAYS_MAX];
+	BeaconStoreBuffer * buffers[BEACON_STORE_RETENTION_DAYS_MAX];
+};
+
+// Function prototypes
+
+static void beacon_store_buffer_release(BeaconStoreBuffer * buffer);
+static void beacon_store_reset_segment(BeaconStore * data, BeaconStoreSegment * segment, uint32_t day_number);
+static bool beacon_store_in_window(BeaconStore const * data, uint32_t day_number);
+
+// Function definitions
+
+/**
+ * Creates a new instance of the class.
+ *
+ * @param retention_days The number of days to retain beacons for, or zero to
+ *        use BEACON_STORE_RETENTION_DAYS. At most
+ *        BEACON_STORE_RETENTION_DAYS_MAX.
+ * @return The newly created object.
+ */
+BeaconStore * beacon_store_new(size_t retention_days) {
+	BeaconStore * data;
+
+	data = calloc(sizeof(BeaconStore), 1);
+	data->retention_days = (retention_days > 0) ? MIN(retention_days, BEACON_STORE_RETENTION_DAYS_MAX) : BEACON_STORE_RETENTION_DAYS;
+	data->segments = calloc(sizeof(BeaconStoreSegment), data->retention_days);
+
+	return data;
+}
+
+/**
+ * Deletes an instance of the class, freeing up the memory allocated to it.
+ *
+ * @param data The instance to free.
+ */
+void beacon_store_delete(BeaconStore * data) {
+	size_t slot;
+
+	if (data) {
+		for (slot = 0; slot < data->retention_days; ++slot) {
+			beacon_store_buffer_release(data->segments[slot].buffer);
+		}
+		free(data->segments);
+
+		free(data);
+	}
+}
+
+/**
+ * Drops a reference to a buffer, freeing it once no references remain.
+ *
+ * For internal use. Safe to call from any thread.
+ *
+ * @param buffer The buffer to release, or NULL.
+ */
+static void beacon_store_buffer_release(BeaconStoreBuffer * buffer) {
+	if (buffer) {
+		if (__atomic_sub_fetch(&buffer->references, 1, __ATOMIC_ACQ_REL) == 0) {
+			free(buffer);
+		}
+	}
+}
+
+/**
+ * Empties a segment so it can be reused for a different day.
+ *
+ * For internal use. The buffer is retained unless a snapshot still refers to
+ * it, in which case it's left to the snapshot.
+ *
+ * @param data The store the segment belongs to.
+ * @param segment The segment to reset.
+ * @param day_number The day the segment will now hold.
+ */
+static void beacon_store_reset_segment(BeaconStore * data, BeaconStoreSegment * segment, uint32_t day_number) {
+	if ((segment->buffer != NULL) && (__atomic_load_n(&segment->buffer->references, __ATOMIC_ACQUIRE) > 1)) {
+		beacon_store_buffer_release(segment->buffer);
+		segment->buffer = NULL;
+	}
+	data->count -= segment->count;
+	segment->count = 0;
+	segment->day_number = day_number;
+	memset(segment->interval_counts, 0, sizeof(segment->interval_counts));
+}
+
+/**
+ * Checks whether a day falls within the retention window.
+ *
+ * For internal use.
+ *
+ * @param data The store to check against.
+ * @param day_number The day to check.
+ * @return true if beacons for the day can be held in the store.
+ */
+static bool beacon_store_in_window(BeaconStore const * data, uint32_t day_number) {
+	return data->populated && (day_number <= data->newest_day) && ((data->newest_day - day_number) < data->retention_days);
+}
+
+/**
+ * Adds a captured beacon to the store.
+ *
+ * If the day is newer than any seen before, the retention window moves
+ * forwards and the segments for any days that fall out of it are emptied.
+ * Beacons for days that have already fallen out of the window are rejected.
+ *
+ * Beacons are also rejected once the day or its time interval has reached
+ * the limits set using \ref beacon_store_set_limits(). The records are shared
+ * with snapshots, so existing beacons are never evicted to make room.
+ *
+ * The rpi_bytes buffer passed in must contain exactly RPI_SIZE (16) bytes of
+ * data.
+ *
+ * @param data The store to add to.
+ * @param day_number The day the beacon was captured on.
+ * @param rpi_bytes The RPI value to add, in binary format.
+ * @param time_interval_number The time interval number the beacon was
+ *        captured in.
+ * @return true if the beacon was added, false if it was too old or over a
+ *         limit.
+ */
+bool beacon_store_add_beacon(BeaconStore * data, uint32_t day_number, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	BeaconStoreSegment * segment;
+	BeaconStoreBuffer * buffer;
+	BeaconRecord * record;
+	size_t allocated;
+	size_t steps;
+	size_t step;
+	uint32_t day;
+	bool result;
+
+	segment = NULL;
+	if (!data->populated) {
+		data->populated = true;
+		data->newest_day = day_number;
+	}
+	else if (day_number > data->newest_day) {
+		// Each day the window moves forwards expires one segment. Counting
+		// back from the new day avoids overflow at the end of the range
+		steps = MIN(day_number - data->newest_day, data->retention_days);
+		for (step = 0; step < steps; ++step) {
+			day = day_number - step;
+			beacon_store_reset_segment(data, &data->segments[day % data->retention_days], day);
+		}
+		data->newest_day = day_number;
+	}
+
+	result = beacon_store_in_window(data, day_number);
+	if (result) {
+		segment = &data->segments[day_number % data->retention_days];
+		if (segment->day_number != day_number) {
+			beacon_store_reset_segment(data, segment, day_number);
+		}
+
+		result = ((data->day_limit == 0) || (segment->count < data->day_limit))
+			&& ((data->interval_limit == 0) || (segment->interval_counts[time_interval_number] < data->interval_limit));
+		if (!result) {
+			data->rejected++;
+			LOG(LOG_DEBUG, "Beacon store limit reached for day %u interval %u\n", day_number, time_interval_number);
+		}
+	}
+	else {
+		LOG(LOG_DEBUG, "Beacon from day %u is outside the retention window\n", day_number);
+	}
+
+	if (result) {
+		if ((segment->buffer == NULL) || (segment->count >= segment->buffer->allocated)) {
+			// Move to a larger buffer, leaving the old one to any snapshots
+			allocated = (segment->buffer == NULL) ? BEACON_STORE_SEGMENT_INITIAL : (segment->buffer->allocated * 2);
+			buffer = malloc(sizeof(BeaconStoreBuffer) + (sizeof(BeaconRecord) * allocated));
+			buffer->references = 1;
+			buffer->allocated = allocated;
+			if (segment->count > 0) {
+				memcpy(buffer->records, segment->buffer->records, sizeof(BeaconRecord) * segment->count);
+			}
+			beacon_store_buffer_release(segment->buffer);
+			segment->buffer = buffer;
+		}
+
+		record = &segment->buffer->records[segment->count];
+		memcpy(record->rpi, rpi_bytes, RPI_SIZE);
+		record->time_interval_number = time_interval_number;
+		segment->count++;
+		segment->interval_counts[time_interval_number]++;
+		data->count++;
+	}
+
+	return result;
+}
+
+/**
+ * Adds all of the beacons in a list to the store.
+ *
+ * @param data The store to add to.
+ * @param day_number The day the beacons were captured on.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ * @return true if all of the beacons were added, false if the day was too
+ *         old or some beacons were over a limit.
+ */
+bool beacon_store_add_list(BeaconStore * data, uint32_t day_number, RpiList const * beacons) {
+	RpiListItem const * rpi_item;
+	Rpi const * rpi;
+	bool result;
+
+	result = true;
+	rpi_item = rpi_list_first(beacons);
+	while (rpi_item != NULL) {
+		rpi = rpi_list_get_rpi(rpi_item);
+		result = beacon_store_add_beacon(data, day_number, rpi_get_proximity_id(rpi), rpi_get_time_interval_number(rpi)) && result;
+		rpi_item = rpi_list_next(rpi_item);
+	}
+
+	return result;
+}
+
+/**
+ * Removes the beacons for all days before the given day.
+ *
+ * Unlike the automatic expiry as the window moves forwards, this releases the
+ * memory held by the expired segments, once no snapshot refers to it. The
+ * buffers kept by empty segments for reuse are also released.
+ *
+ * @param data The store to operate on.
+ * @param oldest_day_number The oldest day to retain.
+ */
+void beacon_store_expire(BeaconStore * data, uint32_t oldest_day_number) {
+	BeaconStoreSegment * segment;
+	size_t slot;
+
+	for (slot = 0; slot < data->retention_days; ++slot) {
+		segment = &data->segments[slot];
+		if ((segment->day_number < oldest_day_number) || (segment->count == 0)) {
+			beacon_store_reset_segment(data, segment, segment->day_number);
+			beacon_store_buffer_release(segment->buffer);
+			segment->buffer = NULL;
+		}
+	}
+}
+
+/**
+ * Sets limits on the number of beacons stored for each day.
+ *
+ * Limiting the number of beacons bounds both the memory used and the time
+ * taken to match against them, however many beacons are broadcast nearby.
+ * Lowering the limits doesn't remove any beacons already in the store.
+ *
+ * @param data The store to operate on.
+ * @param interval_limit The maximum number of beacons for each time interval
+ *        of a day, or zero for no limit.
+ * @param day_limit The maximum number of beacons for each day, or zero for no
+ *        limit.
+ */
+void beacon_store_set_limits(BeaconStore * data, size_t interval_limit, size_t day_limit) {
+	data->interval_limit = interval_limit;
+	data->day_limit = day_limit;
+}
+
+/**
+ * Returns the number of beacons rejected because of the store's limits.
+ *
+ * Beacons rejected for falling outside the retention window aren't counted.
+ *
+ * @param data The store to operate on.
+ * @return The number of beacons that weren't added.
+ */
+uint64_t beacon_store_get_rejected(BeaconStore const * data) {
+	return data->rejected;
+}
+
+/**
+ * Returns the number of days beacons are retained for.
+ *
+ * @param data The store to operate on.
+ * @return The length of the retention window in days.
+ */
+size_t beacon_store_get_retention_days(BeaconStore const * data) {
+	return data->retention_days;
+}
+
+/**
+ * Returns the newest day beacons have been added for.
+ *
+ * The retention window ends on this day.
+ *
+ * @param data The store to operate on.
+ * @param day_number Returns the newest day number.
+ * @return true if any beacons have been added, false otherwise.
+ */
+bool beacon_store_get_newest_day(BeaconStore const * data, uint32_t * day_number) {
+	if (data->populated) {
+		*day_number = data->newest_day;
+	}
+
+	return data->populated;
+}
+
+/**
+ * Returns the number of beacons in the store.
+ *
+ * @param data The store to operate on.
+ * @return The total number of beacons across all retained days.
+ */
+size_t beacon_store_count(BeaconStore const * data) {
+	return data->count;
+}
+
+/**
+ * Returns the beacons captured on a given day.
+ *
+ * The records are returned as a contiguous array that remains owned by the
+ * store. It's only valid until the next beacon is added or days are expired.
+ *
+ * @param data The store to operate on.
+ * @param day_number The day to return the beacons for.
+ * @param count Returns the number of records in the array.
+ * @return The beacons for the day, or NULL if there are none.
+ */
+BeaconRecord const * beacon_store_get_day(BeaconStore const * data, uint32_t day_number, size_t * count) {
+	BeaconStoreSegment const * segment;
+	BeaconRecord const * records;
+
+	records = NULL;
+	*count = 0;
+	if (beacon_store_in_window(data, day_number)) {
+		segment = &data->segments[day_number % data->retention_days];
+		if ((segment->day_number == day_number) && (segment->count > 0)) {
+			records = segment->buffer->records;
+			*count = segment->count;
+		}
+	}
+
+	return records;
+}
+
+/**
+ * Returns a list of matches found between the stored beacons and diagnoses.
+ *
+ * Each diagnosis key is only checked against the beacons captured on its own
+ * day. Keys for days with no stored beacons are skipped without generating
+ * any RPIs. As with an \ref RpiList, each RPI produces a single match for its
+ * time interval, however many times it was captured.
+ *
+ * This can give different results to \ref match_list_find_matches(), which
+ * checks every key against every beacon regardless of day. A beacon stored
+ * under a neighbouring day, for example because it was captured just after
+ * midnight by a device whose clock was running fast, matches there but not
+ * here. Callers that need to tolerate clock skew should match an
+ * \ref RpiList instead.
+ *
+ * Keys are processed in download order; the order and memory budget set on
+ * the match list are ignored. The match list isn't cleared by this call and
+ * so any new values will be appended to it.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons The store of beacons to check.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ */
+void match_list_find_matches_store(MatchList * data, BeaconStore const * beacons, DtkList * diagnosis_keys) {
+	MatchSegment * segments;
+	BeaconStoreSegment const * segment;
+	size_t count;
+	size_t slot;
+
+	segments = malloc(sizeof(MatchSegment) * beacons->retention_days);
+	count = 0;
+	for (slot = 0; slot < beacons->retention_days; ++slot) {
+		segment = &beacons->segments[slot];
+		if ((segment->count > 0) && beacon_store_in_window(beacons, segment->day_number)) {
+			segments[count].day_number = segment->day_number;
+			segments[count].records = segment->buffer->records;
+			segments[count].count = segment->count;
+			segments[count].sorted = false;
+			count++;
+		}
+	}
+
+	match_list_find_matches_segments(data, segments, count, diagnosis_keys);
+
+	free(segments);
+}
+
+/**
+ * Takes a point-in-time snapshot of the store.
+ *
+ * The snapshot holds references to the beacon data rather than copying it,
+ * so this is O(1) in the number of beacons. It's unaffected by any beacons
+ * subsequently added to or expired from the store, and remains valid after
+ * the store is deleted.
+ *
+ * The store mustn't be modified while the snapshot is being taken, but once
+ * taken the snapshot can be read from a different thread to the one
+ * modifying the store.
+ *
+ * @param data The store to take a snapshot of.
+ * @return The newly created snapshot, to be freed using
+ *         \ref beacon_snapshot_delete().
+ */
+BeaconSnapshot * beacon_store_snapshot(BeaconStore const * data) {
+	BeaconSnapshot * snapshot;
+	BeaconStoreSegment const * segment;
+	size_t slot;
+
+	snapshot = calloc(sizeof(BeaconSnapshot), 1);
+	for (slot = 0; slot < data->retention_days; ++slot) {
+		segment = &data->segments[slot];
+		if ((segment->count > 0) && beacon_store_in_window(data, segment->day_number)) {
+			__atomic_add_fetch(&segment->buffer->references, 1, __ATOMIC_ACQ_REL);
+			snapshot->day_numbers[snapshot->day_count] = segment->day_number;
+			snapshot->counts[snapshot->day_count] = segment->count;
+			snapshot->buffers[snapshot->day_count] = segment->buffer;
+			snapshot->count += segment->count;
+			snapshot->day_count++;
+		}
+	}
+
+	return snapshot;
+}
+
+/**
+ * Deletes a snapshot, releasing its references to the beacon data.
+ *
+ * @param data The instance to free.
+ */
+void beacon_snapshot_delete(BeaconSnapshot * data) {
+	size_t day;
+
+	if (data) {
+		for (day = 0; day < data->day_count; ++day) {
+			beacon_store_buffer_release(data->buffers[day]);
+		}
+
+		free(data);
+	}
+}
+
+/**
+ * Returns the number of beacons in the snapshot.
+ *
+ * @param data The snapshot to operate on.
+ * @return The total number of beacons across all days.
+ */
+size_t beacon_snapshot_count(BeaconSnapshot const * data) {
+	return data->count;
+}
+
+/**
+ * Returns the beacons in the snapshot captured on a given day.
+ *
+ * The records remain valid until the snapshot is deleted.
+ *
+ * @param data The snapshot to operate on.
+ * @param day_number The day to return the beacons for.
+ * @param count Returns the number of records in the array.
+ * @return The beacons for the day, or NULL if there are none.
+ */
+BeaconRecord const * beacon_snapshot_get_day(BeaconSnapshot const * data, uint32_t day_number, size_t * count) {
+	BeaconRecord const * records;
+	size_t day;
+
+	records = NULL;
+	*count = 0;
+	for (day = 0; (records == NULL) && (day < data->day_count); ++day) {
+		if (data->day_numbers[day] == day_number) {
+			records = data->buffers[day]->records;
+			*count = data->counts[day];
+		}
+	}
+
+	return records;
+}
+
+/**
+ * Returns a list of matches found between the beacons in a snapshot and
+ * diagnoses.
+ *
+ * Behaves as \ref match_list_find_matches_store(), but can run while beacons
+ * continue to be added to the store the snapshot was taken from.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons The snapshot of beacons to check.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ */
+void match_list_find_matches_snapshot(MatchList * data, BeaconSnapshot const * beacons, DtkList * diagnosis_keys) {
+	MatchSegment segments[BEACON_STORE_RETENTION_DAYS_MAX];
+	size_t day;
+
+	for (day = 0; day < beacons->day_count; ++day) {
+		segments[day].day_number = beacons->day_numbers[day];
+		segments[day].records = beacons->buffers[day]->records;
+		segments[day].count = beacons->counts[day];
+		segments[day].sorted = false;
+	}
+
+	match_list_find_matches_segments(data, segments, beacons->day_count, diagnosis_keys);
+}
+
+/** @} addtogroup Containers*/
+
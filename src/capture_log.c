@@ -0,0 +1,469 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief A crash-safe append-only log of captured beacons
+ * @section DESCRIPTION
+ *
+ * This class provides a durable write path for captured beacons. Each
+ * sighting is appended to the log as a fixed-size record protected by a
+ * CRC-32 checksum.
+ *
+ * Records are collected in memory and written out in batches, with a single
+ * fsync for each batch (group commit). The batch size controls the trade-off
+ * between throughput and durability: on power loss at most one batch of
+ * sightings is lost.
+ *
+ * When a log is opened, its records are replayed sequentially into an
+ * \ref RpiList, a \ref BeaconStore or both, to rebuild the in-memory state.
+ * Replay stops at the first torn or corrupted record, and the log is
+ * truncated at that point so new records follow on from the last good one.
+ *
+ * The log starts with a 16 byte header: the identifier "CTCAPLOG" followed by
+ * the format version and record size. Each record then holds the day number,
+ * the RPI, the time interval number, the signal strength and the time the
+ * beacon was seen, followed by the CRC-32 of these fields. All integers are
+ * stored big-endian.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/rpi.h"
+
+#include "contrac/capture_log.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The bytes identifying a capture log.
+ */
+#define CAPTURE_LOG_MAGIC "CTCAPLOG"
+
+/**
+ * Used internally.
+ *
+ * The version of the log format.
+ */
+#define CAPTURE_LOG_VERSION (1)
+
+/**
+ * Used internally.
+ *
+ * The size of the header at the start of the log.
+ */
+#define CAPTURE_LOG_HEADER_SIZE (16)
+
+/**
+ * Used internally.
+ *
+ * The size of the checksummed fields of a record: day number, RPI, time
+ * interval number, signal strength and time seen.
+ */
+#define CAPTURE_LOG_PAYLOAD_SIZE (4 + RPI_SIZE + 1 + 1 + 8)
+
+/**
+ * Used internally.
+ *
+ * The size of a record, including its checksum.
+ */
+#define CAPTURE_LOG_RECORD_SIZE (CAPTURE_LOG_PAYLOAD_SIZE + 4)
+
+/**
+ * Used internally.
+ *
+ * The number of records read at a time during replay.
+ */
+#define CAPTURE_LOG_REPLAY_RECORDS (4096)
+
+// Structures
+
+/**
+ * @brief An opened capture log
+ *
+ * This is an opaque structure that represents the log. Appended records are
+ * held in the buffer until a full batch has been collected. The committed
+ * offset marks the end of the last batch that was durably written, so a
+ * failed write can be rolled back to it.
+ *
+ * The structure typedef is in capture_log.h
+ */
+struct _CaptureLog {
+	int fd;
+	unsigned char * buffer;
+	size_t pending;
+	size_t sync_batch;
+	size_t recovered;
+	off_t committed;
+	bool failed;
+};
+
+// Function prototypes
+
+static bool capture_log_write_all(int fd, unsigned char const * buffer, size_t size);
+static bool capture_log_replay(CaptureLog * data, RpiList * beacons, BeaconStore * store, off_t size);
+static void capture_log_rollback(CaptureLog * data);
+
+// Function definitions
+
+/**
+ * Writes a whole buffer to a file descriptor.
+ *
+ * For internal use. Retries after short writes and interruptions.
+ *
+ * @param fd The file descriptor to write to.
+ * @param buffer The bytes to write.
+ * @param size The number of bytes to write.
+ * @return true if all of the bytes were written, false otherwise.
+ */
+static bool capture_log_write_all(int fd, unsigned char const * buffer, size_t size) {
+	ssize_t written;
+	size_t total;
+	bool result;
+
+	result = true;
+	total = 0;
+	while (result && (total < size)) {
+		written = write(fd, buffer + total, size - total);
+		if (written > 0) {
+			total += written;
+		}
+		else {
+			result = (written < 0) && (errno == EINTR);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Replays the records in the log into a beacon list and store.
+ *
+ * For internal use. Reads the records sequentially from just after the
+ * header, stopping at the end of the file or at the first record that's
+ * incomplete or fails its checksum. Anything after the last good record is
+ * truncated, and the file position is left at the end of the log ready for
+ * new records to be appended.
+ *
+ * @param data The log to replay.
+ * @param beacons The list to add the sightings to, or NULL.
+ * @param store The store to add the beacons to, or NULL.
+ * @param size The size of the log file.
+ * @return true if the log was replayed and positioned successfully.
+ */
+static bool capture_log_replay(CaptureLog * data, RpiList * beacons, BeaconStore * store, off_t size) {
+	unsigned char * buffer;
+	unsigned char const * record;
+	uint64_t seen;
+	ssize_t bytes;
+	size_t available;
+	size_t pos;
+	off_t end;
+	bool valid;
+	bool result;
+
+	buffer = malloc(CAPTURE_LOG_RECORD_SIZE * CAPTURE_LOG_REPLAY_RECORDS);
+	end = CAPTURE_LOG_HEADER_SIZE;
+	valid = true;
+	result = true;
+
+	while (valid && result) {
+		do {
+			bytes = pread(data->fd, buffer, CAPTURE_LOG_RECORD_SIZE * CAPTURE_LOG_REPLAY_RECORDS, end);
+		} while ((bytes < 0) && (errno == EINTR));
+		result = (bytes >= 0);
+		available = (bytes > 0) ? (bytes / CAPTURE_LOG_RECORD_SIZE) : 0;
+		valid = (bytes > 0) && (available > 0);
+
+		for (pos = 0; valid && (pos < available); ++pos) {
+			record = buffer + (pos * CAPTURE_LOG_RECORD_SIZE);
+			valid = (crc32_update(0, record, CAPTURE_LOG_PAYLOAD_SIZE) == big_endian_decode_u32(record + CAPTURE_LOG_PAYLOAD_SIZE));
+			if (valid) {
+				if (beacons != NULL) {
+					seen = big_endian_decode_u64(record + 6 + RPI_SIZE);
+					rpi_list_add_sighting(beacons, record + 4, record[4 + RPI_SIZE], (time_t)(int64_t)seen, (int8_t)record[5 + RPI_SIZE]);
+				}
+				if (store != NULL) {
+					beacon_store_add_beacon(store, big_endian_decode_u32(record), record + 4, record[4 + RPI_SIZE]);
+				}
+				data->recovered++;
+				end += CAPTURE_LOG_RECORD_SIZE;
+			}
+		}
+	}
+	free(buffer);
+
+	if (result && (end < size)) {
+		LOG(LOG_WARNING, "Discarding %jd bytes from the end of the capture log\n", (intmax_t)(size - end));
+		result = (ftruncate(data->fd, end) == 0);
+	}
+
+	if (result) {
+		result = (lseek(data->fd, end, SEEK_SET) == end);
+		data->committed = end;
+	}
+
+	return result;
+}
+
+/**
+ * Removes any bytes written after the last committed batch.
+ *
+ * For internal use. Called after a failed batch write so that the next batch
+ * isn't appended after a torn record, which would cause replay to stop
+ * before it. If the log can't be truncated it's marked as failed and all
+ * further appends are refused.
+ *
+ * @param data The log to roll back.
+ */
+static void capture_log_rollback(CaptureLog * data) {
+	if ((ftruncate(data->fd, data->committed) != 0) || (lseek(data->fd, data->committed, SEEK_SET) != data->committed)) {
+		LOG(LOG_ERR, "Error rolling back the capture log, refusing further appends\n");
+		data->failed = true;
+	}
+}
+
+/**
+ * Opens a capture log, creating it if it doesn't already exist.
+ *
+ * Any records already in the log are replayed into the list and store, so
+ * after this call they contain all of the beacons that were durably written.
+ * Each record is added to the list as a sighting, with the time it was seen
+ * and its signal strength, subject to the list's limits. Only the RPI and
+ * time interval number of each record are added to the store; beacons from
+ * days outside the store's retention window are skipped.
+ *
+ * A file shorter than the header can only be left by a crash while the log
+ * was being created, so it's treated as empty and the header is rewritten.
+ *
+ * @param path The file holding the log.
+ * @param beacons The list to replay the sightings into, or NULL to skip this.
+ * @param store The store to replay the beacons into, or NULL to skip this.
+ * @return The opened log, or NULL if it couldn't be opened or isn't a valid
+ *         capture log.
+ */
+CaptureLog * capture_log_open(char const * path, RpiList * beacons, BeaconStore * store) {
+	CaptureLog * data;
+	unsigned char header[CAPTURE_LOG_HEADER_SIZE];
+	struct stat status;
+	bool result;
+
+	data = calloc(sizeof(CaptureLog), 1);
+	data->sync_batch = CAPTURE_LOG_SYNC_BATCH;
+	data->buffer = malloc(CAPTURE_LOG_RECORD_SIZE * data->sync_batch);
+
+	data->fd = open(path, O_RDWR | O_CREAT, 0644);
+	result = (data->fd >= 0) && (fstat(data->fd, &status) == 0);
+
+	if (result) {
+		if (status.st_size < CAPTURE_LOG_HEADER_SIZE) {
+			if (status.st_size > 0) {
+				LOG(LOG_WARNING, "Discarding incomplete capture log header\n");
+			}
+			memcpy(header, CAPTURE_LOG_MAGIC, 8);
+			big_endian_encode_u32(header + 8, CAPTURE_LOG_VERSION);
+			big_endian_encode_u32(header + 12, CAPTURE_LOG_RECORD_SIZE);
+			result = (ftruncate(data->fd, 0) == 0) && (lseek(data->fd, 0, SEEK_SET) == 0)
+				&& capture_log_write_all(data->fd, header, CAPTURE_LOG_HEADER_SIZE) && (fdatasync(data->fd) == 0) && file_sync_directory(path);
+			data->committed = CAPTURE_LOG_HEADER_SIZE;
+		}
+		else {
+			result = (pread(data->fd, header, CAPTURE_LOG_HEADER_SIZE, 0) == CAPTURE_LOG_HEADER_SIZE)
+				&& (memcmp(header, CAPTURE_LOG_MAGIC, 8) == 0)
+				&& (big_endian_decode_u32(header + 8) == CAPTURE_LOG_VERSION)
+				&& (big_endian_decode_u32(header + 12) == CAPTURE_LOG_RECORD_SIZE);
+
+			if (result) {
+				result = capture_log_replay(data, beacons, store, status.st_size);
+				LOG(LOG_DEBUG, "Recovered %zu records from the capture log\n", data->recovered);
+			}
+		}
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error opening capture log: %s\n", path);
+		if (data->fd >= 0) {
+			close(data->fd);
+		}
+		free(data->buffer);
+		free(data);
+		data = NULL;
+	}
+
+	return data;
+}
+
+/**
+ * Flushes any pending records and closes the log.
+ *
+ * @param data The instance to free.
+ * @return true if the pending records were written successfully, false
+ *         otherwise.
+ */
+bool capture_log_close(CaptureLog * data) {
+	bool result;
+
+	result = true;
+	if (data) {
+		result = capture_log_flush(data);
+		close(data->fd);
+
+		free(data->buffer);
+		free(data);
+	}
+
+	return result;
+}
+
+/**
+ * Appends a sighting to the log.
+ *
+ * The record is held in memory until a full batch has been collected, at
+ * which point the whole batch is written and synced to disk in one go. Use
+ * \ref capture_log_flush() to force the pending records to disk sooner.
+ *
+ * If an earlier batch write failed, its records are still pending and the
+ * write is retried before the new record is added. The sighting is only
+ * rejected if the retry fails again, or if the log couldn't be rolled back
+ * after the failure.
+ *
+ * @param data The log to append to.
+ * @param day_number The day the beacon was captured on.
+ * @param rpi_bytes The RPI captured, RPI_SIZE bytes in binary format.
+ * @param time_interval_number The time interval number the beacon was
+ *        captured in.
+ * @param seen The time the beacon was received.
+ * @param rssi The signal strength the beacon was received at.
+ * @return false if a batch write failed, true otherwise.
+ */
+bool capture_log_append(CaptureLog * data, uint32_t day_number, unsigned char const * rpi_bytes, uint8_t time_interval_number, time_t seen, int8_t rssi) {
+	unsigned char * record;
+	uint64_t seen_value;
+	bool result;
+
+	result = !data->failed;
+	if (result && (data->pending >= data->sync_batch)) {
+		result = capture_log_flush(data);
+	}
+
+	if (result) {
+		record = data->buffer + (data->pending * CAPTURE_LOG_RECORD_SIZE);
+		seen_value = (uint64_t)(int64_t)seen;
+
+		big_endian_encode_u32(record, day_number);
+		memcpy(record + 4, rpi_bytes, RPI_SIZE);
+		record[4 + RPI_SIZE] = time_interval_number;
+		record[5 + RPI_SIZE] = (unsigned char)rssi;
+		big_endian_encode_u64(record + 6 + RPI_SIZE, seen_value);
+		big_endian_encode_u32(record + CAPTURE_LOG_PAYLOAD_SIZE, crc32_update(0, record, CAPTURE_LOG_PAYLOAD_SIZE));
+		data->pending++;
+
+		if (data->pending >= data->sync_batch) {
+			result = capture_log_flush(data);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Writes any pending records to the log and syncs them to disk.
+ *
+ * If the write fails the log is truncated back to the end of the last batch
+ * that was committed, and the records are kept pending so the write can be
+ * retried by a later flush.
+ *
+ * @param data The log to flush.
+ * @return true if the records are durably stored, false otherwise.
+ */
+bool capture_log_flush(CaptureLog * data) {
+	size_t size;
+	bool result;
+
+	result = !data->failed;
+	if (result && (data->pending > 0)) {
+		size = data->pending * CAPTURE_LOG_RECORD_SIZE;
+		result = capture_log_write_all(data->fd, data->buffer, size) && (fdatasync(data->fd) == 0);
+		if (result) {
+			data->committed += size;
+			data->pending = 0;
+		}
+		else {
+			LOG(LOG_ERR, "Error writing %zu records to the capture log\n", data->pending);
+			capture_log_rollback(data);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Sets the number of records written for each fsync.
+ *
+ * Larger batches give higher throughput, but more records may be lost on
+ * power loss. Any pending records are flushed first; if this fails the
+ * batch size is left unchanged.
+ *
+ * @param data The log to operate on.
+ * @param records The batch size, at least one. Defaults to
+ *        CAPTURE_LOG_SYNC_BATCH.
+ * @return true if the pending records were flushed successfully.
+ */
+bool capture_log_set_sync_batch(CaptureLog * data, size_t records) {
+	bool result;
+
+	result = capture_log_flush(data);
+	if (result) {
+		data->sync_batch = MAX(records, 1);
+		data->buffer = realloc(data->buffer, CAPTURE_LOG_RECORD_SIZE * data->sync_batch);
+	}
+
+	return result;
+}
+
+/**
+ * Returns the number of records written for each fsync.
+ *
+ * @param data The log to operate on.
+ * @return The batch size.
+ */
+size_t capture_log_get_sync_batch(CaptureLog const * data) {
+	return data->sync_batch;
+}
+
+/**
+ * Returns the number of records recovered when the log was opened.
+ *
+ * @param data The log to operate on.
+ * @return The number of valid records replayed.
+ */
+size_t capture_log_get_recovered(CaptureLog const * data) {
+	return data->recovered;
+}
+
+/** @} addtogroup Containers*/
+
@@ -18,6 +18,18 @@
  * 3. Generating a Rolling Proximity Identifier based on the current time
  *    interval number.
  *
+ * The RPIs for every time interval of the current day are generated together
+ * with the DTK and held in a schedule, so moving to a new time interval is a
+ * table lookup. The schedule for the next day can be prepared ahead of time
+ * using \ref contrac_prepare_next_day(), which the \ref RolloverScheduler
+ * does on its own thread during the last time interval of the day, so that
+ * the rollover at midnight doesn't need any key derivation either.
+ *
+ * Each time the RPI changes, the new identity is published using a sequence
+ * lock. The thread updating the keys is the only writer; any number of other
+ * threads can copy the identity without taking a lock, retrying only if they
+ * happen to overlap an update.
+ *
  * Values can be extracted and set in binary or base64 format.
  *
  */
@@ -40,7 +52,9 @@
 
 #include "contrac/log.h"
 #include "contrac/utils.h"
+#include "contrac/base64.h"
 #include "contrac/rpi.h"
+#include "contrac/crypto_context.h"
 
 #include "contrac/contrac.h"
 
@@ -78,8 +92,31 @@
  * .
  */
 #define STATUS_INITIALISED (STATUS_TK | STATUS_DTK | STATUS_RPI)
+
+/**
+ * Used internally.
+ *
+ * The bytes of a BLE advertising payload that precede the RPI: the flags,
+ * the complete list of 16-bit service UUIDs and the service data header, all
+ * for the 0xFD6F contact tracing service.
+ */
+#define CONTRAC_PAYLOAD_HEADER "\x02\x01\x1a\x03\x03\x6f\xfd\x13\x16\x6f\xfd"
+
 // Structures
 
+/**
+ * @brief The keys for a single day
+ *
+ * Holds a Daily Tracing Key together with the RPIs for each of its time
+ * intervals and, if enabled, the advertising payload for each RPI.
+ */
+typedef struct _ContracSchedule {
+	Dtk * dtk;
+	unsigned char rpis[RPI_INTERVAL_MAX * RPI_SIZE];
+	unsigned char payloads[RPI_INTERVAL_MAX * CONTRAC_PAYLOAD_SIZE];
+	bool valid;
+} ContracSchedule;
+
 /**
  * @brief The core structure for storing Contact Tracing state.
  *
@@ -92,16 +129,29 @@
 struct _Contrac {
 	// Tracing key
 	unsigned char tk[TK_SIZE];
-	// Daily key
-	Dtk * dtk;
+	// Daily key and RPIs for the current day
+	ContracSchedule * today;
+	// Daily key and RPIs prepared ahead for the next day
+	ContracSchedule * tomorrow;
 	// Rolling proximity identifier
 	Rpi * rpi;
 
+	bool payloads;
 	uint32_t status;
+
+	// Identity published for other threads, odd while being written
+	uint32_t identity_sequence;
+	uint64_t identity[3];
 };
 
 // Function prototypes
 
+static ContracSchedule * contrac_schedule_new();
+static void contrac_schedule_delete(ContracSchedule * schedule);
+static void contrac_schedule_fill_payloads(ContracSchedule * schedule);
+static bool contrac_schedule_generate(Contrac * data, ContracSchedule * schedule, uint32_t day_number);
+static void contrac_publish_identity(Contrac * data);
+
 // Function definitions
 
 /**
@@ -113,7 +163,8 @@ Contrac * contrac_new() {
 	Contrac * data;
 
 	data = calloc(sizeof(Contrac), 1);
-	data->dtk = dtk_new();
+	data->today = contrac_schedule_new();
+	data->tomorrow = contrac_schedule_new();
 	data->rpi = rpi_new();
 
 	return data;
@@ -126,7 +177,8 @@ Contrac * contrac_new() {
  */
 void contrac_delete(Contrac * data) {
 	if (data) {
-		dtk_delete(data->dtk);
+		contrac_schedule_delete(data->today);
+		contrac_schedule_delete(data->tomorrow);
 		rpi_delete(data->rpi);
 
 		// Clear the data for security
@@ -153,6 +205,7 @@ bool contrac_generate_tracing_key(Contrac * data) {
 	
 	if (result == 1) {
 		data->status |= STATUS_TK;
+		data->tomorrow->valid = false;
 	}
 	else {
 		LOG(LOG_ERR, "Error generating tracing key: %lu\n", ERR_get_error());
@@ -161,12 +214,103 @@ bool contrac_generate_tracing_key(Contrac * data) {
 	return (result == 1);
 }
 
+/**
+ * Creates a schedule.
+ *
+ * For internal use.
+ *
+ * @return The newly created schedule, not yet valid.
+ */
+static ContracSchedule * contrac_schedule_new() {
+	ContracSchedule * schedule;
+
+	schedule = calloc(sizeof(ContracSchedule), 1);
+	schedule->dtk = dtk_new();
+
+	return schedule;
+}
+
+/**
+ * Deletes a schedule, freeing up the memory allocated to it.
+ *
+ * For internal use.
+ *
+ * @param schedule The schedule to free.
+ */
+static void contrac_schedule_delete(ContracSchedule * schedule) {
+	if (schedule) {
+		dtk_delete(schedule->dtk);
+
+		// Clear the data for security
+		memset(schedule, 0, sizeof(ContracSchedule));
+
+		free(schedule);
+	}
+}
+
+/**
+ * Fills out the advertising payloads from a schedule's RPIs.
+ *
+ * For internal use.
+ *
+ * @param schedule The schedule to fill out.
+ */
+static void contrac_schedule_fill_payloads(ContracSchedule * schedule) {
+	unsigned char * payload;
+	size_t interval;
+
+	_Static_assert ((sizeof(CONTRAC_PAYLOAD_HEADER) - 1 + RPI_SIZE == CONTRAC_PAYLOAD_SIZE), "Advertising payload size mismatch");
+
+	for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+		payload = schedule->payloads + (interval * CONTRAC_PAYLOAD_SIZE);
+		memcpy(payload, CONTRAC_PAYLOAD_HEADER, sizeof(CONTRAC_PAYLOAD_HEADER) - 1);
+		memcpy(payload + sizeof(CONTRAC_PAYLOAD_HEADER) - 1, schedule->rpis + (interval * RPI_SIZE), RPI_SIZE);
+	}
+}
+
+/**
+ * Generates the DTK and RPIs for a day.
+ *
+ * For internal use. The keys are removed from the thread's crypto contexts
+ * afterwards, since the DTK must stay secret until it's uploaded.
+ *
+ * @param data The context object to work with.
+ * @param schedule The schedule to fill out.
+ * @param day_number The day to generate the keys for.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+static bool contrac_schedule_generate(Contrac * data, ContracSchedule * schedule, uint32_t day_number) {
+	bool result;
+
+	schedule->valid = false;
+	result = dtk_generate_daily_key(schedule->dtk, data, day_number);
+
+	if (result) {
+		result = rpi_generate_proximity_ids(schedule->dtk, schedule->rpis);
+	}
+
+	if (result && data->payloads) {
+		contrac_schedule_fill_payloads(schedule);
+	}
+
+	// Clear the data for security
+	crypto_context_clear();
+
+	schedule->valid = result;
+
+	return result;
+}
+
 /**
  * Sets the current day number.
  *
  * This will result in a new Daily Tracing Key being generated based on the
- * day provided. If neither the Tracing Key nor the day have changed, the DTK
- * will remain the same.
+ * day provided, along with the RPIs for each of the day's time intervals. If
+ * neither the Tracing Key nor the day have changed, the DTK will remain the
+ * same. If the day's keys were already prepared using
+ * \ref contrac_prepare_next_day() they're used without generating them again.
+ * The new keys are generated into a spare schedule, so if generation fails
+ * the previous day's keys remain in use.
  *
  * The day number is calculated as:
  *     (Number of Seconds since Epoch) / (60 * 60 * 24)
@@ -181,12 +325,27 @@ bool contrac_generate_tracing_key(Contrac * data) {
  * @return true if the operation completed successfully, false otherwise.
  */
 bool contrac_set_day_number(Contrac * data, uint32_t day_number) {
+	ContracSchedule * schedule;
 	bool result;
 
 	result = ((data->status & STATUS_TK) != 0);
 
 	if (result) {
-		result = dtk_generate_daily_key(data->dtk, data, day_number);
+		if (data->tomorrow->valid && (dtk_get_day_number(data->tomorrow->dtk) == day_number)) {
+			schedule = data->today;
+			data->today = data->tomorrow;
+			data->tomorrow = schedule;
+			data->tomorrow->valid = false;
+		}
+		else {
+			result = contrac_schedule_generate(data, data->tomorrow, day_number);
+			if (result) {
+				schedule = data->today;
+				data->today = data->tomorrow;
+				data->tomorrow = schedule;
+				data->tomorrow->valid = false;
+			}
+		}
 	}
 
 	if (result) {
@@ -201,7 +360,8 @@ bool contrac_set_day_number(Contrac * data, uint32_t day_number) {
  *
  * This will result in a new Rolling Proximity Idetifier being generated based 
  * on the time interval number. If none of the Tracing Key, day nor time 
- * interval have changed, the RPI will stay the same.
+ * interval have changed, the RPI will stay the same. The RPI is taken from
+ * the schedule generated along with the DTK, so no key derivation is needed.
  *
  * The time interval number is calculated as:
  *     (Seconds Since Start of DayNumber) / (60 * 10)
@@ -223,17 +383,51 @@ bool contrac_set_time_interval_number(Contrac * data, uint8_t time_interval_numb
 
 	result = ((data->status & STATUS_DTK) != 0);
 
-	if (result) {
-		result = rpi_generate_proximity_id(data->rpi, data->dtk, time_interval_number);
+	if (result && (time_interval_number < RPI_INTERVAL_MAX)) {
+		rpi_assign(data->rpi, data->today->rpis + (time_interval_number * RPI_SIZE), time_interval_number);
+	}
+	else if (result) {
+		result = rpi_generate_proximity_id(data->rpi, data->today->dtk, time_interval_number);
 	}
 
 	if (result) {
 		data->status |= STATUS_RPI;
+		contrac_publish_identity(data);
 	}
 	
 	return result;
 }
 
+/**
+ * Publishes the current RPI, time interval number and day number.
+ *
+ * For internal use. Must only be called from the thread that updates the
+ * keys. The values are stored as whole words using atomic operations, so
+ * readers never see a partially written word, and the sequence number lets
+ * them detect a partially written identity.
+ *
+ * @param data The context object to work with.
+ */
+static void contrac_publish_identity(Contrac * data) {
+	uint64_t identity[3];
+	uint32_t sequence;
+	size_t pos;
+
+	_Static_assert ((sizeof(identity[0]) * 2 == RPI_SIZE), "Identity size mismatch");
+	_Static_assert ((sizeof(((ContracIdentity *)NULL)->rpi) == RPI_SIZE), "Identity RPI size mismatch");
+
+	memcpy(identity, rpi_get_proximity_id(data->rpi), RPI_SIZE);
+	identity[2] = ((uint64_t)dtk_get_day_number(data->today->dtk)) | (((uint64_t)rpi_get_time_interval_number(data->rpi)) << 32);
+
+	// Release stores keep each word from being seen before the odd sequence
+	sequence = __atomic_load_n(&data->identity_sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&data->identity_sequence, sequence + 1, __ATOMIC_RELAXED);
+	for (pos = 0; pos < 3; ++pos) {
+		__atomic_store_n(&data->identity[pos], identity[pos], __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&data->identity_sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
 /**
  * Gets whether the internal state has been fully configured or not.
  *
@@ -273,7 +467,7 @@ bool contrac_get_initialised(Contrac const * data) {
  * @return The day number most recently used to generate the DTK.
  */
 uint32_t contrac_get_day_number(Contrac * data) {
-	return dtk_get_day_number(data->dtk);
+	return dtk_get_day_number(data->today->dtk);
 }
 
 /**
@@ -314,6 +508,7 @@ uint8_t contrac_get_time_interval_number(Contrac * data) {
 void contrac_set_tracing_key(Contrac * data, unsigned char const * tracing_key) {
 	memcpy(data->tk, tracing_key, TK_SIZE);
 	data->status |= STATUS_TK;
+	data->tomorrow->valid = false;
 }
 
 /**
@@ -351,10 +546,11 @@ unsigned char const * contrac_get_tracing_key(Contrac const * data) {
  * @param base64 A buffer of at least TK_SIZE_BAS64 + 1 bytes for the result.
  */
 void contrac_get_tracing_key_base64(Contrac const * data, char * base64) {
-	size_t size = TK_SIZE_BASE64 + 1;
-	base64_encode_binary_to_base64(data->tk, TK_SIZE, (unsigned char *)base64, &size);
+	size_t size;
 
-	if (size != (TK_SIZE_BASE64 + 1)) {
+	size = base64_encode(data->tk, TK_SIZE, base64);
+
+	if (size != TK_SIZE_BASE64) {
 		LOG(LOG_ERR, "Base64 tracing key has incorrect size of %d bytes.\n", size);
 	}
 }
@@ -370,7 +566,8 @@ void contrac_get_tracing_key_base64(Contrac const * data, char * base64) {
  *
  * The tracing_key buffer passed in must contain exactly TK_SIZE_BASE64 (44)
  * bytes of base64-encoded data. It can be null terminated, but doesn't need to
- * be.
+ * be. The key is rejected if it contains any characters that aren't valid
+ * base64, with the position of the first such character logged.
  *
  * @param data The context object to work with.
  * @param tracing_key The Tracing Key to set in base64 format.
@@ -379,6 +576,7 @@ bool contrac_set_tracing_key_base64(Contrac * data, char const * tracing_key) {
 	bool result = true;
 	unsigned char tk[TK_SIZE];
 	size_t size;
+	size_t error_pos;
 
 	if (strlen(tracing_key) != TK_SIZE_BASE64) {
 		LOG(LOG_ERR, "Base64 tracing key has incorrect size. Should be %d bytes.\n", TK_SIZE_BASE64);
@@ -387,10 +585,13 @@ bool contrac_set_tracing_key_base64(Contrac * data, char const * tracing_key) {
 
 	if (result) {
 		size = TK_SIZE;
-		base64_decode_base64_to_binary((unsigned char *)tracing_key, TK_SIZE_BASE64, tk, &size);
-		
-		if (size < TK_SIZE) {
-			LOG(LOG_ERR, "Base64 tracking key output is too short %d bytes.\n", size);
+		result = base64_decode(tracing_key, TK_SIZE_BASE64, tk, &size, &error_pos);
+
+		if (!result) {
+			LOG(LOG_ERR, "Base64 tracing key is invalid at character %zu.\n", error_pos);
+		}
+		else if (size < TK_SIZE) {
+			LOG(LOG_ERR, "Base64 tracking key output is too short %zu bytes.\n", size);
 			result = false;
 		}
 	}
@@ -420,7 +621,7 @@ bool contrac_set_tracing_key_base64(Contrac * data, char const * tracing_key) {
  * @return The Daily Tracing Key in binary format, not null terminated.
  */
 unsigned char const * contrac_get_daily_key(Contrac const * data) {
-	return dtk_get_daily_key(data->dtk);
+	return dtk_get_daily_key(data->today->dtk);
 }
 
 /**
@@ -439,14 +640,47 @@ unsigned char const * contrac_get_daily_key(Contrac const * data) {
  * @param base64 A buffer of at least DTK_SIZE_BASE64 + 1 bytes for the result.
  */
 void contrac_get_daily_key_base64(Contrac const * data, char * base64) {
-	size_t size = DTK_SIZE_BASE64 + 1;
-	base64_encode_binary_to_base64(dtk_get_daily_key(data->dtk), DTK_SIZE, (unsigned char *)base64, &size);
+	size_t size;
+
+	size = base64_encode(dtk_get_daily_key(data->today->dtk), DTK_SIZE, base64);
 
-	if (size != (DTK_SIZE_BASE64 + 1)) {
+	if (size != DTK_SIZE_BASE64) {
 		LOG(LOG_ERR, "Base64 daily key has incorrect size of %d bytes.\n", size);
 	}
 }
 
+/**
+ * Generates the Daily Tracing Keys for a range of days.
+ *
+ * This is useful for generating the keys to upload to a Diagnosis Server,
+ * which covers a history of several days. It's faster than setting each day
+ * in turn using \ref contrac_set_day_number(), since the part of the key
+ * derivation that's the same for every day is only performed once. The
+ * current DTK and RPI are left unchanged.
+ *
+ * The dtk_bytes buffer must be at least count * DTK_SIZE bytes long. It's
+ * filled with the keys for each day in turn, starting with day_number.
+ *
+ * The operation may fail if a Tracing Key has yet to be configured.
+ *
+ * @param data The context object to work with.
+ * @param day_number The first day number to generate a key for.
+ * @param count The number of consecutive days to generate keys for.
+ * @param dtk_bytes A buffer to store the keys in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool contrac_generate_daily_keys(Contrac const * data, uint32_t day_number, size_t count, unsigned char * dtk_bytes) {
+	bool result;
+
+	result = ((data->status & STATUS_TK) != 0);
+
+	if (result) {
+		result = dtk_generate_daily_keys(data, day_number, count, dtk_bytes);
+	}
+
+	return result;
+}
+
 /**
  * Gets the Rolling Proximity Identifier for the device in binary format.
  *
@@ -483,10 +717,11 @@ unsigned char const * contrac_get_proximity_id(Contrac const * data) {
  * @param base64 A buffer of at least RPI_SIZE_BASE64 + 1 bytes for the result.
  */
 void contrac_get_proximity_id_base64(Contrac const * data, char * base64) {
-	size_t size = RPI_SIZE_BASE64 + 1;
-	base64_encode_binary_to_base64(rpi_get_proximity_id(data->rpi), RPI_SIZE, (unsigned char *)base64, &size);
+	size_t size;
+
+	size = base64_encode(rpi_get_proximity_id(data->rpi), RPI_SIZE, base64);
 
-	if (size != (RPI_SIZE_BASE64 + 1)) {
+	if (size != RPI_SIZE_BASE64) {
 		LOG(LOG_ERR, "Base64 proximity id has incorrect size of %d bytes.\n", size);
 	}
 }
@@ -504,6 +739,11 @@ void contrac_get_proximity_id_base64(Contrac const * data, char * base64) {
  * want to get the correct values based on the time, it makes sense to call
  * this function before getting them.
  *
+ * The next day's keys aren't prepared here, so the update never takes longer
+ * than a lookup except on the first call of a day that wasn't prepared. Use
+ * \ref contrac_prepare_next_day() or a \ref RolloverScheduler to prepare
+ * them in advance.
+ *
  * The operation may fail if the state has not yet been fully initialised (for
  * example if a Tracing Key has not yet been generated or set).
  *
@@ -529,7 +769,7 @@ bool contrac_update_current_time(Contrac * data) {
 
 	if (result) {
 		dn_now = epoch_to_day_number(epoch);
-		dn_stored = dtk_get_day_number(data->dtk);
+		dn_stored = dtk_get_day_number(data->today->dtk);
 
 		// Only set again if uninitialised or the time has changed
 		if ((dn_now != dn_stored) || ((data->status & STATUS_DTK) == 0)) {
@@ -550,5 +790,168 @@ bool contrac_update_current_time(Contrac * data) {
 	return result;
 }
 
+/**
+ * Prepares the keys for the day after the current day.
+ *
+ * Generates the next day's DTK and the RPIs for each of its time intervals,
+ * so that moving to the next day using \ref contrac_set_day_number() doesn't
+ * need any key derivation. This is called by the \ref RolloverScheduler
+ * thread shortly before midnight, or can be called directly to control when
+ * the work is done. If the keys have already been prepared this does nothing.
+ *
+ * The operation may fail if a Tracing Key or Daily Tracing Key have yet to be
+ * configured.
+ *
+ * @param data The context object to work with.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool contrac_prepare_next_day(Contrac * data) {
+	uint32_t day_number;
+	bool result;
+
+	result = ((data->status & STATUS_DTK) != 0);
+
+	if (result) {
+		day_number = dtk_get_day_number(data->today->dtk) + 1;
+		if ((!data->tomorrow->valid) || (dtk_get_day_number(data->tomorrow->dtk) != day_number)) {
+			result = contrac_schedule_generate(data, data->tomorrow, day_number);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Gets the Rolling Proximity Identifiers for every time interval of the
+ * current day.
+ *
+ * The buffer returned contains RPI_INTERVAL_MAX RPIs of RPI_SIZE bytes each
+ * in binary format, so the RPI for time interval number n starts at byte
+ * n * RPI_SIZE. Future operations may cause the data to change, so the caller
+ * should make a copy of the buffer rather than keeping the pointer to it.
+ *
+ * @param data The context object to work with.
+ * @return The RPIs for the current day, or NULL if the DTK has yet to be set.
+ */
+unsigned char const * contrac_get_schedule(Contrac const * data) {
+	return ((data->status & STATUS_DTK) != 0) ? data->today->rpis : NULL;
+}
+
+/**
+ * Sets whether BLE advertising payloads are generated for each RPI.
+ *
+ * When enabled, a ready-to-send payload is generated for every RPI in the
+ * schedule, which can then be retrieved using
+ * \ref contrac_get_advertising_payload(). Disabled by default.
+ *
+ * @param data The context object to work with.
+ * @param enabled true to generate payloads, false otherwise.
+ */
+void contrac_set_advertising_payloads(Contrac * data, bool enabled) {
+	if (enabled && !data->payloads) {
+		if (data->today->valid) {
+			contrac_schedule_fill_payloads(data->today);
+		}
+		if (data->tomorrow->valid) {
+			contrac_schedule_fill_payloads(data->tomorrow);
+		}
+	}
+	data->payloads = enabled;
+}
+
+/**
+ * Gets the BLE advertising payload for the current Rolling Proximity
+ * Identifier.
+ *
+ * The buffer returned will contain exactly CONTRAC_PAYLOAD_SIZE (27) bytes:
+ * the flags, the complete list of 16-bit service UUIDs and the service data
+ * for the contact tracing service, with the RPI as the service data. Future
+ * operations may cause the data to change, so the caller should make a copy
+ * of the buffer rather than keeping the pointer to it.
+ *
+ * @param data The context object to work with.
+ * @return The advertising payload, or NULL if payloads are disabled or the
+ *         state isn't fully initialised.
+ */
+unsigned char const * contrac_get_advertising_payload(Contrac const * data) {
+	unsigned char const * payload;
+	uint8_t time_interval_number;
+
+	payload = NULL;
+	time_interval_number = rpi_get_time_interval_number(data->rpi);
+	if (data->payloads && contrac_get_initialised(data) && (time_interval_number < RPI_INTERVAL_MAX)) {
+		payload = data->today->payloads + (time_interval_number * CONTRAC_PAYLOAD_SIZE);
+	}
+
+	return payload;
+}
+
+/**
+ * Copies the current identity.
+ *
+ * Unlike \ref contrac_get_proximity_id(), this is safe to call from any
+ * thread while another thread updates the keys, for example from a BLE
+ * advertising callback. It never blocks. If an update happens while the
+ * identity is being copied, the copy is made again, so the RPI, time interval
+ * number and day number returned always belong together.
+ *
+ * @param data The context object to work with.
+ * @param identity A structure to copy the identity into.
+ * @return true if an identity has been published, false if no RPI has been
+ *         set yet.
+ */
+bool contrac_get_identity(Contrac const * data, ContracIdentity * identity) {
+	uint64_t words[3];
+	uint32_t before;
+	uint32_t after;
+	size_t pos;
+
+	do {
+		before = __atomic_load_n(&data->identity_sequence, __ATOMIC_ACQUIRE);
+		// Acquire loads keep the second sequence read after the words
+		for (pos = 0; pos < 3; ++pos) {
+			words[pos] = __atomic_load_n(&data->identity[pos], __ATOMIC_ACQUIRE);
+		}
+		after = __atomic_load_n(&data->identity_sequence, __ATOMIC_RELAXED);
+	} while (((before & 1) != 0) || (before != after));
+
+	memcpy(identity->rpi, words, RPI_SIZE);
+	identity->day_number = (uint32_t)words[2];
+	identity->time_interval_number = (uint8_t)(words[2] >> 32);
+
+	return (before != 0);
+}
+
+/**
+ * Returns the time at which the current Rolling Proximity Identifier expires.
+ *
+ * This is the start of the time interval after the one the RPI was generated
+ * for, which is also the start of the next day after the last interval of a
+ * day. It's calculated from the current state rather than the system clock,
+ * so if the state hasn't been updated recently the time returned will be in
+ * the past, meaning \ref contrac_update_current_time() should be called
+ * straight away.
+ *
+ * This allows the caller to sleep until the next rollover rather than
+ * polling. If the state isn't fully initialised, the next rollover after the
+ * current system time is returned.
+ *
+ * @param data The context object to work with.
+ * @return The epoch time at which the RPI should next be updated.
+ */
+time_t contrac_get_next_rollover(Contrac * data) {
+	time_t rollover;
+
+	if (contrac_get_initialised(data) && (contrac_get_time_interval_number(data) < RPI_INTERVAL_MAX)) {
+		rollover = (((time_t)contrac_get_day_number(data)) * (60 * 60 * 24)) + (((time_t)contrac_get_time_interval_number(data)) * (60 * 10));
+		rollover = epoch_to_next_rollover(rollover);
+	}
+	else {
+		rollover = epoch_to_next_rollover(time(NULL));
+	}
+
+	return rollover;
+}
+
 /** @} addtogroup KeyGeneration */
 
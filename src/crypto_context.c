@@ -0,0 +1,646 @@
+/** \ingroup Utils
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Per-thread cached HMAC, HKDF and AES operations
+ * @section DESCRIPTION
+ *
+ * Provides the HMAC-SHA256, HKDF-SHA256 and AES-128 operations used to
+ * derive DTKs and RPIs, using contexts that are created once for each thread
+ * and then reused.
+ *
+ * On OpenSSL 3 the HMAC algorithm is fetched once for the whole process and
+ * each thread creates its own EVP_MAC_CTX from it, with the digest already
+ * set. Re-keying the context for each operation then needs no algorithm
+ * lookups. On earlier versions an HMAC_CTX is cached instead.
+ *
+ * The context for the current thread is found through a thread-local
+ * pointer. It's also registered with a pthread key, so that it's freed when
+ * the thread exits. Since the key destructors don't run for the thread that
+ * calls exit(), the context of that thread is freed by an exit handler.
+ *
+ * The cached contexts retain the key schedule of the last key they were used
+ * with. Derivations from the tracing key therefore re-key the contexts with a
+ * dummy key once they're done, and \ref crypto_context_clear() can be used to
+ * do the same after other sensitive operations.
+ *
+ * HKDF is built from the cached HMAC, following RFC 5869 with no salt.
+ *
+ * An AES cipher context is cached in the same way, used for both ECB and CTR
+ * modes. Encrypting many blocks in a single call allows OpenSSL to process
+ * several blocks in parallel using AES-NI where the processor supports it.
+ *
+ */
+
+/** \addtogroup Utils
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <openssl/opensslv.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/err.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+
+#include "contrac/crypto_context.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The maximum number of buffers that can be passed in to a single HMAC.
+ */
+#define CRYPTO_HMAC_PARTS_MAX (3)
+
+// Structures
+
+/**
+ * @brief The cached contexts for a single thread
+ */
+typedef struct _CryptoContext {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC_CTX * hmac;
+#else
+	HMAC_CTX * hmac;
+#endif
+	EVP_CIPHER_CTX * aes;
+} CryptoContext;
+
+// Function prototypes
+
+static void crypto_context_init_once();
+static void crypto_context_destroy(void * user_data);
+static void crypto_context_exit();
+static CryptoContext * crypto_context_get();
+static bool crypto_context_clear_hmac(CryptoContext * context);
+static bool crypto_context_hmac(CryptoContext * context, unsigned char const * key, size_t key_size, unsigned char const * const * parts, size_t const * sizes, size_t count, unsigned char * digest);
+
+// Function definitions
+
+/**
+ * Used internally.
+ *
+ * Ensures the process-wide state is only initialised once.
+ */
+static pthread_once_t crypto_context_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Used internally.
+ *
+ * The key used to free each thread's context when the thread exits.
+ */
+static pthread_key_t crypto_context_key;
+
+/**
+ * Used internally.
+ *
+ * The context belonging to the current thread, or NULL if it's yet to be
+ * created.
+ */
+static __thread CryptoContext * crypto_context_thread = NULL;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/**
+ * Used internally.
+ *
+ * The HMAC algorithm, fetched once and shared between threads.
+ */
+static EVP_MAC * crypto_context_mac = NULL;
+
+/**
+ * Used internally.
+ *
+ * The AES-128-ECB cipher, fetched once and shared between threads.
+ */
+static EVP_CIPHER * crypto_context_aes = NULL;
+
+/**
+ * Used internally.
+ *
+ * The AES-128-CTR cipher, fetched once and shared between threads.
+ */
+static EVP_CIPHER * crypto_context_aes_ctr = NULL;
+#endif
+
+/**
+ * Initialises the process-wide state.
+ *
+ * For internal use. Called once, by the first thread to need a context.
+ * OpenSSL is initialised before the exit handler is registered, so that the
+ * handler runs before OpenSSL cleans up after itself.
+ */
+static void crypto_context_init_once() {
+	if (pthread_key_create(&crypto_context_key, crypto_context_destroy) != 0) {
+		LOG(LOG_ERR, "Error creating crypto context key\n");
+	}
+
+	if ((OPENSSL_init_crypto(0, NULL) != 1) || (atexit(crypto_context_exit) != 0)) {
+		LOG(LOG_ERR, "Error registering crypto context cleanup\n");
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	crypto_context_mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	if (crypto_context_mac == NULL) {
+		LOG(LOG_ERR, "Error fetching HMAC algorithm: %lu\n", ERR_get_error());
+	}
+
+	crypto_context_aes = EVP_CIPHER_fetch(NULL, "AES-128-ECB", NULL);
+	crypto_context_aes_ctr = EVP_CIPHER_fetch(NULL, "AES-128-CTR", NULL);
+	if ((crypto_context_aes == NULL) || (crypto_context_aes_ctr == NULL)) {
+		LOG(LOG_ERR, "Error fetching AES algorithm: %lu\n", ERR_get_error());
+	}
+#endif
+}
+
+/**
+ * Frees a thread's context.
+ *
+ * For internal use. Called automatically when a thread that created a
+ * context exits.
+ *
+ * @param user_data The context to free.
+ */
+static void crypto_context_destroy(void * user_data) {
+	CryptoContext * context = (CryptoContext *)user_data;
+
+	if (context) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		EVP_MAC_CTX_free(context->hmac);
+#else
+		HMAC_CTX_free(context->hmac);
+#endif
+		EVP_CIPHER_CTX_free(context->aes);
+		free(context);
+	}
+}
+
+/**
+ * Frees the context of the thread that's exiting the process.
+ *
+ * For internal use. Registered using atexit(), since the pthread key
+ * destructors aren't called for the thread that calls exit(), which is
+ * usually the main thread.
+ */
+static void crypto_context_exit() {
+	CryptoContext * context;
+
+	context = crypto_context_thread;
+	if (context) {
+		crypto_context_thread = NULL;
+		pthread_setspecific(crypto_context_key, NULL);
+		crypto_context_destroy(context);
+	}
+}
+
+/**
+ * Returns the context for the current thread, creating it if necessary.
+ *
+ * For internal use.
+ *
+ * @return The thread's context, or NULL if it couldn't be created.
+ */
+static CryptoContext * crypto_context_get() {
+	CryptoContext * context;
+	bool result;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[2];
+#endif
+
+	context = crypto_context_thread;
+	if (context == NULL) {
+		pthread_once(&crypto_context_once, crypto_context_init_once);
+		context = calloc(sizeof(CryptoContext), 1);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		result = (crypto_context_mac != NULL);
+		if (result) {
+			context->hmac = EVP_MAC_CTX_new(crypto_context_mac);
+			params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+			params[1] = OSSL_PARAM_construct_end();
+			result = (context->hmac != NULL) && (EVP_MAC_CTX_set_params(context->hmac, params) == 1);
+		}
+#else
+		context->hmac = HMAC_CTX_new();
+		result = (context->hmac != NULL);
+#endif
+
+		if (result) {
+			context->aes = EVP_CIPHER_CTX_new();
+			result = (context->aes != NULL);
+		}
+
+		if (result) {
+			crypto_context_thread = context;
+			pthread_setspecific(crypto_context_key, context);
+		}
+		else {
+			LOG(LOG_ERR, "Error creating crypto context: %lu\n", ERR_get_error());
+			crypto_context_destroy(context);
+			context = NULL;
+		}
+	}
+
+	return context;
+}
+
+/**
+ * Re-keys a context's HMAC with a dummy key.
+ *
+ * For internal use. Overwrites the state derived from the last key used.
+ *
+ * @param context The thread's context.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+static bool crypto_context_clear_hmac(CryptoContext * context) {
+	unsigned char const dummy[CRYPTO_HMAC_SIZE] = {0};
+	bool result;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	result = (EVP_MAC_init(context->hmac, dummy, sizeof(dummy), NULL) == 1);
+#else
+	result = (HMAC_Init_ex(context->hmac, dummy, sizeof(dummy), EVP_sha256(), NULL) == 1);
+#endif
+
+	return result;
+}
+
+/**
+ * Removes any key material from the current thread's cached contexts.
+ *
+ * The HMAC and AES contexts are re-keyed with a dummy key, so that the key
+ * schedules left behind by the previous operations are overwritten. This
+ * should be called after using keys that must stay secret, such as the
+ * tracing key or the device's own daily keys. If the thread has no context
+ * this does nothing.
+ */
+void crypto_context_clear() {
+	unsigned char const dummy[CRYPTO_AES_KEY_SIZE] = {0};
+	CryptoContext * context;
+	EVP_CIPHER const * cipher;
+	bool result;
+
+	context = crypto_context_thread;
+	if (context) {
+		result = crypto_context_clear_hmac(context);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		cipher = crypto_context_aes;
+#else
+		cipher = EVP_aes_128_ecb();
+#endif
+		result = result && (cipher != NULL) && (EVP_EncryptInit_ex(context->aes, cipher, NULL, dummy, NULL) == 1);
+
+		if (!result) {
+			LOG(LOG_ERR, "Error clearing crypto context: %lu\n", ERR_get_error());
+		}
+	}
+}
+
+/**
+ * Calculates the HMAC-SHA256 of several buffers concatenated together.
+ *
+ * For internal use.
+ *
+ * @param context The thread's context.
+ * @param key The HMAC key.
+ * @param key_size The size of the key in bytes.
+ * @param parts The buffers to concatenate.
+ * @param sizes The size of each buffer in bytes.
+ * @param count The number of buffers.
+ * @param digest A buffer of CRYPTO_HMAC_SIZE bytes to store the result in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+static bool crypto_context_hmac(CryptoContext * context, unsigned char const * key, size_t key_size, unsigned char const * const * parts, size_t const * sizes, size_t count, unsigned char * digest) {
+	size_t part;
+	bool result;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	size_t out_length;
+
+	result = (EVP_MAC_init(context->hmac, key, key_size, NULL) == 1);
+	for (part = 0; result && (part < count); ++part) {
+		result = (EVP_MAC_update(context->hmac, parts[part], sizes[part]) == 1);
+	}
+	if (result) {
+		out_length = 0;
+		result = (EVP_MAC_final(context->hmac, digest, &out_length, CRYPTO_HMAC_SIZE) == 1) && (out_length == CRYPTO_HMAC_SIZE);
+	}
+#else
+	unsigned int out_length;
+
+	result = (HMAC_Init_ex(context->hmac, key, key_size, EVP_sha256(), NULL) == 1);
+	for (part = 0; result && (part < count); ++part) {
+		result = (HMAC_Update(context->hmac, parts[part], sizes[part]) == 1);
+	}
+	if (result) {
+		out_length = 0;
+		result = (HMAC_Final(context->hmac, digest, &out_length) == 1) && (out_length == CRYPTO_HMAC_SIZE);
+	}
+#endif
+
+	return result;
+}
+
+/**
+ * Calculates an HMAC-SHA256, truncating the result.
+ *
+ * Uses the current thread's cached context.
+ *
+ * @param key The HMAC key.
+ * @param key_size The size of the key in bytes.
+ * @param input The data to calculate the HMAC of.
+ * @param input_size The size of the data in bytes.
+ * @param output A buffer to store the result in.
+ * @param output_size The number of bytes of the result to store, at most
+ *        CRYPTO_HMAC_SIZE.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool crypto_hmac_sha256(unsigned char const * key, size_t key_size, unsigned char const * input, size_t input_size, unsigned char * output, size_t output_size) {
+	CryptoContext * context;
+	unsigned char digest[CRYPTO_HMAC_SIZE];
+	bool result;
+
+	context = crypto_context_get();
+	result = (context != NULL) && (output_size <= CRYPTO_HMAC_SIZE);
+
+	if (result) {
+		result = crypto_context_hmac(context, key, key_size, &input, &input_size, 1, digest);
+	}
+
+	if (result) {
+		memcpy(output, digest, output_size);
+	}
+	else {
+		LOG(LOG_ERR, "Error calculating HMAC: %lu\n", ERR_get_error());
+	}
+
+	// Clear the data for security
+	memset(digest, 0, sizeof(digest));
+
+	return result;
+}
+
+/**
+ * Calculates the HMAC-SHA256 of several messages using the same key.
+ *
+ * Uses the current thread's cached context. The key is only set up once, so
+ * each further message costs only the hashing of the message itself. This is
+ * much cheaper than calling \ref crypto_hmac_sha256() for each message when
+ * the messages are short.
+ *
+ * The outputs are truncated to output_size bytes and stored consecutively, so
+ * the result for message n starts at byte n * output_size.
+ *
+ * @param key The HMAC key.
+ * @param key_size The size of the key in bytes.
+ * @param inputs The messages to calculate the HMACs of.
+ * @param input_sizes The size of each message in bytes.
+ * @param count The number of messages.
+ * @param outputs A buffer of count * output_size bytes to store the results in.
+ * @param output_size The number of bytes of each result to store, at most
+ *        CRYPTO_HMAC_SIZE.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool crypto_hmac_sha256_multi(unsigned char const * key, size_t key_size, unsigned char const * const * inputs, size_t const * input_sizes, size_t count, unsigned char * outputs, size_t output_size) {
+	CryptoContext * context;
+	unsigned char digest[CRYPTO_HMAC_SIZE];
+	size_t pos;
+	bool result;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	size_t out_length;
+#else
+	unsigned int out_length;
+#endif
+
+	context = crypto_context_get();
+	result = (context != NULL) && (output_size <= CRYPTO_HMAC_SIZE);
+
+	for (pos = 0; result && (pos < count); ++pos) {
+		// Passing a NULL key re-initialises using the key already set up
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		result = (EVP_MAC_init(context->hmac, (pos == 0) ? key : NULL, (pos == 0) ? key_size : 0, NULL) == 1);
+		if (result) {
+			result = (EVP_MAC_update(context->hmac, inputs[pos], input_sizes[pos]) == 1);
+		}
+		if (result) {
+			out_length = 0;
+			result = (EVP_MAC_final(context->hmac, digest, &out_length, CRYPTO_HMAC_SIZE) == 1) && (out_length == CRYPTO_HMAC_SIZE);
+		}
+#else
+		result = (HMAC_Init_ex(context->hmac, (pos == 0) ? key : NULL, (pos == 0) ? key_size : 0, (pos == 0) ? EVP_sha256() : NULL, NULL) == 1);
+		if (result) {
+			result = (HMAC_Update(context->hmac, inputs[pos], input_sizes[pos]) == 1);
+		}
+		if (result) {
+			out_length = 0;
+			result = (HMAC_Final(context->hmac, digest, &out_length) == 1) && (out_length == CRYPTO_HMAC_SIZE);
+		}
+#endif
+		if (result) {
+			memcpy(outputs + (pos * output_size), digest, output_size);
+		}
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error calculating HMAC: %lu\n", ERR_get_error());
+	}
+
+	// Clear the data for security
+	memset(digest, 0, sizeof(digest));
+
+	return result;
+}
+
+/**
+ * Derives a key using HKDF-SHA256 with no salt.
+ *
+ * Uses the current thread's cached context:
+ *
+ *     PRK <- HMAC(Zeros(32), key)
+ *     T(n) <- HMAC(PRK, T(n - 1) || info || n)
+ *     output <- Truncate(T(1) || T(2) || ..., output_size)
+ *
+ * The HMAC context is re-keyed with a dummy key afterwards, so neither the
+ * input key nor the PRK are left behind in it.
+ *
+ * @param key The input keying material.
+ * @param key_size The size of the key in bytes.
+ * @param info The context and application specific information.
+ * @param info_size The size of the info in bytes.
+ * @param output A buffer to store the derived key in.
+ * @param output_size The number of bytes to derive, at most
+ *        255 * CRYPTO_HMAC_SIZE.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool crypto_hkdf_sha256(unsigned char const * key, size_t key_size, unsigned char const * info, size_t info_size, unsigned char * output, size_t output_size) {
+	CryptoContext * context;
+	unsigned char salt[CRYPTO_HMAC_SIZE];
+	unsigned char prk[CRYPTO_HMAC_SIZE];
+	unsigned char block[CRYPTO_HMAC_SIZE];
+	unsigned char const * parts[CRYPTO_HMAC_PARTS_MAX];
+	size_t sizes[CRYPTO_HMAC_PARTS_MAX];
+	unsigned char counter;
+	size_t pos;
+	bool result;
+
+	context = crypto_context_get();
+	result = (context != NULL) && (output_size <= (255 * CRYPTO_HMAC_SIZE));
+
+	// Extract
+	if (result) {
+		memset(salt, 0, sizeof(salt));
+		result = crypto_context_hmac(context, salt, sizeof(salt), &key, &key_size, 1, prk);
+	}
+
+	// Expand
+	counter = 0;
+	sizes[0] = 0;
+	parts[0] = block;
+	parts[1] = info;
+	sizes[1] = info_size;
+	parts[2] = &counter;
+	sizes[2] = 1;
+	for (pos = 0; result && (pos < output_size); pos += CRYPTO_HMAC_SIZE) {
+		counter++;
+		result = crypto_context_hmac(context, prk, sizeof(prk), parts, sizes, CRYPTO_HMAC_PARTS_MAX, block);
+		if (result) {
+			memcpy(output + pos, block, MIN(output_size - pos, (size_t)CRYPTO_HMAC_SIZE));
+			sizes[0] = CRYPTO_HMAC_SIZE;
+		}
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error deriving key: %lu\n", ERR_get_error());
+	}
+
+	// Clear the data for security
+	if ((context != NULL) && !crypto_context_clear_hmac(context)) {
+		LOG(LOG_ERR, "Error clearing HMAC context: %lu\n", ERR_get_error());
+	}
+	memset(prk, 0, sizeof(prk));
+	memset(block, 0, sizeof(block));
+
+	return result;
+}
+
+/**
+ * Encrypts a sequence of blocks using AES-128 in ECB mode.
+ *
+ * Uses the current thread's cached context. Each 16 byte block is encrypted
+ * independently with the same key and no padding is added, so the output is
+ * the same size as the input. All of the blocks are passed to OpenSSL in a
+ * single call so that they can be pipelined.
+ *
+ * The input and output buffers may be the same.
+ *
+ * @param key The AES key, CRYPTO_AES_KEY_SIZE bytes long.
+ * @param input The blocks to encrypt.
+ * @param output A buffer to store the encrypted blocks in.
+ * @param size The number of bytes to encrypt, which must be a multiple of
+ *        CRYPTO_AES_BLOCK_SIZE.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool crypto_aes128_ecb_encrypt(unsigned char const * key, unsigned char const * input, unsigned char * output, size_t size) {
+	CryptoContext * context;
+	EVP_CIPHER const * cipher;
+	int out_length;
+	bool result;
+
+	context = crypto_context_get();
+	result = (context != NULL) && ((size % CRYPTO_AES_BLOCK_SIZE) == 0) && (size <= INT_MAX);
+
+	if (result) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		cipher = crypto_context_aes;
+#else
+		cipher = EVP_aes_128_ecb();
+#endif
+		result = (cipher != NULL) && (EVP_EncryptInit_ex(context->aes, cipher, NULL, key, NULL) == 1);
+	}
+
+	if (result) {
+		result = (EVP_CIPHER_CTX_set_padding(context->aes, 0) == 1);
+	}
+
+	if (result) {
+		out_length = 0;
+		result = (EVP_EncryptUpdate(context->aes, output, &out_length, input, (int)size) == 1) && (out_length == (int)size);
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error encrypting blocks: %lu\n", ERR_get_error());
+	}
+
+	return result;
+}
+
+/**
+ * Encrypts or decrypts data using AES-128 in CTR mode.
+ *
+ * Uses the current thread's cached context. In CTR mode encryption and
+ * decryption are the same operation. The data can be any length.
+ *
+ * The input and output buffers may be the same.
+ *
+ * @param key The AES key, CRYPTO_AES_KEY_SIZE bytes long.
+ * @param iv The initial counter block, CRYPTO_AES_BLOCK_SIZE bytes long.
+ * @param input The data to encrypt or decrypt.
+ * @param output A buffer to store the result in.
+ * @param size The number of bytes to encrypt or decrypt.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool crypto_aes128_ctr(unsigned char const * key, unsigned char const * iv, unsigned char const * input, unsigned char * output, size_t size) {
+	CryptoContext * context;
+	EVP_CIPHER const * cipher;
+	int out_length;
+	bool result;
+
+	context = crypto_context_get();
+	result = (context != NULL) && (size <= INT_MAX);
+
+	if (result) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		cipher = crypto_context_aes_ctr;
+#else
+		cipher = EVP_aes_128_ctr();
+#endif
+		result = (cipher != NULL) && (EVP_EncryptInit_ex(context->aes, cipher, NULL, key, iv) == 1);
+	}
+
+	if (result) {
+		out_length = 0;
+		result = (EVP_EncryptUpdate(context->aes, output, &out_length, input, (int)size) == 1) && (out_length == (int)size);
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error applying AES-CTR: %lu\n", ERR_get_error());
+	}
+
+	return result;
+}
+
+/** @} addtogroup Utils */
+
@@ -28,14 +28,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include <openssl/crypto.h>
-#include <openssl/kdf.h>
-#include <openssl/err.h>
-#include <openssl/evp.h>
-
 #include "contrac/contrac.h"
 #include "contrac/utils.h"
 #include "contrac/log.h"
+#include "contrac/crypto_context.h"
 
 #include "contrac/dtk.h"
 
@@ -49,6 +45,14 @@
  */
 #define DTK_INFO_PREFIX "CT-DTK"
 
+/**
+ * Used internally.
+ *
+ * The size of the pseudorandom key produced by the HKDF extract step, which
+ * is the size of a SHA-256 hash.
+ */
+#define DTK_PRK_SIZE (32)
+
 // Structures
 
 /**
@@ -111,61 +115,85 @@ void dtk_delete(Dtk * data) {
  * @return true if the operation completed successfully, false otherwise.
  */
 bool dtk_generate_daily_key(Dtk * data, Contrac const * contrac, uint32_t day_number) {
-	int result = 1;
-	char encode[sizeof(DTK_INFO_PREFIX) + sizeof(day_number)];
-	size_t out_length = 0;
-	EVP_PKEY_CTX *pctx = NULL;
-	unsigned char const * tk;
+	bool result;
+	unsigned char encode[sizeof(DTK_INFO_PREFIX) + sizeof(day_number)];
 
 	// dtk_i <- HKDF(tk, NULL, (UTF8("CT-DTK") || D_i), 16)
 
-	if (result > 0) {
-		// Produce Info sequence UTF8("CT-DTK") || D_i)
-		// From the spec it's not clear whether this is string or byte concatenation.
-		// Here we use byte, but it might have to be changed
-		memcpy(encode, DTK_INFO_PREFIX, sizeof(DTK_INFO_PREFIX));
-		((uint32_t *)(encode + sizeof(DTK_INFO_PREFIX)))[0] = day_number;
+	// Produce Info sequence UTF8("CT-DTK") || D_i)
+	// From the spec it's not clear whether this is string or byte concatenation.
+	// Here we use byte, but it might have to be changed
+	memcpy(encode, DTK_INFO_PREFIX, sizeof(DTK_INFO_PREFIX));
+	memcpy(encode + sizeof(DTK_INFO_PREFIX), &day_number, sizeof(day_number));
 
-		pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	// No salt is set: HKDF then uses a zero-filled salt
+	result = crypto_hkdf_sha256(contrac_get_tracing_key(contrac), TK_SIZE, encode, sizeof(encode), data->dtk, DTK_SIZE);
 
-		result = EVP_PKEY_derive_init(pctx);
+	if (result) {
+		data->day_number = day_number;
 	}
-
-	if (result > 0) {
-		result = EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256());
+	else {
+		LOG(LOG_ERR, "Error generating daily key\n");
 	}
 
-	if (result > 0) {
-		result = EVP_PKEY_CTX_set1_hkdf_salt(pctx, NULL, 4);
-	}
-	
-	if (result > 0) {
-		tk = contrac_get_tracing_key(contrac);
-		result = EVP_PKEY_CTX_set1_hkdf_key(pctx, tk, TK_SIZE);
-	}
-	
-	if (result > 0) {
-		result = EVP_PKEY_CTX_add1_hkdf_info(pctx, encode, sizeof(encode));
-	}
-	
-	if (result > 0) {
-		out_length = DTK_SIZE;
-		result = EVP_PKEY_derive(pctx, data->dtk, &out_length);
-	}
-	
-	if ((result > 0) && (out_length == DTK_SIZE)) {
-		data->day_number = day_number;
-		result = 1;
+	return result;
+}
+
+/**
+ * Generates the Daily Tracing Keys for a range of days.
+ *
+ * Produces the same keys as \ref dtk_generate_daily_key(), but performs the
+ * HKDF extract step only once. Since the tracing key and salt are the same
+ * for every day, the extract step always produces the same pseudorandom key.
+ * Each day then only needs the expand step, which for a 16 byte key is a
+ * single HMAC:
+ *
+ *     PRK <- HMAC(Zeros(32), tk)
+ *     dtk_i <- Truncate(HMAC(PRK, (UTF8("CT-DTK") || D_i || 0x01)), 16)
+ *
+ * The dtk_bytes buffer must be at least count * DTK_SIZE bytes long. It's
+ * filled with the keys for each day in turn, starting with day_number. The
+ * PRK is removed from the thread's HMAC context afterwards.
+ *
+ * @param contrac The context object holding the tracing key.
+ * @param day_number The first day number to generate a key for.
+ * @param count The number of consecutive days to generate keys for.
+ * @param dtk_bytes A buffer to store the keys in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool dtk_generate_daily_keys(Contrac const * contrac, uint32_t day_number, size_t count, unsigned char * dtk_bytes) {
+	unsigned char salt[DTK_PRK_SIZE];
+	unsigned char prk[DTK_PRK_SIZE];
+	unsigned char encode[sizeof(DTK_INFO_PREFIX) + sizeof(day_number) + 1];
+	uint32_t day;
+	size_t pos;
+	bool result;
+
+	_Static_assert ((CRYPTO_HMAC_SIZE == DTK_PRK_SIZE), "HMAC output size doesn't match PRK size");
+
+	// HKDF-Extract: no salt is set, so a zero-filled salt is used
+	memset(salt, 0, sizeof(salt));
+	result = crypto_hmac_sha256(salt, sizeof(salt), contrac_get_tracing_key(contrac), TK_SIZE, prk, sizeof(prk));
+
+	// HKDF-Expand: the info is encoded in the same way as for a single key
+	memcpy(encode, DTK_INFO_PREFIX, sizeof(DTK_INFO_PREFIX));
+	encode[sizeof(encode) - 1] = 0x01;
+	for (pos = 0; result && (pos < count); ++pos) {
+		day = day_number + pos;
+		memcpy(encode + sizeof(DTK_INFO_PREFIX), &day, sizeof(day));
+
+		result = crypto_hmac_sha256(prk, sizeof(prk), encode, sizeof(encode), dtk_bytes + (pos * DTK_SIZE), DTK_SIZE);
 	}
 
-	if (result <= 0) {
-		LOG(LOG_ERR, "Error generating daily key: %lu\n", ERR_get_error());
+	if (!result) {
+		LOG(LOG_ERR, "Error generating daily keys\n");
 	}
-	
-	// Freeing a NULL value is safe
-	EVP_PKEY_CTX_free(pctx);
 
-	return (result > 0);
+	// Clear the data for security
+	memset(prk, 0, sizeof(prk));
+	crypto_context_clear();
+
+	return result;
 }
 
 /**
@@ -0,0 +1,590 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief A batch of diagnosis keys that can be memory mapped
+ * @section DESCRIPTION
+ *
+ * This class provides a versioned on-disk format for batches of diagnosis
+ * keys that can be memory mapped and used directly, without being parsed.
+ * Batches are written from a \ref DtkList using \ref dtk_file_write(), and
+ * opened using \ref dtk_file_open().
+ *
+ * The file starts with a header holding the format version, the range of days
+ * covered and a checksum, followed by an index giving the position, number
+ * and checksum of each day's keys, in order of day number. The keys follow
+ * as a single column of DTK_SIZE byte values, grouped by day and aligned to
+ * DTK_FILE_ALIGNMENT bytes, so each key can be loaded directly into a vector
+ * register. The day numbers aren't repeated for each key.
+ *
+ * The checksum of the header and index is checked when the file is opened.
+ * Checking the keys themselves requires reading them, so this is only done if
+ * DTK_FILE_VERIFY is passed to \ref dtk_file_open(), and then only for the
+ * days that are used.
+ *
+ * All integers in the header and index are stored big-endian. Checksums are
+ * CRC-32.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/match_private.h"
+
+#include "contrac/dtk_file.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The bytes identifying a diagnosis key batch file.
+ */
+#define DTK_FILE_MAGIC "CTDTKBAT"
+
+/**
+ * Used internally.
+ *
+ * The size of the fixed part of the header.
+ */
+#define DTK_FILE_HEADER_SIZE (64)
+
+/**
+ * Used internally.
+ *
+ * The position of the checksum in the header.
+ */
+#define DTK_FILE_CHECKSUM_OFFSET (48)
+
+/**
+ * Used internally.
+ *
+ * The size of each day's entry in the index: day number, key count, the
+ * position of the day's first key and the checksum of the day's keys.
+ */
+#define DTK_FILE_INDEX_ENTRY_SIZE (24)
+
+/**
+ * Used internally.
+ *
+ * The alignment of the keys, which is a whole cache line.
+ */
+#define DTK_FILE_ALIGNMENT (64)
+
+// Structures
+
+/**
+ * @brief An opened batch file
+ *
+ * This is an opaque structure that represents a mapped batch file. The
+ * header values are decoded when the file is opened; the index and keys are
+ * used in place.
+ *
+ * The structure typedef is in dtk_file.h
+ */
+struct _DtkFile {
+	unsigned char * base;
+	size_t size;
+
+	unsigned int flags;
+	uint32_t day_count;
+	uint64_t keys_offset;
+	uint64_t count;
+	uint32_t first_day;
+	uint32_t last_day;
+};
+
+/**
+ * @brief A key being written, with its position in the list
+ */
+typedef struct _DtkFileKey {
+	uint32_t day_number;
+	size_t order;
+	unsigned char const * dtk_bytes;
+} DtkFileKey;
+
+// Function prototypes
+
+static int dtk_file_compare_keys(void const * left, void const * right);
+static uint32_t dtk_file_header_checksum(unsigned char const * header, size_t size);
+static bool dtk_file_parse(DtkFile * data);
+
+// Function definitions
+
+/**
+ * Orders keys by day number, keeping keys for the same day in list order.
+ *
+ * For internal use as a qsort() comparison function.
+ *
+ * @param left The first DtkFileKey to compare.
+ * @param right The second DtkFileKey to compare.
+ * @return Negative, zero or positive as left is before, equal to or after
+ *         right.
+ */
+static int dtk_file_compare_keys(void const * left, void const * right) {
+	DtkFileKey const * first = (DtkFileKey const *)left;
+	DtkFileKey const * second = (DtkFileKey const *)right;
+	int result;
+
+	if (first->day_number != second->day_number) {
+		result = (first->day_number < second->day_number) ? -1 : 1;
+	}
+	else {
+		result = (first->order < second->order) ? -1 : ((first->order > second->order) ? 1 : 0);
+	}
+
+	return result;
+}
+
+/**
+ * Calculates the checksum of the header and index.
+ *
+ * For internal use. The checksum field itself is treated as zero.
+ *
+ * @param header The start of the file.
+ * @param size The size of the header and index together.
+ * @return The checksum.
+ */
+static uint32_t dtk_file_header_checksum(unsigned char const * header, size_t size) {
+	unsigned char const zero[4] = {0, 0, 0, 0};
+	uint32_t crc;
+
+	crc = crc32_update(0, header, DTK_FILE_CHECKSUM_OFFSET);
+	crc = crc32_update(crc, zero, sizeof(zero));
+	crc = crc32_update(crc, header + DTK_FILE_CHECKSUM_OFFSET + 4, size - DTK_FILE_CHECKSUM_OFFSET - 4);
+
+	return crc;
+}
+
+/**
+ * Writes the keys from a list out to a batch file.
+ *
+ * The keys are grouped by day number. Keys for the same day are kept in the
+ * order they appear in the list.
+ *
+ * The file is written to a uniquely named temporary file alongside the
+ * destination, synced and then renamed into place, so a reader will never
+ * see a partially written file. The directory is synced after the rename so
+ * the new file survives a crash.
+ *
+ * @param diagnosis_keys The keys to write.
+ * @param path The file to write to.
+ * @return true if the file was written successfully, false otherwise.
+ */
+bool dtk_file_write(DtkList const * diagnosis_keys, char const * path) {
+	DtkListItem const * dtk_item;
+	Dtk const * diagnosis_key;
+	DtkFileKey * keys;
+	unsigned char * header;
+	unsigned char * entry;
+	size_t count;
+	size_t pos;
+	size_t first;
+	size_t keys_offset;
+	uint32_t day_count;
+	uint32_t crc;
+	char * temp_path;
+	FILE * file;
+	bool result;
+
+	count = 0;
+	dtk_item = dtk_list_first(diagnosis_keys);
+	while (dtk_item != NULL) {
+		count++;
+		dtk_item = dtk_list_next(dtk_item);
+	}
+
+	// Group the keys by day
+	keys = malloc(sizeof(DtkFileKey) * MAX(count, 1));
+	count = 0;
+	dtk_item = dtk_list_first(diagnosis_keys);
+	while (dtk_item != NULL) {
+		diagnosis_key = dtk_list_get_dtk(dtk_item);
+		keys[count].day_number = dtk_get_day_number(diagnosis_key);
+		keys[count].order = count;
+		keys[count].dtk_bytes = dtk_get_daily_key(diagnosis_key);
+		count++;
+		dtk_item = dtk_list_next(dtk_item);
+	}
+	qsort(keys, count, sizeof(DtkFileKey), dtk_file_compare_keys);
+
+	day_count = 0;
+	for (pos = 0; pos < count; ++pos) {
+		if ((pos == 0) || (keys[pos].day_number != keys[pos - 1].day_number)) {
+			day_count++;
+		}
+	}
+
+	keys_offset = DTK_FILE_HEADER_SIZE + (day_count * DTK_FILE_INDEX_ENTRY_SIZE);
+	keys_offset = ((keys_offset + DTK_FILE_ALIGNMENT - 1) / DTK_FILE_ALIGNMENT) * DTK_FILE_ALIGNMENT;
+
+	// Build the header and index
+	header = calloc(keys_offset, 1);
+	entry = header + DTK_FILE_HEADER_SIZE;
+	first = 0;
+	crc = 0;
+	for (pos = 0; pos < count; ++pos) {
+		crc = crc32_update(crc, keys[pos].dtk_bytes, DTK_SIZE);
+
+		if ((pos + 1 == count) || (keys[pos + 1].day_number != keys[pos].day_number)) {
+			big_endian_encode_u32(entry, keys[pos].day_number);
+			big_endian_encode_u32(entry + 4, (uint32_t)(pos + 1 - first));
+			big_endian_encode_u64(entry + 8, first);
+			big_endian_encode_u32(entry + 16, crc);
+			entry += DTK_FILE_INDEX_ENTRY_SIZE;
+			first = pos + 1;
+			crc = 0;
+		}
+	}
+
+	memcpy(header, DTK_FILE_MAGIC, 8);
+	big_endian_encode_u32(header + 8, DTK_FILE_VERSION);
+	big_endian_encode_u32(header + 12, DTK_SIZE);
+	big_endian_encode_u32(header + 16, day_count);
+	big_endian_encode_u64(header + 24, keys_offset);
+	big_endian_encode_u64(header + 32, count);
+	if (count > 0) {
+		big_endian_encode_u32(header + 40, keys[0].day_number);
+		big_endian_encode_u32(header + 44, keys[count - 1].day_number);
+	}
+	big_endian_encode_u32(header + DTK_FILE_CHECKSUM_OFFSET, dtk_file_header_checksum(header, DTK_FILE_HEADER_SIZE + (day_count * DTK_FILE_INDEX_ENTRY_SIZE)));
+
+	// Write the file
+	file = file_create_temp(path, &temp_path);
+	result = (file != NULL);
+	if (result) {
+		result = (fwrite(header, keys_offset, 1, file) == 1);
+		for (pos = 0; result && (pos < count); ++pos) {
+			result = (fwrite(keys[pos].dtk_bytes, DTK_SIZE, 1, file) == 1);
+		}
+
+		result = result && (fflush(file) == 0) && (fsync(fileno(file)) == 0);
+		result = (fclose(file) == 0) && result;
+
+		if (result) {
+			result = (rename(temp_path, path) == 0);
+		}
+		if (result) {
+			result = file_sync_directory(path);
+		}
+		else {
+			unlink(temp_path);
+		}
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error writing diagnosis key file: %s\n", path);
+	}
+
+	free(temp_path);
+	free(header);
+	free(keys);
+
+	return result;
+}
+
+/**
+ * Decodes and validates the header of a mapped file.
+ *
+ * For internal use. Checks the header checksum, and that the index and keys
+ * all lie within the mapping, so they can be used without further bounds
+ * checks. The index must cover every key in order, and agree with the range
+ * of days recorded in the header.
+ *
+ * @param data The file to parse, with the base and size already set.
+ * @return true if the file is a valid batch file, false otherwise.
+ */
+static bool dtk_file_parse(DtkFile * data) {
+	unsigned char const * entry;
+	uint64_t first;
+	uint64_t keys;
+	uint32_t pos;
+	uint32_t day;
+	bool result;
+
+	result = (data->size >= DTK_FILE_HEADER_SIZE) && (memcmp(data->base, DTK_FILE_MAGIC, 8) == 0);
+	if (result) {
+		if (big_endian_decode_u32(data->base + 8) != DTK_FILE_VERSION) {
+			LOG(LOG_ERR, "Unsupported diagnosis key file version\n");
+			result = false;
+		}
+	}
+
+	if (result) {
+		data->day_count = big_endian_decode_u32(data->base + 16);
+		data->keys_offset = big_endian_decode_u64(data->base + 24);
+		data->count = big_endian_decode_u64(data->base + 32);
+		data->first_day = big_endian_decode_u32(data->base + 40);
+		data->last_day = big_endian_decode_u32(data->base + 44);
+
+		result = (big_endian_decode_u32(data->base + 12) == DTK_SIZE)
+			&& (data->keys_offset >= DTK_FILE_HEADER_SIZE + ((uint64_t)data->day_count * DTK_FILE_INDEX_ENTRY_SIZE))
+			&& (data->keys_offset <= data->size)
+			&& ((data->keys_offset % DTK_FILE_ALIGNMENT) == 0)
+			&& (data->count <= (data->size - data->keys_offset) / DTK_SIZE);
+	}
+
+	if (result) {
+		result = (big_endian_decode_u32(data->base + DTK_FILE_CHECKSUM_OFFSET) == dtk_file_header_checksum(data->base, DTK_FILE_HEADER_SIZE + (data->day_count * DTK_FILE_INDEX_ENTRY_SIZE)));
+		if (!result) {
+			LOG(LOG_ERR, "Diagnosis key file header is corrupt\n");
+		}
+	}
+
+	// The days must be in order for the index to be searched, with each
+	// day's keys following on from the previous day's. The range is checked
+	// without adding, so large values can't wrap around
+	if (result) {
+		entry = data->base + DTK_FILE_HEADER_SIZE;
+		keys = 0;
+		for (pos = 0; result && (pos < data->day_count); ++pos) {
+			day = big_endian_decode_u32(entry);
+			first = big_endian_decode_u64(entry + 8);
+			result = (first == keys)
+				&& (big_endian_decode_u32(entry + 4) <= data->count - first)
+				&& ((pos == 0) || (day > big_endian_decode_u32(entry - DTK_FILE_INDEX_ENTRY_SIZE)))
+				&& ((pos != 0) || (day == data->first_day))
+				&& ((pos + 1 != data->day_count) || (day == data->last_day));
+			keys = first + big_endian_decode_u32(entry + 4);
+			entry += DTK_FILE_INDEX_ENTRY_SIZE;
+		}
+
+		result = result && (keys == data->count);
+		if (!result) {
+			LOG(LOG_ERR, "Diagnosis key file index is invalid\n");
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Opens a batch file and maps it into memory.
+ *
+ * Only the header and index are read; the keys are paged in as they're used.
+ *
+ * @param path The file to open.
+ * @param flags DTK_FILE_VERIFY to check the checksum of each day's keys
+ *        whenever they're used.
+ * @return The opened file, or NULL if it couldn't be opened or isn't valid.
+ */
+DtkFile * dtk_file_open(char const * path, unsigned int flags) {
+	DtkFile * data;
+	struct stat status;
+	void * base;
+	int fd;
+	bool result;
+
+	data = NULL;
+	base = MAP_FAILED;
+
+	fd = open(path, O_RDONLY);
+	result = (fd >= 0) && (fstat(fd, &status) == 0) && (status.st_size > 0);
+
+	if (result) {
+		base = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		result = (base != MAP_FAILED);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (result) {
+		data = calloc(sizeof(DtkFile), 1);
+		data->base = base;
+		data->size = status.st_size;
+		data->flags = flags;
+		result = dtk_file_parse(data);
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error opening diagnosis key file: %s\n", path);
+		dtk_file_close(data);
+		data = NULL;
+	}
+
+	return data;
+}
+
+/**
+ * Unmaps and closes a batch file.
+ *
+ * Any keys returned from the file are no longer valid after this call.
+ *
+ * @param data The instance to free.
+ */
+void dtk_file_close(DtkFile * data) {
+	if (data) {
+		munmap(data->base, data->size);
+
+		free(data);
+	}
+}
+
+/**
+ * Returns the number of diagnosis keys in the file.
+ *
+ * @param data The file to operate on.
+ * @return The total number of keys across all days.
+ */
+size_t dtk_file_count(DtkFile const * data) {
+	return data->count;
+}
+
+/**
+ * Returns the number of days in the file's index.
+ *
+ * Only days with keys are included in the index.
+ *
+ * @param data The file to operate on.
+ * @return The number of days with keys.
+ */
+size_t dtk_file_get_day_count(DtkFile const * data) {
+	return data->day_count;
+}
+
+/**
+ * Returns the range of days covered by the file.
+ *
+ * @param data The file to operate on.
+ * @param first_day_number Returns the oldest day with keys.
+ * @param last_day_number Returns the newest day with keys.
+ * @return true if the file contains any keys, false otherwise.
+ */
+bool dtk_file_get_coverage(DtkFile const * data, uint32_t * first_day_number, uint32_t * last_day_number) {
+	if (data->day_count > 0) {
+		*first_day_number = data->first_day;
+		*last_day_number = data->last_day;
+	}
+
+	return (data->day_count > 0);
+}
+
+/**
+ * Returns the diagnosis keys for a given day.
+ *
+ * The day is found using a binary search of the index. The keys are returned
+ * directly from the mapped file as a contiguous array of DTK_SIZE byte keys,
+ * aligned to at least 16 bytes, and remain valid until the file is closed.
+ *
+ * If the file was opened with DTK_FILE_VERIFY, the checksum of the day's keys
+ * is checked first, and NULL is returned if they're corrupt.
+ *
+ * @param data The file to operate on.
+ * @param day_number The day to return the keys for.
+ * @param count Returns the number of keys in the array.
+ * @return The keys for the day, or NULL if there are none.
+ */
+unsigned char const * dtk_file_get_day(DtkFile const * data, uint32_t day_number, size_t * count) {
+	unsigned char const * keys;
+	unsigned char const * entry;
+	uint32_t lower;
+	uint32_t upper;
+	uint32_t middle;
+	uint32_t day;
+
+	keys = NULL;
+	*count = 0;
+	lower = 0;
+	upper = data->day_count;
+	while ((keys == NULL) && (lower < upper)) {
+		middle = lower + ((upper - lower) / 2);
+		entry = data->base + DTK_FILE_HEADER_SIZE + (middle * DTK_FILE_INDEX_ENTRY_SIZE);
+		day = big_endian_decode_u32(entry);
+		if (day < day_number) {
+			lower = middle + 1;
+		}
+		else if (day > day_number) {
+			upper = middle;
+		}
+		else {
+			keys = data->base + data->keys_offset + (big_endian_decode_u64(entry + 8) * DTK_SIZE);
+			*count = big_endian_decode_u32(entry + 4);
+
+			if ((data->flags & DTK_FILE_VERIFY) && (crc32_update(0, keys, *count * DTK_SIZE) != big_endian_decode_u32(entry + 16))) {
+				LOG(LOG_ERR, "Diagnosis keys for day %u are corrupt\n", day_number);
+				keys = NULL;
+				*count = 0;
+				upper = lower;
+			}
+		}
+	}
+
+	return keys;
+}
+
+/**
+ * Returns a list of matches found between the stored beacons and the keys in
+ * a batch file.
+ *
+ * Only the days for which the store holds beacons are looked up in the file,
+ * so the keys for other days are never read. For each such day, the day's
+ * beacons are indexed once and the day's keys checked against them. As for
+ * \ref match_list_find_matches_store(), beacons stored under a different day
+ * to their key aren't matched.
+ *
+ * Matches are found in order of day, and within each day in the order the
+ * keys were written. The order and memory budget set on the match list are
+ * ignored. The match list isn't cleared by this call and so any new values
+ * will be appended to it.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons The store of beacons to check.
+ * @param diagnosis_keys The opened batch file.
+ */
+void match_list_find_matches_dtk_file(MatchList * data, BeaconStore const * beacons, DtkFile const * diagnosis_keys) {
+	MatchSegment segment;
+	unsigned char const * keys;
+	size_t count;
+	uint32_t newest_day;
+	uint32_t first_day;
+	uint32_t span;
+	uint32_t offset;
+	uint32_t day;
+
+	if (beacon_store_get_newest_day(beacons, &newest_day)) {
+		// Counting from the first day avoids overflow when the newest day is
+		// the last representable day
+		first_day = newest_day - MIN((uint32_t)beacon_store_get_retention_days(beacons) - 1, newest_day);
+		span = newest_day - first_day;
+		for (offset = 0; offset <= span; ++offset) {
+			day = first_day + offset;
+			segment.records = beacon_store_get_day(beacons, day, &segment.count);
+			if (segment.records != NULL) {
+				keys = dtk_file_get_day(diagnosis_keys, day, &count);
+				if (keys != NULL) {
+					segment.day_number = day;
+					segment.sorted = false;
+					match_list_find_matches_segment_keys(data, &segment, keys, count);
+				}
+			}
+		}
+	}
+}
+
+/** @} addtogroup Containers*/
+
@@ -0,0 +1,326 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Reads diagnosis keys from a byte stream
+ * @section DESCRIPTION
+ *
+ * This class allows diagnosis keys to be read one at a time from a file
+ * descriptor, a memory buffer or a callback, without first building a
+ * \ref DtkList. Input is read in fixed-size chunks, so the memory used is
+ * independent of the size of the input.
+ *
+ * The stream is a sequence of records of DTK_STREAM_RECORD_SIZE (20) bytes,
+ * each containing the DTK_SIZE (16) byte diagnosis key followed by its day
+ * number as a 32-bit big-endian integer. Records can be produced using
+ * \ref dtk_stream_encode_record().
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+
+#include "contrac/dtk_stream.h"
+
+// Defines
+
+// Structures
+
+/**
+ * @brief A stream of diagnosis keys
+ *
+ * This is an opaque structure that represents the stream.
+ *
+ * Memory streams read records directly from the buffer provided. Other
+ * streams read into a chunk buffer, carrying any partial record at the end of
+ * a chunk over to the start of the next.
+ *
+ * The structure typedef is in dtk_stream.h
+ */
+struct _DtkStream {
+	DtkStreamRead read;
+	void * user_data;
+	int fd;
+
+	unsigned char const * memory;
+	unsigned char * chunk;
+	size_t chunk_size;
+	size_t fill;
+	size_t position;
+
+	bool end;
+	bool error;
+	size_t count;
+};
+
+// Function prototypes
+
+static ssize_t dtk_stream_read_fd(void * user_data, unsigned char * buffer, size_t size);
+static bool dtk_stream_fill(DtkStream * data);
+
+// Function definitions
+
+/**
+ * Creates a new stream that reads from a file descriptor.
+ *
+ * The file descriptor remains owned by the caller and isn't closed when the
+ * stream is deleted.
+ *
+ * @param fd The file descriptor to read from.
+ * @param chunk_size The number of bytes to read at a time, or zero to use
+ *        DTK_STREAM_CHUNK_SIZE.
+ * @return The newly created object.
+ */
+DtkStream * dtk_stream_new_fd(int fd, size_t chunk_size) {
+	DtkStream * data;
+
+	data = dtk_stream_new_reader(dtk_stream_read_fd, NULL, chunk_size);
+	data->fd = fd;
+	data->user_data = data;
+
+	return data;
+}
+
+/**
+ * Creates a new stream that reads from a memory buffer.
+ *
+ * The records are read directly from the buffer without being copied, so the
+ * buffer must remain valid until the stream is deleted.
+ *
+ * @param buffer The buffer containing the records.
+ * @param size The size of the buffer in bytes.
+ * @return The newly created object.
+ */
+DtkStream * dtk_stream_new_memory(unsigned char const * buffer, size_t size) {
+	DtkStream * data;
+
+	data = calloc(sizeof(DtkStream), 1);
+	data->fd = -1;
+	data->memory = buffer;
+	data->fill = size;
+	data->end = true;
+
+	return data;
+}
+
+/**
+ * Creates a new stream that reads using a callback.
+ *
+ * The callback is called whenever more data is needed, to fill up to
+ * chunk_size bytes at a time.
+ *
+ * @param read The callback to read data with.
+ * @param user_data A pointer that will be passed to the callback.
+ * @param chunk_size The number of bytes to read at a time, or zero to use
+ *        DTK_STREAM_CHUNK_SIZE.
+ * @return The newly created object.
+ */
+DtkStream * dtk_stream_new_reader(DtkStreamRead read, void * user_data, size_t chunk_size) {
+	DtkStream * data;
+
+	if (chunk_size == 0) {
+		chunk_size = DTK_STREAM_CHUNK_SIZE;
+	}
+
+	data = calloc(sizeof(DtkStream), 1);
+	data->fd = -1;
+	data->read = read;
+	data->user_data = user_data;
+	data->chunk_size = MAX(chunk_size, DTK_STREAM_RECORD_SIZE);
+	data->chunk = malloc(data->chunk_size);
+
+	return data;
+}
+
+/**
+ * Deletes an instance of the class, freeing up the memory allocated to it.
+ *
+ * @param data The instance to free.
+ */
+void dtk_stream_delete(DtkStream * data) {
+	if (data) {
+		if (data->chunk) {
+			// Clear the data for security
+			memset(data->chunk, 0, data->chunk_size);
+			free(data->chunk);
+		}
+
+		free(data);
+	}
+}
+
+/**
+ * Reads from a file descriptor.
+ *
+ * For internal use. The DtkStreamRead callback used by streams created with
+ * \ref dtk_stream_new_fd().
+ *
+ * @param user_data The stream.
+ * @param buffer The buffer to write the bytes into.
+ * @param size The maximum number of bytes to write.
+ * @return The number of bytes read, zero at the end of the file, or a negative
+ *         value on error.
+ */
+static ssize_t dtk_stream_read_fd(void * user_data, unsigned char * buffer, size_t size) {
+	DtkStream * data = (DtkStream *)user_data;
+	ssize_t result;
+
+	do {
+		result = read(data->fd, buffer, size);
+	} while ((result < 0) && (errno == EINTR));
+
+	return result;
+}
+
+/**
+ * Refills the chunk buffer.
+ *
+ * For internal use. Moves any partial record to the start of the buffer and
+ * then reads until the buffer is full or the input is exhausted.
+ *
+ * @param data The stream to operate on.
+ * @return true if at least one complete record is available.
+ */
+static bool dtk_stream_fill(DtkStream * data) {
+	size_t remaining;
+	ssize_t got;
+
+	remaining = data->fill - data->position;
+	memmove(data->chunk, data->chunk + data->position, remaining);
+	data->fill = remaining;
+	data->position = 0;
+
+	while ((!data->end) && (data->fill < data->chunk_size)) {
+		got = data->read(data->user_data, data->chunk + data->fill, data->chunk_size - data->fill);
+		if (got > 0) {
+			data->fill += got;
+		}
+		else {
+			if (got < 0) {
+				LOG(LOG_ERR, "Error reading diagnosis key stream\n");
+				data->error = true;
+			}
+			data->end = true;
+		}
+	}
+
+	return (data->fill >= DTK_STREAM_RECORD_SIZE);
+}
+
+/**
+ * Reads the next diagnosis key from the stream.
+ *
+ * The dtk_bytes buffer must be at least DTK_SIZE (16) bytes long.
+ *
+ * If the input ends part way through a record, or the input can't be read,
+ * this returns false and \ref dtk_stream_get_error() will return true.
+ *
+ * @param data The stream to read from.
+ * @param dtk_bytes A buffer of DTK_SIZE bytes to store the key in.
+ * @param day_number Returns the day number associated with the key.
+ * @return true if a key was read, false at the end of the stream.
+ */
+bool dtk_stream_read(DtkStream * data, unsigned char * dtk_bytes, uint32_t * day_number) {
+	unsigned char const * record;
+	bool result;
+
+	result = ((data->fill - data->position) >= DTK_STREAM_RECORD_SIZE);
+	if ((!result) && (data->chunk != NULL)) {
+		result = dtk_stream_fill(data);
+	}
+
+	if (result) {
+		record = (data->memory != NULL) ? data->memory : data->chunk;
+		record += data->position;
+
+		memcpy(dtk_bytes, record, DTK_SIZE);
+		*day_number = ((uint32_t)record[DTK_SIZE] << 24) | ((uint32_t)record[DTK_SIZE + 1] << 16) | ((uint32_t)record[DTK_SIZE + 2] << 8) | (uint32_t)record[DTK_SIZE + 3];
+
+		data->position += DTK_STREAM_RECORD_SIZE;
+		data->count++;
+	}
+	else {
+		if (data->fill != data->position) {
+			LOG(LOG_ERR, "Diagnosis key stream ends with a partial record\n");
+			data->error = true;
+			data->position = data->fill;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Returns whether an error occurred while reading the stream.
+ *
+ * @param data The stream to operate on.
+ * @return true if the input couldn't be read or was truncated.
+ */
+bool dtk_stream_get_error(DtkStream const * data) {
+	return data->error;
+}
+
+/**
+ * Returns the number of diagnosis keys read from the stream so far.
+ *
+ * @param data The stream to operate on.
+ * @return The number of keys read.
+ */
+size_t dtk_stream_get_count(DtkStream const * data) {
+	return data->count;
+}
+
+/**
+ * A DiagnosisSource that reads the keys from a DtkStream.
+ *
+ * This allows a stream to be used as the source for
+ * \ref match_list_find_matches_pipelined().
+ *
+ * @param user_data The DtkStream to read from.
+ * @param dtk_bytes A buffer of DTK_SIZE bytes to store the key in.
+ * @param day_number Returns the day number associated with the key.
+ * @return true if a key was read, false at the end of the stream.
+ */
+bool dtk_stream_source(void * user_data, unsigned char * dtk_bytes, uint32_t * day_number) {
+	return dtk_stream_read((DtkStream *)user_data, dtk_bytes, day_number);
+}
+
+/**
+ * Encodes a diagnosis key as a stream record.
+ *
+ * The record buffer must be at least DTK_STREAM_RECORD_SIZE (20) bytes long.
+ *
+ * @param record The buffer to write the record into.
+ * @param dtk_bytes The DTK_SIZE byte diagnosis key.
+ * @param day_number The day number associated with the key.
+ */
+void dtk_stream_encode_record(unsigned char * record, unsigned char const * dtk_bytes, uint32_t day_number) {
+	memcpy(record, dtk_bytes, DTK_SIZE);
+	record[DTK_SIZE] = (day_number >> 24) & 0xff;
+	record[DTK_SIZE + 1] = (day_number >> 16) & 0xff;
+	record[DTK_SIZE + 2] = (day_number >> 8) & 0xff;
+	record[DTK_SIZE + 3] = day_number & 0xff;
+}
+
+/** @} addtogroup Containers*/
+
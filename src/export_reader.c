@@ -0,0 +1,669 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Reads diagnosis keys from Exposure Notification export files
+ * @section DESCRIPTION
+ *
+ * This class reads the temporary exposure keys from the binary export files
+ * published by Exposure Notification diagnosis servers, one key at a time.
+ *
+ * An export file is the 16 byte header EXPORT_READER_HEADER followed by a
+ * TemporaryExposureKeyExport protocol buffer message. Only the keys field
+ * (7) is used; all other fields, including the revised keys, are skipped
+ * without being interpreted. Each key is a TemporaryExposureKey message, from
+ * which the key data (field 1), rolling start interval number (field 3) and
+ * rolling period (field 4) are read.
+ *
+ * The keys are parsed directly from the mapped file or chunk buffer without
+ * being copied or allocated, so reading each key costs only the decoding of
+ * its fields. Fields other than keys are skipped by moving past them, reading
+ * and discarding chunks as needed if they extend beyond the current chunk.
+ *
+ * The day number of each key is its rolling start interval number divided by
+ * RPI_INTERVAL_MAX. The keys are temporary exposure keys, so RPIs should be
+ * generated from them using RPI_SCHEME_AES.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/rpi.h"
+
+#include "contrac/export_reader.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The field number of the keys in the TemporaryExposureKeyExport message.
+ */
+#define EXPORT_READER_FIELD_KEYS (7)
+
+/**
+ * Used internally.
+ *
+ * The field numbers used from the TemporaryExposureKey message.
+ */
+#define EXPORT_READER_FIELD_KEY_DATA (1)
+#define EXPORT_READER_FIELD_ROLLING_START (3)
+#define EXPORT_READER_FIELD_ROLLING_PERIOD (4)
+
+/**
+ * Used internally.
+ *
+ * The protocol buffer wire types.
+ */
+#define EXPORT_READER_WIRE_VARINT (0)
+#define EXPORT_READER_WIRE_FIXED64 (1)
+#define EXPORT_READER_WIRE_LENGTH (2)
+#define EXPORT_READER_WIRE_FIXED32 (5)
+
+/**
+ * Used internally.
+ *
+ * The maximum size of an encoded varint.
+ */
+#define EXPORT_READER_VARINT_MAX (10)
+
+/**
+ * Used internally.
+ *
+ * The maximum size of a TemporaryExposureKey message. The fields used take up
+ * less than 40 bytes, but this leaves space for fields added in the future.
+ */
+#define EXPORT_READER_KEY_MAX (256)
+
+/**
+ * Used internally.
+ *
+ * The smallest chunk that can hold a field's tag and length along with the
+ * largest key message.
+ */
+#define EXPORT_READER_CHUNK_MIN ((2 * EXPORT_READER_VARINT_MAX) + EXPORT_READER_KEY_MAX)
+
+/**
+ * Used internally.
+ *
+ * The rolling period assumed for keys that don't specify one.
+ */
+#define EXPORT_READER_ROLLING_PERIOD_DEFAULT (144)
+
+// Structures
+
+/**
+ * @brief A reader for an export file
+ *
+ * This is an opaque structure that represents the reader.
+ *
+ * Mapped and memory readers parse directly from the buffer. Other readers
+ * read into a chunk buffer, carrying any partial field at the end of a chunk
+ * over to the start of the next.
+ *
+ * The structure typedef is in export_reader.h
+ */
+struct _ExportReader {
+	DtkStreamRead read;
+	void * user_data;
+	int fd;
+
+	unsigned char const * memory;
+	void * mapping;
+	unsigned char * chunk;
+	size_t chunk_size;
+	size_t fill;
+	size_t position;
+
+	bool header;
+	bool end;
+	bool error;
+	size_t count;
+	uint32_t rolling_period;
+};
+
+// Function prototypes
+
+static ssize_t export_reader_read_fd(void * user_data, unsigned char * buffer, size_t size);
+static bool export_reader_ensure(ExportReader * data, size_t size);
+static void export_reader_skip(ExportReader * data, uint64_t size);
+static bool export_reader_varint(unsigned char const * buffer, size_t size, size_t * pos, uint64_t * value);
+static bool export_reader_parse_key(ExportReader * data, unsigned char const * buffer, size_t size, unsigned char * dtk_bytes, uint32_t * day_number);
+
+// Function definitions
+
+/**
+ * Opens an export file and maps it into memory.
+ *
+ * The keys are parsed directly from the mapping, which is released when the
+ * reader is deleted.
+ *
+ * @param path The file to open.
+ * @return The newly created object, or NULL if the file couldn't be opened.
+ */
+ExportReader * export_reader_open(char const * path) {
+	ExportReader * data;
+	struct stat status;
+	void * base;
+	int fd;
+	bool result;
+
+	data = NULL;
+	base = MAP_FAILED;
+
+	fd = open(path, O_RDONLY);
+	result = (fd >= 0) && (fstat(fd, &status) == 0) && (status.st_size > 0);
+
+	if (result) {
+		base = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		result = (base != MAP_FAILED);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (result) {
+		// The file is read once from start to finish
+		madvise(base, status.st_size, MADV_SEQUENTIAL);
+
+		data = export_reader_new_memory(base, status.st_size);
+		data->mapping = base;
+	}
+	else {
+		LOG(LOG_ERR, "Error opening export file: %s\n", path);
+	}
+
+	return data;
+}
+
+/**
+ * Creates a new reader that reads from a file descriptor.
+ *
+ * The file descriptor remains owned by the caller and isn't closed when the
+ * reader is deleted.
+ *
+ * @param fd The file descriptor to read from.
+ * @param chunk_size The number of bytes to read at a time, or zero to use
+ *        EXPORT_READER_CHUNK_SIZE.
+ * @return The newly created object.
+ */
+ExportReader * export_reader_new_fd(int fd, size_t chunk_size) {
+	ExportReader * data;
+
+	data = export_reader_new_reader(export_reader_read_fd, NULL, chunk_size);
+	data->fd = fd;
+	data->user_data = data;
+
+	return data;
+}
+
+/**
+ * Creates a new reader that parses a memory buffer.
+ *
+ * The keys are parsed directly from the buffer without being copied, so the
+ * buffer must remain valid until the reader is deleted.
+ *
+ * @param buffer The buffer containing the export file.
+ * @param size The size of the buffer in bytes.
+ * @return The newly created object.
+ */
+ExportReader * export_reader_new_memory(unsigned char const * buffer, size_t size) {
+	ExportReader * data;
+
+	data = calloc(sizeof(ExportReader), 1);
+	data->fd = -1;
+	data->memory = buffer;
+	data->fill = size;
+	data->end = true;
+	data->rolling_period = EXPORT_READER_ROLLING_PERIOD_DEFAULT;
+
+	return data;
+}
+
+/**
+ * Creates a new reader that reads using a callback.
+ *
+ * The callback is called whenever more data is needed, to fill up to
+ * chunk_size bytes at a time.
+ *
+ * @param read The callback to read data with.
+ * @param user_data A pointer that will be passed to the callback.
+ * @param chunk_size The number of bytes to read at a time, or zero to use
+ *        EXPORT_READER_CHUNK_SIZE.
+ * @return The newly created object.
+ */
+ExportReader * export_reader_new_reader(DtkStreamRead read, void * user_data, size_t chunk_size) {
+	ExportReader * data;
+
+	if (chunk_size == 0) {
+		chunk_size = EXPORT_READER_CHUNK_SIZE;
+	}
+
+	data = calloc(sizeof(ExportReader), 1);
+	data->fd = -1;
+	data->read = read;
+	data->user_data = user_data;
+	data->chunk_size = MAX(chunk_size, EXPORT_READER_CHUNK_MIN);
+	data->chunk = malloc(data->chunk_size);
+	data->rolling_period = EXPORT_READER_ROLLING_PERIOD_DEFAULT;
+
+	return data;
+}
+
+/**
+ * Deletes an instance of the class, freeing up the memory allocated to it.
+ *
+ * If the reader was created using \ref export_reader_open(), the file is also
+ * unmapped.
+ *
+ * @param data The instance to free.
+ */
+void export_reader_delete(ExportReader * data) {
+	if (data) {
+		if (data->mapping) {
+			munmap(data->mapping, data->fill);
+		}
+
+		if (data->chunk) {
+			// Clear the data for security
+			memset(data->chunk, 0, data->chunk_size);
+			free(data->chunk);
+		}
+
+		free(data);
+	}
+}
+
+/**
+ * Reads from a file descriptor.
+ *
+ * For internal use. The DtkStreamRead callback used by readers created with
+ * \ref export_reader_new_fd().
+ *
+ * @param user_data The reader.
+ * @param buffer The buffer to write the bytes into.
+ * @param size The maximum number of bytes to write.
+ * @return The number of bytes read, zero at the end of the file, or a negative
+ *         value on error.
+ */
+static ssize_t export_reader_read_fd(void * user_data, unsigned char * buffer, size_t size) {
+	ExportReader * data = (ExportReader *)user_data;
+	ssize_t result;
+
+	do {
+		result = read(data->fd, buffer, size);
+	} while ((result < 0) && (errno == EINTR));
+
+	return result;
+}
+
+/**
+ * Makes sure a number of bytes are available to parse.
+ *
+ * For internal use. For chunked readers, if fewer than size bytes remain in
+ * the chunk, any remaining bytes are moved to the start of the buffer and it's
+ * refilled until it's full or the input is exhausted. The size must be no
+ * larger than the chunk size.
+ *
+ * @param data The reader to operate on.
+ * @param size The number of bytes needed.
+ * @return true if at least size bytes are available.
+ */
+static bool export_reader_ensure(ExportReader * data, size_t size) {
+	size_t remaining;
+	ssize_t got;
+
+	remaining = data->fill - data->position;
+	if ((remaining < size) && (data->chunk != NULL) && (!data->end)) {
+		memmove(data->chunk, data->chunk + data->position, remaining);
+		data->fill = remaining;
+		data->position = 0;
+
+		while ((!data->end) && (data->fill < data->chunk_size)) {
+			got = data->read(data->user_data, data->chunk + data->fill, data->chunk_size - data->fill);
+			if (got > 0) {
+				data->fill += got;
+			}
+			else {
+				if (got < 0) {
+					LOG(LOG_ERR, "Error reading export file\n");
+					data->error = true;
+				}
+				data->end = true;
+			}
+		}
+		remaining = data->fill;
+	}
+
+	return (remaining >= size);
+}
+
+/**
+ * Skips over bytes of the input.
+ *
+ * For internal use. For chunked readers, this reads and discards as many
+ * chunks as needed, so skipping a large field needs no extra memory.
+ *
+ * If the input ends before all of the bytes have been skipped, the error flag
+ * is set.
+ *
+ * @param data The reader to operate on.
+ * @param size The number of bytes to skip.
+ */
+static void export_reader_skip(ExportReader * data, uint64_t size) {
+	size_t step;
+
+	while ((size > 0) && (!data->error)) {
+		if (export_reader_ensure(data, 1)) {
+			step = MIN((uint64_t)(data->fill - data->position), size);
+			data->position += step;
+			size -= step;
+		}
+		else {
+			data->error = true;
+		}
+	}
+}
+
+/**
+ * Decodes a protocol buffer varint.
+ *
+ * For internal use.
+ *
+ * @param buffer The buffer to decode from.
+ * @param size The size of the buffer.
+ * @param pos The position to decode from, updated to the position after the
+ *        varint.
+ * @param value Returns the decoded value.
+ * @return true if a complete varint was decoded, false if it was truncated
+ *         or too long.
+ */
+static bool export_reader_varint(unsigned char const * buffer, size_t size, size_t * pos, uint64_t * value) {
+	size_t index;
+	bool more;
+
+	*value = 0;
+	more = true;
+	for (index = 0; more && (index < EXPORT_READER_VARINT_MAX) && (*pos + index < size); ++index) {
+		*value |= ((uint64_t)(buffer[*pos + index] & 0x7f)) << (7 * index);
+		more = ((buffer[*pos + index] & 0x80) != 0);
+	}
+	*pos += index;
+
+	return !more;
+}
+
+/**
+ * Parses a TemporaryExposureKey message.
+ *
+ * For internal use. Unknown fields are skipped. The key data and rolling
+ * start interval number must both be present, and the key data must be
+ * exactly DTK_SIZE bytes long.
+ *
+ * @param data The reader, used to store the rolling period.
+ * @param buffer The encoded message.
+ * @param size The size of the encoded message.
+ * @param dtk_bytes A buffer of DTK_SIZE bytes to store the key in.
+ * @param day_number Returns the day number of the key.
+ * @return true if the message was valid, false otherwise.
+ */
+static bool export_reader_parse_key(ExportReader * data, unsigned char const * buffer, size_t size, unsigned char * dtk_bytes, uint32_t * day_number) {
+	size_t pos;
+	uint64_t tag;
+	uint64_t value;
+	bool has_key;
+	bool has_start;
+	bool result;
+
+	pos = 0;
+	has_key = false;
+	has_start = false;
+	result = true;
+	data->rolling_period = EXPORT_READER_ROLLING_PERIOD_DEFAULT;
+
+	while (result && (pos < size)) {
+		result = export_reader_varint(buffer, size, &pos, &tag);
+		if (result) {
+			switch (tag & 0x07) {
+			case EXPORT_READER_WIRE_VARINT:
+				result = export_reader_varint(buffer, size, &pos, &value);
+				if ((tag >> 3) == EXPORT_READER_FIELD_ROLLING_START) {
+					*day_number = (uint32_t)value / RPI_INTERVAL_MAX;
+					has_start = true;
+				}
+				else if ((tag >> 3) == EXPORT_READER_FIELD_ROLLING_PERIOD) {
+					data->rolling_period = (uint32_t)value;
+				}
+				break;
+			case EXPORT_READER_WIRE_FIXED64:
+				pos += 8;
+				break;
+			case EXPORT_READER_WIRE_FIXED32:
+				pos += 4;
+				break;
+			case EXPORT_READER_WIRE_LENGTH:
+				result = export_reader_varint(buffer, size, &pos, &value) && (value <= size - pos);
+				if (result && ((tag >> 3) == EXPORT_READER_FIELD_KEY_DATA)) {
+					result = (value == DTK_SIZE);
+					if (result) {
+						memcpy(dtk_bytes, buffer + pos, DTK_SIZE);
+						has_key = true;
+					}
+				}
+				pos += result ? value : 0;
+				break;
+			default:
+				result = false;
+				break;
+			}
+		}
+	}
+
+	return result && (pos == size) && has_key && has_start;
+}
+
+/**
+ * Reads the next diagnosis key from the export file.
+ *
+ * The dtk_bytes buffer must be at least DTK_SIZE (16) bytes long.
+ *
+ * If the file doesn't start with the expected header, is malformed or
+ * truncated, or can't be read, this returns false and
+ * \ref export_reader_get_error() will return true.
+ *
+ * @param data The reader to read from.
+ * @param dtk_bytes A buffer of DTK_SIZE bytes to store the key in.
+ * @param day_number Returns the day number associated with the key.
+ * @return true if a key was read, false at the end of the file.
+ */
+bool export_reader_read(ExportReader * data, unsigned char * dtk_bytes, uint32_t * day_number) {
+	unsigned char const * buffer;
+	size_t available;
+	size_t pos;
+	uint64_t tag;
+	uint64_t length;
+	bool result;
+	bool done;
+
+	result = false;
+	done = data->error;
+
+	if ((!done) && (!data->header)) {
+		buffer = (data->memory != NULL) ? data->memory : data->chunk;
+		if (export_reader_ensure(data, EXPORT_READER_HEADER_SIZE) && (memcmp(buffer + data->position, EXPORT_READER_HEADER, EXPORT_READER_HEADER_SIZE) == 0)) {
+			data->position += EXPORT_READER_HEADER_SIZE;
+			data->header = true;
+		}
+		else {
+			LOG(LOG_ERR, "Export file has an invalid header\n");
+			data->error = true;
+			done = true;
+		}
+	}
+
+	while ((!done) && (!data->error)) {
+		// The tag and length both fit in the chunk, unless the file ends first
+		export_reader_ensure(data, 2 * EXPORT_READER_VARINT_MAX);
+		buffer = (data->memory != NULL) ? data->memory : data->chunk;
+		available = data->fill - data->position;
+		buffer += data->position;
+		pos = 0;
+
+		if (available == 0) {
+			done = true;
+		}
+		else if (!export_reader_varint(buffer, available, &pos, &tag)) {
+			data->error = true;
+		}
+		else {
+			switch (tag & 0x07) {
+			case EXPORT_READER_WIRE_VARINT:
+				data->error = !export_reader_varint(buffer, available, &pos, &length);
+				data->position += pos;
+				break;
+			case EXPORT_READER_WIRE_FIXED64:
+				data->position += pos;
+				export_reader_skip(data, 8);
+				break;
+			case EXPORT_READER_WIRE_FIXED32:
+				data->position += pos;
+				export_reader_skip(data, 4);
+				break;
+			case EXPORT_READER_WIRE_LENGTH:
+				data->error = !export_reader_varint(buffer, available, &pos, &length);
+				if (!data->error) {
+					data->position += pos;
+					if ((tag >> 3) == EXPORT_READER_FIELD_KEYS) {
+						if ((length <= EXPORT_READER_KEY_MAX) && export_reader_ensure(data, length)) {
+							buffer = (data->memory != NULL) ? data->memory : data->chunk;
+							result = export_reader_parse_key(data, buffer + data->position, length, dtk_bytes, day_number);
+							data->position += length;
+							data->error = !result;
+							done = true;
+						}
+						else {
+							data->error = true;
+						}
+					}
+					else {
+						export_reader_skip(data, length);
+					}
+				}
+				break;
+			default:
+				data->error = true;
+				break;
+			}
+		}
+
+		if (data->error) {
+			LOG(LOG_ERR, "Export file is malformed\n");
+		}
+	}
+
+	if (result) {
+		data->count++;
+	}
+
+	return result;
+}
+
+/**
+ * Returns the rolling period of the key most recently read.
+ *
+ * This is the number of time intervals the key was used for. Keys that don't
+ * specify a rolling period are used for a whole day, RPI_INTERVAL_MAX (144)
+ * intervals.
+ *
+ * @param data The reader to operate on.
+ * @return The rolling period of the last key read.
+ */
+uint32_t export_reader_get_rolling_period(ExportReader const * data) {
+	return data->rolling_period;
+}
+
+/**
+ * Returns whether an error occurred while reading the file.
+ *
+ * @param data The reader to operate on.
+ * @return true if the input couldn't be read, was truncated or malformed.
+ */
+bool export_reader_get_error(ExportReader const * data) {
+	return data->error;
+}
+
+/**
+ * Returns the number of diagnosis keys read from the file so far.
+ *
+ * @param data The reader to operate on.
+ * @return The number of keys read.
+ */
+size_t export_reader_get_count(ExportReader const * data) {
+	return data->count;
+}
+
+/**
+ * A DiagnosisSource that reads the keys from an ExportReader.
+ *
+ * This allows an export file to be used as the source for
+ * \ref match_list_find_matches_pipelined().
+ *
+ * @param user_data The ExportReader to read from.
+ * @param dtk_bytes A buffer of DTK_SIZE bytes to store the key in.
+ * @param day_number Returns the day number associated with the key.
+ * @return true if a key was read, false at the end of the file.
+ */
+bool export_reader_source(void * user_data, unsigned char * dtk_bytes, uint32_t * day_number) {
+	return export_reader_read((ExportReader *)user_data, dtk_bytes, day_number);
+}
+
+/**
+ * Reads all of the remaining keys from the export file into a list.
+ *
+ * The keys are appended to the list in the order they appear in the file.
+ * If an error occurs, the keys read before the error are kept in the list.
+ *
+ * @param data The reader to read from.
+ * @param diagnosis_keys The list to add the keys to.
+ * @return true if the whole file was read successfully, false otherwise.
+ */
+bool export_reader_add_to_list(ExportReader * data, DtkList * diagnosis_keys) {
+	unsigned char dtk_bytes[DTK_SIZE];
+	uint32_t day_number;
+
+	while (export_reader_read(data, dtk_bytes, &day_number)) {
+		dtk_list_add_diagnosis(diagnosis_keys, dtk_bytes, day_number);
+	}
+
+	// Clear the data for security
+	memset(dtk_bytes, 0, sizeof(dtk_bytes));
+
+	return !data->error;
+}
+
+/** @} addtogroup Containers*/
+
@@ -62,6 +62,8 @@ void log_priority(int priority, const char *format, ...) {
 	buffer[length] = 0;
 	
 	syslog(priority, "%s", buffer);
+
+	free(buffer);
 }
 
 // Function definitions
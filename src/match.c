@@ -40,8 +40,10 @@
 #include "contrac/log.h"
 #include "contrac/rpi_list.h"
 #include "contrac/dtk_list.h"
+#include "contrac/rpi_index.h"
 
 #include "contrac/match.h"
+#include "contrac/match_private.h"
 
 // Defines
 
@@ -58,6 +60,9 @@
 struct _MatchListItem {
 	uint32_t day_number;
 	uint8_t time_interval_number;
+	RpiEncoding variant;
+	bool has_metadata;
+	unsigned char metadata[RPI_METADATA_SIZE];
 
 	MatchListItem * next;
 };
@@ -77,13 +82,59 @@ struct _MatchList {
 	size_t count;
 	MatchListItem * first;
 	MatchListItem * last;
+
+	MatchOrder order;
+	MatchCallback callback;
+	void * user_data;
+
+	size_t memory_budget;
+	char * spill_directory;
+
+	RpiScheme scheme;
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	size_t variant_count;
 };
 
+/**
+ * @brief A diagnosis key queued for processing
+ *
+ * Used internally to sort the diagnosis keys when processing them in an order
+ * other than download order. The position in the original list is retained so
+ * that the sort is stable.
+ */
+typedef struct _MatchQueued {
+	Dtk const * dtk;
+	size_t position;
+} MatchQueued;
+
+/**
+ * @brief The state passed to the index lookup callback
+ *
+ * The matched flag is cleared before each lookup, so that a beacon seen
+ * several times in the same interval only produces a single match.
+ */
+typedef struct _MatchLookup {
+	MatchList * data;
+	uint32_t day_number;
+	uint8_t time_interval_number;
+	RpiEncoding variant;
+	unsigned char const * rpi_bytes;
+	RpiList const * beacons;
+	MatchMetadataKey * key;
+	bool matched;
+} MatchLookup;
+
 // Function prototypes
 
 MatchListItem * match_list_item_new();
 void match_list_item_delete(MatchListItem * data);
 void match_list_append(MatchList * data, MatchListItem * item);
+static void match_list_find_dtk_matches(MatchList * data, RpiList * beacons, Dtk const * diagnosis_key, unsigned char * generated);
+static int match_queued_compare_newest_first(void const * left, void const * right);
+static void match_list_find_dtk_index_matches(MatchList * data, RpiIndex const * index, RpiList const * beacons, Dtk const * diagnosis_key, unsigned char * generated);
+static void match_list_index_visit(uint32_t tag, void * user_data);
+static size_t match_segment_lower_bound(MatchSegment const * segment, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+static void match_list_find_dtk_segment_matches(MatchList * data, MatchSegment const * segment, Dtk const * diagnosis_key, unsigned char * generated);
 
 // Function definitions
 
@@ -110,6 +161,7 @@ MatchList * match_list_new() {
 void match_list_delete(MatchList * data) {
 	if (data) {
 		match_list_clear(data);
+		free(data->spill_directory);
 
 		free(data);
 	}
@@ -228,6 +280,42 @@ uint8_t match_list_get_time_interval_number(MatchListItem const * data) {
 	return data->time_interval_number;
 }
 
+/**
+ * Returns the decrypted metadata of the beacon that matched.
+ *
+ * Metadata is only available when matching using RPI_SCHEME_AES and the
+ * beacon was stored with its encrypted metadata using
+ * \ref rpi_list_add_sighting_metadata(). The metadata is decrypted as the
+ * match is found, so it's already available when any callback set using
+ * \ref match_list_set_callback() is called.
+ *
+ * Metadata isn't available for matches found against beacons that aren't held
+ * in an RpiList, or when matching within a memory budget requires the beacons
+ * to be partitioned.
+ *
+ * @param data The list to operate on.
+ * @return The RPI_METADATA_SIZE bytes of decrypted metadata, or NULL if there
+ *         isn't any.
+ */
+unsigned char const * match_list_get_metadata(MatchListItem const * data) {
+	return data->has_metadata ? data->metadata : NULL;
+}
+
+/**
+ * Returns the encoding of the RPI that matched.
+ *
+ * When several encodings have been registered using
+ * \ref match_list_add_rpi_variant(), this identifies which of them the
+ * matching RPI was generated with. Otherwise, and for matches found using
+ * RPI_SCHEME_AES, it's RPI_ENCODING_BINARY.
+ *
+ * @param data The list to operate on.
+ * @return The encoding the matching RPI was generated with.
+ */
+RpiEncoding match_list_get_variant(MatchListItem const * data) {
+	return data->variant;
+}
+
 /**
  * Adds an item to the list.
  *
@@ -246,6 +334,402 @@ void match_list_append(MatchList * data, MatchListItem * item) {
 		data->last = item;
 	}
 	data->count++;
+
+	if (data->callback) {
+		data->callback(item, data->user_data);
+	}
+}
+
+/**
+ * Creates a match and adds it to the list.
+ *
+ * For internal use by the different matching strategies.
+ *
+ * @param data The list to append to.
+ * @param day_number The day number of the matching DTK.
+ * @param time_interval_number The time interval number of the matching RPI.
+ */
+void match_list_append_match(MatchList * data, uint32_t day_number, uint8_t time_interval_number) {
+	match_list_append_beacon_match(data, NULL, day_number, time_interval_number, RPI_ENCODING_BINARY, NULL);
+}
+
+/**
+ * Prepares to decrypt the metadata of beacons matching a diagnosis key.
+ *
+ * For internal use. The metadata key isn't derived until
+ * \ref match_list_append_beacon_match() finds a beacon with metadata to
+ * decrypt, so keys that don't match any beacons never pay for it. Once
+ * derived, it's reused for all further matches against the same key.
+ *
+ * @param key The metadata key state to initialise.
+ * @param dtk The diagnosis key the metadata key will be derived from.
+ */
+void match_metadata_key_init(MatchMetadataKey * key, Dtk const * dtk) {
+	key->dtk = dtk;
+	key->derived = false;
+	key->valid = false;
+}
+
+/**
+ * Clears the metadata key once the diagnosis key has been processed.
+ *
+ * For internal use.
+ *
+ * @param key The metadata key state to clear.
+ */
+void match_metadata_key_clear(MatchMetadataKey * key) {
+	// Clear the data for security
+	memset(key, 0, sizeof(MatchMetadataKey));
+}
+
+/**
+ * Creates a match against a stored beacon and adds it to the list.
+ *
+ * For internal use by the different matching strategies. If the list is using
+ * RPI_SCHEME_AES and the beacon has encrypted metadata, the metadata is
+ * decrypted and stored with the match. The metadata key is derived the first
+ * time it's needed for the diagnosis key and cached in the key state.
+ *
+ * @param data The list to append to.
+ * @param key The metadata key state for the matching DTK, or NULL.
+ * @param day_number The day number of the matching DTK.
+ * @param time_interval_number The time interval number of the matching RPI.
+ * @param variant The encoding the matching RPI was generated with.
+ * @param beacon The beacon that matched, or NULL if it isn't known.
+ */
+void match_list_append_beacon_match(MatchList * data, MatchMetadataKey * key, uint32_t day_number, uint8_t time_interval_number, RpiEncoding variant, RpiListItem const * beacon) {
+	MatchListItem * match;
+	unsigned char const * encrypted;
+
+	match = match_list_item_new();
+	match->day_number = day_number;
+	match->time_interval_number = time_interval_number;
+	match->variant = variant;
+
+	encrypted = beacon ? rpi_list_get_metadata(beacon) : NULL;
+	if ((key != NULL) && (encrypted != NULL) && (data->scheme == RPI_SCHEME_AES)) {
+		if (!key->derived) {
+			key->valid = rpi_generate_metadata_key(key->dtk, key->aemk);
+			key->derived = true;
+		}
+		if (key->valid) {
+			match->has_metadata = rpi_decrypt_metadata(key->aemk, rpi_get_proximity_id(rpi_list_get_rpi(beacon)), encrypted, match->metadata);
+		}
+	}
+
+	match_list_append(data, match);
+}
+
+/**
+ * Sets the order in which diagnosis keys are processed.
+ *
+ * By default DTKs are processed in download order. Setting the order to
+ * MATCH_ORDER_NEWEST_FIRST causes the DTKs with the most recent day number to
+ * be processed first. Combined with a callback set using
+ * \ref match_list_set_callback() this allows the most actionable matches to be
+ * reported as early as possible.
+ *
+ * The order affects only the sequence in which matches are found and appended
+ * to the list; the set of matches found is the same either way.
+ *
+ * @param data The list to operate on.
+ * @param order The order to use for future calls to
+ *        \ref match_list_find_matches().
+ */
+void match_list_set_order(MatchList * data, MatchOrder order) {
+	data->order = order;
+}
+
+/**
+ * Gets the order in which diagnosis keys are processed.
+ *
+ * @param data The list to operate on.
+ * @return The order used when searching for matches.
+ */
+MatchOrder match_list_get_order(MatchList const * data) {
+	return data->order;
+}
+
+/**
+ * Sets a callback to be called each time a match is added to the list.
+ *
+ * The callback is called synchronously from within
+ * \ref match_list_find_matches(), immediately after each match is appended,
+ * allowing matches to be reported incrementally rather than after the full
+ * search has completed.
+ *
+ * Set the callback to NULL to stop receiving notifications.
+ *
+ * @param data The list to operate on.
+ * @param callback The function to call for each match, or NULL.
+ * @param user_data A pointer that will be passed to the callback.
+ */
+void match_list_set_callback(MatchList * data, MatchCallback callback, void * user_data) {
+	data->callback = callback;
+	data->user_data = user_data;
+}
+
+/**
+ * Sets the maximum amount of memory to use for indexing beacons.
+ *
+ * By default the budget is zero, meaning no limit is applied. When a budget is
+ * set and an in-memory index of the beacons passed to
+ * \ref match_list_find_matches() would exceed it, the beacons and the RPIs
+ * generated from the diagnosis keys are instead partitioned into temporary
+ * files by RPI prefix. Each partition is then matched in turn, with only a
+ * single partition of beacons held in memory at a time.
+ *
+ * The matches found are the same either way, but when partitioning is used
+ * they're reported grouped by partition, so the order set using
+ * \ref match_list_set_order() is no longer reflected in the order of the list.
+ *
+ * @param data The list to operate on.
+ * @param memory_budget The memory budget in bytes, or zero for no limit.
+ */
+void match_list_set_memory_budget(MatchList * data, size_t memory_budget) {
+	data->memory_budget = memory_budget;
+}
+
+/**
+ * Gets the maximum amount of memory to use for indexing beacons.
+ *
+ * @param data The list to operate on.
+ * @return The memory budget in bytes, or zero if there's no limit.
+ */
+size_t match_list_get_memory_budget(MatchList const * data) {
+	return data->memory_budget;
+}
+
+/**
+ * Sets the directory used for temporary files when matching within a memory
+ * budget.
+ *
+ * The files are unlinked as soon as they're created, so nothing is left behind
+ * if the process exits unexpectedly. If no directory is set, or it's set to
+ * NULL, the files are created using tmpfile().
+ *
+ * @param data The list to operate on.
+ * @param directory The directory to create temporary files in, or NULL.
+ */
+void match_list_set_spill_directory(MatchList * data, char const * directory) {
+	free(data->spill_directory);
+	data->spill_directory = directory ? strdup(directory) : NULL;
+}
+
+/**
+ * Sets the scheme used to generate RPIs from the diagnosis keys.
+ *
+ * By default RPI_SCHEME_HMAC is used. This must match the scheme that was
+ * used to generate the RPIs broadcast by the devices that uploaded the
+ * diagnosis keys, otherwise no matches will be found.
+ *
+ * @param data The list to operate on.
+ * @param scheme The scheme to use.
+ */
+void match_list_set_rpi_scheme(MatchList * data, RpiScheme scheme) {
+	data->scheme = scheme;
+}
+
+/**
+ * Gets the scheme used to generate RPIs from the diagnosis keys.
+ *
+ * @param data The list to operate on.
+ * @return The scheme that will be used.
+ */
+RpiScheme match_list_get_rpi_scheme(MatchList const * data) {
+	return data->scheme;
+}
+
+/**
+ * Registers an encoding to generate RPIs with when using RPI_SCHEME_HMAC.
+ *
+ * Implementations differ in how they encode the Info used to generate RPIs.
+ * Registering several encodings allows beacons from all of them to be
+ * matched in a single pass, with each match tagged with the encoding that
+ * produced it. The HMAC key for each diagnosis key is set up once and shared
+ * between all of the encodings, so this costs much less than matching once
+ * for each encoding.
+ *
+ * If no encodings are registered, only RPI_ENCODING_BINARY is used.
+ * Registering an encoding that's already registered has no effect. The
+ * encodings are ignored when using RPI_SCHEME_AES, which isn't ambiguous.
+ *
+ * @param data The list to operate on.
+ * @param variant The encoding to add.
+ */
+void match_list_add_rpi_variant(MatchList * data, RpiEncoding variant) {
+	size_t pos;
+	bool found;
+
+	found = false;
+	for (pos = 0; pos < data->variant_count; ++pos) {
+		found = found || (data->variants[pos] == variant);
+	}
+
+	if ((!found) && (variant < RPI_ENCODING_COUNT)) {
+		data->variants[data->variant_count] = variant;
+		data->variant_count++;
+	}
+}
+
+/**
+ * Removes all of the encodings registered using
+ * \ref match_list_add_rpi_variant().
+ *
+ * Only RPI_ENCODING_BINARY will then be used.
+ *
+ * @param data The list to operate on.
+ */
+void match_list_clear_rpi_variants(MatchList * data) {
+	data->variant_count = 0;
+}
+
+/**
+ * Copies the RPI scheme and encodings from one list to another.
+ *
+ * For internal use, where matching is performed into a temporary list before
+ * the results are transferred.
+ *
+ * @param data The list to operate on.
+ * @param source The list to copy the settings from.
+ */
+void match_list_copy_rpi_settings(MatchList * data, MatchList const * source) {
+	data->scheme = source->scheme;
+	memcpy(data->variants, source->variants, sizeof(data->variants));
+	data->variant_count = source->variant_count;
+}
+
+/**
+ * Returns the encodings registered using \ref match_list_add_rpi_variant().
+ *
+ * For internal use, where the settings need to be passed on to another
+ * matcher.
+ *
+ * @param data The list to operate on.
+ * @param variants An array of RPI_ENCODING_COUNT items to store the encodings
+ *        in.
+ * @return The number of encodings registered.
+ */
+size_t match_list_get_rpi_variants(MatchList const * data, RpiEncoding * variants) {
+	memcpy(variants, data->variants, sizeof(RpiEncoding) * data->variant_count);
+
+	return data->variant_count;
+}
+
+/**
+ * Generates all of the RPIs to match for a diagnosis key.
+ *
+ * For internal use by the different matching strategies. The generated
+ * buffer must be at least MATCH_GENERATED_SIZE bytes long. It's filled with
+ * the RPIs for each variant in turn, each laid out as for
+ * \ref rpi_generate_proximity_ids(), and the encoding of each variant is
+ * stored in the variants array.
+ *
+ * @param data The list whose settings should be used.
+ * @param diagnosis_key The DTK to generate RPIs from.
+ * @param generated A buffer to store the RPIs in.
+ * @param variants An array of RPI_ENCODING_COUNT items to store the encodings
+ *        in.
+ * @return The number of variants generated, or zero if generation failed.
+ */
+size_t match_list_generate_rpis(MatchList const * data, Dtk const * diagnosis_key, unsigned char * generated, RpiEncoding * variants) {
+	size_t count;
+	bool result;
+
+	if ((data->scheme == RPI_SCHEME_HMAC) && (data->variant_count > 0)) {
+		count = data->variant_count;
+		memcpy(variants, data->variants, sizeof(RpiEncoding) * count);
+		result = rpi_generate_proximity_ids_variants(diagnosis_key, variants, count, generated);
+	}
+	else {
+		count = 1;
+		variants[0] = RPI_ENCODING_BINARY;
+		result = rpi_generate_proximity_ids_scheme(diagnosis_key, data->scheme, generated);
+	}
+
+	return result ? count : 0;
+}
+
+/**
+ * Compares two queued diagnosis keys so they sort newest day first.
+ *
+ * For internal use. Keys with the same day number retain their download order.
+ *
+ * @param left The first MatchQueued item to compare.
+ * @param right The second MatchQueued item to compare.
+ * @return negative, zero or positive following the qsort() convention.
+ */
+static int match_queued_compare_newest_first(void const * left, void const * right) {
+	MatchQueued const * first = (MatchQueued const *)left;
+	MatchQueued const * second = (MatchQueued const *)right;
+	uint32_t day_first;
+	uint32_t day_second;
+	int result;
+
+	day_first = dtk_get_day_number(first->dtk);
+	day_second = dtk_get_day_number(second->dtk);
+
+	if (day_first != day_second) {
+		result = (day_first > day_second) ? -1 : 1;
+	}
+	else {
+		result = (first->position < second->position) ? -1 : ((first->position > second->position) ? 1 : 0);
+	}
+
+	return result;
+}
+
+/**
+ * Finds the matches between a single diagnosis key and the beacons.
+ *
+ * For internal use. Generates all possible RPIs for the DTK and compares them
+ * against the beacons, appending any matches to the list.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ * @param diagnosis_key The DTK to generate RPIs from.
+ * @param generated Working space of MATCH_GENERATED_SIZE bytes used to store
+ *        the generated RPIs.
+ */
+static void match_list_find_dtk_matches(MatchList * data, RpiList * beacons, Dtk const * diagnosis_key, unsigned char * generated) {
+	RpiListItem const * rpi_item;
+	MatchMetadataKey key;
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	size_t count;
+	size_t variant;
+	uint8_t interval;
+	bool result;
+	Rpi const * rpi;
+
+	match_metadata_key_init(&key, diagnosis_key);
+
+	// Generate all possible RPIs for this dtk and compare agsinst the beacons
+	count = match_list_generate_rpis(data, diagnosis_key, generated, variants);
+	for (variant = 0; variant < count; ++variant) {
+		for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+			// Check against all beacons
+			rpi_item = rpi_list_first(beacons);
+			while (rpi_item != NULL) {
+				rpi = rpi_list_get_rpi(rpi_item);
+				result = (memcmp(rpi_get_proximity_id(rpi), generated + (((variant * RPI_INTERVAL_MAX) + interval) * RPI_SIZE), RPI_SIZE) == 0);
+
+				if (result) {
+					if (interval != rpi_get_time_interval_number(rpi)) {
+						result = false;
+						LOG(LOG_DEBUG, "Matched beacons don't match intervals\n");
+					}
+				}
+
+				if (result) {
+					match_list_append_beacon_match(data, &key, dtk_get_day_number(diagnosis_key), interval, variants[variant], rpi_item);
+				}
+
+				rpi_item = rpi_list_next(rpi_item);
+			}
+		}
+	}
+
+	match_metadata_key_clear(&key);
 }
 
 /**
@@ -261,6 +745,12 @@ void match_list_append(MatchList * data, MatchListItem * item) {
  * The match list isn't cleared by this call and so any new values will be
  * appended to it.
  *
+ * The DTKs are processed in the order set using \ref match_list_set_order()
+ * and any callback set using \ref match_list_set_callback() is called as each
+ * match is found. If a memory budget has been set using
+ * \ref match_list_set_memory_budget() and the beacons won't fit within it, the
+ * matching is performed partition by partition using temporary files.
+ *
  * @param data The list that any matches will be appended to.
  * @param beacons A list of RPIs extracted from overheard BLE beacons.
  * @param diagnosis_keys A list of DTKs downloaed from a Diagnosis Server.
@@ -268,52 +758,382 @@ void match_list_append(MatchList * data, MatchListItem * item) {
 void match_list_find_matches(MatchList * data, RpiList * beacons, DtkList * diagnosis_keys) {
 	// For each diagnosis key, generate the RPIs and compare them against the captured RPI beacons
 	DtkListItem const * dtk_item;
-	RpiListItem const * rpi_item;
+	unsigned char * generated;
+	MatchQueued * queued;
+	size_t count;
+	size_t pos;
+	bool complete;
+
+	complete = false;
+
+	if (data->memory_budget > 0) {
+		if (rpi_index_memory_estimate(rpi_list_count(beacons)) > data->memory_budget) {
+			complete = match_list_find_matches_external(data, beacons, diagnosis_keys, data->memory_budget, data->spill_directory);
+			if (!complete) {
+				LOG(LOG_WARNING, "Falling back to in-memory matching\n");
+			}
+		}
+	}
+
+	if ((!complete) && (data->order == MATCH_ORDER_NEWEST_FIRST)) {
+		generated = malloc(MATCH_GENERATED_SIZE);
+
+		count = 0;
+		dtk_item = dtk_list_first(diagnosis_keys);
+		while (dtk_item != NULL) {
+			count++;
+			dtk_item = dtk_list_next(dtk_item);
+		}
+
+		queued = malloc(sizeof(MatchQueued) * count);
+		pos = 0;
+		dtk_item = dtk_list_first(diagnosis_keys);
+		while (dtk_item != NULL) {
+			queued[pos].dtk = dtk_list_get_dtk(dtk_item);
+			queued[pos].position = pos;
+			pos++;
+			dtk_item = dtk_list_next(dtk_item);
+		}
+
+		qsort(queued, count, sizeof(MatchQueued), match_queued_compare_newest_first);
+
+		for (pos = 0; pos < count; ++pos) {
+			match_list_find_dtk_matches(data, beacons, queued[pos].dtk, generated);
+		}
+
+		free(queued);
+		free(generated);
+	}
+	else if (!complete) {
+		generated = malloc(MATCH_GENERATED_SIZE);
+
+		dtk_item = dtk_list_first(diagnosis_keys);
+		while (dtk_item != NULL) {
+			match_list_find_dtk_matches(data, beacons, dtk_list_get_dtk(dtk_item), generated);
+			dtk_item = dtk_list_next(dtk_item);
+		}
+
+		free(generated);
+	}
+}
+
+/**
+ * Records a match found in a beacon index.
+ *
+ * For internal use. Only the first entry found for each lookup is recorded,
+ * so repeated sightings of the same RPI are reported once.
+ *
+ * @param tag The tag of the beacon that matched.
+ * @param user_data The MatchLookup state.
+ */
+static void match_list_index_visit(uint32_t tag, void * user_data) {
+	MatchLookup * lookup = (MatchLookup *)user_data;
+	RpiListItem const * beacon;
+
+	if (!lookup->matched) {
+		// Only matched beacons are looked up to find their metadata
+		beacon = lookup->beacons ? rpi_list_find(lookup->beacons, lookup->rpi_bytes, lookup->time_interval_number) : NULL;
+		match_list_append_beacon_match(lookup->data, lookup->key, lookup->day_number, lookup->time_interval_number, lookup->variant, beacon);
+		lookup->matched = true;
+	}
+}
+
+/**
+ * Finds the matches between a single diagnosis key and an index of beacons.
+ *
+ * For internal use. Generates all possible RPIs for the DTK and looks each up
+ * in the index, appending any matches to the list.
+ *
+ * If the list the index was built from is provided, matched beacons are
+ * looked up in it so that their metadata can be decrypted.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param index An index of the RPIs extracted from overheard BLE beacons.
+ * @param beacons The list the index was built from, or NULL.
+ * @param diagnosis_key The DTK to generate RPIs from.
+ * @param generated Working space of MATCH_GENERATED_SIZE bytes used to store
+ *        the generated RPIs.
+ */
+static void match_list_find_dtk_index_matches(MatchList * data, RpiIndex const * index, RpiList const * beacons, Dtk const * diagnosis_key, unsigned char * generated) {
+	MatchLookup lookup;
+	MatchMetadataKey key;
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	size_t count;
+	size_t variant;
 	uint8_t interval;
-	bool result;
-	Rpi * generated;
-	MatchListItem * match;
+
+	match_metadata_key_init(&key, diagnosis_key);
+	lookup.data = data;
+	lookup.day_number = dtk_get_day_number(diagnosis_key);
+	lookup.beacons = beacons;
+	lookup.key = &key;
+
+	count = match_list_generate_rpis(data, diagnosis_key, generated, variants);
+	for (variant = 0; variant < count; ++variant) {
+		lookup.variant = variants[variant];
+		for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+			lookup.time_interval_number = interval;
+			lookup.rpi_bytes = generated + (((variant * RPI_INTERVAL_MAX) + interval) * RPI_SIZE);
+			lookup.matched = false;
+			rpi_index_find(index, lookup.rpi_bytes, interval, match_list_index_visit, &lookup);
+		}
+	}
+
+	match_metadata_key_clear(&key);
+}
+
+/**
+ * Returns a list of matches found between the beacons and a stream of
+ * diagnosis keys.
+ *
+ * This finds the same matches as \ref match_list_find_matches(), but the
+ * diagnosis keys are read one at a time from the stream and discarded once
+ * they've been checked, so no DtkList is ever built. The memory used is
+ * therefore bounded by the stream's chunk size and the number of beacons,
+ * irrespective of the number of diagnosis keys.
+ *
+ * Keys are processed in the order they appear in the stream; the order set
+ * using \ref match_list_set_order() is ignored. Any callback set using
+ * \ref match_list_set_callback() is called as each match is found.
+ *
+ * The match list isn't cleared by this call and so any new values will be
+ * appended to it.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ * @param diagnosis_keys A stream of DTKs downloaded from a Diagnosis Server.
+ * @return true if the full stream was read successfully, false otherwise.
+ */
+bool match_stream(MatchList * data, RpiList * beacons, DtkStream * diagnosis_keys) {
+	RpiIndex * index;
+	Dtk * diagnosis_key;
+	unsigned char * generated;
+	unsigned char dtk_bytes[DTK_SIZE];
+	uint32_t day_number;
+
+	index = rpi_index_new(0);
+	rpi_index_add_list(index, beacons);
+	diagnosis_key = dtk_new();
+	generated = malloc(MATCH_GENERATED_SIZE);
+
+	while (dtk_stream_read(diagnosis_keys, dtk_bytes, &day_number)) {
+		dtk_assign(diagnosis_key, dtk_bytes, day_number);
+		match_list_find_dtk_index_matches(data, index, beacons, diagnosis_key, generated);
+	}
+
+	// Clear the data for security
+	memset(dtk_bytes, 0, DTK_SIZE);
+	free(generated);
+	dtk_delete(diagnosis_key);
+	rpi_index_delete(index);
+
+	return !dtk_stream_get_error(diagnosis_keys);
+}
+
+/**
+ * Compares two beacon records by RPI and then time interval number.
+ *
+ * For internal use. Segments sorted into this order can be searched in
+ * place using a binary search, without building an index.
+ *
+ * @param left The first BeaconRecord to compare.
+ * @param right The second BeaconRecord to compare.
+ * @return negative, zero or positive following the qsort() convention.
+ */
+int match_record_compare(void const * left, void const * right) {
+	BeaconRecord const * first = (BeaconRecord const *)left;
+	BeaconRecord const * second = (BeaconRecord const *)right;
+	int result;
+
+	result = memcmp(first->rpi, second->rpi, RPI_SIZE);
+	if (result == 0) {
+		result = (int)first->time_interval_number - (int)second->time_interval_number;
+	}
+
+	return result;
+}
+
+/**
+ * Finds the first record in a sorted segment that isn't less than a beacon.
+ *
+ * For internal use.
+ *
+ * @param segment The sorted segment to search.
+ * @param rpi_bytes The RPI to search for.
+ * @param time_interval_number The time interval number to search for.
+ * @return The position of the first record not less than the beacon, or the
+ *         segment count if there isn't one.
+ */
+static size_t match_segment_lower_bound(MatchSegment const * segment, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	BeaconRecord target;
+	size_t low;
+	size_t high;
+	size_t middle;
+
+	memcpy(target.rpi, rpi_bytes, RPI_SIZE);
+	target.time_interval_number = time_interval_number;
+
+	low = 0;
+	high = segment->count;
+	while (low < high) {
+		middle = low + ((high - low) / 2);
+		if (match_record_compare(&segment->records[middle], &target) < 0) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/**
+ * Finds the matches between a single diagnosis key and a sorted segment.
+ *
+ * For internal use. Generates all possible RPIs for the DTK and searches for
+ * each in the segment's records, appending any matches to the list. The same
+ * RPI may have been seen several times in an interval, but only one match is
+ * appended for it.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param segment The sorted beacons captured on the key's day.
+ * @param diagnosis_key The DTK to generate RPIs from.
+ * @param generated Working space of MATCH_GENERATED_SIZE bytes used to store
+ *        the generated RPIs.
+ */
+static void match_list_find_dtk_segment_matches(MatchList * data, MatchSegment const * segment, Dtk const * diagnosis_key, unsigned char * generated) {
+	MatchMetadataKey key;
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	unsigned char const * rpi_bytes;
+	uint32_t day_number;
+	size_t count;
+	size_t variant;
+	size_t pos;
+	uint8_t interval;
+
+	match_metadata_key_init(&key, diagnosis_key);
+	day_number = dtk_get_day_number(diagnosis_key);
+
+	count = match_list_generate_rpis(data, diagnosis_key, generated, variants);
+	for (variant = 0; variant < count; ++variant) {
+		for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+			rpi_bytes = generated + (((variant * RPI_INTERVAL_MAX) + interval) * RPI_SIZE);
+			pos = match_segment_lower_bound(segment, rpi_bytes, interval);
+			if ((pos < segment->count) && (segment->records[pos].time_interval_number == interval) && (memcmp(segment->records[pos].rpi, rpi_bytes, RPI_SIZE) == 0)) {
+				match_list_append_beacon_match(data, &key, day_number, interval, variants[variant], NULL);
+			}
+		}
+	}
+
+	match_metadata_key_clear(&key);
+}
+
+/**
+ * Finds the matches between the diagnosis keys and beacons held in day
+ * segments.
+ *
+ * For internal use. Each diagnosis key is only checked against the segment
+ * for its own day. The index for a segment is built the first time a key for
+ * that day is found, so days without any diagnosis keys are never indexed and
+ * keys for days without any beacons never have their RPIs generated. Sorted
+ * segments are searched in place and never indexed.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param segments The beacons, one segment for each day.
+ * @param count The number of segments.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ */
+void match_list_find_matches_segments(MatchList * data, MatchSegment const * segments, size_t count, DtkList * diagnosis_keys) {
+	DtkListItem const * dtk_item;
 	Dtk const * diagnosis_key;
-	Rpi const * rpi;
+	RpiIndex ** indices;
+	unsigned char * generated;
+	uint32_t day_number;
+	size_t segment;
+	size_t pos;
 
-	dtk_item = dtk_list_first(diagnosis_keys);
-	generated = rpi_new();
+	indices = calloc(sizeof(RpiIndex *), MAX(count, 1));
+	generated = malloc(MATCH_GENERATED_SIZE);
 
+	dtk_item = dtk_list_first(diagnosis_keys);
 	while (dtk_item != NULL) {
 		diagnosis_key = dtk_list_get_dtk(dtk_item);
-		// Generate all possible RPIs for this dtk and compare agsinst the beacons
-		for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
-			result = rpi_generate_proximity_id(generated, diagnosis_key, interval);
-			if (result) {
-				// Check against all beacons
-				rpi_item = rpi_list_first(beacons);
-				while (rpi_item != NULL) {
-					rpi = rpi_list_get_rpi(rpi_item);
-					result = rpi_compare(rpi, generated);
-
-					if (result) {
-						if (interval != rpi_get_time_interval_number(rpi)) {
-							result = false;
-							LOG(LOG_DEBUG, "Matched beacons don't match intervals\n");
-						}
-					}
-					
-					if (result) {
-						match = match_list_item_new();
-						match->day_number = dtk_get_day_number(diagnosis_key);
-						match->time_interval_number = interval;
-						match_list_append(data, match);
-					}
+		day_number = dtk_get_day_number(diagnosis_key);
+
+		segment = 0;
+		while ((segment < count) && (segments[segment].day_number != day_number)) {
+			segment++;
+		}
 
-					rpi_item = rpi_list_next(rpi_item);
+		if ((segment < count) && segments[segment].sorted) {
+			match_list_find_dtk_segment_matches(data, &segments[segment], diagnosis_key, generated);
+		}
+		else if (segment < count) {
+			if (indices[segment] == NULL) {
+				indices[segment] = rpi_index_new(segments[segment].count);
+				for (pos = 0; pos < segments[segment].count; ++pos) {
+					rpi_index_add(indices[segment], segments[segment].records[pos].rpi, segments[segment].records[pos].time_interval_number, pos);
 				}
 			}
+			match_list_find_dtk_index_matches(data, indices[segment], NULL, diagnosis_key, generated);
 		}
 
 		dtk_item = dtk_list_next(dtk_item);
 	}
 
-	rpi_delete(generated);
+	free(generated);
+	for (segment = 0; segment < count; ++segment) {
+		rpi_index_delete(indices[segment]);
+	}
+	free(indices);
+}
+
+/**
+ * Checks a contiguous array of diagnosis keys for a single day against the
+ * beacons captured on that day.
+ *
+ * For internal use, by sources that already hold their keys grouped by day.
+ * The beacons are indexed once, unless the segment is sorted, and all of the
+ * keys are then checked against them.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param segment The beacons captured on the day.
+ * @param dtk_bytes The keys for the same day, each DTK_SIZE bytes long, one
+ *        after the other.
+ * @param count The number of keys.
+ */
+void match_list_find_matches_segment_keys(MatchList * data, MatchSegment const * segment, unsigned char const * dtk_bytes, size_t count) {
+	RpiIndex * index;
+	Dtk * diagnosis_key;
+	unsigned char * generated;
+	size_t pos;
+
+	if ((segment->count > 0) && (count > 0)) {
+		index = NULL;
+		if (!segment->sorted) {
+			index = rpi_index_new(segment->count);
+			for (pos = 0; pos < segment->count; ++pos) {
+				rpi_index_add(index, segment->records[pos].rpi, segment->records[pos].time_interval_number, pos);
+			}
+		}
+
+		generated = malloc(MATCH_GENERATED_SIZE);
+		diagnosis_key = dtk_new();
+		for (pos = 0; pos < count; ++pos) {
+			dtk_assign(diagnosis_key, dtk_bytes + (pos * DTK_SIZE), segment->day_number);
+			if (segment->sorted) {
+				match_list_find_dtk_segment_matches(data, segment, diagnosis_key, generated);
+			}
+			else {
+				match_list_find_dtk_index_matches(data, index, NULL, diagnosis_key, generated);
+			}
+		}
+
+		dtk_delete(diagnosis_key);
+		free(generated);
+		rpi_index_delete(index);
+	}
 }
 
 /** @} addtogroup Matching*/
@@ -0,0 +1,435 @@
+/** \ingroup Matching
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Matches the beacons from many devices in a single pass
+ * @section DESCRIPTION
+ *
+ * This class allows the beacons captured by many different devices (tenants)
+ * to be matched against the same diagnosis keys at once. The RPIs for each
+ * diagnosis key are generated only once and looked up in a combined index of
+ * all the tenants' beacons, so the cost of deriving the RPIs is shared between
+ * all of the tenants rather than paid once per device.
+ *
+ * The matches are returned partitioned by tenant, with a separate
+ * \ref MatchList for each. They carry the same encodings and decrypted
+ * metadata as matching each tenant's beacons separately.
+ *
+ */
+
+/** \addtogroup Matching
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/rpi.h"
+#include "contrac/rpi_index.h"
+#include "contrac/match_private.h"
+
+#include "contrac/match_batch.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The initial number of slots in the hash table used to look up tenants. Must
+ * be a power of two.
+ */
+#define MATCH_BATCH_SLOTS_MIN (32)
+
+// Structures
+
+/**
+ * @brief A single tenant in the batch
+ *
+ * The tenant's beacons are copied into its own list, which is used to skip
+ * beacons that are already in the index and to find the metadata of beacons
+ * that match.
+ */
+typedef struct _MatchBatchTenant {
+	uint32_t tenant_id;
+	RpiList * beacons;
+	MatchList * matches;
+} MatchBatchTenant;
+
+/**
+ * @brief A batch of tenants
+ *
+ * This is an opaque structure that represents the batch. The beacons from all
+ * of the tenants are held in a single index, with each entry tagged with the
+ * position of its tenant in the tenants array. Each RPI and time interval
+ * number appears in the index at most once for each tenant.
+ *
+ * The RPI scheme and encodings to match are held in the settings list, and
+ * copied to each tenant's match list before matching.
+ *
+ * Tenants are looked up by identifier using an open addressing hash table.
+ * Each slot holds the position of a tenant plus one, with zero marking an
+ * empty slot. The table is kept at most half full.
+ *
+ * The structure typedef is in match_batch.h
+ */
+struct _MatchBatch {
+	MatchBatchTenant * tenants;
+	size_t count;
+	size_t allocated;
+
+	size_t * slots;
+	size_t slot_count;
+
+	RpiIndex * index;
+	MatchList * settings;
+};
+
+/**
+ * @brief The state passed to the index lookup callback
+ */
+typedef struct _MatchBatchLookup {
+	MatchBatch * data;
+	MatchMetadataKey * key;
+	unsigned char const * rpi_bytes;
+	uint32_t day_number;
+	uint8_t time_interval_number;
+	RpiEncoding variant;
+} MatchBatchLookup;
+
+// Function prototypes
+
+static size_t match_batch_slot(MatchBatch const * data, uint32_t tenant_id);
+static void match_batch_grow_slots(MatchBatch * data);
+static size_t match_batch_find_tenant(MatchBatch const * data, uint32_t tenant_id);
+static void match_batch_visit(uint32_t tag, void * user_data);
+
+// Function definitions
+
+/**
+ * Creates a new instance of the class.
+ *
+ * @return The newly created object.
+ */
+MatchBatch * match_batch_new() {
+	MatchBatch * data;
+
+	data = calloc(sizeof(MatchBatch), 1);
+	data->index = rpi_index_new(0);
+	data->settings = match_list_new();
+	data->slot_count = MATCH_BATCH_SLOTS_MIN;
+	data->slots = calloc(sizeof(size_t), data->slot_count);
+
+	return data;
+}
+
+/**
+ * Deletes an instance of the class, freeing up the memory allocated to it.
+ *
+ * This will also delete the match lists for all of the tenants.
+ *
+ * @param data The instance to free.
+ */
+void match_batch_delete(MatchBatch * data) {
+	size_t pos;
+
+	if (data) {
+		for (pos = 0; pos < data->count; ++pos) {
+			rpi_list_delete(data->tenants[pos].beacons);
+			match_list_delete(data->tenants[pos].matches);
+		}
+		free(data->tenants);
+		free(data->slots);
+		rpi_index_delete(data->index);
+		match_list_delete(data->settings);
+
+		free(data);
+	}
+}
+
+/**
+ * Finds the hash table slot for a tenant.
+ *
+ * For internal use. Probes linearly from the tenant's hash until either the
+ * tenant or an empty slot is found.
+ *
+ * @param data The batch to search.
+ * @param tenant_id The tenant to find.
+ * @return The slot holding the tenant, or the empty slot it would go in.
+ */
+static size_t match_batch_slot(MatchBatch const * data, uint32_t tenant_id) {
+	size_t slot;
+	uint32_t hash;
+
+	// Mix the bits, since identifiers are often sequential
+	hash = tenant_id;
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3bu;
+	hash ^= hash >> 16;
+
+	slot = hash & (data->slot_count - 1);
+	while ((data->slots[slot] != 0) && (data->tenants[data->slots[slot] - 1].tenant_id != tenant_id)) {
+		slot = (slot + 1) & (data->slot_count - 1);
+	}
+
+	return slot;
+}
+
+/**
+ * Doubles the size of the hash table used to look up tenants.
+ *
+ * For internal use.
+ *
+ * @param data The batch to operate on.
+ */
+static void match_batch_grow_slots(MatchBatch * data) {
+	size_t pos;
+
+	free(data->slots);
+	data->slot_count *= 2;
+	data->slots = calloc(sizeof(size_t), data->slot_count);
+
+	for (pos = 0; pos < data->count; ++pos) {
+		data->slots[match_batch_slot(data, data->tenants[pos].tenant_id)] = pos + 1;
+	}
+}
+
+/**
+ * Finds the position of a tenant in the batch.
+ *
+ * For internal use.
+ *
+ * @param data The batch to search.
+ * @param tenant_id The tenant to find.
+ * @return The position of the tenant, or the tenant count if not found.
+ */
+static size_t match_batch_find_tenant(MatchBatch const * data, uint32_t tenant_id) {
+	size_t slot;
+
+	slot = match_batch_slot(data, tenant_id);
+
+	return (data->slots[slot] != 0) ? data->slots[slot] - 1 : data->count;
+}
+
+/**
+ * Adds the beacons captured by a tenant to the batch.
+ *
+ * The beacons are copied into the combined index, so the list can be deleted
+ * once this call returns. If the tenant has already been added, the beacons
+ * are added to those already held for it; as with \ref RpiList, an RPI the
+ * tenant has already reported for the same time interval is only matched
+ * once. Each beacon's latest sighting and any encrypted metadata are kept.
+ *
+ * @param data The batch to add to.
+ * @param tenant_id An identifier for the tenant, chosen by the caller.
+ * @param beacons A list of RPIs extracted from BLE beacons the tenant overheard.
+ */
+void match_batch_add_tenant(MatchBatch * data, uint32_t tenant_id, RpiList const * beacons) {
+	RpiListItem const * rpi_item;
+	Rpi const * rpi;
+	MatchBatchTenant * tenant;
+	size_t position;
+
+	position = match_batch_find_tenant(data, tenant_id);
+	if (position == data->count) {
+		if (data->count >= data->allocated) {
+			data->allocated = MAX(data->allocated * 2, 16);
+			data->tenants = realloc(data->tenants, sizeof(MatchBatchTenant) * data->allocated);
+		}
+		data->tenants[position].tenant_id = tenant_id;
+		data->tenants[position].beacons = rpi_list_new();
+		data->tenants[position].matches = match_list_new();
+		data->count++;
+
+		if ((data->count * 2) > data->slot_count) {
+			match_batch_grow_slots(data);
+		}
+		else {
+			data->slots[match_batch_slot(data, tenant_id)] = position + 1;
+		}
+	}
+
+	tenant = &data->tenants[position];
+	rpi_item = rpi_list_first(beacons);
+	while (rpi_item != NULL) {
+		rpi = rpi_list_get_rpi(rpi_item);
+		if (rpi_list_find(tenant->beacons, rpi_get_proximity_id(rpi), rpi_get_time_interval_number(rpi)) == NULL) {
+			rpi_index_add(data->index, rpi_get_proximity_id(rpi), rpi_get_time_interval_number(rpi), position);
+		}
+		rpi_list_add_sighting_metadata(tenant->beacons, rpi_get_proximity_id(rpi), rpi_get_time_interval_number(rpi), rpi_list_get_last_seen(rpi_item), rpi_list_get_rssi_max(rpi_item), rpi_list_get_metadata(rpi_item));
+		rpi_item = rpi_list_next(rpi_item);
+	}
+}
+
+/**
+ * Sets the scheme used to generate RPIs from the diagnosis keys.
+ *
+ * By default RPI_SCHEME_HMAC is used. The same scheme applies to all of the
+ * tenants in the batch. See \ref match_list_set_rpi_scheme().
+ *
+ * @param data The batch to operate on.
+ * @param scheme The scheme to use.
+ */
+void match_batch_set_rpi_scheme(MatchBatch * data, RpiScheme scheme) {
+	match_list_set_rpi_scheme(data->settings, scheme);
+}
+
+/**
+ * Adds an RPI encoding to match for all of the tenants in the batch.
+ *
+ * See \ref match_list_add_rpi_variant(). Each match records the encoding of
+ * the RPI that matched.
+ *
+ * @param data The batch to operate on.
+ * @param variant The encoding to add.
+ */
+void match_batch_add_rpi_variant(MatchBatch * data, RpiEncoding variant) {
+	match_list_add_rpi_variant(data->settings, variant);
+}
+
+/**
+ * Returns the number of tenants in the batch.
+ *
+ * @param data The batch to operate on.
+ * @return The number of distinct tenants that have been added.
+ */
+size_t match_batch_get_tenant_count(MatchBatch const * data) {
+	return data->count;
+}
+
+/**
+ * Returns the identifier of a tenant in the batch.
+ *
+ * Tenants are held in the order they were first added, so this allows the
+ * tenants to be iterated through.
+ *
+ * @param data The batch to operate on.
+ * @param position The position of the tenant, less than the tenant count.
+ * @return The tenant identifier.
+ */
+uint32_t match_batch_get_tenant_id(MatchBatch const * data, size_t position) {
+	return data->tenants[position].tenant_id;
+}
+
+/**
+ * Records a match found in the combined index.
+ *
+ * For internal use.
+ *
+ * @param tag The position of the tenant whose beacon matched.
+ * @param user_data The MatchBatchLookup state.
+ */
+static void match_batch_visit(uint32_t tag, void * user_data) {
+	MatchBatchLookup * lookup = (MatchBatchLookup *)user_data;
+	MatchBatchTenant * tenant;
+	RpiListItem const * beacon;
+
+	// Only matched beacons are looked up to find their metadata
+	tenant = &lookup->data->tenants[tag];
+	beacon = rpi_list_find(tenant->beacons, lookup->rpi_bytes, lookup->time_interval_number);
+	match_list_append_beacon_match(tenant->matches, lookup->key, lookup->day_number, lookup->time_interval_number, lookup->variant, beacon);
+}
+
+/**
+ * Finds the matches between the diagnosis keys and every tenant's beacons.
+ *
+ * Each diagnosis key's RPIs are generated once and looked up in the combined
+ * index, with any matches appended to the match list of the tenant that
+ * captured the beacon. For each tenant the matches are the same as those
+ * found by calling \ref match_list_find_matches() with that tenant's beacons
+ * and the batch's RPI settings, including the encoding and any decrypted
+ * metadata of each match.
+ *
+ * The match lists aren't cleared by this call and so any new values will be
+ * appended to them.
+ *
+ * @param data The batch to operate on.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ */
+void match_batch_find_matches(MatchBatch * data, DtkList * diagnosis_keys) {
+	DtkListItem const * dtk_item;
+	Dtk const * diagnosis_key;
+	unsigned char * generated;
+	MatchBatchLookup lookup;
+	MatchMetadataKey key;
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	size_t count;
+	size_t variant;
+	size_t pos;
+	uint8_t interval;
+
+	generated = malloc(MATCH_GENERATED_SIZE);
+	lookup.data = data;
+	lookup.key = &key;
+
+	for (pos = 0; pos < data->count; ++pos) {
+		match_list_copy_rpi_settings(data->tenants[pos].matches, data->settings);
+	}
+
+	dtk_item = dtk_list_first(diagnosis_keys);
+	while ((dtk_item != NULL) && (data->count > 0)) {
+		diagnosis_key = dtk_list_get_dtk(dtk_item);
+		lookup.day_number = dtk_get_day_number(diagnosis_key);
+		match_metadata_key_init(&key, diagnosis_key);
+
+		count = match_list_generate_rpis(data->settings, diagnosis_key, generated, variants);
+		for (variant = 0; variant < count; ++variant) {
+			lookup.variant = variants[variant];
+			for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+				lookup.rpi_bytes = generated + (((variant * RPI_INTERVAL_MAX) + interval) * RPI_SIZE);
+				lookup.time_interval_number = interval;
+				rpi_index_find(data->index, lookup.rpi_bytes, interval, match_batch_visit, &lookup);
+			}
+		}
+
+		match_metadata_key_clear(&key);
+		dtk_item = dtk_list_next(dtk_item);
+	}
+
+	free(generated);
+}
+
+/**
+ * Returns the matches found for a tenant.
+ *
+ * The list remains owned by the batch and is deleted along with it.
+ *
+ * @param data The batch to operate on.
+ * @param tenant_id The tenant to return the matches for.
+ * @return The tenant's match list, or NULL if the tenant isn't in the batch.
+ */
+MatchList * match_batch_get_matches(MatchBatch const * data, uint32_t tenant_id) {
+	size_t position;
+
+	position = match_batch_find_tenant(data, tenant_id);
+
+	return (position < data->count) ? data->tenants[position].matches : NULL;
+}
+
+/**
+ * Returns the matches found for the tenant at a given position.
+ *
+ * The list remains owned by the batch and is deleted along with it.
+ *
+ * @param data The batch to operate on.
+ * @param position The position of the tenant, less than the tenant count.
+ * @return The tenant's match list.
+ */
+MatchList * match_batch_get_matches_at(MatchBatch const * data, size_t position) {
+	return data->tenants[position].matches;
+}
+
+/** @} addtogroup Matching*/
+
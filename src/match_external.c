@@ -0,0 +1,426 @@
+/** \ingroup Matching
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Matching of beacon sets that don't fit in memory
+ * @section DESCRIPTION
+ *
+ * This provides the partitioned matching used by \ref match_list_find_matches()
+ * when a memory budget has been set and the beacons won't fit within it.
+ *
+ * The beacons are split by RPI prefix into partitions stored in temporary
+ * files, and the RPIs generated from the diagnosis keys are split the same
+ * way. Since matching RPIs must share a prefix, each partition of beacons only
+ * needs to be checked against the corresponding partition of generated RPIs.
+ * The partitions are then joined one at a time, so only one partition of
+ * beacons needs to be indexed in memory at once.
+ *
+ */
+
+/** \addtogroup Matching
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/rpi.h"
+#include "contrac/rpi_index.h"
+#include "contrac/match_private.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The maximum number of partitions. Two temporary files are open for each
+ * partition, so this is kept well below the usual open file limit.
+ */
+#define MATCH_EXTERNAL_PARTITIONS_MAX (128)
+
+/**
+ * Used internally.
+ *
+ * The size of a beacon record in a partition file: the RPI followed by the
+ * time interval number.
+ */
+#define MATCH_EXTERNAL_BEACON_SIZE (RPI_SIZE + 1)
+
+/**
+ * Used internally.
+ *
+ * The size of a generated RPI record in a partition file: the RPI followed by
+ * the time interval number, the encoding variant and the day number of the
+ * diagnosis key.
+ */
+#define MATCH_EXTERNAL_GENERATED_SIZE (RPI_SIZE + 2 + sizeof(uint32_t))
+
+// Structures
+
+/**
+ * @brief The temporary files holding the partitions
+ */
+typedef struct _MatchPartitions {
+	size_t count;
+	FILE * beacons[MATCH_EXTERNAL_PARTITIONS_MAX];
+	FILE * generated[MATCH_EXTERNAL_PARTITIONS_MAX];
+	size_t beacon_count[MATCH_EXTERNAL_PARTITIONS_MAX];
+	MatchList const * data;
+} MatchPartitions;
+
+/**
+ * @brief A match found while joining a partition
+ */
+typedef struct _MatchExternalFound {
+	uint32_t day_number;
+	uint8_t time_interval_number;
+	RpiEncoding variant;
+} MatchExternalFound;
+
+/**
+ * @brief The state passed to the index lookup callback
+ *
+ * Matches are collected here rather than appended to the list directly, so
+ * that nothing is added if a later partition can't be read.
+ */
+typedef struct _MatchExternalLookup {
+	MatchExternalFound * found;
+	size_t count;
+	size_t capacity;
+	uint32_t day_number;
+	uint8_t time_interval_number;
+	RpiEncoding variant;
+} MatchExternalLookup;
+
+// Function prototypes
+
+static FILE * match_external_temp_file(char const * directory);
+static size_t match_external_partition_count(size_t beacon_count, size_t memory_budget);
+static void match_external_close(MatchPartitions * partitions);
+static bool match_external_partition(MatchPartitions * partitions, RpiList * beacons, DtkList * diagnosis_keys);
+static bool match_external_join(MatchExternalLookup * lookup, MatchPartitions * partitions, size_t partition);
+static void match_external_visit(uint32_t tag, void * user_data);
+
+// Function definitions
+
+/**
+ * Creates an anonymous temporary file.
+ *
+ * For internal use. The file is unlinked immediately so it's removed when
+ * closed.
+ *
+ * @param directory The directory to create the file in, or NULL to use
+ *        tmpfile().
+ * @return The opened file, or NULL on failure.
+ */
+static FILE * match_external_temp_file(char const * directory) {
+	FILE * file;
+	char * path;
+	int fd;
+
+	file = NULL;
+	if (directory == NULL) {
+		file = tmpfile();
+	}
+	else {
+		path = malloc(strlen(directory) + sizeof("/contrac-XXXXXX"));
+		if (path) {
+			sprintf(path, "%s/contrac-XXXXXX", directory);
+			fd = mkstemp(path);
+			if (fd >= 0) {
+				unlink(path);
+				file = fdopen(fd, "w+b");
+				if (file == NULL) {
+					close(fd);
+				}
+			}
+			free(path);
+		}
+	}
+
+	return file;
+}
+
+/**
+ * Calculates the number of partitions needed to fit within the budget.
+ *
+ * For internal use. Allows some headroom since the partitions won't be
+ * exactly equal in size.
+ *
+ * @param beacon_count The total number of beacons.
+ * @param memory_budget The memory available for indexing a partition.
+ * @return The number of partitions to use, a power of two.
+ */
+static size_t match_external_partition_count(size_t beacon_count, size_t memory_budget) {
+	size_t count;
+	size_t per_partition;
+
+	count = 2;
+	per_partition = (beacon_count / count) + (beacon_count / (count * 2)) + 1;
+	while ((count < MATCH_EXTERNAL_PARTITIONS_MAX) && (rpi_index_memory_estimate(per_partition) > memory_budget)) {
+		count <<= 1;
+		per_partition = (beacon_count / count) + (beacon_count / (count * 2)) + 1;
+	}
+
+	if (rpi_index_memory_estimate(per_partition) > memory_budget) {
+		LOG(LOG_WARNING, "Memory budget too small, partitions will exceed it\n");
+	}
+
+	return count;
+}
+
+/**
+ * Closes all of the partition files.
+ *
+ * For internal use.
+ *
+ * @param partitions The partitions to close.
+ */
+static void match_external_close(MatchPartitions * partitions) {
+	size_t partition;
+
+	for (partition = 0; partition < partitions->count; ++partition) {
+		if (partitions->beacons[partition]) {
+			fclose(partitions->beacons[partition]);
+		}
+		if (partitions->generated[partition]) {
+			fclose(partitions->generated[partition]);
+		}
+	}
+}
+
+/**
+ * Writes the beacons and generated RPIs out to the partition files.
+ *
+ * For internal use. The partition is chosen using the first byte of the RPI.
+ * The files are flushed once everything has been written, since fwrite() only
+ * buffers the data and errors may otherwise not be reported until later.
+ *
+ * @param partitions The opened partition files to write to.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ * @return true if all of the records were written successfully.
+ */
+static bool match_external_partition(MatchPartitions * partitions, RpiList * beacons, DtkList * diagnosis_keys) {
+	RpiListItem const * rpi_item;
+	DtkListItem const * dtk_item;
+	Rpi const * rpi;
+	Dtk const * diagnosis_key;
+	unsigned char * generated;
+	unsigned char record[MATCH_EXTERNAL_GENERATED_SIZE];
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	uint32_t day_number;
+	uint8_t interval;
+	size_t partition;
+	size_t count;
+	size_t variant;
+	bool result;
+
+	result = true;
+	rpi_item = rpi_list_first(beacons);
+	while (result && (rpi_item != NULL)) {
+		rpi = rpi_list_get_rpi(rpi_item);
+		memcpy(record, rpi_get_proximity_id(rpi), RPI_SIZE);
+		record[RPI_SIZE] = rpi_get_time_interval_number(rpi);
+
+		partition = record[0] & (partitions->count - 1);
+		result = (fwrite(record, MATCH_EXTERNAL_BEACON_SIZE, 1, partitions->beacons[partition]) == 1);
+		partitions->beacon_count[partition]++;
+
+		rpi_item = rpi_list_next(rpi_item);
+	}
+
+	generated = malloc(MATCH_GENERATED_SIZE);
+	dtk_item = dtk_list_first(diagnosis_keys);
+	while (result && (dtk_item != NULL)) {
+		diagnosis_key = dtk_list_get_dtk(dtk_item);
+		day_number = dtk_get_day_number(diagnosis_key);
+
+		count = match_list_generate_rpis(partitions->data, diagnosis_key, generated, variants);
+		for (variant = 0; result && (variant < count); ++variant) {
+			for (interval = 0; result && (interval < RPI_INTERVAL_MAX); ++interval) {
+				memcpy(record, generated + (((variant * RPI_INTERVAL_MAX) + interval) * RPI_SIZE), RPI_SIZE);
+				record[RPI_SIZE] = interval;
+				record[RPI_SIZE + 1] = (unsigned char)variants[variant];
+				memcpy(record + RPI_SIZE + 2, &day_number, sizeof(uint32_t));
+
+				partition = record[0] & (partitions->count - 1);
+				result = (fwrite(record, MATCH_EXTERNAL_GENERATED_SIZE, 1, partitions->generated[partition]) == 1);
+			}
+		}
+
+		dtk_item = dtk_list_next(dtk_item);
+	}
+	free(generated);
+
+	for (partition = 0; result && (partition < partitions->count); ++partition) {
+		result = (fflush(partitions->beacons[partition]) == 0) && (fflush(partitions->generated[partition]) == 0);
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error writing match partition file\n");
+	}
+
+	return result;
+}
+
+/**
+ * Records a match found in the partition index.
+ *
+ * For internal use.
+ *
+ * @param tag The tag of the beacon that matched.
+ * @param user_data The MatchExternalLookup state.
+ */
+static void match_external_visit(uint32_t tag, void * user_data) {
+	MatchExternalLookup * lookup = (MatchExternalLookup *)user_data;
+	MatchExternalFound * found;
+
+	if (lookup->count == lookup->capacity) {
+		lookup->capacity = MAX(lookup->capacity * 2, (size_t)16);
+		lookup->found = realloc(lookup->found, lookup->capacity * sizeof(MatchExternalFound));
+	}
+
+	found = &lookup->found[lookup->count];
+	found->day_number = lookup->day_number;
+	found->time_interval_number = lookup->time_interval_number;
+	found->variant = lookup->variant;
+	lookup->count++;
+}
+
+/**
+ * Matches a single partition of beacons against its generated RPIs.
+ *
+ * For internal use. The beacons from the partition are loaded into an index,
+ * then the generated RPIs are streamed through and looked up in it. Any
+ * matches are collected in the lookup state.
+ *
+ * @param lookup The lookup state to collect matches in.
+ * @param partitions The partition files, already written and flushed.
+ * @param partition The partition to join.
+ * @return true if both partition files were read successfully.
+ */
+static bool match_external_join(MatchExternalLookup * lookup, MatchPartitions * partitions, size_t partition) {
+	RpiIndex * index;
+	unsigned char record[MATCH_EXTERNAL_GENERATED_SIZE];
+	FILE * file;
+	bool result;
+
+	index = rpi_index_new(partitions->beacon_count[partition]);
+
+	file = partitions->beacons[partition];
+	result = (fseek(file, 0, SEEK_SET) == 0);
+	while (result && (fread(record, MATCH_EXTERNAL_BEACON_SIZE, 1, file) == 1)) {
+		rpi_index_add(index, record, record[RPI_SIZE], 0);
+	}
+	if (result && ferror(file)) {
+		result = false;
+	}
+	if (!result) {
+		LOG(LOG_ERR, "Error reading beacon partition file\n");
+	}
+
+	if (result && (rpi_index_count(index) > 0)) {
+		file = partitions->generated[partition];
+		result = (fseek(file, 0, SEEK_SET) == 0);
+		while (result && (fread(record, MATCH_EXTERNAL_GENERATED_SIZE, 1, file) == 1)) {
+			memcpy(&lookup->day_number, record + RPI_SIZE + 2, sizeof(uint32_t));
+			lookup->time_interval_number = record[RPI_SIZE];
+			lookup->variant = (RpiEncoding)record[RPI_SIZE + 1];
+			rpi_index_find(index, record, lookup->time_interval_number, match_external_visit, lookup);
+		}
+		if (result && ferror(file)) {
+			result = false;
+		}
+		if (!result) {
+			LOG(LOG_ERR, "Error reading generated partition file\n");
+		}
+	}
+
+	rpi_index_delete(index);
+
+	return result;
+}
+
+/**
+ * Finds matches between the beacons and diagnoses using partitioned
+ * temporary files.
+ *
+ * For internal use. Called by \ref match_list_find_matches() when the beacons
+ * won't fit within the memory budget.
+ *
+ * If the temporary files can't be created or written, no matches are added
+ * and false is returned, so the caller can fall back to matching in memory.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ * @param memory_budget The memory available for indexing a partition.
+ * @param directory The directory for temporary files, or NULL.
+ * @return true if the matching was performed, false otherwise.
+ */
+bool match_list_find_matches_external(MatchList * data, RpiList * beacons, DtkList * diagnosis_keys, size_t memory_budget, char const * directory) {
+	MatchPartitions * partitions;
+	MatchExternalLookup lookup;
+	size_t beacon_count;
+	size_t partition;
+	size_t pos;
+	bool result;
+
+	beacon_count = rpi_list_count(beacons);
+
+	partitions = calloc(sizeof(MatchPartitions), 1);
+	partitions->count = match_external_partition_count(beacon_count, memory_budget);
+	partitions->data = data;
+	LOG(LOG_DEBUG, "Matching %zu beacons using %zu partitions\n", beacon_count, partitions->count);
+
+	result = true;
+	for (partition = 0; result && (partition < partitions->count); ++partition) {
+		partitions->beacons[partition] = match_external_temp_file(directory);
+		partitions->generated[partition] = match_external_temp_file(directory);
+		result = (partitions->beacons[partition] != NULL) && (partitions->generated[partition] != NULL);
+	}
+
+	if (result) {
+		result = match_external_partition(partitions, beacons, diagnosis_keys);
+	}
+	else {
+		LOG(LOG_ERR, "Error creating match partition files\n");
+	}
+
+	// Only add the matches once every partition has been joined
+	memset(&lookup, 0, sizeof(MatchExternalLookup));
+	for (partition = 0; result && (partition < partitions->count); ++partition) {
+		result = match_external_join(&lookup, partitions, partition);
+	}
+
+	if (result) {
+		for (pos = 0; pos < lookup.count; ++pos) {
+			match_list_append_beacon_match(data, NULL, lookup.found[pos].day_number, lookup.found[pos].time_interval_number, lookup.found[pos].variant, NULL);
+		}
+	}
+
+	match_external_close(partitions);
+	free(lookup.found);
+	free(partitions);
+
+	return result;
+}
+
+/** @} addtogroup Matching*/
+
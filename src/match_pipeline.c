@@ -0,0 +1,400 @@
+/** \ingroup Matching
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Pipelined matching of diagnosis keys against collected RPIs
+ * @section DESCRIPTION
+ *
+ * This provides an alternative to \ref match_list_find_matches() that doesn't
+ * need the full list of diagnosis keys to be available before matching starts.
+ *
+ * Matching is split into three concurrent stages: reading the diagnosis keys
+ * from a source, deriving the RPIs from each key, and looking the RPIs up in an
+ * index of the beacons. The stages are joined by bounded lock-free queues, so
+ * reading and parsing overlap with the HMAC computation and the memory used is
+ * bounded by the queue depth rather than the number of keys.
+ *
+ */
+
+/** \addtogroup Matching
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/rpi.h"
+#include "contrac/queue.h"
+#include "contrac/rpi_index.h"
+#include "contrac/match_private.h"
+
+#include "contrac/match_pipeline.h"
+
+// Defines
+
+// Structures
+
+/**
+ * @brief A diagnosis key passed from the read stage to the derive stage
+ */
+typedef struct _PipelineKey {
+	unsigned char dtk[DTK_SIZE];
+	uint32_t day_number;
+} PipelineKey;
+
+/**
+ * @brief The RPIs derived from a single diagnosis key
+ *
+ * Passed from the derive stage to the lookup stage. The RPIs are held for
+ * each variant generated, with count set to zero if generation failed. The
+ * key itself is passed along so the lookup stage can decrypt the metadata of
+ * any matched beacons.
+ */
+typedef struct _PipelineDerived {
+	unsigned char dtk[DTK_SIZE];
+	uint32_t day_number;
+	unsigned char rpi[RPI_ENCODING_COUNT][RPI_INTERVAL_MAX][RPI_SIZE];
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	size_t count;
+} PipelineDerived;
+
+/**
+ * @brief The state for the read stage
+ *
+ * The read stage distributes the keys between the derive workers in
+ * round-robin order, so the lookup stage can restore the original order.
+ */
+typedef struct _PipelineReader {
+	DiagnosisSource source;
+	void * user_data;
+	Queue ** keys;
+	size_t workers;
+} PipelineReader;
+
+/**
+ * @brief The state for a single derive worker
+ */
+typedef struct _PipelineWorker {
+	Queue * keys;
+	Queue * derived;
+	MatchList const * data;
+	pthread_t thread;
+} PipelineWorker;
+
+/**
+ * @brief The state passed to the index lookup callback
+ */
+typedef struct _PipelineLookup {
+	MatchList * data;
+	uint32_t day_number;
+	uint8_t time_interval_number;
+	RpiEncoding variant;
+	unsigned char const * rpi_bytes;
+	RpiList const * beacons;
+	MatchMetadataKey * key;
+} PipelineLookup;
+
+// Function prototypes
+
+static void * match_pipeline_read(void * arg);
+static void * match_pipeline_derive(void * arg);
+static void match_pipeline_visit(uint32_t tag, void * user_data);
+static void match_pipeline_lookup(RpiIndex const * index, PipelineLookup * lookup, PipelineDerived const * derived, Dtk * dtk);
+
+// Function definitions
+
+/**
+ * The read stage of the pipeline.
+ *
+ * For internal use. Runs on its own thread, pulling keys from the source until
+ * it's exhausted and passing them on to the derive workers.
+ *
+ * @param arg The PipelineReader state.
+ * @return Always NULL.
+ */
+static void * match_pipeline_read(void * arg) {
+	PipelineReader * reader = (PipelineReader *)arg;
+	PipelineKey key;
+	size_t worker;
+
+	worker = 0;
+	while (reader->source(reader->user_data, key.dtk, &key.day_number)) {
+		queue_push_wait(reader->keys[worker], &key);
+		worker = (worker + 1) % reader->workers;
+	}
+
+	for (worker = 0; worker < reader->workers; ++worker) {
+		queue_close(reader->keys[worker]);
+	}
+
+	// Clear the data for security
+	memset(&key, 0, sizeof(PipelineKey));
+
+	return NULL;
+}
+
+/**
+ * The derive stage of the pipeline.
+ *
+ * For internal use. Runs on its own thread, generating all of the RPIs for
+ * each key received and passing them on to the lookup stage.
+ *
+ * @param arg The PipelineWorker state.
+ * @return Always NULL.
+ */
+static void * match_pipeline_derive(void * arg) {
+	PipelineWorker * worker = (PipelineWorker *)arg;
+	PipelineKey key;
+	PipelineDerived * derived;
+	Dtk * dtk;
+
+	dtk = dtk_new();
+	derived = malloc(sizeof(PipelineDerived));
+
+	while (queue_pop_wait(worker->keys, &key)) {
+		dtk_assign(dtk, key.dtk, key.day_number);
+		memcpy(derived->dtk, key.dtk, DTK_SIZE);
+		derived->day_number = key.day_number;
+
+		derived->count = match_list_generate_rpis(worker->data, dtk, (unsigned char *)derived->rpi, derived->variants);
+
+		queue_push_wait(worker->derived, derived);
+	}
+
+	queue_close(worker->derived);
+
+	memset(&key, 0, sizeof(PipelineKey));
+	memset(derived, 0, sizeof(PipelineDerived));
+	free(derived);
+	dtk_delete(dtk);
+
+	return NULL;
+}
+
+/**
+ * Records a match found in the beacon index.
+ *
+ * For internal use.
+ *
+ * @param tag The tag of the beacon that matched.
+ * @param user_data The PipelineLookup state.
+ */
+static void match_pipeline_visit(uint32_t tag, void * user_data) {
+	PipelineLookup * lookup = (PipelineLookup *)user_data;
+	RpiListItem const * beacon;
+
+	beacon = rpi_list_find(lookup->beacons, lookup->rpi_bytes, lookup->time_interval_number);
+	match_list_append_beacon_match(lookup->data, lookup->key, lookup->day_number, lookup->time_interval_number, lookup->variant, beacon);
+}
+
+/**
+ * The lookup stage of the pipeline for a single key.
+ *
+ * For internal use. Looks up each of the RPIs derived from a key in the
+ * index of beacons, appending any matches found.
+ *
+ * @param index The index of beacons to search.
+ * @param lookup The PipelineLookup state.
+ * @param derived The RPIs derived from the key.
+ * @param dtk A key object to use for decrypting the metadata.
+ */
+static void match_pipeline_lookup(RpiIndex const * index, PipelineLookup * lookup, PipelineDerived const * derived, Dtk * dtk) {
+	size_t variant;
+	uint8_t interval;
+
+	dtk_assign(dtk, derived->dtk, derived->day_number);
+	match_metadata_key_init(lookup->key, dtk);
+	lookup->day_number = derived->day_number;
+	for (variant = 0; variant < derived->count; ++variant) {
+		lookup->variant = derived->variants[variant];
+		for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+			lookup->time_interval_number = interval;
+			lookup->rpi_bytes = derived->rpi[variant][interval];
+			rpi_index_find(index, lookup->rpi_bytes, interval, match_pipeline_visit, lookup);
+		}
+	}
+}
+
+/**
+ * Returns a list of matches found between the beacons and diagnoses, reading
+ * the diagnoses from a source as matching proceeds.
+ *
+ * This produces the same matches as \ref match_list_find_matches(), with the
+ * keys processed in the same order, but the diagnosis keys are pulled from the
+ * source callback on a separate thread while earlier keys are still being
+ * processed. The RPIs for
+ * each key are derived by a pool of worker threads and then looked up in a
+ * hash index of the beacons on the calling thread. Any callback set using
+ * \ref match_list_set_callback() is therefore also called on the calling
+ * thread.
+ *
+ * At most queue_depth keys are buffered between each pair of stages, so the
+ * memory used is independent of the total number of keys.
+ *
+ * If the threads can't be started, the keys are read, derived and looked up
+ * in turn on the calling thread instead, giving the same matches.
+ *
+ * The match list isn't cleared by this call and so any new values will be
+ * appended to it. The order set using \ref match_list_set_order() is ignored,
+ * since the keys are processed in the order the source provides them.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ * @param source A callback that returns the next diagnosis key.
+ * @param user_data A pointer that will be passed to the source callback.
+ * @param queue_depth The capacity of each queue, or zero to use
+ *        MATCH_PIPELINE_QUEUE_DEPTH.
+ * @param derive_threads The number of threads to use for deriving RPIs, or
+ *        zero to use one.
+ */
+void match_list_find_matches_pipelined(MatchList * data, RpiList * beacons, DiagnosisSource source, void * user_data, size_t queue_depth, size_t derive_threads) {
+	RpiIndex * index;
+	PipelineReader reader;
+	PipelineWorker * workers;
+	PipelineDerived * derived;
+	PipelineLookup lookup;
+	MatchMetadataKey key;
+	Dtk * dtk;
+	pthread_t read_thread;
+	size_t worker;
+	size_t started;
+	bool read_started;
+	bool result;
+
+	if (queue_depth == 0) {
+		queue_depth = MATCH_PIPELINE_QUEUE_DEPTH;
+	}
+	derive_threads = MAX(derive_threads, 1);
+
+	// The index is built while the first keys are being read
+	workers = calloc(sizeof(PipelineWorker), derive_threads);
+	reader.source = source;
+	reader.user_data = user_data;
+	reader.keys = calloc(sizeof(Queue *), derive_threads);
+
+	result = true;
+	started = 0;
+	for (worker = 0; worker < derive_threads; ++worker) {
+		workers[worker].keys = queue_new(sizeof(PipelineKey), queue_depth);
+		workers[worker].derived = queue_new(sizeof(PipelineDerived), queue_depth);
+		workers[worker].data = data;
+		reader.keys[worker] = workers[worker].keys;
+		if (result) {
+			result = (workers[worker].keys != NULL) && (workers[worker].derived != NULL);
+		}
+		if (result) {
+			result = (pthread_create(&workers[worker].thread, NULL, match_pipeline_derive, &workers[worker]) == 0);
+			if (result) {
+				started++;
+			}
+		}
+	}
+	reader.workers = derive_threads;
+
+	read_started = false;
+	if (result) {
+		result = (pthread_create(&read_thread, NULL, match_pipeline_read, &reader) == 0);
+		read_started = result;
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Error starting pipeline threads, matching on the calling thread\n");
+		// The workers that did start have no keys and will exit once closed
+		for (worker = 0; worker < started; ++worker) {
+			queue_close(workers[worker].keys);
+		}
+	}
+
+	index = rpi_index_new(0);
+	rpi_index_add_list(index, beacons);
+
+	derived = malloc(sizeof(PipelineDerived));
+	dtk = dtk_new();
+	lookup.data = data;
+	lookup.beacons = beacons;
+	lookup.key = &key;
+	match_metadata_key_init(&key, NULL);
+
+	if (result) {
+		// Lookup stage, collecting from the workers in the same round-robin
+		// order the keys were distributed in
+		worker = 0;
+		while (queue_pop_wait(workers[worker].derived, derived)) {
+			match_pipeline_lookup(index, &lookup, derived, dtk);
+			worker = (worker + 1) % derive_threads;
+		}
+	}
+	else {
+		// Fall back to running all three stages in turn on this thread
+		while (source(user_data, derived->dtk, &derived->day_number)) {
+			dtk_assign(dtk, derived->dtk, derived->day_number);
+			derived->count = match_list_generate_rpis(data, dtk, (unsigned char *)derived->rpi, derived->variants);
+			match_pipeline_lookup(index, &lookup, derived, dtk);
+		}
+	}
+	match_metadata_key_clear(&key);
+	memset(derived, 0, sizeof(PipelineDerived));
+	dtk_delete(dtk);
+
+	if (read_started) {
+		pthread_join(read_thread, NULL);
+	}
+	for (worker = 0; worker < derive_threads; ++worker) {
+		if (worker < started) {
+			pthread_join(workers[worker].thread, NULL);
+		}
+		queue_delete(workers[worker].keys);
+		queue_delete(workers[worker].derived);
+	}
+
+	free(derived);
+	free(reader.keys);
+	free(workers);
+	rpi_index_delete(index);
+}
+
+/**
+ * A DiagnosisSource that reads the keys from a DtkList.
+ *
+ * This allows an existing list to be used with
+ * \ref match_list_find_matches_pipelined(). The user_data must be a pointer
+ * to a DtkListItem const pointer, initialised to the first item of the list
+ * using \ref dtk_list_first(). It's advanced as each key is read.
+ *
+ * @param user_data A pointer to the DtkListItem const pointer to read from.
+ * @param dtk_bytes A buffer of DTK_SIZE bytes to store the key in.
+ * @param day_number Returns the day number associated with the key.
+ * @return true if a key was returned, false if the end of the list was reached.
+ */
+bool match_pipeline_dtk_list_source(void * user_data, unsigned char * dtk_bytes, uint32_t * day_number) {
+	DtkListItem const ** item = (DtkListItem const **)user_data;
+	Dtk const * dtk;
+	bool result;
+
+	result = (*item != NULL);
+	if (result) {
+		dtk = dtk_list_get_dtk(*item);
+		memcpy(dtk_bytes, dtk_get_daily_key(dtk), DTK_SIZE);
+		*day_number = dtk_get_day_number(dtk);
+		*item = dtk_list_next(*item);
+	}
+
+	return result;
+}
+
+/** @} addtogroup Matching*/
+
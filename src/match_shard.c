@@ -0,0 +1,868 @@
+/** \ingroup Matching
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Sharded matching across multiple workers
+ * @section DESCRIPTION
+ *
+ * This allows a large match job to be split between several workers. The
+ * beacons are sharded between the workers by RPI prefix, while every worker
+ * receives all of the diagnosis keys. Each worker finds the matches for its
+ * own shard and the coordinator merges the results into a single
+ * \ref MatchList.
+ *
+ * The coordinator and workers communicate through a \ref MatchTransport, which
+ * abstracts the channel used to carry the messages. A transport based on Unix
+ * domain sockets is provided and used by
+ * \ref match_list_find_matches_sharded() to run the workers as local
+ * threads. The workers can be run in separate processes or on other machines
+ * by calling \ref match_shard_coordinate() and \ref match_shard_serve()
+ * directly, with any suitable transport.
+ *
+ */
+
+/** \addtogroup Matching
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/rpi.h"
+#include "contrac/rpi_index.h"
+#include "contrac/dtk_stream.h"
+#include "contrac/match_private.h"
+
+#include "contrac/match_shard.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * Message type for a batch of beacons, sent from coordinator to worker.
+ */
+#define MATCH_SHARD_BEACONS (1)
+
+/**
+ * Used internally.
+ *
+ * Message type for a batch of diagnosis keys, sent from coordinator to worker.
+ */
+#define MATCH_SHARD_KEYS (2)
+
+/**
+ * Used internally.
+ *
+ * Message type for a batch of matches, sent from worker to coordinator.
+ */
+#define MATCH_SHARD_MATCHES (3)
+
+/**
+ * Used internally.
+ *
+ * Message type indicating the sender has nothing more to send.
+ */
+#define MATCH_SHARD_END (4)
+
+/**
+ * Used internally.
+ *
+ * Message type selecting the RPI scheme, sent from coordinator to worker. The
+ * scheme is carried in the count field and there are no records.
+ */
+#define MATCH_SHARD_SCHEME (5)
+
+/**
+ * Used internally.
+ *
+ * Message type registering an RPI encoding to match, sent from coordinator
+ * to worker. The encoding is carried in the count field and there are no
+ * records.
+ */
+#define MATCH_SHARD_VARIANT (6)
+
+/**
+ * Used internally.
+ *
+ * The size of a message header: the message type followed by the number of
+ * records in the message as a 32-bit big-endian integer.
+ */
+#define MATCH_SHARD_HEADER_SIZE (5)
+
+/**
+ * Used internally.
+ *
+ * The size of a beacon record: the RPI followed by the time interval number
+ * and the position of the beacon in the list as a 32-bit big-endian integer.
+ */
+#define MATCH_SHARD_BEACON_SIZE (RPI_SIZE + 1 + 4)
+
+/**
+ * Used internally.
+ *
+ * The size of a match record: the position of the diagnosis key in the list
+ * and its day number as 32-bit big-endian integers, followed by the time
+ * interval number, the position of the encoding in the list of variants, the
+ * encoding itself and the position of the matching beacon as a 32-bit
+ * big-endian integer.
+ */
+#define MATCH_SHARD_MATCH_SIZE (15)
+
+/**
+ * Used internally.
+ *
+ * The maximum number of records sent in a single message.
+ */
+#define MATCH_SHARD_BATCH (256)
+
+// Structures
+
+/**
+ * @brief A match reported by a worker
+ *
+ * Used by the coordinator to merge the results from the workers back into
+ * the order the diagnosis keys were provided in.
+ */
+typedef struct _MatchShardResult {
+	uint32_t key;
+	uint32_t day_number;
+	uint8_t time_interval_number;
+	uint8_t variant_position;
+	RpiEncoding variant;
+	uint32_t beacon;
+	size_t shard;
+	size_t position;
+} MatchShardResult;
+
+/**
+ * @brief The matches found by a worker, waiting to be sent
+ */
+typedef struct _MatchShardFound {
+	unsigned char * records;
+	size_t count;
+	size_t allocated;
+	uint32_t key;
+	uint32_t day_number;
+	uint8_t time_interval_number;
+	uint8_t variant_position;
+	RpiEncoding variant;
+} MatchShardFound;
+
+/**
+ * @brief A batch of beacon records being assembled for a worker
+ */
+typedef struct _MatchShardBatch {
+	unsigned char records[MATCH_SHARD_BATCH * MATCH_SHARD_BEACON_SIZE];
+	size_t count;
+} MatchShardBatch;
+
+/**
+ * @brief A worker thread serving one end of a socket pair
+ */
+typedef struct _MatchShardWorker {
+	int socket;
+	pthread_t thread;
+	bool result;
+} MatchShardWorker;
+
+// Function prototypes
+
+static bool match_shard_send_header(MatchTransport const * transport, void * channel, uint8_t type, uint32_t count);
+static bool match_shard_receive_header(MatchTransport const * transport, void * channel, uint8_t * type, uint32_t * count);
+static void match_shard_visit(uint32_t tag, void * user_data);
+static int match_shard_result_compare(void const * left, void const * right);
+static bool match_shard_collect(MatchTransport const * transport, void * channel, size_t shard, MatchShardResult ** results, size_t * count, size_t * allocated);
+static bool match_transport_socket_send(void * channel, void const * buffer, size_t size);
+static bool match_transport_socket_receive(void * channel, void * buffer, size_t size);
+static void * match_shard_worker(void * arg);
+
+// Function definitions
+
+/**
+ * Sends a message header.
+ *
+ * For internal use.
+ *
+ * @param transport The transport to send with.
+ * @param channel The channel to send on.
+ * @param type The message type.
+ * @param count The number of records that will follow.
+ * @return true if the header was sent successfully.
+ */
+static bool match_shard_send_header(MatchTransport const * transport, void * channel, uint8_t type, uint32_t count) {
+	unsigned char header[MATCH_SHARD_HEADER_SIZE];
+
+	header[0] = type;
+	big_endian_encode_u32(header + 1, count);
+
+	return transport->send(channel, header, MATCH_SHARD_HEADER_SIZE);
+}
+
+/**
+ * Receives a message header.
+ *
+ * For internal use.
+ *
+ * @param transport The transport to receive with.
+ * @param channel The channel to receive from.
+ * @param type Returns the message type.
+ * @param count Returns the number of records that follow.
+ * @return true if the header was received successfully.
+ */
+static bool match_shard_receive_header(MatchTransport const * transport, void * channel, uint8_t * type, uint32_t * count) {
+	unsigned char header[MATCH_SHARD_HEADER_SIZE];
+	bool result;
+
+	result = transport->receive(channel, header, MATCH_SHARD_HEADER_SIZE);
+	if (result) {
+		*type = header[0];
+		*count = big_endian_decode_u32(header + 1);
+	}
+
+	return result;
+}
+
+/**
+ * Records a match found by a worker.
+ *
+ * For internal use.
+ *
+ * @param tag The tag of the beacon that matched.
+ * @param user_data The MatchShardFound state.
+ */
+static void match_shard_visit(uint32_t tag, void * user_data) {
+	MatchShardFound * found = (MatchShardFound *)user_data;
+	unsigned char * record;
+
+	if (found->count >= found->allocated) {
+		found->allocated = MAX(found->allocated * 2, MATCH_SHARD_BATCH);
+		found->records = realloc(found->records, found->allocated * MATCH_SHARD_MATCH_SIZE);
+	}
+
+	record = found->records + (found->count * MATCH_SHARD_MATCH_SIZE);
+	big_endian_encode_u32(record, found->key);
+	big_endian_encode_u32(record + 4, found->day_number);
+	record[8] = found->time_interval_number;
+	record[9] = found->variant_position;
+	record[10] = (unsigned char)found->variant;
+	big_endian_encode_u32(record + 11, tag);
+	found->count++;
+}
+
+/**
+ * Runs a worker, serving a single coordinator.
+ *
+ * Receives the RPI settings and a shard of beacons followed by the diagnosis
+ * keys from the coordinator, finds the matches between them and sends the
+ * matches back. Returns once the coordinator has indicated there's nothing
+ * more to send and the results have been returned.
+ *
+ * This is called automatically in each worker thread by
+ * \ref match_list_find_matches_sharded(), but can also be called directly to
+ * serve a coordinator using a different transport.
+ *
+ * @param transport The transport to communicate with.
+ * @param channel The channel connected to the coordinator.
+ * @return true if the job completed successfully, false otherwise.
+ */
+bool match_shard_serve(MatchTransport const * transport, void * channel) {
+	RpiIndex * index;
+	Dtk * diagnosis_key;
+	MatchList * settings;
+	unsigned char * generated;
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	MatchShardFound found;
+	unsigned char * records;
+	unsigned char * record;
+	uint8_t type;
+	uint32_t count;
+	uint32_t batch;
+	uint32_t pos;
+	size_t variant;
+	size_t variant_count;
+	uint8_t interval;
+	bool result;
+	bool finished;
+
+	index = rpi_index_new(0);
+	diagnosis_key = dtk_new();
+	settings = match_list_new();
+	generated = malloc(MATCH_GENERATED_SIZE);
+	records = malloc(MATCH_SHARD_BATCH * MAX(DTK_STREAM_RECORD_SIZE, MATCH_SHARD_BEACON_SIZE));
+	memset(&found, 0, sizeof(MatchShardFound));
+
+	finished = false;
+	result = true;
+	while (result && !finished) {
+		result = match_shard_receive_header(transport, channel, &type, &count);
+
+		if (result) {
+			switch (type) {
+				case MATCH_SHARD_SCHEME:
+					// The value comes off the wire, so must be checked
+					result = (count <= RPI_SCHEME_AES);
+					if (result) {
+						match_list_set_rpi_scheme(settings, (RpiScheme)count);
+					}
+					else {
+						LOG(LOG_ERR, "Unknown RPI scheme %u\n", count);
+					}
+					break;
+				case MATCH_SHARD_VARIANT:
+					result = (count < RPI_ENCODING_COUNT);
+					if (result) {
+						match_list_add_rpi_variant(settings, (RpiEncoding)count);
+					}
+					else {
+						LOG(LOG_ERR, "Unknown RPI encoding %u\n", count);
+					}
+					break;
+				case MATCH_SHARD_BEACONS:
+					while (result && (count > 0)) {
+						batch = MIN(count, MATCH_SHARD_BATCH);
+						result = transport->receive(channel, records, batch * MATCH_SHARD_BEACON_SIZE);
+						for (pos = 0; result && (pos < batch); ++pos) {
+							record = records + (pos * MATCH_SHARD_BEACON_SIZE);
+							rpi_index_add(index, record, record[RPI_SIZE], big_endian_decode_u32(record + RPI_SIZE + 1));
+						}
+						count -= batch;
+					}
+					break;
+				case MATCH_SHARD_KEYS:
+					while (result && (count > 0)) {
+						batch = MIN(count, MATCH_SHARD_BATCH);
+						result = transport->receive(channel, records, batch * DTK_STREAM_RECORD_SIZE);
+						for (pos = 0; result && (pos < batch); ++pos) {
+							record = records + (pos * DTK_STREAM_RECORD_SIZE);
+							found.day_number = big_endian_decode_u32(record + DTK_SIZE);
+							dtk_assign(diagnosis_key, record, found.day_number);
+
+							variant_count = match_list_generate_rpis(settings, diagnosis_key, generated, variants);
+							for (variant = 0; variant < variant_count; ++variant) {
+								found.variant_position = variant;
+								found.variant = variants[variant];
+								for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+									found.time_interval_number = interval;
+									rpi_index_find(index, generated + (((variant * RPI_INTERVAL_MAX) + interval) * RPI_SIZE), interval, match_shard_visit, &found);
+								}
+							}
+							found.key++;
+						}
+						count -= batch;
+					}
+					break;
+				case MATCH_SHARD_END:
+					finished = true;
+					break;
+				default:
+					LOG(LOG_ERR, "Unexpected shard message type %u\n", type);
+					result = false;
+					break;
+			}
+		}
+	}
+
+	if (result) {
+		result = match_shard_send_header(transport, channel, MATCH_SHARD_MATCHES, found.count);
+	}
+	if (result && (found.count > 0)) {
+		result = transport->send(channel, found.records, found.count * MATCH_SHARD_MATCH_SIZE);
+	}
+	if (result) {
+		result = match_shard_send_header(transport, channel, MATCH_SHARD_END, 0);
+	}
+
+	if (!result) {
+		LOG(LOG_ERR, "Shard worker failed to complete\n");
+	}
+
+	free(found.records);
+	free(records);
+	free(generated);
+	match_list_delete(settings);
+	dtk_delete(diagnosis_key);
+	rpi_index_delete(index);
+
+	return result;
+}
+
+/**
+ * Compares two worker results so they sort into diagnosis key order.
+ *
+ * For internal use.
+ *
+ * @param left The first MatchShardResult to compare.
+ * @param right The second MatchShardResult to compare.
+ * @return negative, zero or positive following the qsort() convention.
+ */
+static int match_shard_result_compare(void const * left, void const * right) {
+	MatchShardResult const * first = (MatchShardResult const *)left;
+	MatchShardResult const * second = (MatchShardResult const *)right;
+	int result;
+
+	if (first->key != second->key) {
+		result = (first->key < second->key) ? -1 : 1;
+	}
+	else if (first->variant_position != second->variant_position) {
+		result = (first->variant_position < second->variant_position) ? -1 : 1;
+	}
+	else if (first->time_interval_number != second->time_interval_number) {
+		result = (first->time_interval_number < second->time_interval_number) ? -1 : 1;
+	}
+	else if (first->shard != second->shard) {
+		result = (first->shard < second->shard) ? -1 : 1;
+	}
+	else {
+		result = (first->position < second->position) ? -1 : ((first->position > second->position) ? 1 : 0);
+	}
+
+	return result;
+}
+
+/**
+ * Receives the results from a single worker.
+ *
+ * For internal use.
+ *
+ * @param transport The transport to receive with.
+ * @param channel The channel connected to the worker.
+ * @param shard The shard number of the worker.
+ * @param results The array to append the results to, grown as needed.
+ * @param count The number of results in the array, updated.
+ * @param allocated The number of results allocated in the array, updated.
+ * @return true if the results were received successfully.
+ */
+static bool match_shard_collect(MatchTransport const * transport, void * channel, size_t shard, MatchShardResult ** results, size_t * count, size_t * allocated) {
+	unsigned char record[MATCH_SHARD_MATCH_SIZE];
+	MatchShardResult * item;
+	uint8_t type;
+	uint32_t remaining;
+	size_t position;
+	bool result;
+	bool finished;
+
+	position = 0;
+	finished = false;
+	result = true;
+	while (result && !finished) {
+		result = match_shard_receive_header(transport, channel, &type, &remaining);
+
+		if (result && (type == MATCH_SHARD_MATCHES)) {
+			while (result && (remaining > 0)) {
+				result = transport->receive(channel, record, MATCH_SHARD_MATCH_SIZE);
+				if (result) {
+					if (*count >= *allocated) {
+						*allocated = MAX(*allocated * 2, MATCH_SHARD_BATCH);
+						*results = realloc(*results, *allocated * sizeof(MatchShardResult));
+					}
+					item = &(*results)[*count];
+					item->key = big_endian_decode_u32(record);
+					item->day_number = big_endian_decode_u32(record + 4);
+					item->time_interval_number = record[8];
+					item->variant_position = record[9];
+					item->variant = (RpiEncoding)record[10];
+					item->beacon = big_endian_decode_u32(record + 11);
+					item->shard = shard;
+					item->position = position;
+					position++;
+					(*count)++;
+				}
+				remaining--;
+			}
+		}
+		else if (result && (type == MATCH_SHARD_END)) {
+			finished = true;
+		}
+		else if (result) {
+			LOG(LOG_ERR, "Unexpected shard message type %u\n", type);
+			result = false;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Coordinates a sharded match job.
+ *
+ * Passes the RPI scheme and any encodings registered on the match list to the
+ * workers, distributes the beacons between them by RPI prefix and sends all
+ * of the diagnosis keys to every worker. Once the workers have finished,
+ * their results are merged and appended to the match list in diagnosis key
+ * order, the same order used by \ref match_list_find_matches(). Each match
+ * is tagged with its encoding and carries the beacon's decrypted metadata, as
+ * if the match had been found locally.
+ *
+ * Each channel must be connected to a worker that's running
+ * \ref match_shard_serve() with the same transport.
+ *
+ * If any of the communication fails, or a worker returns results that don't
+ * refer to the beacons and keys it was sent, no matches are added to the list.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ * @param transport The transport to communicate with.
+ * @param channels An array of channels, one connected to each worker.
+ * @param shards The number of workers.
+ * @return true if the job completed successfully, false otherwise.
+ */
+bool match_shard_coordinate(MatchList * data, RpiList * beacons, DtkList * diagnosis_keys, MatchTransport const * transport, void ** channels, size_t shards) {
+	MatchShardBatch * batches;
+	MatchShardBatch * batch;
+	RpiListItem const * rpi_item;
+	DtkListItem const * dtk_item;
+	RpiListItem const ** beacon_items;
+	Dtk const ** dtks;
+	Rpi const * rpi;
+	Dtk const * dtk;
+	MatchShardResult * results;
+	MatchMetadataKey key;
+	RpiEncoding variants[RPI_ENCODING_COUNT];
+	unsigned char * keys;
+	unsigned char * record;
+	size_t variant_count;
+	size_t beacon_count;
+	size_t key_count;
+	size_t key_total;
+	size_t key_allocated;
+	size_t count;
+	size_t allocated;
+	size_t shard;
+	size_t pos;
+	bool result;
+
+	result = (shards > 0);
+	batches = calloc(sizeof(MatchShardBatch), MAX(shards, 1));
+
+	// Tell the workers which scheme and encodings to generate the RPIs with
+	variant_count = match_list_get_rpi_variants(data, variants);
+	for (shard = 0; result && (shard < shards); ++shard) {
+		result = match_shard_send_header(transport, channels[shard], MATCH_SHARD_SCHEME, match_list_get_rpi_scheme(data));
+		for (pos = 0; result && (pos < variant_count); ++pos) {
+			result = match_shard_send_header(transport, channels[shard], MATCH_SHARD_VARIANT, variants[pos]);
+		}
+	}
+
+	// Send each worker its shard of the beacons, tagged with their positions
+	// so the matches can be tied back to them
+	beacon_items = malloc(sizeof(RpiListItem const *) * MAX(rpi_list_count(beacons), 1));
+	beacon_count = 0;
+	rpi_item = rpi_list_first(beacons);
+	while (result && (rpi_item != NULL)) {
+		rpi = rpi_list_get_rpi(rpi_item);
+		shard = rpi_get_proximity_id(rpi)[0] % shards;
+		batch = &batches[shard];
+
+		record = batch->records + (batch->count * MATCH_SHARD_BEACON_SIZE);
+		memcpy(record, rpi_get_proximity_id(rpi), RPI_SIZE);
+		record[RPI_SIZE] = rpi_get_time_interval_number(rpi);
+		big_endian_encode_u32(record + RPI_SIZE + 1, beacon_count);
+		batch->count++;
+		beacon_items[beacon_count] = rpi_item;
+		beacon_count++;
+
+		if (batch->count == MATCH_SHARD_BATCH) {
+			result = match_shard_send_header(transport, channels[shard], MATCH_SHARD_BEACONS, batch->count);
+			if (result) {
+				result = transport->send(channels[shard], batch->records, batch->count * MATCH_SHARD_BEACON_SIZE);
+			}
+			batch->count = 0;
+		}
+
+		rpi_item = rpi_list_next(rpi_item);
+	}
+
+	for (shard = 0; result && (shard < shards); ++shard) {
+		batch = &batches[shard];
+		if (batch->count > 0) {
+			result = match_shard_send_header(transport, channels[shard], MATCH_SHARD_BEACONS, batch->count);
+			if (result) {
+				result = transport->send(channels[shard], batch->records, batch->count * MATCH_SHARD_BEACON_SIZE);
+			}
+		}
+	}
+	free(batches);
+
+	// Broadcast the diagnosis keys to all workers, a batch at a time so the
+	// workers can start matching while the rest are sent
+	keys = malloc(MATCH_SHARD_BATCH * DTK_STREAM_RECORD_SIZE);
+	dtks = NULL;
+	key_total = 0;
+	key_allocated = 0;
+	dtk_item = dtk_list_first(diagnosis_keys);
+	while (result && (dtk_item != NULL)) {
+		key_count = 0;
+		while ((dtk_item != NULL) && (key_count < MATCH_SHARD_BATCH)) {
+			dtk = dtk_list_get_dtk(dtk_item);
+			dtk_stream_encode_record(keys + (key_count * DTK_STREAM_RECORD_SIZE), dtk_get_daily_key(dtk), dtk_get_day_number(dtk));
+			if (key_total >= key_allocated) {
+				key_allocated = MAX(key_allocated * 2, MATCH_SHARD_BATCH);
+				dtks = realloc(dtks, key_allocated * sizeof(Dtk const *));
+			}
+			dtks[key_total] = dtk;
+			key_total++;
+			key_count++;
+			dtk_item = dtk_list_next(dtk_item);
+		}
+
+		for (shard = 0; result && (shard < shards); ++shard) {
+			result = match_shard_send_header(transport, channels[shard], MATCH_SHARD_KEYS, key_count);
+			if (result) {
+				result = transport->send(channels[shard], keys, key_count * DTK_STREAM_RECORD_SIZE);
+			}
+		}
+	}
+	memset(keys, 0, MATCH_SHARD_BATCH * DTK_STREAM_RECORD_SIZE);
+	free(keys);
+
+	for (shard = 0; result && (shard < shards); ++shard) {
+		result = match_shard_send_header(transport, channels[shard], MATCH_SHARD_END, 0);
+	}
+
+	// Collect and merge the results
+	results = NULL;
+	count = 0;
+	allocated = 0;
+	for (shard = 0; result && (shard < shards); ++shard) {
+		result = match_shard_collect(transport, channels[shard], shard, &results, &count, &allocated);
+	}
+
+	// The results come off the wire, so check they refer to what was sent
+	for (pos = 0; result && (pos < count); ++pos) {
+		result = (results[pos].key < key_total) && (results[pos].beacon < beacon_count) && (results[pos].variant < RPI_ENCODING_COUNT);
+	}
+
+	if (result) {
+		qsort(results, count, sizeof(MatchShardResult), match_shard_result_compare);
+		match_metadata_key_init(&key, NULL);
+		for (pos = 0; pos < count; ++pos) {
+			if ((pos == 0) || (results[pos].key != results[pos - 1].key)) {
+				match_metadata_key_clear(&key);
+				match_metadata_key_init(&key, dtks[results[pos].key]);
+			}
+			match_list_append_beacon_match(data, &key, results[pos].day_number, results[pos].time_interval_number, results[pos].variant, beacon_items[results[pos].beacon]);
+		}
+		match_metadata_key_clear(&key);
+	}
+	else {
+		LOG(LOG_ERR, "Sharded match failed\n");
+	}
+
+	free(results);
+	free(dtks);
+	free(beacon_items);
+
+	return result;
+}
+
+/**
+ * Sends bytes over a socket.
+ *
+ * For internal use. The channel is a pointer to the socket file descriptor.
+ *
+ * @param channel A pointer to an int containing the socket.
+ * @param buffer The bytes to send.
+ * @param size The number of bytes to send.
+ * @return true if all of the bytes were sent, false otherwise.
+ */
+static bool match_transport_socket_send(void * channel, void const * buffer, size_t size) {
+	int fd = *(int *)channel;
+	unsigned char const * position = (unsigned char const *)buffer;
+	ssize_t sent;
+	bool result;
+
+	result = true;
+	while (result && (size > 0)) {
+		sent = send(fd, position, size, MSG_NOSIGNAL);
+		if (sent > 0) {
+			position += sent;
+			size -= sent;
+		}
+		else {
+			result = (sent < 0) && (errno == EINTR);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Receives bytes from a socket.
+ *
+ * For internal use. The channel is a pointer to the socket file descriptor.
+ *
+ * @param channel A pointer to an int containing the socket.
+ * @param buffer The buffer to fill.
+ * @param size The number of bytes to receive.
+ * @return true if all of the bytes were received, false otherwise.
+ */
+static bool match_transport_socket_receive(void * channel, void * buffer, size_t size) {
+	int fd = *(int *)channel;
+	unsigned char * position = (unsigned char *)buffer;
+	ssize_t received;
+	bool result;
+
+	result = true;
+	while (result && (size > 0)) {
+		received = recv(fd, position, size, 0);
+		if (received > 0) {
+			position += received;
+			size -= received;
+		}
+		else {
+			result = (received < 0) && (errno == EINTR);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Returns a transport that communicates over stream sockets.
+ *
+ * Each channel used with this transport must be a pointer to an int
+ * containing the file descriptor of a connected stream socket, such as a Unix
+ * domain socket or a TCP connection.
+ *
+ * @return The socket transport.
+ */
+MatchTransport const * match_transport_socket() {
+	static MatchTransport const transport = {
+		match_transport_socket_send,
+		match_transport_socket_receive,
+	};
+
+	return &transport;
+}
+
+/**
+ * Runs a local worker.
+ *
+ * For internal use. Runs on its own thread, serving the coordinator over one
+ * end of a socket pair.
+ *
+ * @param arg The MatchShardWorker state.
+ * @return Always NULL.
+ */
+static void * match_shard_worker(void * arg) {
+	MatchShardWorker * worker = (MatchShardWorker *)arg;
+
+	worker->result = match_shard_serve(match_transport_socket(), &worker->socket);
+
+	return NULL;
+}
+
+/**
+ * Returns a list of matches found between the beacons and diagnoses, using
+ * multiple worker threads.
+ *
+ * This finds the same matches as \ref match_list_find_matches(), in the same
+ * diagnosis key order and including any registered encodings and metadata,
+ * but splits the work between a number of worker threads. The beacons are
+ * sharded between the workers by RPI prefix and each worker receives all of
+ * the diagnosis keys. The workers communicate with the caller over Unix
+ * domain sockets, using the same protocol as workers running in other
+ * processes. The order set using \ref match_list_set_order() is ignored.
+ *
+ * Threads are used rather than child processes, since the library may
+ * already be running other threads and it isn't safe to continue running
+ * library code in a forked child of a multi-threaded process.
+ *
+ * The match list isn't cleared by this call and so any new values will be
+ * appended to it. If communication with any of the workers fails, no matches
+ * are added.
+ *
+ * @param data The list that any matches will be appended to.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ * @param diagnosis_keys A list of DTKs downloaded from a Diagnosis Server.
+ * @param shards The number of workers to use.
+ * @return true if the job completed successfully, false otherwise.
+ */
+bool match_list_find_matches_sharded(MatchList * data, RpiList * beacons, DtkList * diagnosis_keys, size_t shards) {
+	int * sockets;
+	MatchShardWorker * workers;
+	void ** channels;
+	size_t shard;
+	size_t created;
+	size_t started;
+	bool result;
+
+	result = (shards > 0);
+	sockets = malloc(sizeof(int) * 2 * MAX(shards, 1));
+	workers = calloc(sizeof(MatchShardWorker), MAX(shards, 1));
+	channels = malloc(sizeof(void *) * MAX(shards, 1));
+
+	created = 0;
+	for (shard = 0; result && (shard < shards); ++shard) {
+		result = (socketpair(AF_UNIX, SOCK_STREAM, 0, &sockets[shard * 2]) == 0);
+		if (result) {
+			created++;
+		}
+	}
+
+	started = 0;
+	for (shard = 0; result && (shard < shards); ++shard) {
+		workers[shard].socket = sockets[(shard * 2) + 1];
+		result = (pthread_create(&workers[shard].thread, NULL, match_shard_worker, &workers[shard]) == 0);
+		if (result) {
+			started++;
+		}
+		else {
+			LOG(LOG_ERR, "Error starting shard worker thread\n");
+		}
+	}
+
+	for (shard = 0; shard < created; ++shard) {
+		channels[shard] = &sockets[shard * 2];
+	}
+
+	if (result) {
+		result = match_shard_coordinate(data, beacons, diagnosis_keys, match_transport_socket(), channels, shards);
+	}
+
+	// Closing the sockets causes any workers still waiting for input to exit
+	for (shard = 0; shard < created; ++shard) {
+		close(sockets[shard * 2]);
+	}
+
+	for (shard = 0; shard < started; ++shard) {
+		pthread_join(workers[shard].thread, NULL);
+		if (!workers[shard].result) {
+			LOG(LOG_ERR, "Shard worker failed\n");
+			result = false;
+		}
+	}
+
+	for (shard = 0; shard < created; ++shard) {
+		close(sockets[(shard * 2) + 1]);
+	}
+
+	free(channels);
+	free(workers);
+	free(sockets);
+
+	return result;
+}
+
+/** @} addtogroup Matching*/
+
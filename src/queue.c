@@ -0,0 +1,381 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Bounded lock-free single-producer single-consumer queue
+ * @section DESCRIPTION
+ *
+ * This class provides a fixed capacity queue of fixed size elements that can
+ * be safely used by exactly one producer thread and one consumer thread at the
+ * same time without locking. It's used to join the stages of the matching
+ * pipeline, where the bounded capacity limits the amount of memory in flight.
+ * A thread only takes a lock when it has to block waiting for the other.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "contrac/log.h"
+
+#include "contrac/queue.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The size of a cache line. The producer and consumer positions are kept on
+ * separate cache lines to avoid false sharing between the two threads.
+ */
+#define QUEUE_CACHE_LINE (64)
+
+/**
+ * Used internally.
+ *
+ * The number of times a waiting thread retries before blocking. Short waits
+ * are handled without any system calls, while longer waits, such as when the
+ * producer is blocked on I/O, don't keep a core busy.
+ */
+#define QUEUE_SPIN_COUNT (64)
+
+// Structures
+
+/**
+ * @brief A bounded single-producer single-consumer queue
+ *
+ * This is an opaque structure that represents the queue. The head is only
+ * written by the consumer and the tail is only written by the producer, so
+ * no locks are needed. The positions increase monotonically and are reduced
+ * modulo the capacity (which is always a power of two) to index the buffer.
+ *
+ * A thread that has to wait blocks on the condition variable once it's spun
+ * for a while. The waiting count lets the other thread skip the mutex
+ * entirely unless someone is actually blocked.
+ *
+ * The structure typedef is in queue.h
+ */
+struct _Queue {
+	size_t element_size;
+	size_t capacity;
+	unsigned char * elements;
+	bool closed;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int waiting;
+
+	size_t head __attribute__ ((aligned (QUEUE_CACHE_LINE)));
+	size_t tail __attribute__ ((aligned (QUEUE_CACHE_LINE)));
+};
+
+// Function prototypes
+
+static bool queue_try_push(Queue * data, void const * element);
+static bool queue_try_pop(Queue * data, void * element);
+static void queue_wake(Queue * data);
+
+// Function definitions
+
+/**
+ * Creates a new instance of the class.
+ *
+ * The capacity will be rounded up to the next power of two.
+ *
+ * @param element_size The size in bytes of each element in the queue.
+ * @param capacity The maximum number of elements the queue can hold.
+ * @return The newly created object.
+ */
+Queue * queue_new(size_t element_size, size_t capacity) {
+	Queue * data;
+	void * memory;
+	size_t size;
+
+	size = 1;
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	// The structure holds cache line aligned members, so must itself be
+	// allocated on a cache line boundary
+	if (posix_memalign(&memory, QUEUE_CACHE_LINE, sizeof(Queue)) != 0) {
+		LOG(LOG_ERR, "Error allocating queue\n");
+		memory = NULL;
+	}
+
+	data = (Queue *)memory;
+	if (data) {
+		memset(data, 0, sizeof(Queue));
+		pthread_mutex_init(&data->lock, NULL);
+		pthread_cond_init(&data->changed, NULL);
+		data->element_size = element_size;
+		data->capacity = size;
+		data->elements = malloc(element_size * size);
+	}
+
+	return data;
+}
+
+/**
+ * Deletes an instance of the class, freeing up the memory allocated to it.
+ *
+ * The queue must no longer be in use by either the producer or consumer.
+ *
+ * @param data The instance to free.
+ */
+void queue_delete(Queue * data) {
+	if (data) {
+		// Clear the data for security
+		memset(data->elements, 0, data->element_size * data->capacity);
+		free(data->elements);
+
+		pthread_cond_destroy(&data->changed);
+		pthread_mutex_destroy(&data->lock);
+
+		free(data);
+	}
+}
+
+/**
+ * Adds an element to the back of the queue without waking a blocked consumer.
+ *
+ * For internal use.
+ *
+ * @param data The queue to operate on.
+ * @param element The element to copy into the queue.
+ * @return true if the element was added, false if the queue was full.
+ */
+static bool queue_try_push(Queue * data, void const * element) {
+	size_t head;
+	size_t tail;
+	bool result;
+
+	tail = data->tail;
+	head = __atomic_load_n(&data->head, __ATOMIC_ACQUIRE);
+
+	result = ((tail - head) < data->capacity);
+	if (result) {
+		memcpy(data->elements + ((tail & (data->capacity - 1)) * data->element_size), element, data->element_size);
+		__atomic_store_n(&data->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	return result;
+}
+
+/**
+ * Removes an element from the front of the queue without waking a blocked
+ * producer.
+ *
+ * For internal use.
+ *
+ * @param data The queue to operate on.
+ * @param element A buffer of at least the element size to copy the element
+ *        into.
+ * @return true if an element was removed, false if the queue was empty.
+ */
+static bool queue_try_pop(Queue * data, void * element) {
+	size_t head;
+	size_t tail;
+	bool result;
+
+	head = data->head;
+	tail = __atomic_load_n(&data->tail, __ATOMIC_ACQUIRE);
+
+	result = (tail != head);
+	if (result) {
+		memcpy(element, data->elements + ((head & (data->capacity - 1)) * data->element_size), data->element_size);
+		__atomic_store_n(&data->head, head + 1, __ATOMIC_RELEASE);
+	}
+
+	return result;
+}
+
+/**
+ * Wakes the other thread if it's blocked waiting on the queue.
+ *
+ * For internal use. Must be called after the queue has changed, without
+ * holding the lock. The fence pairs with the one in the waiting thread, so
+ * either the waiter sees the change before blocking, or this sees the waiter
+ * and signals it.
+ *
+ * @param data The queue to operate on.
+ */
+static void queue_wake(Queue * data) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&data->waiting, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&data->lock);
+		pthread_cond_broadcast(&data->changed);
+		pthread_mutex_unlock(&data->lock);
+	}
+}
+
+/**
+ * Adds an element to the back of the queue without blocking.
+ *
+ * Must only be called from the producer thread.
+ *
+ * @param data The queue to operate on.
+ * @param element The element to copy into the queue.
+ * @return true if the element was added, false if the queue was full.
+ */
+bool queue_push(Queue * data, void const * element) {
+	bool result;
+
+	result = queue_try_push(data, element);
+	if (result) {
+		queue_wake(data);
+	}
+
+	return result;
+}
+
+/**
+ * Removes an element from the front of the queue without blocking.
+ *
+ * Must only be called from the consumer thread.
+ *
+ * @param data The queue to operate on.
+ * @param element A buffer of at least the element size to copy the element
+ *        into.
+ * @return true if an element was removed, false if the queue was empty.
+ */
+bool queue_pop(Queue * data, void * element) {
+	bool result;
+
+	result = queue_try_pop(data, element);
+	if (result) {
+		queue_wake(data);
+	}
+
+	return result;
+}
+
+/**
+ * Adds an element to the back of the queue, waiting for space if needed.
+ *
+ * Must only be called from the producer thread. The thread yields for a
+ * short while if the queue is full, and then blocks until the consumer has
+ * removed an element.
+ *
+ * @param data The queue to operate on.
+ * @param element The element to copy into the queue.
+ */
+void queue_push_wait(Queue * data, void const * element) {
+	bool result;
+	int spin;
+
+	result = queue_push(data, element);
+	for (spin = 0; (!result) && (spin < QUEUE_SPIN_COUNT); ++spin) {
+		sched_yield();
+		result = queue_push(data, element);
+	}
+
+	if (!result) {
+		pthread_mutex_lock(&data->lock);
+		__atomic_add_fetch(&data->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		result = queue_try_push(data, element);
+		while (!result) {
+			pthread_cond_wait(&data->changed, &data->lock);
+			result = queue_try_push(data, element);
+		}
+		__atomic_sub_fetch(&data->waiting, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&data->lock);
+
+		queue_wake(data);
+	}
+}
+
+/**
+ * Removes an element from the front of the queue, waiting for one if needed.
+ *
+ * Must only be called from the consumer thread. The thread yields for a
+ * short while if the queue is empty, and then blocks until the producer has
+ * added an element. Once the producer has closed the queue using
+ * \ref queue_close() and all elements have been removed, the call returns
+ * false.
+ *
+ * @param data The queue to operate on.
+ * @param element A buffer of at least the element size to copy the element
+ *        into.
+ * @return true if an element was removed, false if the queue is closed and
+ *         empty.
+ */
+bool queue_pop_wait(Queue * data, void * element) {
+	bool result;
+	bool closed;
+	int spin;
+
+	// Read the flag before trying again, in case an element was pushed just
+	// before the queue was closed
+	closed = false;
+	result = queue_pop(data, element);
+	for (spin = 0; (!result) && (!closed) && (spin < QUEUE_SPIN_COUNT); ++spin) {
+		sched_yield();
+		closed = __atomic_load_n(&data->closed, __ATOMIC_ACQUIRE);
+		result = queue_pop(data, element);
+	}
+
+	if ((!result) && (!closed)) {
+		pthread_mutex_lock(&data->lock);
+		__atomic_add_fetch(&data->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		closed = __atomic_load_n(&data->closed, __ATOMIC_ACQUIRE);
+		result = queue_try_pop(data, element);
+		while ((!result) && (!closed)) {
+			pthread_cond_wait(&data->changed, &data->lock);
+			closed = __atomic_load_n(&data->closed, __ATOMIC_ACQUIRE);
+			result = queue_try_pop(data, element);
+		}
+		__atomic_sub_fetch(&data->waiting, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&data->lock);
+
+		if (result) {
+			queue_wake(data);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Marks the queue as closed.
+ *
+ * Must only be called from the producer thread, once it has finished pushing
+ * elements. The consumer will continue to receive the remaining elements,
+ * after which \ref queue_pop_wait() will return false.
+ *
+ * @param data The queue to operate on.
+ */
+void queue_close(Queue * data) {
+	__atomic_store_n(&data->closed, true, __ATOMIC_RELEASE);
+	queue_wake(data);
+}
+
+/**
+ * Returns the maximum number of elements the queue can hold.
+ *
+ * @param data The queue to operate on.
+ * @return The capacity of the queue.
+ */
+size_t queue_get_capacity(Queue const * data) {
+	return data->capacity;
+}
+
+/** @} addtogroup Containers*/
+
@@ -0,0 +1,302 @@
+/** \ingroup KeyGeneration
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Updates the keys at each time interval boundary
+ * @section DESCRIPTION
+ *
+ * This class runs a background thread that sleeps until the current Rolling
+ * Proximity Identifier expires, then updates the keys and calls a callback.
+ * During the last time interval of the day it also prepares the next day's
+ * keys, after the callback, so the rollover at midnight is just a lookup.
+ *
+ * The thread waits on a timerfd set to fire at the absolute time returned by
+ * \ref contrac_get_next_rollover(). If the system clock is changed the timer
+ * is cancelled, the keys are updated for the new time and the timer is set
+ * again. An eventfd is used to wake the thread when it's stopped.
+ *
+ */
+
+/** \addtogroup KeyGeneration
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+#include "contrac/rpi.h"
+
+#include "contrac/rollover_scheduler.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * The number of time intervals before the end of the day at which the next
+ * day's keys are prepared.
+ */
+#define ROLLOVER_SCHEDULER_PREPARE_AHEAD_INTERVALS (1)
+
+// Structures
+
+/**
+ * @brief The scheduler state
+ *
+ * This is an opaque structure that represents the scheduler. The file
+ * descriptors are only open while the thread is running.
+ *
+ * The structure typedef is in rollover_scheduler.h
+ */
+struct _RolloverScheduler {
+	Contrac * contrac;
+	RolloverCallback callback;
+	void * user_data;
+
+	int timer_fd;
+	int stop_fd;
+	pthread_t thread;
+	bool running;
+};
+
+// Function prototypes
+
+static bool rollover_scheduler_arm(RolloverScheduler * data);
+static void rollover_scheduler_update(RolloverScheduler * data);
+static void * rollover_scheduler_thread(void * user_data);
+
+// Function definitions
+
+/**
+ * Creates a new instance of the class.
+ *
+ * The context object remains owned by the caller. It should be fully
+ * initialised before the scheduler is started, for example by calling
+ * \ref contrac_update_current_time(), although the first update happens
+ * straight away if it isn't up to date.
+ *
+ * @param contrac The context object to keep updated.
+ * @param callback A function to call after each update, or NULL.
+ * @param user_data A pointer that will be passed to the callback.
+ * @return The newly created object.
+ */
+RolloverScheduler * rollover_scheduler_new(Contrac * contrac, RolloverCallback callback, void * user_data) {
+	RolloverScheduler * data;
+
+	data = calloc(sizeof(RolloverScheduler), 1);
+	data->contrac = contrac;
+	data->callback = callback;
+	data->user_data = user_data;
+	data->timer_fd = -1;
+	data->stop_fd = -1;
+
+	return data;
+}
+
+/**
+ * Deletes an instance of the class, freeing up the memory allocated to it.
+ *
+ * Stops the thread if it's running.
+ *
+ * @param data The instance to free.
+ */
+void rollover_scheduler_delete(RolloverScheduler * data) {
+	if (data) {
+		rollover_scheduler_stop(data);
+
+		free(data);
+	}
+}
+
+/**
+ * Sets the timer to fire when the current RPI expires.
+ *
+ * For internal use. If the expiry time has already passed the timer fires
+ * immediately.
+ *
+ * @param data The scheduler to operate on.
+ * @return true if the timer was set, false otherwise.
+ */
+static bool rollover_scheduler_arm(RolloverScheduler * data) {
+	struct itimerspec deadline;
+	bool result;
+
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.it_value.tv_sec = contrac_get_next_rollover(data->contrac);
+
+	result = (timerfd_settime(data->timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &deadline, NULL) == 0);
+	if (!result) {
+		LOG(LOG_ERR, "Error setting rollover timer: %d\n", errno);
+	}
+
+	return result;
+}
+
+/**
+ * Updates the keys for the current time and calls the callback.
+ *
+ * For internal use. Near the end of the day the next day's keys are then
+ * prepared, off the critical path of the update.
+ *
+ * @param data The scheduler to operate on.
+ */
+static void rollover_scheduler_update(RolloverScheduler * data) {
+	uint32_t day_number;
+	bool initialised;
+	bool result;
+
+	initialised = contrac_get_initialised(data->contrac);
+	day_number = contrac_get_day_number(data->contrac);
+
+	result = contrac_update_current_time(data->contrac);
+	if (result && data->callback) {
+		data->callback(data->contrac, (!initialised) || (contrac_get_day_number(data->contrac) != day_number), data->user_data);
+	}
+	else if (!result) {
+		LOG(LOG_ERR, "Error updating keys at rollover\n");
+	}
+
+	if (result && (contrac_get_time_interval_number(data->contrac) >= (RPI_INTERVAL_MAX - ROLLOVER_SCHEDULER_PREPARE_AHEAD_INTERVALS))) {
+		if (!contrac_prepare_next_day(data->contrac)) {
+			LOG(LOG_ERR, "Error preparing keys for the next day\n");
+		}
+	}
+}
+
+/**
+ * The scheduler thread.
+ *
+ * For internal use. Waits for either the timer or a request to stop,
+ * updating the keys each time the timer fires. A read from the timer fails
+ * with ECANCELED if the clock was changed, in which case the keys are updated
+ * for the new time in the same way.
+ *
+ * @param user_data The scheduler the thread belongs to.
+ * @return Always NULL.
+ */
+static void * rollover_scheduler_thread(void * user_data) {
+	RolloverScheduler * data = (RolloverScheduler *)user_data;
+	struct pollfd fds[2];
+	uint64_t expirations;
+	ssize_t size;
+	bool running;
+
+	fds[0].fd = data->timer_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = data->stop_fd;
+	fds[1].events = POLLIN;
+
+	running = rollover_scheduler_arm(data);
+	while (running) {
+		if (poll(fds, 2, -1) < 0) {
+			running = (errno == EINTR);
+		}
+		else if (fds[1].revents & POLLIN) {
+			running = false;
+		}
+		else if (fds[0].revents & POLLIN) {
+			size = read(data->timer_fd, &expirations, sizeof(expirations));
+			if ((size == sizeof(expirations)) || ((size < 0) && (errno == ECANCELED))) {
+				rollover_scheduler_update(data);
+			}
+			running = rollover_scheduler_arm(data);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts the scheduler thread.
+ *
+ * @param data The scheduler to operate on.
+ * @return true if the thread is running, false if it couldn't be started.
+ */
+bool rollover_scheduler_start(RolloverScheduler * data) {
+	bool result;
+
+	result = true;
+	if (!data->running) {
+		data->timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+		data->stop_fd = eventfd(0, EFD_CLOEXEC);
+		result = (data->timer_fd >= 0) && (data->stop_fd >= 0);
+
+		if (result) {
+			__atomic_store_n(&data->running, true, __ATOMIC_RELEASE);
+			result = (pthread_create(&data->thread, NULL, rollover_scheduler_thread, data) == 0);
+		}
+
+		if (!result) {
+			__atomic_store_n(&data->running, false, __ATOMIC_RELEASE);
+			LOG(LOG_ERR, "Error starting rollover scheduler thread\n");
+			if (data->timer_fd >= 0) {
+				close(data->timer_fd);
+			}
+			if (data->stop_fd >= 0) {
+				close(data->stop_fd);
+			}
+			data->timer_fd = -1;
+			data->stop_fd = -1;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Stops the scheduler thread.
+ *
+ * Wakes the thread and waits for it to finish. If a callback is in progress
+ * it's allowed to complete first.
+ *
+ * @param data The scheduler to operate on.
+ */
+void rollover_scheduler_stop(RolloverScheduler * data) {
+	uint64_t wake;
+
+	if (data->running) {
+		wake = 1;
+		if (write(data->stop_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+			LOG(LOG_ERR, "Error waking rollover scheduler thread\n");
+		}
+		pthread_join(data->thread, NULL);
+		__atomic_store_n(&data->running, false, __ATOMIC_RELEASE);
+
+		close(data->timer_fd);
+		close(data->stop_fd);
+		data->timer_fd = -1;
+		data->stop_fd = -1;
+	}
+}
+
+/**
+ * Returns whether the scheduler thread is running.
+ *
+ * @param data The scheduler to operate on.
+ * @return true if the thread has been started and not yet stopped.
+ */
+bool rollover_scheduler_get_running(RolloverScheduler const * data) {
+	return __atomic_load_n(&data->running, __ATOMIC_ACQUIRE);
+}
+
+/** @} addtogroup KeyGeneration */
+
@@ -27,14 +27,12 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
-
-#include <openssl/crypto.h>
-#include <openssl/hmac.h>
-#include <openssl/err.h>
+#include <stdio.h>
 
 #include "contrac/contrac.h"
 #include "contrac/utils.h"
 #include "contrac/log.h"
+#include "contrac/crypto_context.h"
 
 #include "contrac/rpi.h"
 
@@ -48,6 +46,45 @@
  */
 #define RPI_INFO_PREFIX "CT-RPI"
 
+/**
+ * Used internally.
+ *
+ * The maximum size of the Info parameter for any of the encodings: the
+ * prefix followed by up to three decimal digits and a null terminator.
+ */
+#define RPI_INFO_SIZE_MAX (sizeof(RPI_INFO_PREFIX) + 4)
+
+/**
+ * Used internally.
+ *
+ * The Info parameter provided to the HKDF used to derive the AES key. Unlike
+ * the HMAC scheme this doesn't include the null terminator.
+ */
+#define RPI_AES_KEY_INFO "EN-RPIK"
+
+/**
+ * Used internally.
+ *
+ * The prefix of the padded data encrypted to generate each AES scheme RPI.
+ * Unlike the HMAC scheme this doesn't include the null terminator.
+ */
+#define RPI_AES_PADDED_PREFIX "EN-RPI"
+
+/**
+ * Used internally.
+ *
+ * The Info parameter provided to the HKDF used to derive the metadata key.
+ * This doesn't include the null terminator.
+ */
+#define RPI_METADATA_KEY_INFO "EN-AEMK"
+
+/**
+ * Used internally.
+ *
+ * The position of the interval number within the AES scheme padded data.
+ */
+#define RPI_AES_PADDED_ENIN_OFFSET (12)
+
 // Structures
 
 /**
@@ -67,6 +104,10 @@ struct _Rpi {
 
 // Function prototypes
 
+static size_t rpi_encode_info(unsigned char * encode, RpiEncoding encoding, uint8_t time_interval_number);
+static bool rpi_generate_aes_key(Dtk const * dtk, unsigned char * rpik);
+static void rpi_encode_aes_padded_data(unsigned char * padded, uint32_t interval_number);
+
 // Function definitions
 
 /**
@@ -112,49 +153,319 @@ void rpi_delete(Rpi * data) {
  * @return true if the operation completed successfully, false otherwise.
  */
 bool rpi_generate_proximity_id(Rpi * data, Dtk const * dtk, uint8_t time_interval_number) {
-	int result = 1;
-	unsigned char encode[sizeof(RPI_INFO_PREFIX) + sizeof(time_interval_number)];
-	unsigned char output[EVP_MAX_MD_SIZE];
-	unsigned int out_length = 0;
-	unsigned int pos;
-	unsigned int min;
-	unsigned char const * daily_key;
+	bool result;
+	unsigned char encode[RPI_INFO_SIZE_MAX];
+	size_t size;
 
 	// RPI_{i, j} <- Truncate(HMAC(dkt_i, (UTF8("CT-RPI") || TIN_j)), 16)
 
-	if (result > 0) {
-		// Produce Info sequence UTF8("CT-DTK") || D_i)
-		// From the spec it's not clear whether this is string or byte concatenation.
-		// Here we use byte, but it might have to be changed
-		memcpy(encode, RPI_INFO_PREFIX, sizeof(RPI_INFO_PREFIX));
-		((uint8_t *)(encode + sizeof(RPI_INFO_PREFIX)))[0] = time_interval_number;
-		out_length = sizeof(output);
+	size = rpi_encode_info(encode, RPI_ENCODING_BINARY, time_interval_number);
+
+	_Static_assert ((CRYPTO_HMAC_SIZE >= RPI_SIZE), "HMAC output size too small");
+
+	// Truncate and copy the result
+	result = crypto_hmac_sha256(dtk_get_daily_key(dtk), DTK_SIZE, encode, size, data->rpi, RPI_SIZE);
+
+	if (result) {
+		data->time_interval_number = time_interval_number;
+	}
+	else {
+		LOG(LOG_ERR, "Error generating rolling proximity id\n");
+	}
+
+	return result;
+}
+
+/**
+ * Produces the Info sequence used to generate an RPI using RPI_SCHEME_HMAC.
+ *
+ * For internal use.
+ *
+ * @param encode A buffer of RPI_INFO_SIZE_MAX bytes to store the Info in.
+ * @param encoding The encoding to use.
+ * @param time_interval_number The time interval number to encode.
+ * @return The size of the Info in bytes.
+ */
+static size_t rpi_encode_info(unsigned char * encode, RpiEncoding encoding, uint8_t time_interval_number) {
+	size_t size;
+
+	switch (encoding) {
+		case RPI_ENCODING_BINARY_UNTERMINATED:
+			// UTF8("CT-RPI") || TIN_j
+			memcpy(encode, RPI_INFO_PREFIX, sizeof(RPI_INFO_PREFIX) - 1);
+			encode[sizeof(RPI_INFO_PREFIX) - 1] = time_interval_number;
+			size = sizeof(RPI_INFO_PREFIX);
+			break;
+		case RPI_ENCODING_STRING:
+			// UTF8("CT-RPI" || TIN_j)
+			memcpy(encode, RPI_INFO_PREFIX, sizeof(RPI_INFO_PREFIX) - 1);
+			size = (sizeof(RPI_INFO_PREFIX) - 1) + snprintf((char *)encode + sizeof(RPI_INFO_PREFIX) - 1, RPI_INFO_SIZE_MAX - (sizeof(RPI_INFO_PREFIX) - 1), "%u", time_interval_number);
+			break;
+		default:
+			// UTF8("CT-RPI") || 0x00 || TIN_j
+			memcpy(encode, RPI_INFO_PREFIX, sizeof(RPI_INFO_PREFIX));
+			encode[sizeof(RPI_INFO_PREFIX)] = time_interval_number;
+			size = sizeof(RPI_INFO_PREFIX) + sizeof(time_interval_number);
+			break;
+	}
+
+	return size;
+}
+
+/**
+ * Generates the Rolling Proximity Identifiers for every time interval of a
+ * day.
+ *
+ * The rpi_bytes buffer must be at least RPI_INTERVAL_MAX * RPI_SIZE bytes
+ * long. It's filled with the RPIs for each time interval in turn, so the RPI
+ * for time interval number n starts at byte n * RPI_SIZE.
+ *
+ * @param dtk The Daily Tracing Key to generate the RPIs from.
+ * @param rpi_bytes A buffer to store the RPIs in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool rpi_generate_proximity_ids(Dtk const * dtk, unsigned char * rpi_bytes) {
+	RpiEncoding const encoding = RPI_ENCODING_BINARY;
+
+	return rpi_generate_proximity_ids_variants(dtk, &encoding, 1, rpi_bytes);
+}
+
+/**
+ * Generates the Rolling Proximity Identifiers for every time interval of a
+ * day, for several encodings at once.
+ *
+ * This allows RPIs to be matched against keys from servers that differ in how
+ * they encode the Info when using RPI_SCHEME_HMAC. The HMAC key is only set
+ * up once, then shared between all of the intervals and encodings, so
+ * generating several encodings costs much less than generating each
+ * separately.
+ *
+ * The rpi_bytes buffer must be at least count * RPI_INTERVAL_MAX * RPI_SIZE
+ * bytes long. It's filled with the RPIs for each encoding in turn, each laid
+ * out as for \ref rpi_generate_proximity_ids().
+ *
+ * @param dtk The Daily Tracing Key to generate the RPIs from.
+ * @param encodings The encodings to generate RPIs for.
+ * @param count The number of encodings.
+ * @param rpi_bytes A buffer to store the RPIs in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool rpi_generate_proximity_ids_variants(Dtk const * dtk, RpiEncoding const * encodings, size_t count, unsigned char * rpi_bytes) {
+	unsigned char * encode;
+	unsigned char const ** inputs;
+	size_t * sizes;
+	size_t variant;
+	size_t pos;
+	uint8_t interval;
+	bool result;
+
+	encode = malloc(count * RPI_INTERVAL_MAX * RPI_INFO_SIZE_MAX);
+	inputs = malloc(sizeof(unsigned char const *) * count * RPI_INTERVAL_MAX);
+	sizes = malloc(sizeof(size_t) * count * RPI_INTERVAL_MAX);
+
+	pos = 0;
+	for (variant = 0; variant < count; ++variant) {
+		for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+			inputs[pos] = encode + (pos * RPI_INFO_SIZE_MAX);
+			sizes[pos] = rpi_encode_info(encode + (pos * RPI_INFO_SIZE_MAX), encodings[variant], interval);
+			pos++;
+		}
+	}
+
+	result = crypto_hmac_sha256_multi(dtk_get_daily_key(dtk), DTK_SIZE, inputs, sizes, pos, rpi_bytes, RPI_SIZE);
+	if (!result) {
+		LOG(LOG_ERR, "Error generating rolling proximity ids\n");
+	}
+
+	free(sizes);
+	free(inputs);
+	free(encode);
 
-		daily_key = dtk_get_daily_key(dtk);
-		HMAC(EVP_sha256(), daily_key, DTK_SIZE, encode, sizeof(encode), output, &out_length);
+	return result;
+}
 
-		_Static_assert ((EVP_MAX_MD_SIZE >= 16), "HMAC buffer size too small");
+/**
+ * Derives the AES key used to generate RPIs under the AES scheme.
+ *
+ * For internal use.
+ *
+ * @param dtk The daily key to derive the AES key from.
+ * @param rpik A buffer of CRYPTO_AES_KEY_SIZE bytes to store the key in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+static bool rpi_generate_aes_key(Dtk const * dtk, unsigned char * rpik) {
+	// RPIK_i <- HKDF(dtk_i, NULL, UTF8("EN-RPIK"), 16)
+	return crypto_hkdf_sha256(dtk_get_daily_key(dtk), DTK_SIZE, (unsigned char const *)RPI_AES_KEY_INFO, sizeof(RPI_AES_KEY_INFO) - 1, rpik, CRYPTO_AES_KEY_SIZE);
+}
 
-		// Truncate and copy the result
-		min = MIN(out_length, 16);
-		for (pos = 0; pos < min; ++pos) {
-			data->rpi[pos] = output[pos];
+/**
+ * Encodes the block that's encrypted to generate an AES scheme RPI.
+ *
+ * For internal use.
+ *
+ * @param padded A buffer of CRYPTO_AES_BLOCK_SIZE bytes to store the block in.
+ * @param interval_number The interval number counted from the Unix epoch.
+ */
+static void rpi_encode_aes_padded_data(unsigned char * padded, uint32_t interval_number) {
+	_Static_assert ((RPI_AES_PADDED_ENIN_OFFSET + sizeof(uint32_t) == CRYPTO_AES_BLOCK_SIZE), "AES padded data size mismatch");
+
+	// PaddedData_j <- UTF8("EN-RPI") || 0x000000000000 || ENIN_j
+	memset(padded, 0, CRYPTO_AES_BLOCK_SIZE);
+	memcpy(padded, RPI_AES_PADDED_PREFIX, sizeof(RPI_AES_PADDED_PREFIX) - 1);
+	padded[RPI_AES_PADDED_ENIN_OFFSET + 0] = (interval_number >> 0) & 0xff;
+	padded[RPI_AES_PADDED_ENIN_OFFSET + 1] = (interval_number >> 8) & 0xff;
+	padded[RPI_AES_PADDED_ENIN_OFFSET + 2] = (interval_number >> 16) & 0xff;
+	padded[RPI_AES_PADDED_ENIN_OFFSET + 3] = (interval_number >> 24) & 0xff;
+}
+
+/**
+ * Generates a Rolling Proximity Identifier using the scheme provided.
+ *
+ * With RPI_SCHEME_HMAC this is the same as \ref rpi_generate_proximity_id().
+ * With RPI_SCHEME_AES the interval number encoded is the one counted from the
+ * Unix epoch, calculated from the day number of the daily key and the time
+ * interval number provided.
+ *
+ * Generating a single AES scheme RPI requires the AES key to be derived. When
+ * several RPIs are needed for the same key it's much more efficient to use
+ * \ref rpi_generate_proximity_ids_scheme() instead.
+ *
+ * @param data The context object to work with.
+ * @param dtk The Daily Tracing Key to generate the RPI from.
+ * @param time_interval_number The time interval number to use to generate the
+ *        key.
+ * @param scheme The scheme to use to generate the RPI.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool rpi_generate_proximity_id_scheme(Rpi * data, Dtk const * dtk, uint8_t time_interval_number, RpiScheme scheme) {
+	unsigned char rpik[CRYPTO_AES_KEY_SIZE];
+	unsigned char padded[CRYPTO_AES_BLOCK_SIZE];
+	bool result;
+
+	if (scheme == RPI_SCHEME_AES) {
+		result = rpi_generate_aes_key(dtk, rpik);
+		if (result) {
+			rpi_encode_aes_padded_data(padded, (dtk_get_day_number(dtk) * RPI_INTERVAL_MAX) + time_interval_number);
+			result = crypto_aes128_ecb_encrypt(rpik, padded, data->rpi, CRYPTO_AES_BLOCK_SIZE);
+		}
+
+		if (result) {
+			data->time_interval_number = time_interval_number;
 		}
-		// Zero out padding if there is any
-		for (pos = min; pos < 16; ++pos) {
-			data->rpi[pos] = 0;
+		else {
+			LOG(LOG_ERR, "Error generating rolling proximity id\n");
 		}
+
+		// Clear the data for security
+		memset(rpik, 0, sizeof(rpik));
 	}
-	
-	if (result > 0) {
-		data->time_interval_number = time_interval_number;
+	else {
+		result = rpi_generate_proximity_id(data, dtk, time_interval_number);
 	}
 
-	if (result <= 0) {
-		LOG(LOG_ERR, "Error generating rolling proximity id: %lu\n", ERR_get_error());
+	return result;
+}
+
+/**
+ * Generates the Rolling Proximity Identifiers for every time interval of a
+ * day using the scheme provided.
+ *
+ * The output is laid out in the same way as for
+ * \ref rpi_generate_proximity_ids().
+ *
+ * With RPI_SCHEME_AES the AES key is derived once, then the padded data for
+ * all of the intervals is encrypted in a single operation. This allows the
+ * blocks to be pipelined through the processor's AES instructions, if it has
+ * them.
+ *
+ * @param dtk The Daily Tracing Key to generate the RPIs from.
+ * @param scheme The scheme to use to generate the RPIs.
+ * @param rpi_bytes A buffer to store the RPIs in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool rpi_generate_proximity_ids_scheme(Dtk const * dtk, RpiScheme scheme, unsigned char * rpi_bytes) {
+	unsigned char rpik[CRYPTO_AES_KEY_SIZE];
+	uint32_t interval_number;
+	uint8_t interval;
+	bool result;
+
+	_Static_assert ((RPI_SIZE == CRYPTO_AES_BLOCK_SIZE), "RPI size doesn't match AES block size");
+
+	if (scheme == RPI_SCHEME_AES) {
+		result = rpi_generate_aes_key(dtk, rpik);
+		if (result) {
+			interval_number = dtk_get_day_number(dtk) * RPI_INTERVAL_MAX;
+			for (interval = 0; interval < RPI_INTERVAL_MAX; ++interval) {
+				rpi_encode_aes_padded_data(rpi_bytes + (interval * RPI_SIZE), interval_number + interval);
+			}
+			// Encrypt in place
+			result = crypto_aes128_ecb_encrypt(rpik, rpi_bytes, rpi_bytes, RPI_INTERVAL_MAX * RPI_SIZE);
+		}
+
+		if (!result) {
+			LOG(LOG_ERR, "Error generating rolling proximity ids\n");
+		}
+
+		// Clear the data for security
+		memset(rpik, 0, sizeof(rpik));
+	}
+	else {
+		result = rpi_generate_proximity_ids(dtk, rpi_bytes);
+	}
+
+	return result;
+}
+
+/**
+ * Derives the key used to decrypt the Associated Encrypted Metadata.
+ *
+ * Under the AES scheme each beacon carries RPI_METADATA_SIZE bytes of
+ * metadata, such as the protocol version and transmit power, encrypted using
+ * a key derived from the daily key:
+ *
+ *     AEMK_i <- HKDF(dtk_i, NULL, UTF8("EN-AEMK"), 16)
+ *
+ * The same key applies to every beacon generated from the daily key, so it
+ * can be derived once and used to decrypt the metadata from all of them using
+ * \ref rpi_decrypt_metadata().
+ *
+ * @param dtk The daily key to derive the metadata key from.
+ * @param aemk A buffer of RPI_METADATA_KEY_SIZE bytes to store the key in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool rpi_generate_metadata_key(Dtk const * dtk, unsigned char * aemk) {
+	bool result;
+
+	result = crypto_hkdf_sha256(dtk_get_daily_key(dtk), DTK_SIZE, (unsigned char const *)RPI_METADATA_KEY_INFO, sizeof(RPI_METADATA_KEY_INFO) - 1, aemk, RPI_METADATA_KEY_SIZE);
+	if (!result) {
+		LOG(LOG_ERR, "Error generating metadata key\n");
 	}
 
-	return (result > 0);
+	return result;
+}
+
+/**
+ * Decrypts the Associated Encrypted Metadata from a beacon.
+ *
+ * The metadata is encrypted using AES-128 in CTR mode, with the RPI it was
+ * broadcast alongside used as the initial counter block:
+ *
+ *     AEM <- AES128-CTR(AEMK_i, RPI_{i, j}, Metadata)
+ *
+ * Since encryption and decryption are the same operation in CTR mode, this
+ * can also be used to encrypt metadata.
+ *
+ * @param aemk The key from \ref rpi_generate_metadata_key().
+ * @param rpi_bytes The RPI the metadata was broadcast with, RPI_SIZE bytes.
+ * @param encrypted The encrypted metadata, RPI_METADATA_SIZE bytes.
+ * @param metadata A buffer of RPI_METADATA_SIZE bytes to store the decrypted
+ *        metadata in.
+ * @return true if the operation completed successfully, false otherwise.
+ */
+bool rpi_decrypt_metadata(unsigned char const * aemk, unsigned char const * rpi_bytes, unsigned char const * encrypted, unsigned char * metadata) {
+	_Static_assert ((RPI_METADATA_KEY_SIZE == CRYPTO_AES_KEY_SIZE), "Metadata key size doesn't match AES key size");
+
+	return crypto_aes128_ctr(aemk, rpi_bytes, encrypted, metadata, RPI_METADATA_SIZE);
 }
 
 /**
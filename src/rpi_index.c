@@ -0,0 +1,314 @@
+/** \ingroup Containers
+ * @file
+ * @author	David Llewellyn-Jones <david@flypig.co.uk>
+ * @version	$(VERSION)
+ *
+ * @section LICENSE
+ *
+ * Copyright David Llewellyn-Jones, 2020
+ * Released under the GPLv2.
+ *
+ * @brief Provides a hash index of RPIs
+ * @section DESCRIPTION
+ *
+ * This class allows RPIs captured over Bluetooth to be looked up by value in
+ * constant time. Generated RPIs can then be checked against the full set of
+ * beacons with a single lookup, rather than by comparing against each beacon
+ * in turn.
+ *
+ * Each entry stores a tag alongside the RPI and time interval number, which
+ * the caller can use to associate the entry with other data.
+ *
+ * The RPIs come from beacons broadcast by anyone nearby, so the buckets are
+ * chosen using a hash keyed with a random secret. Otherwise an attacker could
+ * broadcast RPIs crafted to fall into the same bucket, turning each lookup
+ * into a search through every beacon.
+ *
+ */
+
+/** \addtogroup Containers
+ *  @{
+ */
+
+// Includes
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "contrac/contrac.h"
+#include "contrac/utils.h"
+#include "contrac/log.h"
+
+#include "contrac/rpi_index.h"
+
+// Defines
+
+/**
+ * Used internally.
+ *
+ * Marks the end of a bucket chain.
+ */
+#define RPI_INDEX_NONE (UINT32_MAX)
+
+/**
+ * Used internally.
+ *
+ * The number of buckets allocated for an empty index.
+ */
+#define RPI_INDEX_MIN_BUCKETS (16)
+
+// Structures
+
+/**
+ * @brief An entry in the RPI index
+ *
+ * Entries are stored contiguously. Entries that share a bucket are chained
+ * together using the position of the next entry in the chain.
+ */
+typedef struct _RpiIndexEntry {
+	unsigned char rpi[RPI_SIZE];
+	uint32_t tag;
+	uint32_t next;
+	uint8_t time_interval_number;
+} RpiIndexEntry;
+
+/**
+ * @brief The RPI index
+ *
+ * This is an opaque structure that represents the index. It's a chained hash
+ * table, with the number of buckets always a power of two and kept at least
+ * twice the number of entries.
+ *
+ * The structure typedef is in rpi_index.h
+ */
+struct _RpiIndex {
+	RpiIndexEntry * entries;
+	size_t count;
+	size_t allocated;
+
+	uint32_t * buckets;
+	size_t bucket_count;
+
+	unsigned char key[HASH_KEY_SIZE];
+};
+
+// Function prototypes
+
+static uint32_t rpi_index_hash(RpiIndex const * data, unsigned char const * rpi_bytes);
+static void rpi_index_rehash(RpiIndex * data, size_t bucket_count);
+
+// Function definitions
+
+/**
+ * Creates a new instance of the class.
+ *
+ * The capacity is the number of entries to reserve space for. The index will
+ * grow as needed if more entries are added.
+ *
+ * @param capacity The number of entries to reserve space for.
+ * @return The newly created object.
+ */
+RpiIndex * rpi_index_new(size_t capacity) {
+	RpiIndex * data;
+	size_t bucket_count;
+
+	data = calloc(sizeof(RpiIndex), 1);
+	hash_key_generate(data->key);
+
+	data->allocated = MAX(capacity, 1);
+	data->entries = malloc(sizeof(RpiIndexEntry) * data->allocated);
+
+	bucket_count = RPI_INDEX_MIN_BUCKETS;
+	while (bucket_count < (capacity * 2)) {
+		bucket_count <<= 1;
+	}
+	rpi_index_rehash(data, bucket_count);
+
+	return data;
+}
+
+/**
+ * Deletes an instance of the class, freeing up the memory allocated to it.
+ *
+ * @param data The instance to free.
+ */
+void rpi_index_delete(RpiIndex * data) {
+	if (data) {
+		// Clear the data for security
+		memset(data->entries, 0, sizeof(RpiIndexEntry) * data->allocated);
+		free(data->entries);
+		free(data->buckets);
+
+		free(data);
+	}
+}
+
+/**
+ * Calculates the bucket hash for an RPI.
+ *
+ * For internal use. Genuine RPIs are already uniformly distributed, but
+ * captured beacons may have been crafted, so the hash is keyed with the
+ * index's secret.
+ *
+ * @param data The index the hash is for.
+ * @param rpi_bytes The RPI to hash, RPI_SIZE bytes long.
+ * @return The hash value.
+ */
+static uint32_t rpi_index_hash(RpiIndex const * data, unsigned char const * rpi_bytes) {
+	return (uint32_t)siphash_13(data->key, rpi_bytes, RPI_SIZE);
+}
+
+/**
+ * Rebuilds the bucket table with the given number of buckets.
+ *
+ * For internal use.
+ *
+ * @param data The index to operate on.
+ * @param bucket_count The new number of buckets, a power of two.
+ */
+static void rpi_index_rehash(RpiIndex * data, size_t bucket_count) {
+	size_t pos;
+	uint32_t bucket;
+
+	free(data->buckets);
+	data->bucket_count = bucket_count;
+	data->buckets = malloc(sizeof(uint32_t) * bucket_count);
+	memset(data->buckets, 0xff, sizeof(uint32_t) * bucket_count);
+
+	for (pos = 0; pos < data->count; ++pos) {
+		bucket = rpi_index_hash(data, data->entries[pos].rpi) & (bucket_count - 1);
+		data->entries[pos].next = data->buckets[bucket];
+		data->buckets[bucket] = pos;
+	}
+}
+
+/**
+ * Adds an RPI to the index.
+ *
+ * The rpi_bytes buffer passed in must contain exactly RPI_SIZE (16) bytes of
+ * data. The same RPI can be added multiple times, in which case each entry
+ * will be found by a lookup.
+ *
+ * @param data The index to add to.
+ * @param rpi_bytes The RPI value to add, in binary format.
+ * @param time_interval_number The time interval number to associate with the
+ *        RPI.
+ * @param tag A value to store with the entry, returned on lookup.
+ */
+void rpi_index_add(RpiIndex * data, unsigned char const * rpi_bytes, uint8_t time_interval_number, uint32_t tag) {
+	RpiIndexEntry * entry;
+	uint32_t bucket;
+
+	if (data->count >= data->allocated) {
+		data->allocated *= 2;
+		data->entries = realloc(data->entries, sizeof(RpiIndexEntry) * data->allocated);
+	}
+
+	if ((data->count + 1) * 2 > data->bucket_count) {
+		rpi_index_rehash(data, data->bucket_count * 2);
+	}
+
+	entry = &data->entries[data->count];
+	memcpy(entry->rpi, rpi_bytes, RPI_SIZE);
+	entry->time_interval_number = time_interval_number;
+	entry->tag = tag;
+
+	bucket = rpi_index_hash(data, rpi_bytes) & (data->bucket_count - 1);
+	entry->next = data->buckets[bucket];
+	data->buckets[bucket] = data->count;
+
+	data->count++;
+}
+
+/**
+ * Adds all of the RPIs from a list to the index.
+ *
+ * Each entry is tagged with the position of the RPI in the list.
+ *
+ * @param data The index to add to.
+ * @param beacons A list of RPIs extracted from overheard BLE beacons.
+ */
+void rpi_index_add_list(RpiIndex * data, RpiList const * beacons) {
+	RpiListItem const * rpi_item;
+	Rpi const * rpi;
+	uint32_t position;
+
+	position = 0;
+	rpi_item = rpi_list_first(beacons);
+	while (rpi_item != NULL) {
+		rpi = rpi_list_get_rpi(rpi_item);
+		rpi_index_add(data, rpi_get_proximity_id(rpi), rpi_get_time_interval_number(rpi), position);
+		position++;
+		rpi_item = rpi_list_next(rpi_item);
+	}
+}
+
+/**
+ * Returns the number of entries in the index.
+ *
+ * @param data The index to operate on.
+ * @return The number of entries that have been added.
+ */
+size_t rpi_index_count(RpiIndex const * data) {
+	return data->count;
+}
+
+/**
+ * Returns an upper bound on the memory needed to index a number of RPIs.
+ *
+ * This allows the caller to check whether an index will fit within a given
+ * memory budget before building it. It accounts for both the entries and the
+ * bucket table, assuming the worst case occupancy after growth.
+ *
+ * @param count The number of RPIs to be indexed.
+ * @return The number of bytes the index may use.
+ */
+size_t rpi_index_memory_estimate(size_t count) {
+	return sizeof(RpiIndex) + (count * 2 * sizeof(RpiIndexEntry)) + (MAX(count * 4, RPI_INDEX_MIN_BUCKETS) * sizeof(uint32_t));
+}
+
+/**
+ * Looks up an RPI in the index.
+ *
+ * Finds all entries with the same RPI and time interval number as those
+ * provided. The visit callback is called for each entry found, in the reverse
+ * of the order they were added. The callback may be NULL if only the number of
+ * entries is needed.
+ *
+ * @param data The index to search.
+ * @param rpi_bytes The RPI value to look for, RPI_SIZE bytes in binary format.
+ * @param time_interval_number The time interval number the RPI must have.
+ * @param visit A function to call for each entry found, or NULL.
+ * @param user_data A pointer that will be passed to the callback.
+ * @return The number of entries found.
+ */
+size_t rpi_index_find(RpiIndex const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number, RpiIndexVisit visit, void * user_data) {
+	uint32_t position;
+	RpiIndexEntry const * entry;
+	size_t found;
+
+	found = 0;
+	position = data->buckets[rpi_index_hash(data, rpi_bytes) & (data->bucket_count - 1)];
+	while (position != RPI_INDEX_NONE) {
+		entry = &data->entries[position];
+		if (memcmp(entry->rpi, rpi_bytes, RPI_SIZE) == 0) {
+			if (entry->time_interval_number == time_interval_number) {
+				found++;
+				if (visit) {
+					visit(entry->tag, user_data);
+				}
+			}
+			else {
+				LOG(LOG_DEBUG, "Matched beacons don't match intervals\n");
+			}
+		}
+		position = entry->next;
+	}
+
+	return found;
+}
+
+/** @} addtogroup Containers*/
+
@@ -16,6 +16,20 @@
  * captured over Bluetooth. Combined with the \ref DtkList class the two can
  * be easily stored and passed into the \ref match_list_find_matches() function.
  *
+ * A nearby device will broadcast the same RPI many times during each time
+ * interval. Rather than storing every sighting, the list keeps a single item
+ * for each distinct RPI and time interval number, found using a hash set when
+ * a beacon is added. Each item records how many times it was seen, when it was
+ * first and last seen, and the range of signal strengths it was received at.
+ *
+ * Beacons can be broadcast by anyone, so the hash set is keyed with a random
+ * secret to stop an attacker choosing RPIs that collide. Limits can also be
+ * set on the number of distinct RPIs held for each time interval and in
+ * total. Once a limit is reached new RPIs are either rejected or replace RPIs
+ * that have only been seen once, depending on the \ref RpiListEviction
+ * policy. The number of RPIs rejected and evicted are counted, so a flood can
+ * be detected.
+ *
  */
 
 /** \addtogroup Containers
@@ -28,6 +42,7 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "contrac/contrac.h"
 #include "contrac/utils.h"
@@ -38,21 +53,79 @@
 
 // Defines
 
+/**
+ * Used internally.
+ *
+ * The initial number of slots in the hash set. Must be a power of two.
+ */
+#define RPI_LIST_SLOTS_INITIAL (64)
+
+/**
+ * Used internally.
+ *
+ * The number of possible time interval numbers.
+ */
+#define RPI_LIST_INTERVALS (UINT8_MAX + 1)
+
+/**
+ * Used internally.
+ *
+ * The links an item uses in the queue of all single-sighting items.
+ */
+#define RPI_LIST_QUEUE_ALL (0)
+
+/**
+ * Used internally.
+ *
+ * The links an item uses in the queue of single-sighting items for its time
+ * interval.
+ */
+#define RPI_LIST_QUEUE_INTERVAL (1)
+
+/**
+ * Used internally.
+ *
+ * The number of eviction queues an item can be in.
+ */
+#define RPI_LIST_QUEUES (2)
+
 // Structures
 
 /**
  * @brief An RPI list element
  *
  * This is an opaque structure that represents a single item in the list and
- * contains an Rpi instance.
+ * contains an Rpi instance. Items that have only been seen once are also
+ * linked into the eviction queues, oldest first.
  * 
  * The structure typedef is in rpi_list.h
  */
 struct _RpiListItem {
 	Rpi * rpi;
 	RpiListItem * next;
+	RpiListItem * previous;
+	RpiListItem * queue_next[RPI_LIST_QUEUES];
+	RpiListItem * queue_previous[RPI_LIST_QUEUES];
+	time_t first_seen;
+	time_t last_seen;
+	uint32_t sightings;
+	int8_t rssi_min;
+	int8_t rssi_max;
+	bool has_metadata;
+	unsigned char metadata[RPI_METADATA_SIZE];
 };
 
+/**
+ * @brief A queue of items that can be evicted
+ *
+ * Items are added at the end and evicted from the front, so the earliest
+ * added are evicted first.
+ */
+typedef struct _RpiListQueue {
+	RpiListItem * first;
+	RpiListItem * last;
+} RpiListQueue;
+
 /**
  * @brief The head of an RPI list
  *
@@ -67,10 +140,37 @@ struct _RpiListItem {
 struct _RpiList {
 	RpiListItem * first;
 	RpiListItem * last;
+	size_t count;
+
+	RpiListItem ** slots;
+	size_t slot_count;
+	unsigned char key[HASH_KEY_SIZE];
+
+	size_t interval_limit;
+	size_t total_limit;
+	RpiListEviction eviction;
+	uint32_t interval_counts[RPI_LIST_INTERVALS];
+	RpiListQueue interval_singles[RPI_LIST_INTERVALS];
+	RpiListQueue singles;
+	uint64_t rejected;
+	uint64_t evicted;
 };
 
 // Function prototypes
 
+static size_t rpi_list_hash(RpiList const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+static RpiListItem ** rpi_list_find_slot(RpiList const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+static RpiListItem * rpi_list_lookup(RpiList const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number);
+static void rpi_list_grow(RpiList * data);
+static void rpi_list_queue_push(RpiListQueue * queue, RpiListItem * item, size_t links);
+static void rpi_list_queue_remove(RpiListQueue * queue, RpiListItem * item, size_t links);
+static void rpi_list_record_sighting(RpiList * data, RpiListItem * item, time_t seen, int8_t rssi);
+static bool rpi_list_has_room(RpiList const * data, uint8_t time_interval_number);
+static bool rpi_list_make_room(RpiList * data, uint8_t time_interval_number);
+static RpiListItem * rpi_list_insert(RpiList * data, Rpi * rpi);
+static void rpi_list_remove(RpiList * data, RpiListItem * item);
+static bool rpi_list_append_sighting(RpiList * data, Rpi * rpi, time_t seen, int8_t rssi);
+
 // Function definitions
 
 /**
@@ -82,6 +182,8 @@ RpiList * rpi_list_new() {
 	RpiList * data;
 	
 	data = calloc(sizeof(RpiList), 1);
+	hash_key_generate(data->key);
+	data->eviction = RPI_LIST_EVICTION_REJECT;
 
 	return data;
 }
@@ -106,34 +208,407 @@ void rpi_list_delete(RpiList * data) {
 			item = next;
 		}
 
+		free(data->slots);
 		free(data);
 	}
 }
 
 /**
- * Adds an item to the list.
+ * Calculates the hash set slot for an RPI.
  *
- * This adds an Rpi item to the list. It's primarily for internal use and when
- * adding RPIs to the list it's usually more appropriate to use the
- * \ref rpi_list_add_beacon() function.
+ * For internal use. The hash is keyed with the list's secret, so an attacker
+ * can't broadcast RPIs that are known to collide.
  *
- * @param data The list to append to.
- * @param rpi The RPI to append.
+ * @param data The list the hash is for.
+ * @param rpi_bytes The RPI to hash, RPI_SIZE bytes long.
+ * @param time_interval_number The time interval number of the RPI.
+ * @return The hash value.
  */
-void rpi_list_append(RpiList * data, Rpi * rpi) {
+static size_t rpi_list_hash(RpiList const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	return (size_t)(siphash_13(data->key, rpi_bytes, RPI_SIZE) ^ time_interval_number);
+}
+
+/**
+ * Finds the hash set slot for an RPI.
+ *
+ * For internal use. Uses linear probing, so the slot returned either holds
+ * the item with the same RPI and time interval number, or is empty.
+ *
+ * @param data The list to search.
+ * @param rpi_bytes The RPI to find, RPI_SIZE bytes long.
+ * @param time_interval_number The time interval number of the RPI.
+ * @return The slot for the RPI.
+ */
+static RpiListItem ** rpi_list_find_slot(RpiList const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	size_t slot;
 	RpiListItem * item;
-	
+	bool found;
+
+	found = false;
+	slot = rpi_list_hash(data, rpi_bytes, time_interval_number) & (data->slot_count - 1);
+	while (!found) {
+		item = data->slots[slot];
+		if ((item == NULL) || ((rpi_get_time_interval_number(item->rpi) == time_interval_number) && (memcmp(rpi_get_proximity_id(item->rpi), rpi_bytes, RPI_SIZE) == 0))) {
+			found = true;
+		}
+		else {
+			slot = (slot + 1) & (data->slot_count - 1);
+		}
+	}
+
+	return &data->slots[slot];
+}
+
+/**
+ * Finds the item for an RPI.
+ *
+ * For internal use.
+ *
+ * @param data The list to search.
+ * @param rpi_bytes The RPI to find, RPI_SIZE bytes long.
+ * @param time_interval_number The time interval number of the RPI.
+ * @return The item, or NULL if the RPI isn't in the list.
+ */
+static RpiListItem * rpi_list_lookup(RpiList const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	RpiListItem * item;
+
+	if (data->slot_count > 0) {
+		item = *rpi_list_find_slot(data, rpi_bytes, time_interval_number);
+	}
+	else {
+		item = NULL;
+	}
+
+	return item;
+}
+
+/**
+ * Increases the size of the hash set.
+ *
+ * For internal use. The set is kept at most half full, so probe sequences
+ * stay short.
+ *
+ * @param data The list to operate on.
+ */
+static void rpi_list_grow(RpiList * data) {
+	RpiListItem * item;
+
+	free(data->slots);
+	data->slot_count = (data->slot_count == 0) ? RPI_LIST_SLOTS_INITIAL : (data->slot_count * 2);
+	data->slots = calloc(sizeof(RpiListItem *), data->slot_count);
+
+	item = data->first;
+	while (item) {
+		*rpi_list_find_slot(data, rpi_get_proximity_id(item->rpi), rpi_get_time_interval_number(item->rpi)) = item;
+		item = item->next;
+	}
+}
+
+/**
+ * Adds an item to the end of an eviction queue.
+ *
+ * For internal use.
+ *
+ * @param queue The queue to add to.
+ * @param item The item to add.
+ * @param links Which of the item's queue links to use.
+ */
+static void rpi_list_queue_push(RpiListQueue * queue, RpiListItem * item, size_t links) {
+	item->queue_next[links] = NULL;
+	item->queue_previous[links] = queue->last;
+	if (queue->last == NULL) {
+		queue->first = item;
+	}
+	else {
+		queue->last->queue_next[links] = item;
+	}
+	queue->last = item;
+}
+
+/**
+ * Removes an item from an eviction queue.
+ *
+ * For internal use.
+ *
+ * @param queue The queue to remove from.
+ * @param item The item to remove, which must be in the queue.
+ * @param links Which of the item's queue links are used for the queue.
+ */
+static void rpi_list_queue_remove(RpiListQueue * queue, RpiListItem * item, size_t links) {
+	if (item->queue_previous[links] == NULL) {
+		queue->first = item->queue_next[links];
+	}
+	else {
+		item->queue_previous[links]->queue_next[links] = item->queue_next[links];
+	}
+	if (item->queue_next[links] == NULL) {
+		queue->last = item->queue_previous[links];
+	}
+	else {
+		item->queue_next[links]->queue_previous[links] = item->queue_previous[links];
+	}
+	item->queue_next[links] = NULL;
+	item->queue_previous[links] = NULL;
+}
+
+/**
+ * Updates the aggregates of an item with a new sighting.
+ *
+ * For internal use. Also keeps the queues of items that have only been seen
+ * once, which are the ones that can be evicted.
+ *
+ * @param data The list the item belongs to.
+ * @param item The item to update.
+ * @param seen The time the beacon was received.
+ * @param rssi The signal strength, or RPI_LIST_RSSI_UNKNOWN.
+ */
+static void rpi_list_record_sighting(RpiList * data, RpiListItem * item, time_t seen, int8_t rssi) {
+	uint8_t time_interval_number;
+
+	time_interval_number = rpi_get_time_interval_number(item->rpi);
+	if (item->sightings == 0) {
+		rpi_list_queue_push(&data->singles, item, RPI_LIST_QUEUE_ALL);
+		rpi_list_queue_push(&data->interval_singles[time_interval_number], item, RPI_LIST_QUEUE_INTERVAL);
+	}
+	else if (item->sightings == 1) {
+		rpi_list_queue_remove(&data->singles, item, RPI_LIST_QUEUE_ALL);
+		rpi_list_queue_remove(&data->interval_singles[time_interval_number], item, RPI_LIST_QUEUE_INTERVAL);
+	}
+
+	if (item->sightings == 0) {
+		item->first_seen = seen;
+		item->last_seen = seen;
+		item->rssi_min = rssi;
+		item->rssi_max = rssi;
+	}
+	else {
+		item->first_seen = MIN(item->first_seen, seen);
+		item->last_seen = MAX(item->last_seen, seen);
+		if (rssi != RPI_LIST_RSSI_UNKNOWN) {
+			item->rssi_min = (item->rssi_min == RPI_LIST_RSSI_UNKNOWN) ? rssi : MIN(item->rssi_min, rssi);
+			item->rssi_max = (item->rssi_max == RPI_LIST_RSSI_UNKNOWN) ? rssi : MAX(item->rssi_max, rssi);
+		}
+	}
+	if (item->sightings < UINT32_MAX) {
+		item->sightings++;
+	}
+}
+
+/**
+ * Checks whether there's room for a new RPI within the list's limits.
+ *
+ * For internal use.
+ *
+ * @param data The list to check.
+ * @param time_interval_number The time interval number of the new RPI.
+ * @return true if the RPI can be added without exceeding a limit.
+ */
+static bool rpi_list_has_room(RpiList const * data, uint8_t time_interval_number) {
+	return ((data->interval_limit == 0) || (data->interval_counts[time_interval_number] < data->interval_limit))
+		&& ((data->total_limit == 0) || (data->count < data->total_limit));
+}
+
+/**
+ * Makes room for a new RPI, evicting RPIs if the policy allows it.
+ *
+ * For internal use. Only items that have been seen once are evicted, earliest
+ * added first. If the interval's limit has been reached the item evicted must
+ * be from the same interval. The single-sighting items are kept in queues,
+ * both overall and for each interval, so the item to evict is found without
+ * searching.
+ *
+ * @param data The list to make room in.
+ * @param time_interval_number The time interval number of the new RPI.
+ * @return true if there's room for the RPI, false if it must be rejected.
+ */
+static bool rpi_list_make_room(RpiList * data, uint8_t time_interval_number) {
+	RpiListItem * item;
+	bool interval_full;
+	bool evicting;
+	bool result;
+
+	result = rpi_list_has_room(data, time_interval_number);
+	evicting = (!result) && (data->eviction == RPI_LIST_EVICTION_SPARSE);
+	while (evicting) {
+		interval_full = (data->interval_limit > 0) && (data->interval_counts[time_interval_number] >= data->interval_limit);
+		item = interval_full ? data->interval_singles[time_interval_number].first : data->singles.first;
+		if (item != NULL) {
+			rpi_list_remove(data, item);
+			data->evicted++;
+			result = rpi_list_has_room(data, time_interval_number);
+		}
+		// Stop once there's room or nothing left that can be evicted
+		evicting = (!result) && (item != NULL);
+	}
+
+	if (!result) {
+		data->rejected++;
+		LOG(LOG_DEBUG, "RPI list limit reached for interval %u\n", time_interval_number);
+	}
+
+	return result;
+}
+
+/**
+ * Adds a new item to the list and the hash set.
+ *
+ * For internal use. The RPI must not already be in the list.
+ *
+ * @param data The list to add to.
+ * @param rpi The RPI to add. Ownership passes to the list.
+ * @return The new item.
+ */
+static RpiListItem * rpi_list_insert(RpiList * data, Rpi * rpi) {
+	RpiListItem * item;
+
+	if ((data->count + 1) * 2 > data->slot_count) {
+		rpi_list_grow(data);
+	}
+
 	item = calloc(sizeof(RpiListItem), 1);
 	item->rpi = rpi;
+	*rpi_list_find_slot(data, rpi_get_proximity_id(rpi), rpi_get_time_interval_number(rpi)) = item;
+	data->count++;
+	data->interval_counts[rpi_get_time_interval_number(rpi)]++;
 
 	if (data->last == NULL) {
 		data->first = item;
 		data->last = item;
 	}
 	else {
+		item->previous = data->last;
 		data->last->next = item;
 		data->last = item;
 	}
+
+	return item;
+}
+
+/**
+ * Removes an item from the list and the hash set, and deletes it.
+ *
+ * For internal use. Since the hash set uses linear probing, any items later
+ * in the same probe sequence are shifted back to fill the gap left behind.
+ *
+ * @param data The list to remove from.
+ * @param item The item to remove.
+ */
+static void rpi_list_remove(RpiList * data, RpiListItem * item) {
+	size_t empty;
+	size_t slot;
+	size_t home;
+	uint8_t time_interval_number;
+	RpiListItem * moving;
+
+	time_interval_number = rpi_get_time_interval_number(item->rpi);
+	empty = rpi_list_find_slot(data, rpi_get_proximity_id(item->rpi), time_interval_number) - data->slots;
+	data->slots[empty] = NULL;
+
+	slot = (empty + 1) & (data->slot_count - 1);
+	moving = data->slots[slot];
+	while (moving != NULL) {
+		home = rpi_list_hash(data, rpi_get_proximity_id(moving->rpi), rpi_get_time_interval_number(moving->rpi)) & (data->slot_count - 1);
+		// Move the item back unless its home lies cyclically after the gap
+		if (((slot - home) & (data->slot_count - 1)) >= ((slot - empty) & (data->slot_count - 1))) {
+			data->slots[empty] = moving;
+			data->slots[slot] = NULL;
+			empty = slot;
+		}
+		slot = (slot + 1) & (data->slot_count - 1);
+		moving = data->slots[slot];
+	}
+
+	if (item->previous == NULL) {
+		data->first = item->next;
+	}
+	else {
+		item->previous->next = item->next;
+	}
+	if (item->next == NULL) {
+		data->last = item->previous;
+	}
+	else {
+		item->next->previous = item->previous;
+	}
+
+	data->count--;
+	data->interval_counts[time_interval_number]--;
+	if (item->sightings == 1) {
+		rpi_list_queue_remove(&data->singles, item, RPI_LIST_QUEUE_ALL);
+		rpi_list_queue_remove(&data->interval_singles[time_interval_number], item, RPI_LIST_QUEUE_INTERVAL);
+	}
+
+	rpi_delete(item->rpi);
+	free(item);
+}
+
+/**
+ * Adds an item to the list.
+ *
+ * This adds an Rpi item to the list. It's primarily for internal use and when
+ * adding RPIs to the list it's usually more appropriate to use the
+ * \ref rpi_list_add_beacon() function.
+ *
+ * If the list already contains an item with the same RPI and time interval
+ * number, the rpi passed in is deleted and the sighting is recorded against
+ * the existing item instead. The rpi is also deleted if the list's limits
+ * mean it has to be rejected.
+ *
+ * @param data The list to append to.
+ * @param rpi The RPI to append. Ownership passes to the list.
+ */
+void rpi_list_append(RpiList * data, Rpi * rpi) {
+	rpi_list_append_sighting(data, rpi, time(NULL), RPI_LIST_RSSI_UNKNOWN);
+}
+
+/**
+ * Adds an item to the list, recording when and how strongly it was received.
+ *
+ * For internal use. Deduplicates in the same way as \ref rpi_list_append().
+ *
+ * @param data The list to append to.
+ * @param rpi The RPI to append. Ownership passes to the list.
+ * @param seen The time the beacon was received.
+ * @param rssi The signal strength, or RPI_LIST_RSSI_UNKNOWN.
+ * @return true if the sighting was recorded, false if it was rejected.
+ */
+static bool rpi_list_append_sighting(RpiList * data, Rpi * rpi, time_t seen, int8_t rssi) {
+	RpiListItem * item;
+	bool result;
+
+	result = true;
+	item = rpi_list_lookup(data, rpi_get_proximity_id(rpi), rpi_get_time_interval_number(rpi));
+	if (item != NULL) {
+		rpi_delete(rpi);
+	}
+	else {
+		result = rpi_list_make_room(data, rpi_get_time_interval_number(rpi));
+		if (result) {
+			item = rpi_list_insert(data, rpi);
+		}
+		else {
+			rpi_delete(rpi);
+		}
+	}
+
+	if (result) {
+		rpi_list_record_sighting(data, item, seen, rssi);
+	}
+
+	return result;
+}
+
+/**
+ * Returns the number of distinct RPIs in the list.
+ *
+ * Repeated sightings of the same RPI in the same time interval are only
+ * counted once.
+ *
+ * @param data The list to operate on.
+ * @return The number of items in the list.
+ */
+size_t rpi_list_count(RpiList const * data) {
+	return data->count;
 }
 
 /**
@@ -170,21 +645,229 @@ Rpi const * rpi_list_get_rpi(RpiListItem const * data) {
 	return data->rpi;
 }
 
+/**
+ * Returns the number of times the RPI was seen.
+ *
+ * @param data The current item in the list.
+ * @return The number of sightings recorded against the item.
+ */
+uint32_t rpi_list_get_sighting_count(RpiListItem const * data) {
+	return data->sightings;
+}
+
+/**
+ * Returns the time the RPI was first seen.
+ *
+ * @param data The current item in the list.
+ * @return The earliest time recorded against the item.
+ */
+time_t rpi_list_get_first_seen(RpiListItem const * data) {
+	return data->first_seen;
+}
+
+/**
+ * Returns the time the RPI was last seen.
+ *
+ * @param data The current item in the list.
+ * @return The latest time recorded against the item.
+ */
+time_t rpi_list_get_last_seen(RpiListItem const * data) {
+	return data->last_seen;
+}
+
+/**
+ * Returns the weakest signal strength the RPI was received at.
+ *
+ * @param data The current item in the list.
+ * @return The minimum RSSI, or RPI_LIST_RSSI_UNKNOWN if none was recorded.
+ */
+int8_t rpi_list_get_rssi_min(RpiListItem const * data) {
+	return data->rssi_min;
+}
+
+/**
+ * Returns the strongest signal strength the RPI was received at.
+ *
+ * @param data The current item in the list.
+ * @return The maximum RSSI, or RPI_LIST_RSSI_UNKNOWN if none was recorded.
+ */
+int8_t rpi_list_get_rssi_max(RpiListItem const * data) {
+	return data->rssi_max;
+}
+
+/**
+ * Returns the encrypted metadata broadcast alongside the RPI.
+ *
+ * The metadata is returned as it was received, still encrypted. It can only
+ * be decrypted once the daily key that generated the RPI is known, which
+ * happens when a match is found.
+ *
+ * @param data The current item in the list.
+ * @return The RPI_METADATA_SIZE bytes of encrypted metadata, or NULL if none
+ *         was recorded.
+ */
+unsigned char const * rpi_list_get_metadata(RpiListItem const * data) {
+	return data->has_metadata ? data->metadata : NULL;
+}
+
+/**
+ * Finds the item for an RPI received in a given time interval.
+ *
+ * This is a hash lookup, so it's cheap enough to use for each match found
+ * when the beacons are being searched through an index.
+ *
+ * @param data The list to search.
+ * @param rpi_bytes The RPI to find, RPI_SIZE bytes long.
+ * @param time_interval_number The time interval number of the RPI.
+ * @return The item, or NULL if the RPI isn't in the list.
+ */
+RpiListItem const * rpi_list_find(RpiList const * data, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	return rpi_list_lookup(data, rpi_bytes, time_interval_number);
+}
+
+/**
+ * Sets limits on the number of distinct RPIs held in the list.
+ *
+ * Once a limit is reached, new RPIs are handled according to the eviction
+ * policy set using \ref rpi_list_set_eviction(). Further sightings of RPIs
+ * already in the list are always recorded. Lowering the limits doesn't remove
+ * any RPIs already in the list.
+ *
+ * @param data The list to operate on.
+ * @param interval_limit The maximum number of RPIs for each time interval, or
+ *        zero for no limit.
+ * @param total_limit The maximum number of RPIs in the list, or zero for no
+ *        limit.
+ */
+void rpi_list_set_limits(RpiList * data, size_t interval_limit, size_t total_limit) {
+	data->interval_limit = interval_limit;
+	data->total_limit = total_limit;
+}
+
+/**
+ * Sets what happens when a new RPI is added once a limit has been reached.
+ *
+ * The default is RPI_LIST_EVICTION_REJECT.
+ *
+ * @param data The list to operate on.
+ * @param eviction The eviction policy to use.
+ */
+void rpi_list_set_eviction(RpiList * data, RpiListEviction eviction) {
+	data->eviction = eviction;
+}
+
+/**
+ * Returns the number of sightings rejected because of the list's limits.
+ *
+ * @param data The list to operate on.
+ * @return The number of sightings of new RPIs that weren't added.
+ */
+uint64_t rpi_list_get_rejected(RpiList const * data) {
+	return data->rejected;
+}
+
+/**
+ * Returns the number of RPIs evicted to make room for new ones.
+ *
+ * @param data The list to operate on.
+ * @return The number of RPIs removed from the list.
+ */
+uint64_t rpi_list_get_evicted(RpiList const * data) {
+	return data->evicted;
+}
+
 /**
  * Adds Rpi data to the list.
  *
  * The rpi_bytes buffer passed in must contain exactly RPI_SIZE (16) bytes of
  * data. It doen't have to be null terminated.
  *
+ * The sighting is recorded at the current time with an unknown signal
+ * strength. If the RPI is already in the list for the same time interval, the
+ * existing item is updated rather than a new one added.
+ *
  * @param data The current list to operate on.
  * @param rpi_bytes The RPI value to add, in binary format.
  * @param time_interval_number The time interval number to associate with the
  *        RPI.
+ * @return true if the sighting was recorded, false if it was rejected
+ *         because of the list's limits.
  */
-void rpi_list_add_beacon(RpiList * data, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
-	Rpi * rpi = rpi_new();
-	rpi_assign(rpi, rpi_bytes, time_interval_number);
-	rpi_list_append(data, rpi);
+bool rpi_list_add_beacon(RpiList * data, unsigned char const * rpi_bytes, uint8_t time_interval_number) {
+	return rpi_list_add_sighting(data, rpi_bytes, time_interval_number, time(NULL), RPI_LIST_RSSI_UNKNOWN);
+}
+
+/**
+ * Adds Rpi data to the list, recording when and how strongly it was received.
+ *
+ * The rpi_bytes buffer passed in must contain exactly RPI_SIZE (16) bytes of
+ * data. If the RPI is already in the list for the same time interval, the
+ * sighting is added to the existing item's aggregates, so the list grows with
+ * the number of distinct contacts rather than with the scan rate.
+ *
+ * @param data The current list to operate on.
+ * @param rpi_bytes The RPI value to add, in binary format.
+ * @param time_interval_number The time interval number to associate with the
+ *        RPI.
+ * @param seen The time the beacon was received.
+ * @param rssi The signal strength the beacon was received at, or
+ *        RPI_LIST_RSSI_UNKNOWN.
+ * @return true if the sighting was recorded, false if it was rejected
+ *         because of the list's limits.
+ */
+bool rpi_list_add_sighting(RpiList * data, unsigned char const * rpi_bytes, uint8_t time_interval_number, time_t seen, int8_t rssi) {
+	return rpi_list_add_sighting_metadata(data, rpi_bytes, time_interval_number, seen, rssi, NULL);
+}
+
+/**
+ * Adds Rpi data to the list, along with the encrypted metadata broadcast with
+ * it.
+ *
+ * This works in the same way as \ref rpi_list_add_sighting(), but also stores
+ * the Associated Encrypted Metadata carried by beacons using the AES scheme.
+ * The metadata is stored encrypted and is only decrypted for beacons that
+ * turn out to match a diagnosis key.
+ *
+ * If the RPI is already in the list for the same time interval, the metadata
+ * recorded with the first sighting is kept.
+ *
+ * @param data The current list to operate on.
+ * @param rpi_bytes The RPI value to add, in binary format.
+ * @param time_interval_number The time interval number to associate with the
+ *        RPI.
+ * @param seen The time the beacon was received.
+ * @param rssi The signal strength the beacon was received at, or
+ *        RPI_LIST_RSSI_UNKNOWN.
+ * @param metadata The RPI_METADATA_SIZE bytes of encrypted metadata, or NULL
+ *        if there is none.
+ * @return true if the sighting was recorded, false if it was rejected
+ *         because of the list's limits.
+ */
+bool rpi_list_add_sighting_metadata(RpiList * data, unsigned char const * rpi_bytes, uint8_t time_interval_number, time_t seen, int8_t rssi, unsigned char const * metadata) {
+	RpiListItem * item;
+	Rpi * rpi;
+	bool result;
+
+	result = true;
+	item = rpi_list_lookup(data, rpi_bytes, time_interval_number);
+	if (item == NULL) {
+		result = rpi_list_make_room(data, time_interval_number);
+		if (result) {
+			rpi = rpi_new();
+			rpi_assign(rpi, rpi_bytes, time_interval_number);
+			item = rpi_list_insert(data, rpi);
+		}
+	}
+
+	if (result) {
+		rpi_list_record_sighting(data, item, seen, rssi);
+		if ((metadata != NULL) && (!item->has_metadata)) {
+			memcpy(item->metadata, metadata, RPI_METADATA_SIZE);
+			item->has_metadata = true;
+		}
+	}
+
+	return result;
 }
 
 /** @} addtogroup Containers*/
@@ -15,6 +15,9 @@
  *
  * base64 encoding and decoding functionality.
  * Time conversion: from epoch to day numbers and time interval numbers.
+ * CRC-32 checksums, for detecting corrupted records.
+ * Keyed hashing, for hash tables that hold data chosen by an attacker.
+ * Durable file replacement: unique temporary files and directory syncs.
  *
  */
 
@@ -24,14 +27,46 @@
 
 // Includes
 
-#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "contrac/log.h"
+#include "contrac/base64.h"
+#include "contrac/utils.h"
 
 // Defines
 
+/**
+ * Used internally.
+ *
+ * Rotates a 64-bit value left.
+ */
+#define SIPHASH_ROTATE(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+/**
+ * Used internally.
+ *
+ * A single SipHash round.
+ */
+#define SIPHASH_ROUND(v0, v1, v2, v3) \
+	do { \
+		v0 += v1; v1 = SIPHASH_ROTATE(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTATE(v0, 32); \
+		v2 += v3; v3 = SIPHASH_ROTATE(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = SIPHASH_ROTATE(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = SIPHASH_ROTATE(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTATE(v2, 32); \
+	} while (0)
+
 // Structures
 
 // Function prototypes
 
+static uint64_t siphash_read(unsigned char const * buffer);
+
 // Function definitions
 
 // Function definitions
@@ -85,6 +120,9 @@ size_t base64_decode_size(size_t base64_input) {
  * If the output buffer is too small (based on the size provided) then the
  * base64 string may be only partially written.
  *
+ * This is a wrapper around \ref base64_encode(), which should be used in
+ * preference.
+ *
  * @param input The binary data to encode. This doesn't need to be zero
  *        terminated.
  * @param input_size The size of the input buffer to be converted.
@@ -104,7 +142,7 @@ void base64_encode_binary_to_base64(unsigned char const *input, size_t input_siz
 	}
 	*output_size = base64_encode_size(size_in);
 
-	EVP_EncodeBlock(output, input, size_in);
+	base64_encode(input, size_in, (char *)output);
 }
 
 /**
@@ -118,6 +156,9 @@ void base64_encode_binary_to_base64(unsigned char const *input, size_t input_siz
  * If the output buffer is too small (based on the size provided) then the
  * binary output may be only partially written.
  *
+ * This is a wrapper around \ref base64_decode(), which should be used in
+ * preference since it also reports whether the input was valid.
+ *
  * @param input The base64 string to encode. This doesn't need to be zero
  *        terminated.
  * @param input_size The size of the input buffer to be converted.
@@ -128,16 +169,18 @@ void base64_encode_binary_to_base64(unsigned char const *input, size_t input_siz
 void base64_decode_base64_to_binary(unsigned char const *input, size_t input_size, unsigned char *output, size_t *output_size) {
 	size_t size_in;
 	size_t size_out;
+	size_t capacity;
 
 	size_in = input_size;
 	size_out = base64_decode_size(input_size);
+	capacity = *output_size;
 	
 	if (size_out > *output_size) {
-		size_in = base64_encode_size(*output_size - 1) - 1;
+		size_in = MIN(base64_encode_size(*output_size - 1) - 1, input_size);
 	}
 	*output_size = base64_decode_size(size_in);
 
-	EVP_DecodeBlock(output, input, size_in);
+	base64_decode((char const *)input, size_in, output, &capacity, NULL);
 }
 
 /**
@@ -194,5 +237,282 @@ uint8_t epoch_to_time_interval_number(time_t epoch) {
 	return time_interval_number;
 }
 
+/**
+ * Returns the time at which the next time interval starts.
+ *
+ * Time intervals are 10 minutes long and a day is an exact number of them,
+ * so this is also the time at which the next day starts if the epoch falls
+ * in the last time interval of a day. The result is always strictly later
+ * than the epoch provided.
+ *
+ * @param epoch The epoch time in seconds.
+ * @return The epoch time at which the next time interval starts.
+ */
+time_t epoch_to_next_rollover(time_t epoch) {
+	return ((epoch / (60 * 10)) + 1) * (60 * 10);
+}
+
+/**
+ * Used internally.
+ *
+ * The CRC-32 remainders for each four-bit value, using the reflected IEEE
+ * 802.3 polynomial 0xEDB88320.
+ */
+static uint32_t const crc32_nibble_table[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+/**
+ * Updates a CRC-32 checksum with more data.
+ *
+ * Calculates the standard CRC-32 used by zlib and Ethernet. To checksum a
+ * buffer in one go pass in zero as the initial crc value. To checksum data in
+ * several pieces, pass the result of the previous call as the crc value for
+ * the next.
+ *
+ * @param crc The checksum of the data so far, or zero to start.
+ * @param buffer The data to add to the checksum.
+ * @param size The number of bytes in the buffer.
+ * @return The updated checksum.
+ */
+uint32_t crc32_update(uint32_t crc, unsigned char const * buffer, size_t size) {
+	size_t pos;
+
+	crc = ~crc;
+	for (pos = 0; pos < size; ++pos) {
+		crc ^= buffer[pos];
+		crc = (crc >> 4) ^ crc32_nibble_table[crc & 0x0f];
+		crc = (crc >> 4) ^ crc32_nibble_table[crc & 0x0f];
+	}
+
+	return ~crc;
+}
+
+/**
+ * Writes a 32-bit value in big-endian byte order.
+ *
+ * Used for the integers stored in the library's file formats and messages.
+ *
+ * @param buffer The buffer to write to, at least four bytes long.
+ * @param value The value to write.
+ */
+void big_endian_encode_u32(unsigned char * buffer, uint32_t value) {
+	buffer[0] = (value >> 24) & 0xff;
+	buffer[1] = (value >> 16) & 0xff;
+	buffer[2] = (value >> 8) & 0xff;
+	buffer[3] = value & 0xff;
+}
+
+/**
+ * Writes a 64-bit value in big-endian byte order.
+ *
+ * @param buffer The buffer to write to, at least eight bytes long.
+ * @param value The value to write.
+ */
+void big_endian_encode_u64(unsigned char * buffer, uint64_t value) {
+	big_endian_encode_u32(buffer, (uint32_t)(value >> 32));
+	big_endian_encode_u32(buffer + 4, (uint32_t)value);
+}
+
+/**
+ * Reads a 32-bit value in big-endian byte order.
+ *
+ * @param buffer The buffer to read from, at least four bytes long.
+ * @return The value read.
+ */
+uint32_t big_endian_decode_u32(unsigned char const * buffer) {
+	return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | (uint32_t)buffer[3];
+}
+
+/**
+ * Reads a 64-bit value in big-endian byte order.
+ *
+ * @param buffer The buffer to read from, at least eight bytes long.
+ * @return The value read.
+ */
+uint64_t big_endian_decode_u64(unsigned char const * buffer) {
+	return ((uint64_t)big_endian_decode_u32(buffer) << 32) | (uint64_t)big_endian_decode_u32(buffer + 4);
+}
+
+/**
+ * Generates a random key for use with \ref siphash_13().
+ *
+ * If the random number generator fails, an error is logged and a key derived
+ * from the time and the key's address is used instead, which is less
+ * resistant to attack but still varies between runs.
+ *
+ * @param key A buffer to store the key in, HASH_KEY_SIZE bytes long.
+ */
+void hash_key_generate(unsigned char * key) {
+	uint64_t fallback[2];
+
+	if (RAND_bytes(key, HASH_KEY_SIZE) != 1) {
+		LOG(LOG_ERR, "Error generating hash key\n");
+		fallback[0] = (uint64_t)time(NULL);
+		fallback[1] = (uint64_t)(uintptr_t)key;
+		memcpy(key, fallback, HASH_KEY_SIZE);
+	}
+}
+
+/**
+ * Reads a little-endian 64-bit value.
+ *
+ * For internal use.
+ *
+ * @param buffer The eight bytes to read.
+ * @return The value read.
+ */
+static uint64_t siphash_read(unsigned char const * buffer) {
+	uint64_t value;
+	int pos;
+
+	value = 0;
+	for (pos = 7; pos >= 0; --pos) {
+		value = (value << 8) | buffer[pos];
+	}
+
+	return value;
+}
+
+/**
+ * Calculates the SipHash-1-3 keyed hash of some data.
+ *
+ * Hash tables that are filled with values received over the air, such as
+ * captured RPIs, can be attacked by sending values that all fall into the
+ * same bucket. Hashing with a secret key prevents an attacker from choosing
+ * such values, since they can't predict which bucket a value will fall into.
+ *
+ * @param key The secret key, HASH_KEY_SIZE bytes long.
+ * @param buffer The data to hash.
+ * @param size The number of bytes in the buffer.
+ * @return The hash value.
+ */
+uint64_t siphash_13(unsigned char const * key, unsigned char const * buffer, size_t size) {
+	uint64_t k0;
+	uint64_t k1;
+	uint64_t v0;
+	uint64_t v1;
+	uint64_t v2;
+	uint64_t v3;
+	uint64_t block;
+	size_t pos;
+	size_t remaining;
+	int round;
+
+	k0 = siphash_read(key);
+	k1 = siphash_read(key + 8);
+	v0 = k0 ^ 0x736f6d6570736575ULL;
+	v1 = k1 ^ 0x646f72616e646f6dULL;
+	v2 = k0 ^ 0x6c7967656e657261ULL;
+	v3 = k1 ^ 0x7465646279746573ULL;
+
+	for (pos = 0; pos + 8 <= size; pos += 8) {
+		block = siphash_read(buffer + pos);
+		v3 ^= block;
+		SIPHASH_ROUND(v0, v1, v2, v3);
+		v0 ^= block;
+	}
+
+	// The final block holds any remaining bytes and the length
+	block = ((uint64_t)size) << 56;
+	for (remaining = size - pos; remaining > 0; --remaining) {
+		block |= ((uint64_t)buffer[pos + remaining - 1]) << (8 * (remaining - 1));
+	}
+	v3 ^= block;
+	SIPHASH_ROUND(v0, v1, v2, v3);
+	v0 ^= block;
+
+	v2 ^= 0xff;
+	for (round = 0; round < 3; ++round) {
+		SIPHASH_ROUND(v0, v1, v2, v3);
+	}
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * Creates a uniquely named temporary file alongside a destination file.
+ *
+ * The temporary file can be written, synced and then renamed over the
+ * destination, so readers never see a partially written file. The name is
+ * unique, so concurrent writers can't interfere with each other.
+ *
+ * @param path The destination file the temporary file will replace.
+ * @param temp_path Returns the path of the temporary file, to be freed by the
+ *        caller. Set to NULL on failure.
+ * @return The temporary file opened for writing, or NULL on failure.
+ */
+FILE * file_create_temp(char const * path, char ** temp_path) {
+	FILE * file;
+	int fd;
+
+	file = NULL;
+	*temp_path = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (*temp_path) {
+		sprintf(*temp_path, "%s.XXXXXX", path);
+		fd = mkstemp(*temp_path);
+		if (fd >= 0) {
+			file = fdopen(fd, "wb");
+			if (file == NULL) {
+				close(fd);
+				unlink(*temp_path);
+			}
+		}
+	}
+
+	if (file == NULL) {
+		free(*temp_path);
+		*temp_path = NULL;
+	}
+
+	return file;
+}
+
+/**
+ * Flushes the directory holding a file to disk.
+ *
+ * Creating or renaming a file only changes its directory, so the directory
+ * must also be synced for the change to survive a crash.
+ *
+ * @param path The file whose directory should be synced.
+ * @return true if the directory was synced successfully, false otherwise.
+ */
+bool file_sync_directory(char const * path) {
+	char * directory;
+	char * separator;
+	int fd;
+	bool result;
+
+	directory = strdup(path);
+	result = (directory != NULL);
+	if (result) {
+		separator = strrchr(directory, '/');
+		if (separator == NULL) {
+			fd = open(".", O_RDONLY | O_DIRECTORY);
+		}
+		else {
+			if (separator == directory) {
+				separator[1] = 0;
+			}
+			else {
+				separator[0] = 0;
+			}
+			fd = open(directory, O_RDONLY | O_DIRECTORY);
+		}
+
+		result = (fd >= 0);
+		if (result) {
+			result = (fsync(fd) == 0);
+			close(fd);
+		}
+		free(directory);
+	}
+
+	return result;
+}
+
 /** @} addtogroup Utils */
 
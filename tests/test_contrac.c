@@ -18,6 +18,16 @@
 
 #include <check.h>
 #include <malloc.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <pthread.h>
+#include <openssl/evp.h>
 
 #include "contrac/contrac.h"
 #include "contrac/contrac_private.h"
@@ -27,6 +37,20 @@
 #include "contrac/dtk_list.h"
 #include "contrac/rpi_list.h"
 #include "contrac/match.h"
+#include "contrac/match_pipeline.h"
+#include "contrac/dtk_stream.h"
+#include "contrac/match_shard.h"
+#include "contrac/match_batch.h"
+#include "contrac/beacon_store.h"
+#include "contrac/beacon_file.h"
+#include "contrac/capture_log.h"
+#include "contrac/beacon_ingest.h"
+#include "contrac/beacon_shm.h"
+#include "contrac/rollover_scheduler.h"
+#include "contrac/crypto_context.h"
+#include "contrac/base64.h"
+#include "contrac/export_reader.h"
+#include "contrac/dtk_file.h"
 
 // Defines
 
@@ -89,6 +113,175 @@ START_TEST (check_base64) {
 }
 END_TEST
 
+START_TEST (check_base64_bulk) {
+	bool result;
+	unsigned char binary[100];
+	unsigned char decoded[100];
+	unsigned char keys[5 * DTK_SIZE];
+	unsigned char decoded_keys[5 * DTK_SIZE];
+	char encoded[base64_encode_size(100)];
+	char expected[base64_encode_size(100)];
+	char list[base64_key_list_size(DTK_SIZE, 5) + 8];
+	char crlf[base64_key_list_size(DTK_SIZE, 5) + 8];
+	unsigned char many_keys[40 * DTK_SIZE];
+	unsigned char many_decoded[40 * DTK_SIZE];
+	char many_list[base64_key_list_size(DTK_SIZE, 40)];
+	size_t length;
+	size_t size;
+	size_t pos;
+	size_t error_pos;
+	size_t count;
+	char original;
+
+	for (pos = 0; pos < sizeof(binary); ++pos) {
+		binary[pos] = (pos * 151) + 7;
+	}
+
+	// Every length exercises a different mix of vector blocks and tail
+	for (length = 0; length <= sizeof(binary); ++length) {
+		EVP_EncodeBlock((unsigned char *)expected, binary, length);
+		size = base64_encode(binary, length, encoded);
+		ck_assert_int_eq(size, strlen(expected));
+		ck_assert_str_eq(encoded, expected);
+
+		size = sizeof(decoded);
+		result = base64_decode(encoded, strlen(encoded), decoded, &size, NULL);
+		ck_assert(result);
+		ck_assert_int_eq(size, length);
+		ck_assert(memcmp(decoded, binary, length) == 0);
+	}
+
+	// Invalid characters are reported at their exact position
+	length = base64_encode(binary, 60, encoded);
+	ck_assert_int_eq(length, 80);
+	for (pos = 0; pos < length; ++pos) {
+		original = encoded[pos];
+		encoded[pos] = (pos % 2 == 0) ? '*' : (char)0xc3;
+		size = sizeof(decoded);
+		result = base64_decode(encoded, length, decoded, &size, &error_pos);
+		ck_assert(!result);
+		ck_assert_int_eq(error_pos, pos);
+		encoded[pos] = original;
+	}
+
+	// Padding is only allowed at the end
+	original = encoded[40];
+	encoded[40] = '=';
+	size = sizeof(decoded);
+	result = base64_decode(encoded, length, decoded, &size, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(error_pos, 40);
+	encoded[40] = original;
+
+	// Truncated input and a short output buffer
+	size = sizeof(decoded);
+	result = base64_decode(encoded, length - 1, decoded, &size, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(error_pos, length - 1);
+
+	size = 10;
+	result = base64_decode(encoded, length, decoded, &size, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(error_pos, 12);
+	ck_assert_int_eq(size, 9);
+
+	// Unused bits before the padding must be zero
+	size = sizeof(decoded);
+	result = base64_decode("AB==", 4, decoded, &size, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(error_pos, 1);
+	size = sizeof(decoded);
+	result = base64_decode("AAAAAAB=", 8, decoded, &size, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(error_pos, 6);
+	size = sizeof(decoded);
+	result = base64_decode("AAAAAAE=", 8, decoded, &size, &error_pos);
+	ck_assert(result);
+	ck_assert_int_eq(size, 5);
+
+	// Key lists
+	for (pos = 0; pos < sizeof(keys); ++pos) {
+		keys[pos] = (pos * 37) + 3;
+	}
+	length = base64_encode_key_list(keys, DTK_SIZE, 5, list);
+	ck_assert_int_eq(length, 5 * (DTK_SIZE_BASE64 + 1));
+	ck_assert_int_eq(strlen(list), length);
+	ck_assert(list[DTK_SIZE_BASE64] == '\n');
+
+	result = base64_decode_key_list(list, length, DTK_SIZE, decoded_keys, 5, &count, &error_pos);
+	ck_assert(result);
+	ck_assert_int_eq(count, 5);
+	ck_assert(memcmp(decoded_keys, keys, sizeof(keys)) == 0);
+
+	// Windows line endings, blank lines and no final newline
+	size = 0;
+	for (pos = 0; pos < length - 1; ++pos) {
+		if (list[pos] == '\n') {
+			crlf[size++] = '\r';
+			crlf[size++] = '\n';
+			if (pos == DTK_SIZE_BASE64) {
+				crlf[size++] = '\n';
+			}
+		}
+		else {
+			crlf[size++] = list[pos];
+		}
+	}
+	memset(decoded_keys, 0, sizeof(decoded_keys));
+	result = base64_decode_key_list(crlf, size, DTK_SIZE, decoded_keys, 5, &count, &error_pos);
+	ck_assert(result);
+	ck_assert_int_eq(count, 5);
+	ck_assert(memcmp(decoded_keys, keys, sizeof(keys)) == 0);
+
+	// Too many keys for the buffer
+	result = base64_decode_key_list(list, length, DTK_SIZE, decoded_keys, 3, &count, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(count, 3);
+	ck_assert_int_eq(error_pos, 3 * (DTK_SIZE_BASE64 + 1));
+
+	// An invalid character in the third key
+	list[(2 * (DTK_SIZE_BASE64 + 1)) + 5] = '-';
+	result = base64_decode_key_list(list, length, DTK_SIZE, decoded_keys, 5, &count, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(count, 2);
+	ck_assert_int_eq(error_pos, (2 * (DTK_SIZE_BASE64 + 1)) + 5);
+
+	// A key that's too short
+	result = base64_decode_key_list("AAAAAAAAAAAAAAAAAAAAAA==\nAAAA\n", 30, DTK_SIZE, decoded_keys, 5, &count, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(error_pos, 29);
+
+	// A key that's too long
+	result = base64_decode_key_list("AAAAAAAAAAAAAAAAAAAAAAAA\n", 25, DTK_SIZE, decoded_keys, 5, &count, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(count, 0);
+	ck_assert_int_eq(error_pos, 20);
+
+	// Longer lists are decoded in batches, with errors still found exactly
+	for (pos = 0; pos < sizeof(many_keys); ++pos) {
+		many_keys[pos] = (pos * 53) + 11;
+	}
+	length = base64_encode_key_list(many_keys, DTK_SIZE, 40, many_list);
+	result = base64_decode_key_list(many_list, length, DTK_SIZE, many_decoded, 40, &count, &error_pos);
+	ck_assert(result);
+	ck_assert_int_eq(count, 40);
+	ck_assert(memcmp(many_decoded, many_keys, sizeof(many_keys)) == 0);
+
+	many_list[(29 * (DTK_SIZE_BASE64 + 1)) + 21] = 'B';
+	result = base64_decode_key_list(many_list, length, DTK_SIZE, many_decoded, 40, &count, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(count, 29);
+	ck_assert_int_eq(error_pos, (29 * (DTK_SIZE_BASE64 + 1)) + 21);
+
+	// Padding inside the last line of a batch is rejected
+	result = base64_decode_key_list("AAAAAAAAAAAAAAAAAAAAAA==\nAAAAAAAAAAAAAAAAAAA=AA==\n", 50, DTK_SIZE, decoded_keys, 5, &count, &error_pos);
+	ck_assert(!result);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(error_pos, 25 + 19);
+}
+END_TEST
+
 START_TEST (check_contrac) {
 	bool result;
 	unsigned char const *tk;
@@ -340,6 +533,2899 @@ START_TEST (check_match) {
 }
 END_TEST
 
+// Records the day numbers of matches as they're reported
+typedef struct _MatchRecord {
+	size_t count;
+	uint32_t days[16];
+} MatchRecord;
+
+static void record_match(MatchListItem const * match, void * user_data) {
+	MatchRecord * record = (MatchRecord *)user_data;
+
+	if (record->count < 16) {
+		record->days[record->count] = match_list_get_day_number(match);
+	}
+	record->count++;
+}
+
+START_TEST (check_match_order) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	// One match on each of the days, with the diagnoses oldest first
+	uint32_t beacon_days[5] = {100, 101, 102, 103, 104};
+	uint8_t beacon_times[5] = {7, 143, 0, 52, 99};
+	uint32_t diagnosis_days[5] = {100, 101, 102, 103, 104};
+	int pos;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchList * matches;
+	MatchListItem const * match;
+	MatchRecord record;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	beacon_list = rpi_list_new();
+	for (pos = 0; pos < 5; ++pos) {
+		result = contrac_set_day_number(contrac, beacon_days[pos]);
+		ck_assert(result);
+		result = contrac_set_time_interval_number(contrac, beacon_times[pos]);
+		ck_assert(result);
+
+		rpi_bytes = contrac_get_proximity_id(contrac);
+		rpi_list_add_beacon(beacon_list, rpi_bytes, beacon_times[pos]);
+	}
+
+	diagnosis_list = dtk_list_new();
+	for (pos = 0; pos < 5; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+
+	// Download order is the default
+	matches = match_list_new();
+	ck_assert(match_list_get_order(matches) == MATCH_ORDER_DOWNLOAD);
+	memset(&record, 0, sizeof(record));
+	match_list_set_callback(matches, record_match, &record);
+	match_list_find_matches(matches, beacon_list, diagnosis_list);
+
+	ck_assert_int_eq(record.count, 5);
+	for (pos = 0; pos < 5; ++pos) {
+		ck_assert_int_eq(record.days[pos], diagnosis_days[pos]);
+	}
+
+	// Newest first reports the same matches in reverse day order
+	match_list_clear(matches);
+	match_list_set_order(matches, MATCH_ORDER_NEWEST_FIRST);
+	memset(&record, 0, sizeof(record));
+	match_list_find_matches(matches, beacon_list, diagnosis_list);
+
+	ck_assert_int_eq(record.count, 5);
+	ck_assert_int_eq(match_list_count(matches), 5);
+	match = match_list_first(matches);
+	for (pos = 0; pos < 5; ++pos) {
+		ck_assert_int_eq(record.days[pos], diagnosis_days[4 - pos]);
+		ck_assert_int_eq(match_list_get_day_number(match), diagnosis_days[4 - pos]);
+		ck_assert_int_eq(match_list_get_time_interval_number(match), beacon_times[4 - pos]);
+		match = match_list_next(match);
+	}
+
+	// Clean up
+	match_list_delete(matches);
+	rpi_list_delete(beacon_list);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+// A source that stalls before each key, so the pipeline threads block
+static bool slow_dtk_list_source(void * user_data, unsigned char * dtk_bytes, uint32_t * day_number) {
+	usleep(5000);
+	return match_pipeline_dtk_list_source(user_data, dtk_bytes, day_number);
+}
+
+START_TEST (check_match_pipeline) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	uint32_t beacon_days[8] = {55, 12, 0, 8787, 1175, 1175, 187, 12};
+	uint8_t beacon_times[8] = {1, 15, 5, 101, 142, 67, 51, 93};
+	uint32_t diagnosis_days[6] = {1175, 3, 12, 4, 187, 5};
+	int pos;
+	size_t threads;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchList * expected;
+	MatchList * matches;
+	MatchListItem const * match;
+	MatchListItem const * match_expected;
+	DtkListItem const * source;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	beacon_list = rpi_list_new();
+	for (pos = 0; pos < 8; ++pos) {
+		result = contrac_set_day_number(contrac, beacon_days[pos]);
+		ck_assert(result);
+		result = contrac_set_time_interval_number(contrac, beacon_times[pos]);
+		ck_assert(result);
+
+		rpi_bytes = contrac_get_proximity_id(contrac);
+		rpi_list_add_beacon(beacon_list, rpi_bytes, beacon_times[pos]);
+	}
+
+	diagnosis_list = dtk_list_new();
+	for (pos = 0; pos < 6; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+
+	expected = match_list_new();
+	match_list_find_matches(expected, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(expected), 5);
+
+	// The pipeline should give the same results whatever its configuration
+	for (threads = 0; threads < 4; ++threads) {
+		matches = match_list_new();
+		source = dtk_list_first(diagnosis_list);
+		match_list_find_matches_pipelined(matches, beacon_list, match_pipeline_dtk_list_source, &source, threads + 1, threads);
+
+		ck_assert_int_eq(match_list_count(matches), match_list_count(expected));
+		match = match_list_first(matches);
+		match_expected = match_list_first(expected);
+		while (match_expected) {
+			ck_assert_int_eq(match_list_get_day_number(match), match_list_get_day_number(match_expected));
+			ck_assert_int_eq(match_list_get_time_interval_number(match), match_list_get_time_interval_number(match_expected));
+			match = match_list_next(match);
+			match_expected = match_list_next(match_expected);
+		}
+
+		match_list_delete(matches);
+	}
+
+	// As should a source that's slower than the rest of the pipeline
+	matches = match_list_new();
+	source = dtk_list_first(diagnosis_list);
+	match_list_find_matches_pipelined(matches, beacon_list, slow_dtk_list_source, &source, 1, 2);
+	ck_assert_int_eq(match_list_count(matches), match_list_count(expected));
+	match_list_delete(matches);
+
+	// Clean up
+	match_list_delete(expected);
+	rpi_list_delete(beacon_list);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+// Orders beacon records by RPI and then time interval number
+static int compare_beacon_records(void const * left, void const * right) {
+	return memcmp(left, right, sizeof(BeaconRecord));
+}
+
+// Feeds a memory buffer to a DtkStream a few bytes at a time
+typedef struct _TrickleReader {
+	unsigned char const * buffer;
+	size_t size;
+	size_t position;
+} TrickleReader;
+
+static ssize_t trickle_read(void * user_data, unsigned char * buffer, size_t size) {
+	TrickleReader * reader = (TrickleReader *)user_data;
+	size_t length;
+
+	length = reader->size - reader->position;
+	if (length > 3) {
+		length = 3;
+	}
+	if (length > size) {
+		length = size;
+	}
+	memcpy(buffer, reader->buffer + reader->position, length);
+	reader->position += length;
+
+	return length;
+}
+
+START_TEST (check_match_stream) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	RpiList * beacon_list;
+	// There are four matches in amongst this lot
+	// (day, time) = (12, 15), (1175, 142), (1175, 67), (12, 93)
+	uint32_t beacon_days[8] = {55, 12, 0, 8787, 1175, 1175, 187, 12};
+	uint8_t beacon_times[8] = {1, 15, 5, 101, 142, 67, 51, 93};
+	uint32_t diagnosis_days[3] = {1175, 12, 19000};
+	unsigned char records[3 * DTK_STREAM_RECORD_SIZE];
+	unsigned char dtk_read[DTK_SIZE];
+	uint32_t day_read;
+	int pos;
+	int fds[2];
+	const unsigned char * rpi_bytes;
+	MatchList * matches;
+	DtkStream * stream;
+	TrickleReader trickle;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	beacon_list = rpi_list_new();
+	for (pos = 0; pos < 8; ++pos) {
+		result = contrac_set_day_number(contrac, beacon_days[pos]);
+		ck_assert(result);
+		result = contrac_set_time_interval_number(contrac, beacon_times[pos]);
+		ck_assert(result);
+
+		rpi_bytes = contrac_get_proximity_id(contrac);
+		rpi_list_add_beacon(beacon_list, rpi_bytes, beacon_times[pos]);
+	}
+
+	for (pos = 0; pos < 3; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+		dtk_stream_encode_record(records + (pos * DTK_STREAM_RECORD_SIZE), contrac_get_daily_key(contrac), diagnosis_days[pos]);
+	}
+
+	// Records round trip
+	stream = dtk_stream_new_memory(records, sizeof(records));
+	for (pos = 0; pos < 3; ++pos) {
+		result = dtk_stream_read(stream, dtk_read, &day_read);
+		ck_assert(result);
+		ck_assert_int_eq(day_read, diagnosis_days[pos]);
+		ck_assert(memcmp(dtk_read, records + (pos * DTK_STREAM_RECORD_SIZE), DTK_SIZE) == 0);
+	}
+	result = dtk_stream_read(stream, dtk_read, &day_read);
+	ck_assert(result == false);
+	ck_assert(dtk_stream_get_error(stream) == false);
+	dtk_stream_delete(stream);
+
+	// Memory buffer
+	matches = match_list_new();
+	stream = dtk_stream_new_memory(records, sizeof(records));
+	result = match_stream(matches, beacon_list, stream);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 4);
+	ck_assert_int_eq(dtk_stream_get_count(stream), 3);
+	dtk_stream_delete(stream);
+
+	// File descriptor
+	match_list_clear(matches);
+	ck_assert_int_eq(pipe(fds), 0);
+	ck_assert_int_eq(write(fds[1], records, sizeof(records)), sizeof(records));
+	close(fds[1]);
+	stream = dtk_stream_new_fd(fds[0], 0);
+	result = match_stream(matches, beacon_list, stream);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 4);
+	dtk_stream_delete(stream);
+	close(fds[0]);
+
+	// Callback reader with records straddling the chunks
+	match_list_clear(matches);
+	trickle.buffer = records;
+	trickle.size = sizeof(records);
+	trickle.position = 0;
+	stream = dtk_stream_new_reader(trickle_read, &trickle, DTK_STREAM_RECORD_SIZE + 7);
+	result = match_stream(matches, beacon_list, stream);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 4);
+	dtk_stream_delete(stream);
+
+	// A truncated stream is reported as an error
+	match_list_clear(matches);
+	stream = dtk_stream_new_memory(records, sizeof(records) - 1);
+	result = match_stream(matches, beacon_list, stream);
+	ck_assert(result == false);
+	ck_assert_int_eq(match_list_count(matches), 4);
+	dtk_stream_delete(stream);
+
+	// Clean up
+	match_list_delete(matches);
+	rpi_list_delete(beacon_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+// Orders matches by day and then time interval number
+static int compare_match_times(void const * left, void const * right) {
+	uint64_t first = *(uint64_t const *)left;
+	uint64_t second = *(uint64_t const *)right;
+
+	return (first < second) ? -1 : ((first > second) ? 1 : 0);
+}
+
+// Returns the sorted (day, time) pairs from a match list
+static uint64_t * sorted_match_times(MatchList * matches) {
+	MatchListItem const * match;
+	uint64_t * times;
+	size_t pos;
+
+	times = calloc(sizeof(uint64_t), match_list_count(matches) + 1);
+	pos = 0;
+	match = match_list_first(matches);
+	while (match) {
+		times[pos] = ((uint64_t)match_list_get_day_number(match) << 8) | match_list_get_time_interval_number(match);
+		pos++;
+		match = match_list_next(match);
+	}
+	qsort(times, pos, sizeof(uint64_t), compare_match_times);
+
+	return times;
+}
+
+START_TEST (check_match_budget) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	uint32_t diagnosis_days[4] = {1175, 12, 6, 972};
+	size_t budgets[3] = {1, 1024, 4096};
+	int pos;
+	int budget;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchList * expected;
+	MatchList * matches;
+	uint64_t * times_expected;
+	uint64_t * times;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	// Beacons spread over a range of days, including a repeated sighting
+	beacon_list = rpi_list_new();
+	for (pos = 0; pos < 200; ++pos) {
+		result = contrac_set_day_number(contrac, (pos % 20) * 60 + 12);
+		ck_assert(result);
+		result = contrac_set_time_interval_number(contrac, (pos * 7) % RPI_INTERVAL_MAX);
+		ck_assert(result);
+
+		rpi_bytes = contrac_get_proximity_id(contrac);
+		rpi_list_add_beacon(beacon_list, rpi_bytes, (pos * 7) % RPI_INTERVAL_MAX);
+		if (pos == 20) {
+			rpi_list_add_beacon(beacon_list, rpi_bytes, (pos * 7) % RPI_INTERVAL_MAX);
+		}
+	}
+
+	diagnosis_list = dtk_list_new();
+	for (pos = 0; pos < 4; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+
+	expected = match_list_new();
+	match_list_find_matches(expected, beacon_list, diagnosis_list);
+	// Days 12 and 972 each have ten beacons, with the repeated sighting stored once
+	ck_assert_int_eq(rpi_list_count(beacon_list), 200);
+	ck_assert_int_eq(match_list_count(expected), 20);
+	times_expected = sorted_match_times(expected);
+
+	// The partitioned matching should give the same results
+	for (budget = 0; budget < 3; ++budget) {
+		matches = match_list_new();
+		match_list_set_memory_budget(matches, budgets[budget]);
+		ck_assert_int_eq(match_list_get_memory_budget(matches), budgets[budget]);
+		if (budget == 1) {
+			match_list_set_spill_directory(matches, "/tmp");
+		}
+		match_list_find_matches(matches, beacon_list, diagnosis_list);
+
+		ck_assert_int_eq(match_list_count(matches), match_list_count(expected));
+		times = sorted_match_times(matches);
+		for (pos = 0; pos < match_list_count(expected); ++pos) {
+			ck_assert(times[pos] == times_expected[pos]);
+		}
+
+		free(times);
+		match_list_delete(matches);
+	}
+
+	// Clean up
+	free(times_expected);
+	match_list_delete(expected);
+	rpi_list_delete(beacon_list);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_match_sharded) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	uint32_t diagnosis_days[4] = {1175, 12, 6, 972};
+	size_t shards[3] = {1, 3, 4};
+	unsigned char const bad_scheme[5] = {5, 0, 0, 0, 99};
+	int sockets[2];
+	int pos;
+	int shard;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchList * expected;
+	MatchList * matches;
+	MatchListItem const * match;
+	MatchListItem const * match_expected;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	beacon_list = rpi_list_new();
+	for (pos = 0; pos < 600; ++pos) {
+		result = contrac_set_day_number(contrac, (pos % 20) * 60 + 12);
+		ck_assert(result);
+		result = contrac_set_time_interval_number(contrac, (pos * 7) % RPI_INTERVAL_MAX);
+		ck_assert(result);
+
+		rpi_bytes = contrac_get_proximity_id(contrac);
+		rpi_list_add_beacon(beacon_list, rpi_bytes, (pos * 7) % RPI_INTERVAL_MAX);
+	}
+
+	diagnosis_list = dtk_list_new();
+	for (pos = 0; pos < 4; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+
+	expected = match_list_new();
+	match_list_find_matches(expected, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(expected), 60);
+
+	// Running the workers in separate threads should give the same results
+	for (shard = 0; shard < 3; ++shard) {
+		matches = match_list_new();
+		result = match_list_find_matches_sharded(matches, beacon_list, diagnosis_list, shards[shard]);
+		ck_assert(result);
+
+		ck_assert_int_eq(match_list_count(matches), match_list_count(expected));
+		match = match_list_first(matches);
+		match_expected = match_list_first(expected);
+		while (match_expected) {
+			ck_assert_int_eq(match_list_get_day_number(match), match_list_get_day_number(match_expected));
+			ck_assert_int_eq(match_list_get_time_interval_number(match), match_list_get_time_interval_number(match_expected));
+			match = match_list_next(match);
+			match_expected = match_list_next(match_expected);
+		}
+
+		match_list_delete(matches);
+	}
+
+	// A worker should reject an unknown scheme sent by the coordinator
+	result = (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+	ck_assert(result);
+	result = (write(sockets[0], bad_scheme, sizeof(bad_scheme)) == sizeof(bad_scheme));
+	ck_assert(result);
+	result = match_shard_serve(match_transport_socket(), &sockets[1]);
+	ck_assert(!result);
+	close(sockets[0]);
+	close(sockets[1]);
+
+	// Clean up
+	match_list_delete(expected);
+	rpi_list_delete(beacon_list);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_match_sharded_processes) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	uint32_t diagnosis_days[4] = {1175, 12, 6, 972};
+	int sockets[3][2];
+	void * channels[3];
+	pid_t workers[3];
+	int status;
+	int pos;
+	int shard;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchList * expected;
+	MatchList * matches;
+	MatchListItem const * match;
+	MatchListItem const * match_expected;
+	Contrac * contrac;
+
+	// Start the worker processes before anything else, so no library
+	// threads are running when they fork
+	for (shard = 0; shard < 3; ++shard) {
+		result = (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[shard]) == 0);
+		ck_assert(result);
+		workers[shard] = fork();
+		ck_assert(workers[shard] >= 0);
+		if (workers[shard] == 0) {
+			for (pos = 0; pos <= shard; ++pos) {
+				close(sockets[pos][0]);
+			}
+			result = match_shard_serve(match_transport_socket(), &sockets[shard][1]);
+			_exit(result ? 0 : 1);
+		}
+		close(sockets[shard][1]);
+		channels[shard] = &sockets[shard][0];
+	}
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	beacon_list = rpi_list_new();
+	for (pos = 0; pos < 600; ++pos) {
+		result = contrac_set_day_number(contrac, (pos % 20) * 60 + 12);
+		ck_assert(result);
+		result = contrac_set_time_interval_number(contrac, (pos * 7) % RPI_INTERVAL_MAX);
+		ck_assert(result);
+
+		rpi_bytes = contrac_get_proximity_id(contrac);
+		rpi_list_add_beacon(beacon_list, rpi_bytes, (pos * 7) % RPI_INTERVAL_MAX);
+	}
+
+	diagnosis_list = dtk_list_new();
+	for (pos = 0; pos < 4; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+
+	expected = match_list_new();
+	match_list_find_matches(expected, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(expected), 60);
+
+	// Workers in separate processes should give the same results
+	matches = match_list_new();
+	result = match_shard_coordinate(matches, beacon_list, diagnosis_list, match_transport_socket(), channels, 3);
+	ck_assert(result);
+
+	for (shard = 0; shard < 3; ++shard) {
+		close(sockets[shard][0]);
+		result = (waitpid(workers[shard], &status, 0) == workers[shard]);
+		ck_assert(result);
+		ck_assert(WIFEXITED(status));
+		ck_assert_int_eq(WEXITSTATUS(status), 0);
+	}
+
+	ck_assert_int_eq(match_list_count(matches), match_list_count(expected));
+	match = match_list_first(matches);
+	match_expected = match_list_first(expected);
+	while (match_expected) {
+		ck_assert_int_eq(match_list_get_day_number(match), match_list_get_day_number(match_expected));
+		ck_assert_int_eq(match_list_get_time_interval_number(match), match_list_get_time_interval_number(match_expected));
+		match = match_list_next(match);
+		match_expected = match_list_next(match_expected);
+	}
+
+	// Clean up
+	match_list_delete(matches);
+	match_list_delete(expected);
+	rpi_list_delete(beacon_list);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_match_batch) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	RpiList * beacon_lists[3];
+	RpiList * empty_list;
+	DtkList * diagnosis_list;
+	uint32_t diagnosis_days[4] = {1175, 12, 6, 972};
+	uint32_t tenant_ids[3] = {42, 7, 1000};
+	int pos;
+	int tenant;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchBatch * batch;
+	MatchList * expected;
+	MatchList * matches;
+	uint64_t * times;
+	uint64_t * times_expected;
+	size_t total;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	for (tenant = 0; tenant < 3; ++tenant) {
+		beacon_lists[tenant] = rpi_list_new();
+	}
+	empty_list = rpi_list_new();
+
+	// Share the beacons between three tenants
+	for (pos = 0; pos < 600; ++pos) {
+		result = contrac_set_day_number(contrac, (pos % 20) * 60 + 12);
+		ck_assert(result);
+		result = contrac_set_time_interval_number(contrac, (pos * 7) % RPI_INTERVAL_MAX);
+		ck_assert(result);
+
+		rpi_bytes = contrac_get_proximity_id(contrac);
+		rpi_list_add_beacon(beacon_lists[pos % 3], rpi_bytes, (pos * 7) % RPI_INTERVAL_MAX);
+	}
+
+	diagnosis_list = dtk_list_new();
+	for (pos = 0; pos < 4; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+
+	batch = match_batch_new();
+	for (tenant = 0; tenant < 3; ++tenant) {
+		match_batch_add_tenant(batch, tenant_ids[tenant], beacon_lists[tenant]);
+	}
+	match_batch_add_tenant(batch, 5, empty_list);
+	ck_assert_int_eq(match_batch_get_tenant_count(batch), 4);
+
+	// Adding a tenant's beacons again shouldn't duplicate its matches
+	match_batch_add_tenant(batch, tenant_ids[0], beacon_lists[0]);
+	ck_assert_int_eq(match_batch_get_tenant_count(batch), 4);
+	ck_assert_int_eq(match_batch_get_tenant_id(batch, 1), 7);
+
+	match_batch_find_matches(batch, diagnosis_list);
+
+	// Each tenant should get the same matches as if matched separately
+	total = 0;
+	for (tenant = 0; tenant < 3; ++tenant) {
+		expected = match_list_new();
+		match_list_find_matches(expected, beacon_lists[tenant], diagnosis_list);
+		times_expected = sorted_match_times(expected);
+
+		matches = match_batch_get_matches(batch, tenant_ids[tenant]);
+		ck_assert(matches == match_batch_get_matches_at(batch, tenant));
+		ck_assert_int_eq(match_list_count(matches), match_list_count(expected));
+		times = sorted_match_times(matches);
+		for (pos = 0; pos < match_list_count(expected); ++pos) {
+			ck_assert(times[pos] == times_expected[pos]);
+		}
+		total += match_list_count(matches);
+
+		free(times);
+		free(times_expected);
+		match_list_delete(expected);
+	}
+	ck_assert_int_eq(total, 60);
+
+	ck_assert_int_eq(match_list_count(match_batch_get_matches(batch, 5)), 0);
+	ck_assert(match_batch_get_matches(batch, 99) == NULL);
+
+	// Many tenants can be added and found again, keeping their order
+	for (pos = 0; pos < 2000; ++pos) {
+		match_batch_add_tenant(batch, 10000 + (pos * 3), empty_list);
+	}
+	match_batch_add_tenant(batch, 10000 + (100 * 3), empty_list);
+	ck_assert_int_eq(match_batch_get_tenant_count(batch), 2004);
+	for (pos = 0; pos < 2000; ++pos) {
+		ck_assert_int_eq(match_batch_get_tenant_id(batch, pos + 4), 10000 + (pos * 3));
+		ck_assert(match_batch_get_matches(batch, 10000 + (pos * 3)) == match_batch_get_matches_at(batch, pos + 4));
+		ck_assert(match_batch_get_matches(batch, 10001 + (pos * 3)) == NULL);
+	}
+	ck_assert(match_batch_get_matches(batch, 7) == match_batch_get_matches_at(batch, 1));
+
+	// Clean up
+	match_batch_delete(batch);
+	for (tenant = 0; tenant < 3; ++tenant) {
+		rpi_list_delete(beacon_lists[tenant]);
+	}
+	rpi_list_delete(empty_list);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_rpi_list_dedup) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	MatchList * matches;
+	RpiListItem const * rpi_item;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	int8_t rssi[4] = {-70, -55, RPI_LIST_RSSI_UNKNOWN, -82};
+	int pos;
+	int repeat;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	result = contrac_set_day_number(contrac, 12);
+	ck_assert(result);
+
+	// Each of 100 RPIs is seen four times
+	beacon_list = rpi_list_new();
+	for (repeat = 0; repeat < 4; ++repeat) {
+		for (pos = 0; pos < 100; ++pos) {
+			result = contrac_set_time_interval_number(contrac, pos);
+			ck_assert(result);
+
+			rpi_bytes = contrac_get_proximity_id(contrac);
+			rpi_list_add_sighting(beacon_list, rpi_bytes, pos, 1000 + (repeat * 60) + pos, rssi[repeat]);
+		}
+	}
+
+	// The same RPI with a different interval is a different beacon
+	rpi_list_add_beacon(beacon_list, rpi_bytes, 100);
+
+	ck_assert_int_eq(rpi_list_count(beacon_list), 101);
+
+	pos = 0;
+	rpi_item = rpi_list_first(beacon_list);
+	while (pos < 100) {
+		ck_assert_int_eq(rpi_get_time_interval_number(rpi_list_get_rpi(rpi_item)), pos);
+		ck_assert_int_eq(rpi_list_get_sighting_count(rpi_item), 4);
+		ck_assert_int_eq(rpi_list_get_first_seen(rpi_item), 1000 + pos);
+		ck_assert_int_eq(rpi_list_get_last_seen(rpi_item), 1180 + pos);
+		ck_assert_int_eq(rpi_list_get_rssi_min(rpi_item), -82);
+		ck_assert_int_eq(rpi_list_get_rssi_max(rpi_item), -55);
+		rpi_item = rpi_list_next(rpi_item);
+		pos++;
+	}
+	ck_assert_int_eq(rpi_list_get_sighting_count(rpi_item), 1);
+	ck_assert_int_eq(rpi_list_get_rssi_min(rpi_item), RPI_LIST_RSSI_UNKNOWN);
+	ck_assert(rpi_list_next(rpi_item) == NULL);
+
+	// Each distinct beacon matches only once
+	diagnosis_list = dtk_list_new();
+	dtk_bytes = contrac_get_daily_key(contrac);
+	dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, 12);
+
+	matches = match_list_new();
+	match_list_find_matches(matches, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), 100);
+
+	// Clean up
+	match_list_delete(matches);
+	rpi_list_delete(beacon_list);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_beacon_store) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	BeaconStore * store;
+	BeaconRecord const * records;
+	DtkList * diagnosis_list;
+	uint32_t diagnosis_days[4] = {100, 105, 115, 200};
+	uint32_t day;
+	size_t count;
+	int pos;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchList * matches;
+	MatchListItem const * match;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	store = beacon_store_new(0);
+	ck_assert_int_eq(beacon_store_get_retention_days(store), BEACON_STORE_RETENTION_DAYS);
+	ck_assert(!beacon_store_get_newest_day(store, &day));
+
+	// Sixteen days of beacons, so the first two fall out of the window
+	for (day = 100; day < 116; ++day) {
+		result = contrac_set_day_number(contrac, day);
+		ck_assert(result);
+		for (pos = 0; pos < 20; ++pos) {
+			result = contrac_set_time_interval_number(contrac, (pos * 7) % RPI_INTERVAL_MAX);
+			ck_assert(result);
+
+			rpi_bytes = contrac_get_proximity_id(contrac);
+			result = beacon_store_add_beacon(store, day, rpi_bytes, (pos * 7) % RPI_INTERVAL_MAX);
+			ck_assert(result);
+		}
+	}
+
+	ck_assert(beacon_store_get_newest_day(store, &day));
+	ck_assert_int_eq(day, 115);
+	ck_assert_int_eq(beacon_store_count(store), 14 * 20);
+
+	records = beacon_store_get_day(store, 101, &count);
+	ck_assert(records == NULL);
+	ck_assert_int_eq(count, 0);
+	result = beacon_store_add_beacon(store, 101, rpi_bytes, 0);
+	ck_assert(!result);
+
+	records = beacon_store_get_day(store, 102, &count);
+	ck_assert(records != NULL);
+	ck_assert_int_eq(count, 20);
+	ck_assert_int_eq(records[3].time_interval_number, 21);
+
+	// Only the keys for retained days should match
+	diagnosis_list = dtk_list_new();
+	for (pos = 0; pos < 4; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+
+	matches = match_list_new();
+	match_list_find_matches_store(matches, store, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), 40);
+	match = match_list_first(matches);
+	for (pos = 0; pos < 40; ++pos) {
+		ck_assert_int_eq(match_list_get_day_number(match), (pos < 20) ? 105 : 115);
+		ck_assert_int_eq(match_list_get_time_interval_number(match), ((pos % 20) * 7) % RPI_INTERVAL_MAX);
+		match = match_list_next(match);
+	}
+	match_list_delete(matches);
+
+	// Explicit expiry
+	beacon_store_expire(store, 110);
+	ck_assert_int_eq(beacon_store_count(store), 6 * 20);
+	records = beacon_store_get_day(store, 105, &count);
+	ck_assert(records == NULL);
+
+	// Moving the window a long way forwards expires everything
+	result = beacon_store_add_beacon(store, 140, rpi_bytes, 0);
+	ck_assert(result);
+	ck_assert_int_eq(beacon_store_count(store), 1);
+
+	// Expiring the remaining day empties the store
+	beacon_store_expire(store, 141);
+	ck_assert_int_eq(beacon_store_count(store), 0);
+	records = beacon_store_get_day(store, 140, &count);
+	ck_assert(records == NULL);
+
+	// The window can move up to the last representable day
+	result = beacon_store_add_beacon(store, UINT32_MAX - 1, rpi_bytes, 0);
+	ck_assert(result);
+	result = beacon_store_add_beacon(store, UINT32_MAX, rpi_bytes, 0);
+	ck_assert(result);
+	ck_assert_int_eq(beacon_store_count(store), 2);
+	records = beacon_store_get_day(store, UINT32_MAX, &count);
+	ck_assert(records != NULL);
+	ck_assert_int_eq(count, 1);
+
+	// Clean up
+	beacon_store_delete(store);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_beacon_file) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	char const *path = "/tmp/contrac-check-beacons";
+	BeaconStore * store;
+	BeaconFile * file;
+	BeaconRecord const * records;
+	BeaconRecord const * records_expected;
+	BeaconRecord * sorted;
+	DtkList * diagnosis_list;
+	uint32_t diagnosis_days[4] = {100, 105, 115, 108};
+	unsigned int flags[2] = {0, BEACON_FILE_HUGE_PAGES};
+	unsigned char const wrapped[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+	uint32_t day;
+	uint32_t first_day;
+	uint32_t last_day;
+	size_t count;
+	size_t count_expected;
+	int pos;
+	int flag;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchList * expected;
+	MatchList * matches;
+	MatchListItem const * match;
+	MatchListItem const * match_expected;
+	FILE * corrupt;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	// Beacons for alternate days
+	store = beacon_store_new(0);
+	for (day = 104; day < 116; day += 2) {
+		result = contrac_set_day_number(contrac, day);
+		ck_assert(result);
+		for (pos = 0; pos < 20; ++pos) {
+			result = contrac_set_time_interval_number(contrac, (pos * 7) % RPI_INTERVAL_MAX);
+			ck_assert(result);
+
+			rpi_bytes = contrac_get_proximity_id(contrac);
+			result = beacon_store_add_beacon(store, day, rpi_bytes, (pos * 7) % RPI_INTERVAL_MAX);
+			ck_assert(result);
+		}
+	}
+
+	diagnosis_list = dtk_list_new();
+	for (pos = 0; pos < 4; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+
+	expected = match_list_new();
+	match_list_find_matches_store(expected, store, diagnosis_list);
+	ck_assert_int_eq(match_list_count(expected), 20);
+
+	for (flag = 0; flag < 2; ++flag) {
+		result = beacon_file_write(store, path, flags[flag]);
+		ck_assert(result);
+
+		file = beacon_file_open(path, flags[flag]);
+		ck_assert(file != NULL);
+		ck_assert_int_eq(beacon_file_count(file), 6 * 20);
+		ck_assert_int_eq(beacon_file_get_day_count(file), 6);
+		result = beacon_file_get_coverage(file, &first_day, &last_day);
+		ck_assert(result);
+		ck_assert_int_eq(first_day, 104);
+		ck_assert_int_eq(last_day, 114);
+
+		// The mapped records should be those in the store, sorted
+		for (day = 100; day < 116; ++day) {
+			records = beacon_file_get_day(file, day, &count);
+			records_expected = beacon_store_get_day(store, day, &count_expected);
+			ck_assert_int_eq(count, count_expected);
+			ck_assert((records == NULL) == (records_expected == NULL));
+			if (records != NULL) {
+				sorted = malloc(count * sizeof(BeaconRecord));
+				memcpy(sorted, records_expected, count * sizeof(BeaconRecord));
+				qsort(sorted, count, sizeof(BeaconRecord), compare_beacon_records);
+				ck_assert(memcmp(records, sorted, count * sizeof(BeaconRecord)) == 0);
+				free(sorted);
+			}
+		}
+
+		// Matching against the file should give the same results
+		matches = match_list_new();
+		match_list_find_matches_file(matches, file, diagnosis_list);
+		ck_assert_int_eq(match_list_count(matches), match_list_count(expected));
+		match = match_list_first(matches);
+		match_expected = match_list_first(expected);
+		while (match_expected) {
+			ck_assert_int_eq(match_list_get_day_number(match), match_list_get_day_number(match_expected));
+			ck_assert_int_eq(match_list_get_time_interval_number(match), match_list_get_time_interval_number(match_expected));
+			match = match_list_next(match);
+			match_expected = match_list_next(match_expected);
+		}
+
+		match_list_delete(matches);
+		beacon_file_close(file);
+	}
+
+	// Only the current version of the format is accepted
+	corrupt = fopen(path, "r+b");
+	ck_assert(corrupt != NULL);
+	fseek(corrupt, 11, SEEK_SET);
+	fputc(1, corrupt);
+	fflush(corrupt);
+	file = beacon_file_open(path, 0);
+	ck_assert(file == NULL);
+	fseek(corrupt, 11, SEEK_SET);
+	fputc(BEACON_FILE_VERSION, corrupt);
+	fclose(corrupt);
+	file = beacon_file_open(path, 0);
+	ck_assert(file != NULL);
+	beacon_file_close(file);
+
+	// The directory of a bare file name is the current one
+	result = file_sync_directory("");
+	ck_assert(result);
+
+	// An index entry whose offset would wrap around should be rejected
+	corrupt = fopen(path, "r+b");
+	ck_assert(corrupt != NULL);
+	fseek(corrupt, 64 + 8, SEEK_SET);
+	fwrite(wrapped, sizeof(wrapped), 1, corrupt);
+	fclose(corrupt);
+	file = beacon_file_open(path, 0);
+	ck_assert(file == NULL);
+
+	// A truncated file should be rejected
+	result = (truncate(path, 200) == 0);
+	ck_assert(result);
+	file = beacon_file_open(path, 0);
+	ck_assert(file == NULL);
+
+	// As should a file that isn't a beacon file
+	corrupt = fopen(path, "wb");
+	ck_assert(corrupt != NULL);
+	fputs("Not a beacon file, but long enough to hold a header for one of them", corrupt);
+	fclose(corrupt);
+	file = beacon_file_open(path, 0);
+	ck_assert(file == NULL);
+
+	// Clean up
+	unlink(path);
+	match_list_delete(expected);
+	beacon_store_delete(store);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_capture_log) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	char const *path = "/tmp/contrac-check-capture-log";
+	unsigned char const check_bytes[9] = "123456789";
+	BeaconStore * store;
+	RpiList * beacon_list;
+	RpiListItem const * item;
+	BeaconRecord const * records;
+	CaptureLog * log;
+	uint32_t day;
+	size_t count;
+	int pos;
+	const unsigned char * rpi_bytes;
+	struct stat status;
+	struct rlimit limit;
+	struct rlimit saved_limit;
+	FILE * file;
+	Contrac * contrac;
+
+	// The standard CRC-32 check value
+	ck_assert_int_eq(crc32_update(0, check_bytes, 9), 0xcbf43926);
+	ck_assert_int_eq(crc32_update(crc32_update(0, check_bytes, 4), check_bytes + 4, 5), 0xcbf43926);
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	unlink(path);
+
+	log = capture_log_open(path, NULL, NULL);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 0);
+	ck_assert_int_eq(capture_log_get_sync_batch(log), CAPTURE_LOG_SYNC_BATCH);
+	result = capture_log_set_sync_batch(log, 100);
+	ck_assert(result);
+
+	// Sightings over three days
+	for (pos = 0; pos < 1050; ++pos) {
+		day = 500 + (pos / 350);
+		result = contrac_set_day_number(contrac, day);
+		ck_assert(result);
+		result = contrac_set_time_interval_number(contrac, pos % RPI_INTERVAL_MAX);
+		ck_assert(result);
+
+		rpi_bytes = contrac_get_proximity_id(contrac);
+		result = capture_log_append(log, day, rpi_bytes, pos % RPI_INTERVAL_MAX, 43200000 + pos, -40 - (pos % 50));
+		ck_assert(result);
+	}
+	result = capture_log_close(log);
+	ck_assert(result);
+
+	// Replaying should rebuild the store
+	store = beacon_store_new(0);
+	log = capture_log_open(path, NULL, store);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 1050);
+	ck_assert_int_eq(beacon_store_count(store), 1050);
+	records = beacon_store_get_day(store, 501, &count);
+	ck_assert_int_eq(count, 350);
+	ck_assert(memcmp(records[349].rpi, rpi_bytes, RPI_SIZE) != 0);
+	records = beacon_store_get_day(store, 502, &count);
+	ck_assert(memcmp(records[349].rpi, rpi_bytes, RPI_SIZE) == 0);
+	ck_assert_int_eq(records[349].time_interval_number, 1049 % RPI_INTERVAL_MAX);
+	capture_log_close(log);
+	beacon_store_delete(store);
+
+	// Or an RPI list, with the sightings aggregated
+	beacon_list = rpi_list_new();
+	log = capture_log_open(path, beacon_list, NULL);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 1050);
+	ck_assert_int_eq(rpi_list_count(beacon_list), 3 * RPI_INTERVAL_MAX);
+	item = rpi_list_find(beacon_list, rpi_bytes, 1049 % RPI_INTERVAL_MAX);
+	ck_assert(item != NULL);
+	ck_assert_int_eq(rpi_list_get_sighting_count(item), 3);
+	ck_assert_int_eq(rpi_list_get_first_seen(item), 43200761);
+	ck_assert_int_eq(rpi_list_get_last_seen(item), 43201049);
+	ck_assert_int_eq(rpi_list_get_rssi_min(item), -89);
+	ck_assert_int_eq(rpi_list_get_rssi_max(item), -45);
+	capture_log_close(log);
+	rpi_list_delete(beacon_list);
+
+	// The list's limits apply during replay
+	beacon_list = rpi_list_new();
+	rpi_list_set_limits(beacon_list, 0, 100);
+	log = capture_log_open(path, beacon_list, NULL);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 1050);
+	ck_assert_int_eq(rpi_list_count(beacon_list), 100);
+	capture_log_close(log);
+	rpi_list_delete(beacon_list);
+
+	// A torn record at the end should be discarded
+	file = fopen(path, "ab");
+	ck_assert(file != NULL);
+	fwrite(rpi_bytes, 1, 10, file);
+	fclose(file);
+
+	log = capture_log_open(path, NULL, NULL);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 1050);
+	result = capture_log_append(log, 502, rpi_bytes, 1, 43300000, -60);
+	ck_assert(result);
+	result = capture_log_flush(log);
+	ck_assert(result);
+	capture_log_close(log);
+
+	stat(path, &status);
+	ck_assert_int_eq(status.st_size, 16 + (1051 * 34));
+
+	// Replay stops at a corrupted record
+	file = fopen(path, "r+b");
+	ck_assert(file != NULL);
+	fseek(file, 16 + (600 * 34) + 7, SEEK_SET);
+	fputc(0xff, file);
+	fclose(file);
+
+	store = beacon_store_new(0);
+	log = capture_log_open(path, NULL, store);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 600);
+	ck_assert_int_eq(beacon_store_count(store), 600);
+	capture_log_close(log);
+	beacon_store_delete(store);
+
+	// A partly written batch should be rolled back and retried
+	log = capture_log_open(path, NULL, NULL);
+	ck_assert(log != NULL);
+	result = capture_log_set_sync_batch(log, 100);
+	ck_assert(result);
+	signal(SIGXFSZ, SIG_IGN);
+	getrlimit(RLIMIT_FSIZE, &limit);
+	saved_limit = limit;
+	limit.rlim_cur = 16 + (650 * 34) + 5;
+	setrlimit(RLIMIT_FSIZE, &limit);
+	for (pos = 0; pos < 100; ++pos) {
+		result = capture_log_append(log, 502, rpi_bytes, 2, 43400000 + pos, -60);
+		ck_assert(result == (pos < 99));
+	}
+	stat(path, &status);
+	ck_assert_int_eq(status.st_size, 16 + (600 * 34));
+	setrlimit(RLIMIT_FSIZE, &saved_limit);
+	signal(SIGXFSZ, SIG_DFL);
+	result = capture_log_append(log, 502, rpi_bytes, 3, 43500000, -60);
+	ck_assert(result);
+	result = capture_log_close(log);
+	ck_assert(result);
+
+	store = beacon_store_new(0);
+	log = capture_log_open(path, NULL, store);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 701);
+	ck_assert_int_eq(beacon_store_count(store), 701);
+	capture_log_close(log);
+	beacon_store_delete(store);
+
+	// A header torn while the log was being created is rewritten
+	result = (truncate(path, 5) == 0);
+	ck_assert(result);
+	log = capture_log_open(path, NULL, NULL);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 0);
+	result = capture_log_append(log, 502, rpi_bytes, 4, 43600000, -60);
+	ck_assert(result);
+	result = capture_log_close(log);
+	ck_assert(result);
+
+	store = beacon_store_new(0);
+	log = capture_log_open(path, NULL, store);
+	ck_assert(log != NULL);
+	ck_assert_int_eq(capture_log_get_recovered(log), 1);
+	ck_assert_int_eq(beacon_store_count(store), 1);
+	capture_log_close(log);
+	beacon_store_delete(store);
+
+	// A file that isn't a capture log should be rejected
+	file = fopen(path, "wb");
+	ck_assert(file != NULL);
+	fputs("Not a capture log", file);
+	fclose(file);
+	log = capture_log_open(path, NULL, NULL);
+	ck_assert(log == NULL);
+
+	// Clean up
+	unlink(path);
+	contrac_delete(contrac);
+}
+END_TEST
+
+/**
+ * State shared with each beacon producer thread in check_beacon_ingest
+ */
+typedef struct _IngestProducer {
+	BeaconIngest * ingest;
+	size_t producer;
+	unsigned char const * rpis;
+	size_t count;
+	size_t rejected;
+} IngestProducer;
+
+/**
+ * Adds beacons using one of the producers of a BeaconIngest
+ */
+static void * ingest_producer(void * user_data) {
+	IngestProducer * state = (IngestProducer *)user_data;
+	size_t pos;
+
+	for (pos = 0; pos < state->count; ++pos) {
+		if (!beacon_ingest_add_beacon(state->ingest, state->producer, 300, state->rpis + ((pos % RPI_INTERVAL_MAX) * RPI_SIZE), pos % RPI_INTERVAL_MAX)) {
+			state->rejected++;
+		}
+	}
+
+	return NULL;
+}
+
+START_TEST (check_beacon_ingest) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	unsigned char rpis[RPI_INTERVAL_MAX * RPI_SIZE];
+	IngestProducer producers[4];
+	pthread_t threads[4];
+	BeaconStore * store;
+	BeaconStore const * locked;
+	BeaconIngest * ingest;
+	DtkList * diagnosis_list;
+	MatchList * matches;
+	size_t count;
+	int pos;
+	const unsigned char * dtk_bytes;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	result = contrac_set_day_number(contrac, 300);
+	ck_assert(result);
+
+	for (pos = 0; pos < RPI_INTERVAL_MAX; ++pos) {
+		result = contrac_set_time_interval_number(contrac, pos);
+		ck_assert(result);
+		memcpy(rpis + (pos * RPI_SIZE), contrac_get_proximity_id(contrac), RPI_SIZE);
+	}
+
+	diagnosis_list = dtk_list_new();
+	dtk_bytes = contrac_get_daily_key(contrac);
+	dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, 300);
+
+	store = beacon_store_new(0);
+	ingest = beacon_ingest_new(store, 4, 8192);
+	ck_assert_int_eq(beacon_ingest_get_producer_count(ingest), 4);
+	result = beacon_ingest_start(ingest);
+	ck_assert(result);
+
+	// Four producers add beacons while matches are being found
+	for (pos = 0; pos < 4; ++pos) {
+		producers[pos].ingest = ingest;
+		producers[pos].producer = pos;
+		producers[pos].rpis = rpis;
+		producers[pos].count = 5000;
+		producers[pos].rejected = 0;
+		result = (pthread_create(&threads[pos], NULL, ingest_producer, &producers[pos]) == 0);
+		ck_assert(result);
+	}
+
+	for (pos = 0; pos < 4; ++pos) {
+		matches = match_list_new();
+		match_list_find_matches_ingest(matches, ingest, diagnosis_list);
+		ck_assert_int_le(match_list_count(matches), RPI_INTERVAL_MAX);
+		match_list_delete(matches);
+	}
+
+	for (pos = 0; pos < 4; ++pos) {
+		pthread_join(threads[pos], NULL);
+		ck_assert_int_eq(producers[pos].rejected, 0);
+	}
+	beacon_ingest_stop(ingest);
+	beacon_ingest_drain(ingest);
+
+	ck_assert_int_eq(beacon_ingest_get_dropped(ingest), 0);
+	locked = beacon_ingest_lock_store(ingest);
+	count = beacon_store_count(locked);
+	beacon_ingest_unlock_store(ingest);
+	ck_assert_int_eq(count, 20000);
+
+	// Every RPI should now match, once however many times it was seen
+	matches = match_list_new();
+	match_list_find_matches_ingest(matches, ingest, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), RPI_INTERVAL_MAX);
+	match_list_delete(matches);
+
+	// A full queue drops beacons rather than blocking
+	beacon_ingest_delete(ingest);
+	ingest = beacon_ingest_new(store, 1, 16);
+	for (pos = 0; pos < 20; ++pos) {
+		result = beacon_ingest_add_beacon(ingest, 0, 300, rpis, 0);
+		ck_assert(result == (pos < 16));
+	}
+	ck_assert_int_eq(beacon_ingest_get_dropped(ingest), 4);
+	ck_assert_int_eq(beacon_ingest_drain(ingest), 16);
+
+	// Clean up
+	beacon_ingest_delete(ingest);
+	beacon_store_delete(store);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_beacon_snapshot) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	unsigned char rpis[RPI_INTERVAL_MAX * RPI_SIZE];
+	BeaconStore * store;
+	BeaconSnapshot * snapshot;
+	BeaconSnapshot * later;
+	BeaconRecord const * records;
+	BeaconRecord const * records_store;
+	DtkList * diagnosis_list;
+	MatchList * matches;
+	size_t count;
+	int pos;
+	const unsigned char * dtk_bytes;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	result = contrac_set_day_number(contrac, 400);
+	ck_assert(result);
+
+	for (pos = 0; pos < RPI_INTERVAL_MAX; ++pos) {
+		result = contrac_set_time_interval_number(contrac, pos);
+		ck_assert(result);
+		memcpy(rpis + (pos * RPI_SIZE), contrac_get_proximity_id(contrac), RPI_SIZE);
+	}
+
+	diagnosis_list = dtk_list_new();
+	dtk_bytes = contrac_get_daily_key(contrac);
+	dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, 400);
+
+	store = beacon_store_new(0);
+	for (pos = 0; pos < 50; ++pos) {
+		beacon_store_add_beacon(store, 400, rpis + (pos * RPI_SIZE), pos);
+	}
+
+	// The snapshot shares the beacon data with the store
+	snapshot = beacon_store_snapshot(store);
+	ck_assert_int_eq(beacon_snapshot_count(snapshot), 50);
+	records = beacon_snapshot_get_day(snapshot, 400, &count);
+	records_store = beacon_store_get_day(store, 400, &count);
+	ck_assert(records == records_store);
+
+	// Adding beacons, including enough to grow the buffer, doesn't change it
+	for (pos = 50; pos < RPI_INTERVAL_MAX; ++pos) {
+		beacon_store_add_beacon(store, 400, rpis + (pos * RPI_SIZE), pos);
+	}
+	ck_assert_int_eq(beacon_store_count(store), RPI_INTERVAL_MAX);
+	ck_assert_int_eq(beacon_snapshot_count(snapshot), 50);
+	records = beacon_snapshot_get_day(snapshot, 400, &count);
+	ck_assert_int_eq(count, 50);
+	ck_assert(memcmp(records[49].rpi, rpis + (49 * RPI_SIZE), RPI_SIZE) == 0);
+
+	later = beacon_store_snapshot(store);
+	ck_assert_int_eq(beacon_snapshot_count(later), RPI_INTERVAL_MAX);
+
+	// Expiring the day from the store leaves the snapshots intact
+	beacon_store_add_beacon(store, 420, rpis, 0);
+	ck_assert_int_eq(beacon_store_count(store), 1);
+	beacon_store_add_beacon(store, 420, rpis + RPI_SIZE, 1);
+
+	matches = match_list_new();
+	match_list_find_matches_snapshot(matches, snapshot, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), 50);
+	match_list_delete(matches);
+
+	// The snapshot outlives the store
+	beacon_store_delete(store);
+	beacon_snapshot_delete(snapshot);
+
+	matches = match_list_new();
+	match_list_find_matches_snapshot(matches, later, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), RPI_INTERVAL_MAX);
+	match_list_delete(matches);
+
+	records = beacon_snapshot_get_day(later, 420, &count);
+	ck_assert(records == NULL);
+	ck_assert_int_eq(count, 0);
+
+	// Clean up
+	beacon_snapshot_delete(later);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_beacon_shm) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	char const *name = "/contrac-check-shm";
+	unsigned char rpis[RPI_INTERVAL_MAX * RPI_SIZE];
+	BeaconShm * writer;
+	BeaconShm * reader;
+	BeaconShm * replacement;
+	BeaconRecord const * records;
+	DtkList * diagnosis_list;
+	MatchList * matches;
+	struct stat status;
+	size_t count;
+	int pos;
+	int fd;
+	const unsigned char * dtk_bytes;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	result = contrac_set_day_number(contrac, 500);
+	ck_assert(result);
+
+	for (pos = 0; pos < RPI_INTERVAL_MAX; ++pos) {
+		result = contrac_set_time_interval_number(contrac, pos);
+		ck_assert(result);
+		memcpy(rpis + (pos * RPI_SIZE), contrac_get_proximity_id(contrac), RPI_SIZE);
+	}
+
+	diagnosis_list = dtk_list_new();
+	dtk_bytes = contrac_get_daily_key(contrac);
+	dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, 500);
+
+	// Opening a store that doesn't exist fails
+	reader = beacon_shm_open("/contrac-check-shm-missing");
+	ck_assert(reader == NULL);
+
+	writer = beacon_shm_create(name, 0, 100, 0640);
+	ck_assert(writer != NULL);
+	ck_assert_int_eq(beacon_shm_get_day_capacity(writer), 100);
+
+	reader = beacon_shm_open(name);
+	ck_assert(reader != NULL);
+	ck_assert_int_eq(beacon_shm_get_day_capacity(reader), 100);
+	ck_assert_int_eq(beacon_shm_count(reader), 0);
+
+	// Beacons added by the writer are seen live by the reader
+	for (pos = 0; pos < 60; ++pos) {
+		result = beacon_shm_add_beacon(writer, 500, rpis + (pos * RPI_SIZE), pos);
+		ck_assert(result);
+	}
+	ck_assert_int_eq(beacon_shm_count(reader), 60);
+	records = beacon_shm_get_day(reader, 500, &count);
+	ck_assert_int_eq(count, 60);
+	ck_assert(memcmp(records[59].rpi, rpis + (59 * RPI_SIZE), RPI_SIZE) == 0);
+	ck_assert_int_eq(records[59].time_interval_number, 59);
+
+	// Readers can't add beacons
+	result = beacon_shm_add_beacon(reader, 500, rpis, 0);
+	ck_assert(!result);
+
+	matches = match_list_new();
+	result = match_list_find_matches_shm(matches, reader, diagnosis_list);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 60);
+	match_list_delete(matches);
+
+	// Days are limited to their capacity
+	for (pos = 60; pos < RPI_INTERVAL_MAX; ++pos) {
+		result = beacon_shm_add_beacon(writer, 500, rpis + (pos * RPI_SIZE), pos);
+		ck_assert(result == (pos < 100));
+	}
+	ck_assert_int_eq(beacon_shm_count(reader), 100);
+
+	matches = match_list_new();
+	result = match_list_find_matches_shm(matches, reader, diagnosis_list);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 100);
+	match_list_delete(matches);
+
+	// Moving the window on expires the day for the reader
+	result = beacon_shm_add_beacon(writer, 520, rpis, 0);
+	ck_assert(result);
+	result = beacon_shm_add_beacon(writer, 500, rpis, 0);
+	ck_assert(!result);
+	ck_assert_int_eq(beacon_shm_count(reader), 1);
+	records = beacon_shm_get_day(reader, 500, &count);
+	ck_assert(records == NULL);
+	ck_assert_int_eq(count, 0);
+
+	matches = match_list_new();
+	result = match_list_find_matches_shm(matches, reader, diagnosis_list);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 0);
+	match_list_delete(matches);
+
+	// The window can move right up to the last day
+	result = beacon_shm_add_beacon(writer, UINT32_MAX - 1, rpis, 0);
+	ck_assert(result);
+	result = beacon_shm_add_beacon(writer, UINT32_MAX, rpis, 1);
+	ck_assert(result);
+	ck_assert_int_eq(beacon_shm_count(reader), 2);
+	records = beacon_shm_get_day(reader, UINT32_MAX, &count);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(records[0].time_interval_number, 1);
+
+	// Recreating the store leaves existing readers undisturbed
+	replacement = beacon_shm_create(name, 0, 100, 0640);
+	ck_assert(replacement != NULL);
+	ck_assert_int_eq(beacon_shm_count(reader), 2);
+	fd = shm_open(name, O_RDONLY, 0);
+	ck_assert(fd >= 0);
+	fstat(fd, &status);
+	close(fd);
+	ck_assert_int_eq(status.st_mode & 0777, 0640);
+	beacon_shm_delete(replacement);
+
+	// The name is removed along with the writer
+	beacon_shm_delete(writer);
+	ck_assert_int_eq(beacon_shm_count(reader), 2);
+	beacon_shm_delete(reader);
+	reader = beacon_shm_open(name);
+	ck_assert(reader == NULL);
+
+	// Clean up
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_beacon_flood) {
+	bool result;
+	unsigned char rpi[RPI_SIZE];
+	unsigned char key[HASH_KEY_SIZE];
+	unsigned char key_other[HASH_KEY_SIZE];
+	RpiList * list;
+	RpiListItem const * rpi_item;
+	BeaconStore * store;
+	size_t count;
+	int pos;
+
+	// The keyed hash depends on the key
+	memset(rpi, 0, RPI_SIZE);
+	hash_key_generate(key);
+	memcpy(key_other, key, HASH_KEY_SIZE);
+	key_other[0] ^= 1;
+	ck_assert(siphash_13(key, rpi, RPI_SIZE) == siphash_13(key, rpi, RPI_SIZE));
+	ck_assert(siphash_13(key, rpi, RPI_SIZE) != siphash_13(key_other, rpi, RPI_SIZE));
+
+	// New RPIs are rejected once an interval is full
+	list = rpi_list_new();
+	rpi_list_set_limits(list, 10, 30);
+	for (pos = 0; pos < 20; ++pos) {
+		rpi[0] = pos;
+		result = rpi_list_add_beacon(list, rpi, 0);
+		ck_assert(result == (pos < 10));
+	}
+	ck_assert_int_eq(rpi_list_count(list), 10);
+	ck_assert_int_eq(rpi_list_get_rejected(list), 10);
+
+	// Further sightings of RPIs already held are still recorded
+	for (pos = 0; pos < 5; ++pos) {
+		rpi[0] = pos;
+		result = rpi_list_add_beacon(list, rpi, 0);
+		ck_assert(result);
+	}
+	ck_assert_int_eq(rpi_list_count(list), 10);
+	ck_assert_int_eq(rpi_list_get_rejected(list), 10);
+
+	// Eviction replaces the earliest RPIs that were only seen once
+	rpi_list_set_eviction(list, RPI_LIST_EVICTION_SPARSE);
+	for (pos = 20; pos < 25; ++pos) {
+		rpi[0] = pos;
+		result = rpi_list_add_beacon(list, rpi, 0);
+		ck_assert(result);
+	}
+	ck_assert_int_eq(rpi_list_count(list), 10);
+	ck_assert_int_eq(rpi_list_get_evicted(list), 5);
+
+	count = 0;
+	rpi_item = rpi_list_first(list);
+	while (rpi_item != NULL) {
+		pos = rpi_get_proximity_id(rpi_list_get_rpi(rpi_item))[0];
+		ck_assert((pos < 5) || (pos >= 20));
+		if (pos < 5) {
+			ck_assert_int_eq(rpi_list_get_sighting_count(rpi_item), 2);
+		}
+		count++;
+		rpi_item = rpi_list_next(rpi_item);
+	}
+	ck_assert_int_eq(count, 10);
+
+	// The remaining RPIs can still be found after the evictions
+	for (pos = 20; pos < 25; ++pos) {
+		rpi[0] = pos;
+		result = rpi_list_add_beacon(list, rpi, 0);
+		ck_assert(result);
+	}
+	ck_assert_int_eq(rpi_list_count(list), 10);
+	ck_assert_int_eq(rpi_list_get_evicted(list), 5);
+
+	// Once every RPI has been seen repeatedly, new ones are rejected
+	rpi[0] = 30;
+	result = rpi_list_add_beacon(list, rpi, 0);
+	ck_assert(!result);
+	ck_assert_int_eq(rpi_list_get_rejected(list), 11);
+
+	// The total limit applies across intervals
+	for (pos = 0; pos < 20; ++pos) {
+		rpi[0] = pos;
+		result = rpi_list_add_beacon(list, rpi, 1 + (pos / 10));
+		ck_assert(result);
+	}
+	ck_assert_int_eq(rpi_list_count(list), 30);
+	rpi[0] = 0;
+	result = rpi_list_add_beacon(list, rpi, 3);
+	ck_assert(result);
+	ck_assert_int_eq(rpi_list_count(list), 30);
+	ck_assert_int_eq(rpi_list_get_evicted(list), 6);
+	rpi_list_delete(list);
+
+	// A flood only evicts the RPIs seen once, behind the repeated ones
+	list = rpi_list_new();
+	rpi_list_set_limits(list, 0, 2000);
+	rpi_list_set_eviction(list, RPI_LIST_EVICTION_SPARSE);
+	memset(rpi, 0, RPI_SIZE);
+	for (pos = 0; pos < 1000; ++pos) {
+		memcpy(rpi + 4, &pos, sizeof(pos));
+		rpi_list_add_beacon(list, rpi, 5);
+		rpi_list_add_beacon(list, rpi, 5);
+	}
+	rpi[0] = 1;
+	for (pos = 0; pos < 100000; ++pos) {
+		memcpy(rpi + 4, &pos, sizeof(pos));
+		result = rpi_list_add_beacon(list, rpi, pos % RPI_INTERVAL_MAX);
+		ck_assert(result);
+	}
+	ck_assert_int_eq(rpi_list_count(list), 2000);
+	ck_assert_int_eq(rpi_list_get_evicted(list), 99000);
+	count = 0;
+	rpi_item = rpi_list_first(list);
+	while (rpi_item != NULL) {
+		count += (rpi_list_get_sighting_count(rpi_item) == 2) ? 1 : 0;
+		rpi_item = rpi_list_next(rpi_item);
+	}
+	ck_assert_int_eq(count, 1000);
+	rpi_list_delete(list);
+
+	// The beacon store rejects beacons over its limits
+	store = beacon_store_new(0);
+	beacon_store_set_limits(store, 5, 8);
+	for (pos = 0; pos < 10; ++pos) {
+		rpi[0] = pos;
+		result = beacon_store_add_beacon(store, 600, rpi, 0);
+		ck_assert(result == (pos < 5));
+	}
+	for (pos = 0; pos < 5; ++pos) {
+		rpi[0] = pos;
+		result = beacon_store_add_beacon(store, 600, rpi, 1);
+		ck_assert(result == (pos < 3));
+	}
+	ck_assert_int_eq(beacon_store_count(store), 8);
+	ck_assert_int_eq(beacon_store_get_rejected(store), 7);
+
+	// The limits apply to each day separately
+	result = beacon_store_add_beacon(store, 601, rpi, 0);
+	ck_assert(result);
+	ck_assert_int_eq(beacon_store_count(store), 9);
+	beacon_store_delete(store);
+}
+END_TEST
+
+START_TEST (check_schedule) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	unsigned char const header[] = {0x02, 0x01, 0x1a, 0x03, 0x03, 0x6f, 0xfd, 0x13, 0x16, 0x6f, 0xfd};
+	unsigned char dtk_next[DTK_SIZE];
+	unsigned char const * schedule;
+	unsigned char const * payload;
+	Contrac * contrac;
+	Contrac * reference;
+	int pos;
+
+	contrac = contrac_new();
+	reference = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	contrac_set_tracing_key_base64(reference, tracing_key_base64);
+
+	ck_assert(contrac_get_schedule(contrac) == NULL);
+	result = contrac_set_day_number(contrac, 12);
+	ck_assert(result);
+
+	// The schedule holds the RPI for every interval of the day
+	schedule = contrac_get_schedule(contrac);
+	ck_assert(schedule != NULL);
+	result = contrac_set_day_number(reference, 12);
+	ck_assert(result);
+	for (pos = 0; pos < RPI_INTERVAL_MAX; ++pos) {
+		result = contrac_set_time_interval_number(reference, pos);
+		ck_assert(result);
+		ck_assert(memcmp(schedule + (pos * RPI_SIZE), contrac_get_proximity_id(reference), RPI_SIZE) == 0);
+	}
+
+	// Payloads are only available once enabled
+	result = contrac_set_time_interval_number(contrac, 100);
+	ck_assert(result);
+	ck_assert(contrac_get_advertising_payload(contrac) == NULL);
+	contrac_set_advertising_payloads(contrac, true);
+	payload = contrac_get_advertising_payload(contrac);
+	ck_assert(payload != NULL);
+	ck_assert(memcmp(payload, header, sizeof(header)) == 0);
+	ck_assert(memcmp(payload + sizeof(header), contrac_get_proximity_id(contrac), RPI_SIZE) == 0);
+
+	// The prepared next day matches a freshly generated one
+	result = contrac_prepare_next_day(contrac);
+	ck_assert(result);
+	result = contrac_set_day_number(reference, 13);
+	ck_assert(result);
+	memcpy(dtk_next, contrac_get_daily_key(reference), DTK_SIZE);
+
+	result = contrac_set_day_number(contrac, 13);
+	ck_assert(result);
+	ck_assert_int_eq(contrac_get_day_number(contrac), 13);
+	ck_assert(memcmp(contrac_get_daily_key(contrac), dtk_next, DTK_SIZE) == 0);
+
+	result = contrac_set_time_interval_number(contrac, 5);
+	ck_assert(result);
+	result = contrac_set_time_interval_number(reference, 5);
+	ck_assert(result);
+	ck_assert(memcmp(contrac_get_proximity_id(contrac), contrac_get_proximity_id(reference), RPI_SIZE) == 0);
+	payload = contrac_get_advertising_payload(contrac);
+	ck_assert(memcmp(payload + sizeof(header), contrac_get_proximity_id(reference), RPI_SIZE) == 0);
+
+	// Skipping a day generates the keys directly
+	result = contrac_set_day_number(contrac, 20);
+	ck_assert(result);
+	result = contrac_set_day_number(reference, 20);
+	ck_assert(result);
+	ck_assert(memcmp(contrac_get_daily_key(contrac), contrac_get_daily_key(reference), DTK_SIZE) == 0);
+
+	// Clean up
+	contrac_delete(reference);
+	contrac_delete(contrac);
+}
+END_TEST
+
+/**
+ * State shared with a thread reading the published identity
+ */
+typedef struct _IdentityReader {
+	Contrac const * contrac;
+	unsigned char const * schedule;
+	bool volatile * finished;
+	size_t reads;
+	size_t inconsistent;
+} IdentityReader;
+
+/**
+ * Repeatedly copies the identity, checking it against the day's schedule
+ */
+static void * identity_reader(void * user_data) {
+	IdentityReader * state = (IdentityReader *)user_data;
+	ContracIdentity identity;
+
+	while (!__atomic_load_n(state->finished, __ATOMIC_ACQUIRE)) {
+		if (contrac_get_identity(state->contrac, &identity)) {
+			if ((identity.day_number != 30) || (identity.time_interval_number >= RPI_INTERVAL_MAX) || (memcmp(identity.rpi, state->schedule + (identity.time_interval_number * RPI_SIZE), RPI_SIZE) != 0)) {
+				state->inconsistent++;
+			}
+			__atomic_add_fetch(&state->reads, 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	return NULL;
+}
+
+START_TEST (check_identity) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	unsigned char schedule[RPI_INTERVAL_MAX * RPI_SIZE];
+	ContracIdentity identity;
+	IdentityReader reader;
+	pthread_t thread;
+	bool finished;
+	Contrac * contrac;
+	int pos;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	// Nothing is published until an RPI has been set
+	result = contrac_get_identity(contrac, &identity);
+	ck_assert(!result);
+
+	result = contrac_set_day_number(contrac, 30);
+	ck_assert(result);
+	result = contrac_set_time_interval_number(contrac, 7);
+	ck_assert(result);
+
+	result = contrac_get_identity(contrac, &identity);
+	ck_assert(result);
+	ck_assert_int_eq(identity.day_number, 30);
+	ck_assert_int_eq(identity.time_interval_number, 7);
+	ck_assert(memcmp(identity.rpi, contrac_get_proximity_id(contrac), RPI_SIZE) == 0);
+
+	// A reader never sees a torn identity while the RPI is being updated
+	memcpy(schedule, contrac_get_schedule(contrac), sizeof(schedule));
+	finished = false;
+	reader.contrac = contrac;
+	reader.schedule = schedule;
+	reader.finished = &finished;
+	reader.reads = 0;
+	reader.inconsistent = 0;
+	pthread_create(&thread, NULL, identity_reader, &reader);
+
+	pos = 0;
+	while ((pos < 20000) || (__atomic_load_n(&reader.reads, __ATOMIC_ACQUIRE) < 1000)) {
+		result = contrac_set_time_interval_number(contrac, pos % RPI_INTERVAL_MAX);
+		ck_assert(result);
+		pos++;
+	}
+
+	__atomic_store_n(&finished, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	ck_assert_int_gt(reader.reads, 0);
+	ck_assert_int_eq(reader.inconsistent, 0);
+
+	// Clean up
+	contrac_delete(contrac);
+}
+END_TEST
+
+/**
+ * Counts the rollovers reported by a RolloverScheduler
+ */
+typedef struct _RolloverCount {
+	size_t rollovers;
+	size_t new_days;
+} RolloverCount;
+
+/**
+ * Records a rollover reported by a RolloverScheduler
+ */
+static void rollover_callback(Contrac * contrac, bool new_day, void * user_data) {
+	RolloverCount * count = (RolloverCount *)user_data;
+
+	if (new_day) {
+		__atomic_add_fetch(&count->new_days, 1, __ATOMIC_RELEASE);
+	}
+	__atomic_add_fetch(&count->rollovers, 1, __ATOMIC_RELEASE);
+}
+
+START_TEST (check_rollover) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	struct timespec wait;
+	struct timespec now;
+	RolloverScheduler * scheduler;
+	RolloverCount count;
+	Contrac * contrac;
+	time_t fake_time_stored;
+	int pos;
+
+	// Rollovers happen every ten minutes
+	ck_assert_int_eq(epoch_to_next_rollover(0), 600);
+	ck_assert_int_eq(epoch_to_next_rollover(599), 600);
+	ck_assert_int_eq(epoch_to_next_rollover(600), 1200);
+	ck_assert_int_eq(epoch_to_next_rollover(86399), 86400);
+
+	// The current RPI expires at the end of its interval
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	result = contrac_set_day_number(contrac, 100);
+	ck_assert(result);
+	result = contrac_set_time_interval_number(contrac, 5);
+	ck_assert(result);
+	ck_assert_int_eq(contrac_get_next_rollover(contrac), (100 * 86400) + (6 * 600));
+
+	result = contrac_set_time_interval_number(contrac, 143);
+	ck_assert(result);
+	ck_assert_int_eq(contrac_get_next_rollover(contrac), 101 * 86400);
+
+	// The scheduler's timer uses the real clock
+	fake_time_stored = fake_time;
+	clock_gettime(CLOCK_REALTIME, &now);
+	fake_time = now.tv_sec;
+
+	// An out of date state is updated as soon as the scheduler starts
+	count.rollovers = 0;
+	count.new_days = 0;
+	scheduler = rollover_scheduler_new(contrac, rollover_callback, &count);
+	ck_assert(!rollover_scheduler_get_running(scheduler));
+	result = rollover_scheduler_start(scheduler);
+	ck_assert(result);
+	ck_assert(rollover_scheduler_get_running(scheduler));
+
+	wait.tv_sec = 0;
+	wait.tv_nsec = 1000000;
+	for (pos = 0; (pos < 5000) && (__atomic_load_n(&count.rollovers, __ATOMIC_ACQUIRE) == 0); ++pos) {
+		nanosleep(&wait, NULL);
+	}
+
+	// The next rollover is in the future, so stopping doesn't wait for it
+	rollover_scheduler_stop(scheduler);
+	ck_assert(!rollover_scheduler_get_running(scheduler));
+	ck_assert_int_ge(count.rollovers, 1);
+	ck_assert_int_ge(count.new_days, 1);
+
+	ck_assert_int_eq(contrac_get_day_number(contrac), epoch_to_day_number(fake_time));
+	ck_assert_int_eq(contrac_get_next_rollover(contrac), epoch_to_next_rollover(fake_time));
+
+	// The scheduler can be restarted and is stopped when deleted
+	result = rollover_scheduler_start(scheduler);
+	ck_assert(result);
+	rollover_scheduler_delete(scheduler);
+
+	// Clean up
+	fake_time = fake_time_stored;
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_dtk_batch) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	unsigned char dtks[144 * DTK_SIZE];
+	char dtk_base64[DTK_SIZE_BASE64 + 1];
+	size_t size;
+	Contrac * contrac;
+	Contrac * reference;
+	int pos;
+
+	contrac = contrac_new();
+	reference = contrac_new();
+
+	// A tracing key is needed
+	result = contrac_generate_daily_keys(contrac, 0, 14, dtks);
+	ck_assert(!result);
+
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	contrac_set_tracing_key_base64(reference, tracing_key_base64);
+	result = contrac_generate_daily_keys(contrac, 0, 144, dtks);
+	ck_assert(result);
+
+	// Check against the same vectors as for single keys
+	size = sizeof(dtk_base64);
+	base64_encode_binary_to_base64(dtks + (12 * DTK_SIZE), DTK_SIZE, (unsigned char *)dtk_base64, &size);
+	ck_assert_str_eq(dtk_base64, "AzZ389DsGecAjZqby1sLNQ==");
+	size = sizeof(dtk_base64);
+	base64_encode_binary_to_base64(dtks, DTK_SIZE, (unsigned char *)dtk_base64, &size);
+	ck_assert_str_eq(dtk_base64, "p7LrsTReTw3k721eIWDjRw==");
+	size = sizeof(dtk_base64);
+	base64_encode_binary_to_base64(dtks + (143 * DTK_SIZE), DTK_SIZE, (unsigned char *)dtk_base64, &size);
+	ck_assert_str_eq(dtk_base64, "f6RZL/2wGCzxSBzZc9xVNQ==");
+
+	// Every key matches the one generated on its own
+	result = contrac_generate_daily_keys(contrac, 18000, 14, dtks);
+	ck_assert(result);
+	for (pos = 0; pos < 14; ++pos) {
+		result = contrac_set_day_number(reference, 18000 + pos);
+		ck_assert(result);
+		ck_assert(memcmp(dtks + (pos * DTK_SIZE), contrac_get_daily_key(reference), DTK_SIZE) == 0);
+	}
+
+	// Clean up
+	contrac_delete(reference);
+	contrac_delete(contrac);
+}
+END_TEST
+
+typedef struct _CryptoWorker {
+	Contrac const * contrac;
+	unsigned char const * expected;
+	bool matched;
+} CryptoWorker;
+
+static void * crypto_worker(void * user_data) {
+	CryptoWorker * worker = (CryptoWorker *)user_data;
+	unsigned char dtks[14 * DTK_SIZE];
+	int round;
+
+	worker->matched = true;
+	for (round = 0; round < 50; ++round) {
+		memset(dtks, 0, sizeof(dtks));
+		worker->matched = worker->matched && contrac_generate_daily_keys(worker->contrac, 18000, 14, dtks);
+		worker->matched = worker->matched && (memcmp(dtks, worker->expected, sizeof(dtks)) == 0);
+	}
+
+	return NULL;
+}
+
+START_TEST (check_crypto_context) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	unsigned char const hmac_expected[] = {
+		0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+		0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43
+	};
+	unsigned char const hkdf_expected[] = {
+		0x8d, 0xa4, 0xe7, 0x75, 0xa5, 0x63, 0xc1, 0x8f, 0x71, 0x5f, 0x80, 0x2a, 0x06, 0x3c, 0x5a, 0x31,
+		0xb8, 0xa1, 0x1f, 0x5c, 0x5e, 0xe1, 0x87, 0x9e, 0xc3, 0x45, 0x4e, 0x5f, 0x3c, 0x73, 0x8d, 0x2d,
+		0x9d, 0x20, 0x13, 0x95, 0xfa, 0xa4, 0xb6, 0x1a, 0x96, 0xc8
+	};
+	unsigned char ikm[22];
+	unsigned char output[64];
+	unsigned char expected[14 * DTK_SIZE];
+	CryptoWorker workers[4];
+	pthread_t threads[4];
+	Contrac * contrac;
+	int pos;
+
+	// RFC 4231 test case 2
+	result = crypto_hmac_sha256((unsigned char const *)"Jefe", 4, (unsigned char const *)"what do ya want for nothing?", 28, output, CRYPTO_HMAC_SIZE);
+	ck_assert(result);
+	ck_assert(memcmp(output, hmac_expected, sizeof(hmac_expected)) == 0);
+
+	// Truncated output
+	memset(output, 0, sizeof(output));
+	result = crypto_hmac_sha256((unsigned char const *)"Jefe", 4, (unsigned char const *)"what do ya want for nothing?", 28, output, 16);
+	ck_assert(result);
+	ck_assert(memcmp(output, hmac_expected, 16) == 0);
+	ck_assert_int_eq(output[16], 0);
+
+	result = crypto_hmac_sha256((unsigned char const *)"Jefe", 4, (unsigned char const *)"what do ya want for nothing?", 28, output, CRYPTO_HMAC_SIZE + 1);
+	ck_assert(!result);
+
+	// RFC 5869 test case 3, which spans more than one expand block
+	memset(ikm, 0x0b, sizeof(ikm));
+	result = crypto_hkdf_sha256(ikm, sizeof(ikm), NULL, 0, output, sizeof(hkdf_expected));
+	ck_assert(result);
+	ck_assert(memcmp(output, hkdf_expected, sizeof(hkdf_expected)) == 0);
+
+	// Clearing the contexts doesn't affect later operations
+	crypto_context_clear();
+	memset(output, 0, sizeof(output));
+	result = crypto_hkdf_sha256(ikm, sizeof(ikm), NULL, 0, output, sizeof(hkdf_expected));
+	ck_assert(result);
+	ck_assert(memcmp(output, hkdf_expected, sizeof(hkdf_expected)) == 0);
+
+	// Threads deriving keys at the same time get the same results
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+	result = contrac_generate_daily_keys(contrac, 18000, 14, expected);
+	ck_assert(result);
+
+	for (pos = 0; pos < 4; ++pos) {
+		workers[pos].contrac = contrac;
+		workers[pos].expected = expected;
+		workers[pos].matched = false;
+		ck_assert_int_eq(pthread_create(&threads[pos], NULL, crypto_worker, &workers[pos]), 0);
+	}
+	for (pos = 0; pos < 4; ++pos) {
+		pthread_join(threads[pos], NULL);
+		ck_assert(workers[pos].matched);
+	}
+
+	// Clean up
+	contrac_delete(contrac);
+}
+END_TEST
+
+START_TEST (check_rpi_scheme) {
+	bool result;
+	unsigned char const tek[DTK_SIZE] = {
+		0x75, 0xc7, 0x34, 0xc6, 0xdd, 0x1a, 0x78, 0x2d, 0xe7, 0xa9, 0x65, 0xda, 0x5e, 0xb9, 0x31, 0x25
+	};
+	unsigned char rpis[RPI_INTERVAL_MAX * RPI_SIZE];
+	unsigned char reference[RPI_INTERVAL_MAX * RPI_SIZE];
+	char rpi_base64[RPI_SIZE_BASE64 + 1];
+	size_t size;
+	Dtk * dtk;
+	Rpi * rpi;
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	MatchList * matches;
+	MatchListItem const * match;
+	int pos;
+
+	// ENIN 2642976 is the start of day 18354
+	dtk = dtk_new();
+	dtk_assign(dtk, tek, 18354);
+	rpi = rpi_new();
+
+	result = rpi_generate_proximity_ids_scheme(dtk, RPI_SCHEME_AES, rpis);
+	ck_assert(result);
+
+	size = sizeof(rpi_base64);
+	base64_encode_binary_to_base64(rpis, RPI_SIZE, (unsigned char *)rpi_base64, &size);
+	ck_assert_str_eq(rpi_base64, "i+bNNxxciRYEv75J34RQlg==");
+	size = sizeof(rpi_base64);
+	base64_encode_binary_to_base64(rpis + (14 * RPI_SIZE), RPI_SIZE, (unsigned char *)rpi_base64, &size);
+	ck_assert_str_eq(rpi_base64, "olUiW6qeN7cwqV+Zemly9Q==");
+	size = sizeof(rpi_base64);
+	base64_encode_binary_to_base64(rpis + (143 * RPI_SIZE), RPI_SIZE, (unsigned char *)rpi_base64, &size);
+	ck_assert_str_eq(rpi_base64, "9DG2Ls9EMQLOTtBAfeVL1A==");
+
+	// Single RPIs match the batch
+	for (pos = 0; pos < RPI_INTERVAL_MAX; pos += 13) {
+		result = rpi_generate_proximity_id_scheme(rpi, dtk, pos, RPI_SCHEME_AES);
+		ck_assert(result);
+		ck_assert(memcmp(rpi_get_proximity_id(rpi), rpis + (pos * RPI_SIZE), RPI_SIZE) == 0);
+		ck_assert_int_eq(rpi_get_time_interval_number(rpi), pos);
+	}
+
+	// The HMAC scheme is unchanged
+	result = rpi_generate_proximity_ids_scheme(dtk, RPI_SCHEME_HMAC, rpis);
+	ck_assert(result);
+	result = rpi_generate_proximity_ids(dtk, reference);
+	ck_assert(result);
+	ck_assert(memcmp(rpis, reference, sizeof(rpis)) == 0);
+
+	// The matcher only finds AES scheme beacons when using the AES scheme
+	result = rpi_generate_proximity_ids_scheme(dtk, RPI_SCHEME_AES, rpis);
+	ck_assert(result);
+	beacon_list = rpi_list_new();
+	rpi_list_add_beacon(beacon_list, rpis + (14 * RPI_SIZE), 14);
+	rpi_list_add_beacon(beacon_list, rpis + (101 * RPI_SIZE), 101);
+	rpi_list_add_beacon(beacon_list, rpis + (50 * RPI_SIZE), 51);
+	diagnosis_list = dtk_list_new();
+	dtk_list_add_diagnosis(diagnosis_list, tek, 18354);
+
+	matches = match_list_new();
+	ck_assert_int_eq(match_list_get_rpi_scheme(matches), RPI_SCHEME_HMAC);
+	match_list_find_matches(matches, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), 0);
+
+	match_list_set_rpi_scheme(matches, RPI_SCHEME_AES);
+	match_list_find_matches(matches, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), 2);
+	match = match_list_first(matches);
+	ck_assert_int_eq(match_list_get_day_number(match), 18354);
+	ck_assert_int_eq(match_list_get_time_interval_number(match), 14);
+	match = match_list_next(match);
+	ck_assert_int_eq(match_list_get_time_interval_number(match), 101);
+
+	// The sharded matcher passes the scheme on to its workers
+	match_list_clear(matches);
+	result = match_list_find_matches_sharded(matches, beacon_list, diagnosis_list, 2);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 2);
+
+	// Clean up
+	match_list_delete(matches);
+	dtk_list_delete(diagnosis_list);
+	rpi_list_delete(beacon_list);
+	rpi_delete(rpi);
+	dtk_delete(dtk);
+}
+END_TEST
+
+START_TEST (check_metadata) {
+	bool result;
+	unsigned char const tek[DTK_SIZE] = {
+		0x75, 0xc7, 0x34, 0xc6, 0xdd, 0x1a, 0x78, 0x2d, 0xe7, 0xa9, 0x65, 0xda, 0x5e, 0xb9, 0x31, 0x25
+	};
+	unsigned char const aemk_expected[RPI_METADATA_KEY_SIZE] = {
+		0xd5, 0x7c, 0x46, 0xaf, 0x7a, 0x1d, 0x83, 0x96, 0x5b, 0x9b, 0xed, 0x8b, 0xd1, 0x52, 0x93, 0x6a
+	};
+	unsigned char const encrypted_expected[RPI_METADATA_SIZE] = {0x43, 0x5e, 0xa5, 0x56};
+	unsigned char const metadata[RPI_METADATA_SIZE] = {0x40, 0x08, 0x00, 0x00};
+	unsigned char rpis[RPI_INTERVAL_MAX * RPI_SIZE];
+	unsigned char aemk[RPI_METADATA_KEY_SIZE];
+	unsigned char encrypted[RPI_METADATA_SIZE];
+	unsigned char decrypted[RPI_METADATA_SIZE];
+	Dtk * dtk;
+	RpiList * beacon_list;
+	RpiListItem const * beacon;
+	DtkList * diagnosis_list;
+	DtkListItem const * dtk_item;
+	MatchList * matches;
+	MatchListItem const * match;
+	MatchBatch * batch;
+	int pass;
+
+	dtk = dtk_new();
+	dtk_assign(dtk, tek, 18354);
+	result = rpi_generate_proximity_ids_scheme(dtk, RPI_SCHEME_AES, rpis);
+	ck_assert(result);
+
+	// Check the key and encryption against known values
+	result = rpi_generate_metadata_key(dtk, aemk);
+	ck_assert(result);
+	ck_assert(memcmp(aemk, aemk_expected, sizeof(aemk)) == 0);
+
+	result = rpi_decrypt_metadata(aemk, rpis + (14 * RPI_SIZE), metadata, encrypted);
+	ck_assert(result);
+	ck_assert(memcmp(encrypted, encrypted_expected, sizeof(encrypted)) == 0);
+	result = rpi_decrypt_metadata(aemk, rpis + (14 * RPI_SIZE), encrypted, decrypted);
+	ck_assert(result);
+	ck_assert(memcmp(decrypted, metadata, sizeof(decrypted)) == 0);
+
+	// Beacons are stored with their metadata still encrypted
+	beacon_list = rpi_list_new();
+	rpi_list_add_sighting_metadata(beacon_list, rpis + (14 * RPI_SIZE), 14, 1000, -60, encrypted);
+	rpi_decrypt_metadata(aemk, rpis + (101 * RPI_SIZE), metadata, encrypted);
+	rpi_list_add_sighting_metadata(beacon_list, rpis + (101 * RPI_SIZE), 101, 1000, -60, encrypted);
+	rpi_list_add_beacon(beacon_list, rpis + (120 * RPI_SIZE), 120);
+	rpi_list_add_sighting_metadata(beacon_list, rpis + (50 * RPI_SIZE), 51, 1000, -60, encrypted);
+
+	beacon = rpi_list_find(beacon_list, rpis + (101 * RPI_SIZE), 101);
+	ck_assert(beacon != NULL);
+	ck_assert(memcmp(rpi_list_get_metadata(beacon), encrypted, RPI_METADATA_SIZE) == 0);
+	ck_assert(rpi_list_get_metadata(rpi_list_find(beacon_list, rpis + (120 * RPI_SIZE), 120)) == NULL);
+	ck_assert(rpi_list_find(beacon_list, rpis + (101 * RPI_SIZE), 100) == NULL);
+
+	diagnosis_list = dtk_list_new();
+	dtk_list_add_diagnosis(diagnosis_list, tek, 18354);
+
+	// The metadata is decrypted for matched beacons, whether searching the
+	// list directly, using an index or using sharded workers
+	matches = match_list_new();
+	match_list_set_rpi_scheme(matches, RPI_SCHEME_AES);
+	for (pass = 0; pass < 3; ++pass) {
+		match_list_clear(matches);
+		if (pass == 0) {
+			match_list_find_matches(matches, beacon_list, diagnosis_list);
+		}
+		else if (pass == 1) {
+			dtk_item = dtk_list_first(diagnosis_list);
+			match_list_find_matches_pipelined(matches, beacon_list, match_pipeline_dtk_list_source, &dtk_item, 0, 2);
+		}
+		else {
+			result = match_list_find_matches_sharded(matches, beacon_list, diagnosis_list, 2);
+			ck_assert(result);
+		}
+		ck_assert_int_eq(match_list_count(matches), 3);
+
+		match = match_list_first(matches);
+		ck_assert_int_eq(match_list_get_time_interval_number(match), 14);
+		ck_assert(match_list_get_metadata(match) != NULL);
+		ck_assert(memcmp(match_list_get_metadata(match), metadata, RPI_METADATA_SIZE) == 0);
+		match = match_list_next(match);
+		ck_assert_int_eq(match_list_get_time_interval_number(match), 101);
+		ck_assert(match_list_get_metadata(match) != NULL);
+		ck_assert(memcmp(match_list_get_metadata(match), metadata, RPI_METADATA_SIZE) == 0);
+		match = match_list_next(match);
+		ck_assert_int_eq(match_list_get_time_interval_number(match), 120);
+		ck_assert(match_list_get_metadata(match) == NULL);
+	}
+
+	// As it is when matching tenants in a batch
+	batch = match_batch_new();
+	match_batch_set_rpi_scheme(batch, RPI_SCHEME_AES);
+	match_batch_add_tenant(batch, 1, beacon_list);
+	match_batch_find_matches(batch, diagnosis_list);
+	ck_assert_int_eq(match_list_count(match_batch_get_matches(batch, 1)), 3);
+	match = match_list_first(match_batch_get_matches(batch, 1));
+	ck_assert_int_eq(match_list_get_time_interval_number(match), 14);
+	ck_assert(match_list_get_metadata(match) != NULL);
+	ck_assert(memcmp(match_list_get_metadata(match), metadata, RPI_METADATA_SIZE) == 0);
+	match = match_list_next(match);
+	ck_assert_int_eq(match_list_get_time_interval_number(match), 101);
+	ck_assert(match_list_get_metadata(match) != NULL);
+	match = match_list_next(match);
+	ck_assert_int_eq(match_list_get_time_interval_number(match), 120);
+	ck_assert(match_list_get_metadata(match) == NULL);
+	match_batch_delete(batch);
+
+	// Nothing matches using the HMAC scheme
+	match_list_set_rpi_scheme(matches, RPI_SCHEME_HMAC);
+	match_list_clear(matches);
+	match_list_find_matches(matches, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), 0);
+
+	// Clean up
+	match_list_delete(matches);
+	dtk_list_delete(diagnosis_list);
+	rpi_list_delete(beacon_list);
+	dtk_delete(dtk);
+}
+END_TEST
+
+START_TEST (check_rpi_variants) {
+	bool result;
+	unsigned char const tek[DTK_SIZE] = {
+		0x75, 0xc7, 0x34, 0xc6, 0xdd, 0x1a, 0x78, 0x2d, 0xe7, 0xa9, 0x65, 0xda, 0x5e, 0xb9, 0x31, 0x25
+	};
+	RpiEncoding const encodings[RPI_ENCODING_COUNT] = {RPI_ENCODING_BINARY, RPI_ENCODING_BINARY_UNTERMINATED, RPI_ENCODING_STRING};
+	unsigned char rpis[RPI_ENCODING_COUNT * RPI_INTERVAL_MAX * RPI_SIZE];
+	unsigned char single[RPI_INTERVAL_MAX * RPI_SIZE];
+	unsigned char hmac[RPI_SIZE];
+	Dtk * dtk;
+	Rpi * rpi;
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	DtkListItem const * dtk_item;
+	MatchList * matches;
+	MatchListItem const * match;
+	MatchBatch * batch;
+	int pass;
+
+	dtk = dtk_new();
+	dtk_assign(dtk, tek, 18354);
+	result = rpi_generate_proximity_ids_variants(dtk, encodings, RPI_ENCODING_COUNT, rpis);
+	ck_assert(result);
+
+	// The binary variant matches the standard derivation
+	result = rpi_generate_proximity_ids(dtk, single);
+	ck_assert(result);
+	ck_assert(memcmp(rpis, single, sizeof(single)) == 0);
+
+	rpi = rpi_new();
+	result = rpi_generate_proximity_id(rpi, dtk, 14);
+	ck_assert(result);
+	ck_assert(memcmp(rpis + (14 * RPI_SIZE), rpi_get_proximity_id(rpi), RPI_SIZE) == 0);
+	rpi_delete(rpi);
+
+	// Check the other variants against the HMAC computed directly
+	result = crypto_hmac_sha256(tek, DTK_SIZE, (unsigned char const *)"CT-RPI14", 8, hmac, RPI_SIZE);
+	ck_assert(result);
+	ck_assert(memcmp(rpis + (((2 * RPI_INTERVAL_MAX) + 14) * RPI_SIZE), hmac, RPI_SIZE) == 0);
+	result = crypto_hmac_sha256(tek, DTK_SIZE, (unsigned char const *)"CT-RPI\x0e", 7, hmac, RPI_SIZE);
+	ck_assert(result);
+	ck_assert(memcmp(rpis + (((1 * RPI_INTERVAL_MAX) + 14) * RPI_SIZE), hmac, RPI_SIZE) == 0);
+
+	// Beacons generated by implementations using different encodings
+	beacon_list = rpi_list_new();
+	rpi_list_add_beacon(beacon_list, rpis + (((1 * RPI_INTERVAL_MAX) + 14) * RPI_SIZE), 14);
+	rpi_list_add_beacon(beacon_list, rpis + (((2 * RPI_INTERVAL_MAX) + 101) * RPI_SIZE), 101);
+	rpi_list_add_beacon(beacon_list, rpis + (((0 * RPI_INTERVAL_MAX) + 120) * RPI_SIZE), 120);
+
+	diagnosis_list = dtk_list_new();
+	dtk_list_add_diagnosis(diagnosis_list, tek, 18354);
+
+	// By default only the binary encoding is matched
+	matches = match_list_new();
+	match_list_find_matches(matches, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), 1);
+	ck_assert_int_eq(match_list_get_time_interval_number(match_list_first(matches)), 120);
+	ck_assert_int_eq(match_list_get_variant(match_list_first(matches)), RPI_ENCODING_BINARY);
+
+	// With all variants registered, each match is tagged with its encoding
+	match_list_add_rpi_variant(matches, RPI_ENCODING_BINARY);
+	match_list_add_rpi_variant(matches, RPI_ENCODING_BINARY_UNTERMINATED);
+	match_list_add_rpi_variant(matches, RPI_ENCODING_STRING);
+	match_list_add_rpi_variant(matches, RPI_ENCODING_STRING);
+	for (pass = 0; pass < 4; ++pass) {
+		match_list_clear(matches);
+		switch (pass) {
+		case 0:
+			match_list_find_matches(matches, beacon_list, diagnosis_list);
+			break;
+		case 1:
+			dtk_item = dtk_list_first(diagnosis_list);
+			match_list_find_matches_pipelined(matches, beacon_list, match_pipeline_dtk_list_source, &dtk_item, 0, 2);
+			break;
+		case 2:
+			result = match_list_find_matches_sharded(matches, beacon_list, diagnosis_list, 3);
+			ck_assert(result);
+			break;
+		default:
+			// A tiny memory budget forces the partitioned external join
+			match_list_set_memory_budget(matches, 1);
+			match_list_find_matches(matches, beacon_list, diagnosis_list);
+			match_list_set_memory_budget(matches, 0);
+			break;
+		}
+		ck_assert_int_eq(match_list_count(matches), 3);
+
+		match = match_list_first(matches);
+		while (match != NULL) {
+			switch (match_list_get_time_interval_number(match)) {
+			case 14:
+				ck_assert_int_eq(match_list_get_variant(match), RPI_ENCODING_BINARY_UNTERMINATED);
+				break;
+			case 101:
+				ck_assert_int_eq(match_list_get_variant(match), RPI_ENCODING_STRING);
+				break;
+			default:
+				ck_assert_int_eq(match_list_get_time_interval_number(match), 120);
+				ck_assert_int_eq(match_list_get_variant(match), RPI_ENCODING_BINARY);
+				break;
+			}
+			match = match_list_next(match);
+		}
+	}
+
+	// Batches of tenants match the registered variants too
+	batch = match_batch_new();
+	match_batch_add_rpi_variant(batch, RPI_ENCODING_BINARY);
+	match_batch_add_rpi_variant(batch, RPI_ENCODING_BINARY_UNTERMINATED);
+	match_batch_add_rpi_variant(batch, RPI_ENCODING_STRING);
+	match_batch_add_tenant(batch, 1, beacon_list);
+	match_batch_find_matches(batch, diagnosis_list);
+	ck_assert_int_eq(match_list_count(match_batch_get_matches(batch, 1)), 3);
+	match = match_list_first(match_batch_get_matches(batch, 1));
+	while (match != NULL) {
+		switch (match_list_get_time_interval_number(match)) {
+		case 14:
+			ck_assert_int_eq(match_list_get_variant(match), RPI_ENCODING_BINARY_UNTERMINATED);
+			break;
+		case 101:
+			ck_assert_int_eq(match_list_get_variant(match), RPI_ENCODING_STRING);
+			break;
+		default:
+			ck_assert_int_eq(match_list_get_variant(match), RPI_ENCODING_BINARY);
+			break;
+		}
+		match = match_list_next(match);
+	}
+	match_batch_delete(batch);
+
+	// A single non-default variant excludes the binary encoding
+	match_list_clear_rpi_variants(matches);
+	match_list_add_rpi_variant(matches, RPI_ENCODING_STRING);
+	match_list_clear(matches);
+	match_list_find_matches(matches, beacon_list, diagnosis_list);
+	ck_assert_int_eq(match_list_count(matches), 1);
+	ck_assert_int_eq(match_list_get_time_interval_number(match_list_first(matches)), 101);
+
+	// Clean up
+	match_list_delete(matches);
+	dtk_list_delete(diagnosis_list);
+	rpi_list_delete(beacon_list);
+	dtk_delete(dtk);
+}
+END_TEST
+
+// Writes a protocol buffer varint
+static size_t export_write_varint(unsigned char * buffer, uint64_t value) {
+	size_t size;
+
+	size = 0;
+	do {
+		buffer[size] = (value & 0x7f) | ((value > 0x7f) ? 0x80 : 0);
+		value >>= 7;
+		size++;
+	} while (value > 0);
+
+	return size;
+}
+
+// Writes a TemporaryExposureKey as a length-delimited field of an export
+static size_t export_write_key(unsigned char * buffer, uint8_t field, unsigned char const * key, size_t key_size, uint32_t rolling_start, uint32_t rolling_period) {
+	unsigned char message[64];
+	size_t size;
+	size_t pos;
+
+	size = 0;
+	message[size++] = 0x0a;
+	size += export_write_varint(message + size, key_size);
+	memcpy(message + size, key, key_size);
+	size += key_size;
+	// Transmission risk level
+	message[size++] = 0x10;
+	message[size++] = 0x03;
+	message[size++] = 0x18;
+	size += export_write_varint(message + size, rolling_start);
+	if (rolling_period > 0) {
+		message[size++] = 0x20;
+		size += export_write_varint(message + size, rolling_period);
+	}
+	// Report type
+	message[size++] = 0x28;
+	message[size++] = 0x01;
+
+	pos = 0;
+	buffer[pos++] = (field << 3) | 2;
+	pos += export_write_varint(buffer + pos, size);
+	memcpy(buffer + pos, message, size);
+
+	return pos + size;
+}
+
+// Reads all of the keys from an export and matches them against the beacons
+static bool export_match(MatchList * matches, RpiList * beacons, ExportReader * reader) {
+	match_list_find_matches_pipelined(matches, beacons, export_reader_source, reader, 0, 2);
+
+	return !export_reader_get_error(reader);
+}
+
+START_TEST (check_export_reader) {
+	bool result;
+	unsigned char const tek[DTK_SIZE] = {
+		0x75, 0xc7, 0x34, 0xc6, 0xdd, 0x1a, 0x78, 0x2d, 0xe7, 0xa9, 0x65, 0xda, 0x5e, 0xb9, 0x31, 0x25
+	};
+	char const *path = "/tmp/contrac-check-export";
+	unsigned char other[DTK_SIZE];
+	unsigned char rpis[RPI_INTERVAL_MAX * RPI_SIZE];
+	unsigned char export[2048];
+	unsigned char dtk_read[DTK_SIZE];
+	uint32_t day_read;
+	size_t size;
+	size_t pos;
+	int fds[2];
+	FILE * file;
+	Dtk * dtk;
+	RpiList * beacon_list;
+	DtkList * diagnosis_list;
+	DtkListItem const * dtk_item;
+	MatchList * matches;
+	ExportReader * reader;
+	TrickleReader trickle;
+
+	for (pos = 0; pos < DTK_SIZE; ++pos) {
+		other[pos] = pos;
+	}
+
+	// Header, then start and end timestamps, region and batch number
+	size = 0;
+	memcpy(export, EXPORT_READER_HEADER, EXPORT_READER_HEADER_SIZE);
+	size += EXPORT_READER_HEADER_SIZE;
+	export[size++] = 0x09;
+	memset(export + size, 0x5e, 8);
+	size += 8;
+	export[size++] = 0x11;
+	memset(export + size, 0x5f, 8);
+	size += 8;
+	export[size++] = 0x1a;
+	export[size++] = 0x02;
+	export[size++] = 'G';
+	export[size++] = 'B';
+	export[size++] = 0x20;
+	export[size++] = 0x01;
+	size += export_write_key(export + size, 7, other, DTK_SIZE, 2000 * RPI_INTERVAL_MAX, 144);
+	// A large signature info field that straddles several chunks
+	export[size++] = 0x32;
+	size += export_write_varint(export + size, 700);
+	memset(export + size, 0xc4, 700);
+	size += 700;
+	size += export_write_key(export + size, 7, tek, DTK_SIZE, 18354 * RPI_INTERVAL_MAX, 0);
+	// Revised keys are ignored
+	size += export_write_key(export + size, 8, tek, DTK_SIZE, 18355 * RPI_INTERVAL_MAX, 144);
+	size += export_write_key(export + size, 7, other, DTK_SIZE, (18354 * RPI_INTERVAL_MAX) + 72, 72);
+
+	// Keys are read in order
+	reader = export_reader_new_memory(export, size);
+	result = export_reader_read(reader, dtk_read, &day_read);
+	ck_assert(result);
+	ck_assert_int_eq(day_read, 2000);
+	ck_assert(memcmp(dtk_read, other, DTK_SIZE) == 0);
+	result = export_reader_read(reader, dtk_read, &day_read);
+	ck_assert(result);
+	ck_assert_int_eq(day_read, 18354);
+	ck_assert(memcmp(dtk_read, tek, DTK_SIZE) == 0);
+	ck_assert_int_eq(export_reader_get_rolling_period(reader), 144);
+	result = export_reader_read(reader, dtk_read, &day_read);
+	ck_assert(result);
+	ck_assert_int_eq(day_read, 18354);
+	ck_assert_int_eq(export_reader_get_rolling_period(reader), 72);
+	result = export_reader_read(reader, dtk_read, &day_read);
+	ck_assert(!result);
+	ck_assert(!export_reader_get_error(reader));
+	ck_assert_int_eq(export_reader_get_count(reader), 3);
+	export_reader_delete(reader);
+
+	// Into a list
+	diagnosis_list = dtk_list_new();
+	reader = export_reader_new_memory(export, size);
+	result = export_reader_add_to_list(reader, diagnosis_list);
+	ck_assert(result);
+	dtk_item = dtk_list_first(diagnosis_list);
+	ck_assert_int_eq(dtk_get_day_number(dtk_list_get_dtk(dtk_item)), 2000);
+	dtk_item = dtk_list_next(dtk_item);
+	ck_assert(memcmp(dtk_get_daily_key(dtk_list_get_dtk(dtk_item)), tek, DTK_SIZE) == 0);
+	dtk_item = dtk_list_next(dtk_item);
+	ck_assert(dtk_item != NULL);
+	ck_assert(dtk_list_next(dtk_item) == NULL);
+	export_reader_delete(reader);
+	dtk_list_delete(diagnosis_list);
+
+	// Beacons generated from the key
+	dtk = dtk_new();
+	dtk_assign(dtk, tek, 18354);
+	result = rpi_generate_proximity_ids_scheme(dtk, RPI_SCHEME_AES, rpis);
+	ck_assert(result);
+	beacon_list = rpi_list_new();
+	rpi_list_add_beacon(beacon_list, rpis + (14 * RPI_SIZE), 14);
+	rpi_list_add_beacon(beacon_list, rpis + (101 * RPI_SIZE), 101);
+	rpi_list_add_beacon(beacon_list, other, 7);
+
+	matches = match_list_new();
+	match_list_set_rpi_scheme(matches, RPI_SCHEME_AES);
+
+	// Memory buffer
+	reader = export_reader_new_memory(export, size);
+	result = export_match(matches, beacon_list, reader);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 2);
+	export_reader_delete(reader);
+
+	// Mapped file
+	match_list_clear(matches);
+	file = fopen(path, "wb");
+	ck_assert(file != NULL);
+	ck_assert_int_eq(fwrite(export, size, 1, file), 1);
+	fclose(file);
+	reader = export_reader_open(path);
+	ck_assert(reader != NULL);
+	result = export_match(matches, beacon_list, reader);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 2);
+	export_reader_delete(reader);
+	unlink(path);
+	ck_assert(export_reader_open(path) == NULL);
+
+	// File descriptor
+	match_list_clear(matches);
+	ck_assert_int_eq(pipe(fds), 0);
+	ck_assert_int_eq(write(fds[1], export, size), size);
+	close(fds[1]);
+	reader = export_reader_new_fd(fds[0], 0);
+	result = export_match(matches, beacon_list, reader);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 2);
+	export_reader_delete(reader);
+	close(fds[0]);
+
+	// Callback reader with the smallest chunks
+	match_list_clear(matches);
+	trickle.buffer = export;
+	trickle.size = size;
+	trickle.position = 0;
+	reader = export_reader_new_reader(trickle_read, &trickle, 1);
+	result = export_match(matches, beacon_list, reader);
+	ck_assert(result);
+	ck_assert_int_eq(match_list_count(matches), 2);
+	ck_assert_int_eq(export_reader_get_count(reader), 3);
+	export_reader_delete(reader);
+
+	// Truncated files are reported as errors
+	for (pos = 0; pos < 3; ++pos) {
+		match_list_clear(matches);
+		trickle.size = size - (pos * 300) - 1;
+		trickle.position = 0;
+		reader = export_reader_new_reader(trickle_read, &trickle, 1);
+		result = export_match(matches, beacon_list, reader);
+		ck_assert(!result);
+		export_reader_delete(reader);
+	}
+
+	// As are invalid headers and keys of the wrong size
+	reader = export_reader_new_memory((unsigned char const *)"EK Export v2    ", EXPORT_READER_HEADER_SIZE);
+	ck_assert(!export_reader_read(reader, dtk_read, &day_read));
+	ck_assert(export_reader_get_error(reader));
+	export_reader_delete(reader);
+
+	size = EXPORT_READER_HEADER_SIZE;
+	size += export_write_key(export + size, 7, tek, DTK_SIZE - 1, 18354 * RPI_INTERVAL_MAX, 144);
+	reader = export_reader_new_memory(export, size);
+	ck_assert(!export_reader_read(reader, dtk_read, &day_read));
+	ck_assert(export_reader_get_error(reader));
+	export_reader_delete(reader);
+
+	// Clean up
+	match_list_delete(matches);
+	rpi_list_delete(beacon_list);
+	dtk_delete(dtk);
+}
+END_TEST
+
+// Overwrites part of a diagnosis key file's header or index, then updates
+// the header checksum so only the index checks can catch the change
+static void patch_dtk_file(char const * path, long offset, unsigned char const * bytes, size_t size) {
+	unsigned char header[64 + (24 * 16)];
+	size_t length;
+	uint32_t crc;
+	FILE * file;
+
+	file = fopen(path, "r+b");
+	ck_assert(file != NULL);
+	ck_assert_int_eq(fread(header, 1, 64, file), 64);
+	length = 64 + (24 * (size_t)header[19]);
+	ck_assert_int_le(length, sizeof(header));
+	ck_assert_int_eq(fread(header + 64, 1, length - 64, file), length - 64);
+
+	memcpy(header + offset, bytes, size);
+	memset(header + 48, 0, 4);
+	crc = crc32_update(0, header, length);
+	big_endian_encode_u32(header + 48, crc);
+
+	fseek(file, 0, SEEK_SET);
+	ck_assert_int_eq(fwrite(header, 1, length, file), length);
+	fclose(file);
+}
+
+START_TEST (check_dtk_file) {
+	bool result;
+	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
+	char const *path = "/tmp/contrac-check-dtks";
+	BeaconStore * store;
+	DtkFile * file;
+	DtkList * diagnosis_list;
+	uint32_t diagnosis_days[5] = {108, 100, 105, 115, 106};
+	unsigned char unrelated[DTK_SIZE];
+	unsigned char dtk_expected[DTK_SIZE];
+	unsigned char const wrapped[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+	unsigned char const * keys;
+	uint32_t day;
+	uint32_t first_day;
+	uint32_t last_day;
+	size_t count;
+	int pos;
+	const unsigned char * rpi_bytes;
+	const unsigned char * dtk_bytes;
+	MatchList * expected;
+	MatchList * matches;
+	uint64_t * times;
+	uint64_t * times_expected;
+	FILE * corrupt;
+	struct stat file_stat;
+	Contrac * contrac;
+
+	contrac = contrac_new();
+	contrac_set_tracing_key_base64(contrac, tracing_key_base64);
+
+	// Beacons for alternate days
+	store = beacon_store_new(0);
+	for (day = 104; day < 116; day += 2) {
+		result = contrac_set_day_number(contrac, day);
+		ck_assert(result);
+		for (pos = 0; pos < 20; ++pos) {
+			result = contrac_set_time_interval_number(contrac, (pos * 7) % RPI_INTERVAL_MAX);
+			ck_assert(result);
+
+			rpi_bytes = contrac_get_proximity_id(contrac);
+			result = beacon_store_add_beacon(store, day, rpi_bytes, (pos * 7) % RPI_INTERVAL_MAX);
+			ck_assert(result);
+		}
+	}
+
+	// Keys out of day order, with more than one key for some days
+	diagnosis_list = dtk_list_new();
+	memset(unrelated, 0x5a, DTK_SIZE);
+	dtk_list_add_diagnosis(diagnosis_list, unrelated, 106);
+	for (pos = 0; pos < 5; ++pos) {
+		result = contrac_set_day_number(contrac, diagnosis_days[pos]);
+		ck_assert(result);
+
+		dtk_bytes = contrac_get_daily_key(contrac);
+		dtk_list_add_diagnosis(diagnosis_list, dtk_bytes, diagnosis_days[pos]);
+	}
+	dtk_list_add_diagnosis(diagnosis_list, unrelated, 105);
+
+	result = contrac_set_day_number(contrac, 106);
+	ck_assert(result);
+	memcpy(dtk_expected, contrac_get_daily_key(contrac), DTK_SIZE);
+
+	expected = match_list_new();
+	match_list_find_matches_store(expected, store, diagnosis_list);
+	ck_assert_int_eq(match_list_count(expected), 40);
+
+	result = dtk_file_write(diagnosis_list, path);
+	ck_assert(result);
+
+	file = dtk_file_open(path, DTK_FILE_VERIFY);
+	ck_assert(file != NULL);
+	ck_assert_int_eq(dtk_file_count(file), 7);
+	ck_assert_int_eq(dtk_file_get_day_count(file), 5);
+	result = dtk_file_get_coverage(file, &first_day, &last_day);
+	ck_assert(result);
+	ck_assert_int_eq(first_day, 100);
+	ck_assert_int_eq(last_day, 115);
+
+	// Keys for a day are contiguous, aligned and kept in list order
+	keys = dtk_file_get_day(file, 106, &count);
+	ck_assert(keys != NULL);
+	ck_assert_int_eq(count, 2);
+	ck_assert(((uintptr_t)keys % 16) == 0);
+	ck_assert(memcmp(keys, unrelated, DTK_SIZE) == 0);
+	ck_assert(memcmp(keys + DTK_SIZE, dtk_expected, DTK_SIZE) == 0);
+
+	keys = dtk_file_get_day(file, 115, &count);
+	ck_assert(keys != NULL);
+	ck_assert_int_eq(count, 1);
+
+	keys = dtk_file_get_day(file, 107, &count);
+	ck_assert(keys == NULL);
+	ck_assert_int_eq(count, 0);
+
+	// Matching against the file should give the same results
+	matches = match_list_new();
+	match_list_find_matches_dtk_file(matches, store, file);
+	ck_assert_int_eq(match_list_count(matches), match_list_count(expected));
+	times = sorted_match_times(matches);
+	times_expected = sorted_match_times(expected);
+	ck_assert(memcmp(times, times_expected, match_list_count(expected) * sizeof(uint64_t)) == 0);
+	free(times);
+	free(times_expected);
+	match_list_delete(matches);
+	dtk_file_close(file);
+
+	// A corrupted key should be caught only when verifying
+	result = (stat(path, &file_stat) == 0);
+	ck_assert(result);
+	corrupt = fopen(path, "r+b");
+	ck_assert(corrupt != NULL);
+	fseek(corrupt, file_stat.st_size - 1, SEEK_SET);
+	pos = fgetc(corrupt);
+	fseek(corrupt, file_stat.st_size - 1, SEEK_SET);
+	fputc(pos ^ 0xff, corrupt);
+	fclose(corrupt);
+
+	file = dtk_file_open(path, DTK_FILE_VERIFY);
+	ck_assert(file != NULL);
+	keys = dtk_file_get_day(file, 115, &count);
+	ck_assert(keys == NULL);
+	keys = dtk_file_get_day(file, 106, &count);
+	ck_assert(keys != NULL);
+	dtk_file_close(file);
+
+	file = dtk_file_open(path, 0);
+	ck_assert(file != NULL);
+	keys = dtk_file_get_day(file, 115, &count);
+	ck_assert(keys != NULL);
+	ck_assert_int_eq(count, 1);
+	dtk_file_close(file);
+
+	// A corrupted header should be rejected
+	corrupt = fopen(path, "r+b");
+	ck_assert(corrupt != NULL);
+	fseek(corrupt, 41, SEEK_SET);
+	fputc(0xff, corrupt);
+	fclose(corrupt);
+	file = dtk_file_open(path, 0);
+	ck_assert(file == NULL);
+
+	// An index entry whose position would wrap around should be rejected,
+	// even with a valid checksum
+	result = dtk_file_write(diagnosis_list, path);
+	ck_assert(result);
+	patch_dtk_file(path, 64 + 8, wrapped, sizeof(wrapped));
+	file = dtk_file_open(path, 0);
+	ck_assert(file == NULL);
+
+	// As should a day range that disagrees with the index
+	result = dtk_file_write(diagnosis_list, path);
+	ck_assert(result);
+	patch_dtk_file(path, 44, (unsigned char const *)"\x00\x00\x00\x74", 4);
+	file = dtk_file_open(path, 0);
+	ck_assert(file == NULL);
+
+	// The days used for matching can run right up to the last day
+	result = dtk_file_write(diagnosis_list, path);
+	ck_assert(result);
+	file = dtk_file_open(path, 0);
+	ck_assert(file != NULL);
+	beacon_store_delete(store);
+	store = beacon_store_new(0);
+	result = beacon_store_add_beacon(store, UINT32_MAX, unrelated, 0);
+	ck_assert(result);
+	matches = match_list_new();
+	match_list_find_matches_dtk_file(matches, store, file);
+	ck_assert_int_eq(match_list_count(matches), 0);
+	match_list_delete(matches);
+	dtk_file_close(file);
+
+	// As should a file that isn't a batch file
+	corrupt = fopen(path, "wb");
+	ck_assert(corrupt != NULL);
+	fputs("Not a diagnosis key batch file, but long enough to hold a header for one of them", corrupt);
+	fclose(corrupt);
+	file = dtk_file_open(path, 0);
+	ck_assert(file == NULL);
+
+	// Clean up
+	unlink(path);
+	match_list_delete(expected);
+	beacon_store_delete(store);
+	dtk_list_delete(diagnosis_list);
+	contrac_delete(contrac);
+}
+END_TEST
+
 START_TEST (check_time) {
 	bool result;
 	char const *tracing_key_base64 = "3UmKrtcQ2tfLE8UPSXHb4PtgRfE0E2xdSs+PGVIS8cc=";
@@ -408,6 +3494,32 @@ int main(void) {
 	tcase_add_test(tc, check_dtk);
 	tcase_add_test(tc, check_rpi);
 	tcase_add_test(tc, check_match);
+	tcase_add_test(tc, check_match_order);
+	tcase_add_test(tc, check_match_pipeline);
+	tcase_add_test(tc, check_match_stream);
+	tcase_add_test(tc, check_match_budget);
+	tcase_add_test(tc, check_match_sharded);
+	tcase_add_test(tc, check_match_sharded_processes);
+	tcase_add_test(tc, check_match_batch);
+	tcase_add_test(tc, check_rpi_list_dedup);
+	tcase_add_test(tc, check_beacon_store);
+	tcase_add_test(tc, check_beacon_file);
+	tcase_add_test(tc, check_capture_log);
+	tcase_add_test(tc, check_beacon_ingest);
+	tcase_add_test(tc, check_beacon_snapshot);
+	tcase_add_test(tc, check_beacon_shm);
+	tcase_add_test(tc, check_beacon_flood);
+	tcase_add_test(tc, check_schedule);
+	tcase_add_test(tc, check_identity);
+	tcase_add_test(tc, check_rollover);
+	tcase_add_test(tc, check_dtk_batch);
+	tcase_add_test(tc, check_crypto_context);
+	tcase_add_test(tc, check_rpi_scheme);
+	tcase_add_test(tc, check_metadata);
+	tcase_add_test(tc, check_rpi_variants);
+	tcase_add_test(tc, check_export_reader);
+	tcase_add_test(tc, check_dtk_file);
+	tcase_add_test(tc, check_base64_bulk);
 	tcase_add_test(tc, check_time);
 	suite_add_tcase(s, tc);
 	sr = srunner_create(s);